@@ -31,4 +31,9 @@
 
 int GetEncodedSourceID(char encodedIdBuffer[32]);
 
+/* RFC 1521 Base-64 encoding, without a terminating null */
+int base64Encode(const void *inSourceData, size_t inSourceSize, 
+				 void *inEncodedDataBuffer, size_t inEncodedDataBufferSize, 
+				 size_t *outEncodedSize);
+
 #endif
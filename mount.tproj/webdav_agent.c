@@ -30,6 +30,7 @@
 #include <netinet/in.h>
 
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -55,6 +56,7 @@
 #include "webdav_cache.h"
 #include "webdav_cookie.h"
 #include "webdav_utils.h"
+#include "webdav_stats.h"
 
 /*****************************************************************************/
 
@@ -73,6 +75,11 @@ CFURLRef gBaseURL = NULL;		/* the base URL for this mount */
 CFStringRef gBasePath = NULL;	/* the base path (from gBaseURL) for this mount */
 char gBasePathStr[MAXPATHLEN];	/* gBasePath as a c-string */
 uint32_t gServerIdent = 0;		/* identifies some (not all) types of servers we are connected to (i.e. WEBDAV_IDISK_SERVER) */
+unsigned int gDirListingTimeout = WEBDAV_DIR_LISTING_TIMEOUT; /* seconds a directory listing is reused without asking the server */
+unsigned int gWriteSeqWindow = WEBDAV_WRITESEQ_WINDOW; /* bytes a sequential write may have in flight */
+int gLocklessOpens = FALSE;		/* if TRUE, files are opened for writing without a LOCK and PUT with If-Match */
+int gStreamedUploads = FALSE;	/* if TRUE, new files are sent to the server as they are written (chunked PUT) */
+int gTreeDeletes = FALSE;		/* if TRUE, rmdir and rename delete what's in a directory that isn't empty */
 fsid_t	g_fsid;					/* file system id */
 char g_mountPoint[MAXPATHLEN];	/* path to our mount point */
 
@@ -154,6 +161,61 @@ static void usage(void)
 
 /*****************************************************************************/
 
+/*
+ * Handles the webdavfs specific mount options ("name=value" options and
+ * flags), which getmntopts() ignores. Returns EINVAL if a value is malformed.
+ */
+static int parse_webdav_mount_options(const char *options)
+{
+	char *optbuf, *optptr, *opt, *endptr;
+	unsigned long value;
+	int error;
+	
+	error = 0;
+	
+	optbuf = strdup(options);
+	require_action(optbuf != NULL, strdup, error = ENOMEM);
+	
+	optptr = optbuf;
+	while ( (opt = strsep(&optptr, ",")) != NULL )
+	{
+		if ( strncmp(opt, "dirlisttimeout=", strlen("dirlisttimeout=")) == 0 )
+		{
+			opt += strlen("dirlisttimeout=");
+			value = strtoul(opt, &endptr, 10);
+			require_action((*opt != '\0') && (*endptr == '\0') && (value <= UINT_MAX), bad_value, error = EINVAL);
+			gDirListingTimeout = (unsigned int)value;
+		}
+		else if ( strncmp(opt, "writeseqwindow=", strlen("writeseqwindow=")) == 0 )
+		{
+			opt += strlen("writeseqwindow=");
+			value = strtoul(opt, &endptr, 10);
+			require_action((*opt != '\0') && (*endptr == '\0') && (value <= UINT_MAX), bad_value, error = EINVAL);
+			gWriteSeqWindow = (unsigned int)value;
+		}
+		else if ( strcmp(opt, "lockless") == 0 )
+		{
+			gLocklessOpens = TRUE;
+		}
+		else if ( strcmp(opt, "streamedupload") == 0 )
+		{
+			gStreamedUploads = TRUE;
+		}
+		else if ( strcmp(opt, "treedelete") == 0 )
+		{
+			gTreeDeletes = TRUE;
+		}
+	}
+	
+bad_value:
+	free(optbuf);
+strdup:
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
 static
 char *GetMountURI(char *arguri, int *isHTTPS)
 {
@@ -783,6 +845,9 @@ int main(int argc, char *argv[])
 						error = 1;
 					else
 						freemntopts(mp);
+					
+					if (parse_webdav_mount_options(optarg) != 0)
+						error = 1;
 				}
 				break;
 			
@@ -967,6 +1032,8 @@ int main(int argc, char *argv[])
 	}
 	require_noerr_action(error, error_exit, error = EINVAL);
 
+	stats_init();
+	
 	error = nodecache_init(strlen(uri), uri, &root_node);
 	require_noerr_action_quiet(error, error_exit, error = EINVAL);
 	
@@ -1070,6 +1137,10 @@ int main(int argc, char *argv[])
 	{
 		args.pa_flags |= WEBDAV_SECURECONNECTION;
 	}
+	if ( gTreeDeletes )
+	{
+		args.pa_flags |= WEBDAV_TREEDELETES;
+	}
 	
 	args.pa_server_ident = gServerIdent;	/* gServerIdent is set in filesytem_mount() */
 	args.pa_root_id = root_node->nodeid;
@@ -25,14 +25,42 @@
 
 #include <sys/types.h>
 #include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <libkern/OSAtomic.h>
+#include <CommonCrypto/CommonDigest.h>
 #include "webdav_authcache.h"
 #include "webdav_network.h"
+#include "webdav_stats.h"
+#include "EncodedSourceID.h"
 
 /*****************************************************************************/
 
 /* define authcache_head structure */
 LIST_HEAD(authcache_head, authcache_entry);
 
+#define DIGEST_HASH_LENGTH	(CC_MD5_DIGEST_LENGTH * 2 + 1)	/* an MD5 hash as a hex string */
+
+/*
+ * client-side state for a Digest (RFC 2617) challenge using MD5 or MD5-sess.
+ * Once an entry has it, only nc changes: a new nonce gets new digest_state,
+ * because requests may be using the old one without authcache_lock.
+ */
+struct digest_state
+{
+	volatile int32_t refcount;	/* the entry and any authcache_credentials using it each hold a reference */
+	char *username;				/* the username (UTF-8) the Authorization header is for */
+	char *realm;
+	char *nonce;
+	char *opaque;				/* NULL if the server didn't send one */
+	int qop_auth;				/* TRUE if the server offered qop=auth */
+	int md5_sess;				/* TRUE for algorithm=MD5-sess */
+	volatile int32_t nc;		/* nonce count of the last request authorized with nonce (only changed with OSAtomicIncrement32Barrier) */
+	char cnonce[17];			/* client nonce, chosen when nonce changes */
+	char ha1_base[DIGEST_HASH_LENGTH];	/* H(username:realm:password) */
+	char ha1[DIGEST_HASH_LENGTH];		/* H(A1) for the current nonce */
+};
+
 struct authcache_entry
 {
 	LIST_ENTRY(authcache_entry) entries;
@@ -42,6 +70,9 @@ struct authcache_entry
 	CFStringRef password;
 	CFStringRef domain;			/* can be NULL if there is no account domain */
 	u_int32_t authflags;		/* The options for this authorization */
+	CFStringRef basic_authorization;	/* pre-rendered Basic credentials, or NULL */
+	struct digest_state *digest;		/* Digest state, or NULL */
+	int prerendered;			/* TRUE if requests get basic_authorization or digest instead of going through CFNetwork */
 };
 
 /* authFlags */
@@ -71,6 +102,104 @@ static CFStringRef mount_proxy_username = NULL;
 static CFStringRef mount_proxy_password = NULL;
 static CFStringRef mount_domain = NULL;
 
+/*
+ * authcache_state is a snapshot of the authcache that authcache_apply() and
+ * authcache_valid() read without taking authcache_lock. It packs the
+ * authcache_generation it describes in the low 32 bits with kState* flags
+ * above them, so a single 64-bit load always sees a consistent snapshot.
+ * It is only written with authcache_lock held (see PublishAuthcacheState).
+ */
+static volatile int64_t authcache_state = 0;
+
+/* authcache_state flags */
+#define kStateServerEntries		(1LL << 32)		/* authcache_list is not empty */
+#define kStateProxyEntry		(1LL << 33)		/* authcache_proxy_entry is not NULL */
+#define kStateAllValid			(1LL << 34)		/* every entry has kCredentialsValid set */
+
+#define AUTHCACHE_STATE_GENERATION(state)	((u_int32_t)((state) & 0xffffffffLL))
+
+/*
+ * authcache_credentials is an immutable snapshot of the rendered credentials
+ * authcache_apply() adds to requests once the authcache has settled: every
+ * entry valid, at most one server entry, and everything rendered (a Basic
+ * header or Digest state). While it's published, authcache_apply() applies it
+ * without taking authcache_lock. It is NULL whenever the authcache hasn't
+ * settled, and is only replaced with authcache_lock held (see
+ * PublishAuthcacheCredentials).
+ *
+ * Readers count themselves in authcache_credentials_readers before loading
+ * authcache_credentials and out again when they are done with it. Replaced
+ * snapshots wait on authcache_retired_credentials until a writer sees no
+ * readers.
+ */
+struct authcache_credentials
+{
+	u_int32_t generation;				/* the authcache_generation it was taken at */
+	uid_t uid;							/* uid of the server entry */
+	CFStringRef authorization;			/* the server entry's Basic Authorization header, or NULL */
+	struct digest_state *digest;		/* the server entry's Digest state, or NULL */
+	CFStringRef proxy_authorization;	/* the proxy entry's Basic Proxy-Authorization header, or NULL */
+	struct authcache_credentials *next_retired;
+};
+
+static struct authcache_credentials * volatile authcache_credentials = NULL;
+static volatile int32_t authcache_credentials_readers = 0;
+static struct authcache_credentials *authcache_retired_credentials = NULL;	/* protected by authcache_lock */
+
+/*****************************************************************************/
+
+static
+void PublishAuthcacheCredentials(void);
+
+/*****************************************************************************/
+
+/*
+ * PublishAuthcacheState
+ *
+ * Recomputes authcache_state from the authcache. Must be called with
+ * authcache_lock held, after anything that may have changed the generation,
+ * the entries, or their kCredentialsValid flags.
+ */
+static
+void PublishAuthcacheState(void)
+{
+	struct authcache_entry *entry_ptr;
+	int64_t state;
+	int all_valid;
+	
+	state = authcache_generation;
+	all_valid = TRUE;
+	
+	LIST_FOREACH(entry_ptr, &authcache_list, entries)
+	{
+		state |= kStateServerEntries;
+		if ( (entry_ptr->authflags & kCredentialsValid) == 0 )
+		{
+			all_valid = FALSE;
+		}
+	}
+	
+	if ( authcache_proxy_entry != NULL )
+	{
+		state |= kStateProxyEntry;
+		if ( (authcache_proxy_entry->authflags & kCredentialsValid) == 0 )
+		{
+			all_valid = FALSE;
+		}
+	}
+	
+	if ( all_valid )
+	{
+		state |= kStateAllValid;
+	}
+	
+	/* make the changes to the authcache visible before the snapshot that describes them */
+	OSMemoryBarrier();
+	authcache_state = state;
+	
+	PublishAuthcacheCredentials();
+}
+
 /*****************************************************************************/
 
 // static
@@ -79,6 +208,12 @@ char *CopyCFStringToCString(CFStringRef theString);
 static
 void ReleaseCredentials(struct authcache_entry *entry_ptr);
 
+static
+void ReleaseRenderedCredentials(struct authcache_entry *entry_ptr);
+
+static
+void ReleaseDigestState(struct digest_state *digest);
+
 /*****************************************************************************/
 
 static
@@ -131,6 +266,28 @@ void ReleaseCredentials(
 		CFRelease(entry_ptr->domain);
 		entry_ptr->domain = NULL;
 	}
+	
+	/* anything rendered from the credentials goes with them */
+	ReleaseRenderedCredentials(entry_ptr);
+}
+
+/*****************************************************************************/
+
+static
+void ReleaseRenderedCredentials(
+	struct authcache_entry *entry_ptr)
+{
+	if (entry_ptr->basic_authorization != NULL)
+	{
+		CFRelease(entry_ptr->basic_authorization);
+		entry_ptr->basic_authorization = NULL;
+	}
+	if (entry_ptr->digest != NULL)
+	{
+		ReleaseDigestState(entry_ptr->digest);
+		entry_ptr->digest = NULL;
+	}
+	entry_ptr->prerendered = FALSE;
 }
 
 /*****************************************************************************/
@@ -170,6 +327,543 @@ char *CopyCFStringToCString(CFStringRef theString)
 
 /*****************************************************************************/
 
+static
+void ReleaseDigestState(struct digest_state *digest)
+{
+	if ( OSAtomicDecrement32Barrier(&digest->refcount) != 0 )
+	{
+		return;
+	}
+	
+	if ( digest->username != NULL )
+	{
+		free(digest->username);
+	}
+	if ( digest->realm != NULL )
+	{
+		free(digest->realm);
+	}
+	if ( digest->nonce != NULL )
+	{
+		free(digest->nonce);
+	}
+	if ( digest->opaque != NULL )
+	{
+		free(digest->opaque);
+	}
+	/* don't leave H(A1) lying around */
+	memset(digest, 0, sizeof(struct digest_state));
+	free(digest);
+}
+
+/*****************************************************************************/
+
+/* hashes the strings in the NULL terminated list, separated by colons, into a hex string */
+static
+void DigestHash(char hash[DIGEST_HASH_LENGTH], ...)
+{
+	CC_MD5_CTX md5_ctx;
+	unsigned char md5_value[CC_MD5_DIGEST_LENGTH];
+	const char *str;
+	va_list ap;
+	int i;
+	
+	CC_MD5_Init(&md5_ctx);
+	va_start(ap, hash);
+	for ( i = 0; (str = va_arg(ap, const char *)) != NULL; ++i )
+	{
+		if ( i != 0 )
+		{
+			CC_MD5_Update(&md5_ctx, ":", 1);
+		}
+		CC_MD5_Update(&md5_ctx, str, (CC_LONG)strlen(str));
+	}
+	va_end(ap);
+	CC_MD5_Final(md5_value, &md5_ctx);
+	
+	for ( i = 0; i < CC_MD5_DIGEST_LENGTH; ++i )
+	{
+		snprintf(&hash[i * 2], 3, "%02x", md5_value[i]);
+	}
+}
+
+/*****************************************************************************/
+
+/* starts a new nonce: resets the nonce count, picks a cnonce, and derives H(A1) */
+static
+void DigestSetNonce(struct digest_state *digest)
+{
+	digest->nc = 0;
+	snprintf(digest->cnonce, sizeof(digest->cnonce), "%08x%08x", arc4random(), arc4random());
+	if ( digest->md5_sess )
+	{
+		DigestHash(digest->ha1, digest->ha1_base, digest->nonce, digest->cnonce, NULL);
+	}
+	else
+	{
+		strlcpy(digest->ha1, digest->ha1_base, sizeof(digest->ha1));
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * ParseDigestChallenge
+ *
+ * Finds the Digest challenge in the response's WWW-Authenticate (or
+ * Proxy-Authenticate) header and returns its parameters, or NULL if there
+ * isn't one or it asks for something only CFNetwork handles (an algorithm
+ * other than MD5 or MD5-sess, or a qop other than auth).
+ */
+static
+struct digest_state *ParseDigestChallenge(
+	CFHTTPMessageRef response,			/* -> the response containing the challenge */
+	int isProxy,						/* -> if TRUE, look at Proxy-Authenticate */
+	int *stale)							/* <- TRUE if the challenge says the old nonce was stale */
+{
+	struct digest_state *digest;
+	CFStringRef headerRef;
+	char *header, *p, *name, *value, *q;
+	char *algorithm, *qop, *last;
+	size_t len;
+	int in_digest, found, supported;
+	
+	*stale = FALSE;
+	digest = NULL;
+	header = NULL;
+	algorithm = qop = NULL;
+	found = FALSE;
+	
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(response, isProxy ? CFSTR("Proxy-Authenticate") : CFSTR("WWW-Authenticate"));
+	require_quiet(headerRef != NULL, no_header);
+	
+	header = CopyCFStringToCString(headerRef);
+	CFRelease(headerRef);
+	require(header != NULL, CopyCFStringToCString);
+	
+	digest = calloc(1, sizeof(struct digest_state));
+	require(digest != NULL, calloc);
+	digest->refcount = 1;
+	
+	/*
+	 * The header is a list of challenges: a scheme name followed by
+	 * name=value or name="quoted value" parameters, all separated by commas.
+	 * Parameters are decoded in place.
+	 */
+	in_digest = FALSE;
+	p = header;
+	while ( *p != '\0' )
+	{
+		while ( *p == ' ' || *p == '\t' || *p == ',' )
+		{
+			++p;
+		}
+		name = p;
+		len = strcspn(p, " \t,=");
+		if ( len == 0 )
+		{
+			break;
+		}
+		p += len;
+		while ( *p == ' ' || *p == '\t' )
+		{
+			*p++ = '\0';
+		}
+		
+		if ( *p != '=' )
+		{
+			/* a scheme name starts the next challenge */
+			if ( *p == ',' )
+			{
+				*p++ = '\0';
+			}
+			if ( in_digest )
+			{
+				break;
+			}
+			in_digest = (strcasecmp(name, "Digest") == 0);
+			found = found || in_digest;
+			continue;
+		}
+		*p++ = '\0';
+		while ( *p == ' ' || *p == '\t' )
+		{
+			++p;
+		}
+		
+		if ( *p == '"' )
+		{
+			/* quoted-string, with backslash escapes */
+			value = q = ++p;
+			while ( *p != '\0' && *p != '"' )
+			{
+				if ( *p == '\\' && p[1] != '\0' )
+				{
+					++p;
+				}
+				*q++ = *p++;
+			}
+			if ( *p == '"' )
+			{
+				++p;
+			}
+			*q = '\0';
+		}
+		else
+		{
+			value = p;
+			p += strcspn(p, " \t,");
+			if ( *p != '\0' )
+			{
+				*p++ = '\0';
+			}
+		}
+		
+		if ( !in_digest )
+		{
+			continue;
+		}
+		if ( strcasecmp(name, "realm") == 0 )
+		{
+			digest->realm = value;
+		}
+		else if ( strcasecmp(name, "nonce") == 0 )
+		{
+			digest->nonce = value;
+		}
+		else if ( strcasecmp(name, "opaque") == 0 )
+		{
+			digest->opaque = value;
+		}
+		else if ( strcasecmp(name, "algorithm") == 0 )
+		{
+			algorithm = value;
+		}
+		else if ( strcasecmp(name, "qop") == 0 )
+		{
+			qop = value;
+		}
+		else if ( strcasecmp(name, "stale") == 0 )
+		{
+			*stale = (strcasecmp(value, "true") == 0);
+		}
+	}
+	
+	supported = found && (digest->realm != NULL) && (digest->nonce != NULL);
+	if ( supported && (algorithm != NULL) )
+	{
+		if ( strcasecmp(algorithm, "MD5-sess") == 0 )
+		{
+			digest->md5_sess = TRUE;
+		}
+		else if ( strcasecmp(algorithm, "MD5") != 0 )
+		{
+			supported = FALSE;
+		}
+	}
+	if ( supported && (qop != NULL) )
+	{
+		/* qop is a comma separated list of tokens */
+		for ( q = strtok_r(qop, ", \t", &last); q != NULL; q = strtok_r(NULL, ", \t", &last) )
+		{
+			if ( strcasecmp(q, "auth") == 0 )
+			{
+				digest->qop_auth = TRUE;
+			}
+		}
+		supported = digest->qop_auth;
+	}
+	/* MD5-sess needs a cnonce, which RFC 2069 style requests don't send */
+	if ( digest->md5_sess && !digest->qop_auth )
+	{
+		supported = FALSE;
+	}
+	require_quiet(supported, not_supported);
+	
+	/* copy the parameters out of the header */
+	digest->realm = strdup(digest->realm);
+	digest->nonce = strdup(digest->nonce);
+	if ( digest->opaque != NULL )
+	{
+		digest->opaque = strdup(digest->opaque);
+		require_action(digest->opaque != NULL, strdup, digest->opaque = NULL);
+	}
+	require(digest->realm != NULL && digest->nonce != NULL, strdup);
+	
+	free(header);
+	
+	return ( digest );
+
+strdup:
+	ReleaseDigestState(digest);
+	digest = NULL;
+	goto calloc;
+
+not_supported:
+	free(digest);
+	digest = NULL;
+calloc:
+	free(header);
+CopyCFStringToCString:
+no_header:
+
+	return ( NULL );
+}
+
+/*****************************************************************************/
+
+/*
+ * RenderCredentials
+ *
+ * Once an entry's credentials are set, renders what requests need so they
+ * can be authorized without going through CFNetwork: the Basic header, or
+ * the Digest state for the response's challenge. Schemes CFNetwork has to
+ * handle (NTLM, Negotiate, unusual Digest options) are left alone.
+ */
+static
+void RenderCredentials(
+	struct authcache_entry *entry_ptr,	/* -> the entry whose credentials were just set */
+	CFHTTPMessageRef response,			/* -> the response containing the challenge */
+	int isProxy)						/* -> if TRUE, entry_ptr is authcache_proxy_entry */
+{
+	CFStringRef method;
+	char *username, *password;
+	int stale;
+	
+	username = password = NULL;
+	method = NULL;
+	
+	/* start over from whatever was rendered for earlier credentials */
+	ReleaseRenderedCredentials(entry_ptr);
+	
+	/* nothing to render for credentials with an account domain, or without a username and password */
+	require_quiet(entry_ptr->username != NULL && entry_ptr->password != NULL && entry_ptr->domain == NULL, no_credentials);
+	
+	method = CFHTTPAuthenticationCopyMethod(entry_ptr->auth);
+	require_quiet(method != NULL, CFHTTPAuthenticationCopyMethod);
+	
+	username = CopyCFStringToCString(entry_ptr->username);
+	require(username != NULL, CopyCFStringToCString);
+	password = CopyCFStringToCString(entry_ptr->password);
+	require(password != NULL, CopyCFStringToCString);
+	
+	if ( CFStringCompare(method, kCFHTTPAuthenticationSchemeBasic, kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+	{
+		char *credentials, *encoded;
+		size_t len, encoded_len;
+		
+		len = strlen(username) + 1 + strlen(password);
+		credentials = malloc(len + 1);
+		encoded = malloc(((len + 2) / 3) * 4 + 1);
+		if ( credentials != NULL && encoded != NULL )
+		{
+			snprintf(credentials, len + 1, "%s:%s", username, password);
+			if ( base64Encode(credentials, len, encoded, ((len + 2) / 3) * 4, &encoded_len) == 0 )
+			{
+				encoded[encoded_len] = '\0';
+				entry_ptr->basic_authorization = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("Basic %s"), encoded);
+			}
+			memset(credentials, 0, len);
+		}
+		free(credentials);
+		free(encoded);
+		entry_ptr->prerendered = (entry_ptr->basic_authorization != NULL);
+	}
+	else if ( !isProxy &&
+		CFStringCompare(method, kCFHTTPAuthenticationSchemeDigest, kCFCompareCaseInsensitive) == kCFCompareEqualTo &&
+		strpbrk(username, "\\\"") == NULL )
+	{
+		/* Proxies are left to CFNetwork because their request-uri is the absolute URI */
+		entry_ptr->digest = ParseDigestChallenge(response, isProxy, &stale);
+		if ( entry_ptr->digest != NULL )
+		{
+			entry_ptr->digest->username = strdup(username);
+			if ( entry_ptr->digest->username != NULL )
+			{
+				DigestHash(entry_ptr->digest->ha1_base, username, entry_ptr->digest->realm, password, NULL);
+				DigestSetNonce(entry_ptr->digest);
+				entry_ptr->prerendered = TRUE;
+			}
+			else
+			{
+				ReleaseDigestState(entry_ptr->digest);
+				entry_ptr->digest = NULL;
+			}
+		}
+	}
+
+CopyCFStringToCString:
+	if ( password != NULL )
+	{
+		memset(password, 0, strlen(password));
+		free(password);
+	}
+	if ( username != NULL )
+	{
+		free(username);
+	}
+	CFRelease(method);
+CFHTTPAuthenticationCopyMethod:
+no_credentials:
+
+	return;
+}
+
+/*****************************************************************************/
+
+/*
+ * ApplyDigestToRequest
+ *
+ * Adds an Authorization header computed from the Digest state, using the
+ * next nonce count. Returns FALSE if the request can't be authorized this
+ * way. Doesn't need authcache_lock.
+ */
+static
+int ApplyDigestToRequest(struct digest_state *digest, CFHTTPMessageRef request)
+{
+	CFStringRef methodRef, pathRef, queryRef, header;
+	CFURLRef url;
+	char *method, *path, *query, *uri, *value;
+	char ha2[DIGEST_HASH_LENGTH], response[DIGEST_HASH_LENGTH], nc[9];
+	size_t uri_len;
+	int result;
+	
+	result = FALSE;
+	method = path = query = uri = NULL;
+	pathRef = queryRef = NULL;
+	
+	methodRef = CFHTTPMessageCopyRequestMethod(request);
+	require(methodRef != NULL, CFHTTPMessageCopyRequestMethod);
+	url = CFHTTPMessageCopyRequestURL(request);
+	require(url != NULL, CFHTTPMessageCopyRequestURL);
+	
+	/* the digest-uri is the Request-URI as sent: the escaped path and query */
+	pathRef = CFURLCopyPath(url);
+	queryRef = CFURLCopyQueryString(url, NULL);
+	method = CopyCFStringToCString(methodRef);
+	path = (pathRef != NULL) ? CopyCFStringToCString(pathRef) : strdup("");
+	query = (queryRef != NULL) ? CopyCFStringToCString(queryRef) : NULL;
+	require(method != NULL && path != NULL && (queryRef == NULL || query != NULL), CopyCFStringToCString);
+	
+	uri_len = strlen(path) + 2 + ((query != NULL) ? strlen(query) + 1 : 0);
+	uri = malloc(uri_len);
+	require(uri != NULL, malloc);
+	snprintf(uri, uri_len, "%s%s%s%s", (path[0] != '/') ? "/" : "", path, (query != NULL) ? "?" : "", (query != NULL) ? query : "");
+	
+	DigestHash(ha2, method, uri, NULL);
+	if ( digest->qop_auth )
+	{
+		/* concurrent requests must never reuse a nonce count */
+		snprintf(nc, sizeof(nc), "%08x", (u_int32_t)OSAtomicIncrement32Barrier(&digest->nc));
+		DigestHash(response, digest->ha1, digest->nonce, nc, digest->cnonce, "auth", ha2, NULL);
+		value = NULL;
+		(void) asprintf(&value,
+			"Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", response=\"%s\", algorithm=%s, qop=auth, nc=%s, cnonce=\"%s\"%s%s%s",
+			digest->username, digest->realm, digest->nonce, uri, response, digest->md5_sess ? "MD5-sess" : "MD5", nc, digest->cnonce,
+			(digest->opaque != NULL) ? ", opaque=\"" : "", (digest->opaque != NULL) ? digest->opaque : "", (digest->opaque != NULL) ? "\"" : "");
+	}
+	else
+	{
+		DigestHash(response, digest->ha1, digest->nonce, ha2, NULL);
+		value = NULL;
+		(void) asprintf(&value,
+			"Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", response=\"%s\"%s%s%s",
+			digest->username, digest->realm, digest->nonce, uri, response,
+			(digest->opaque != NULL) ? ", opaque=\"" : "", (digest->opaque != NULL) ? digest->opaque : "", (digest->opaque != NULL) ? "\"" : "");
+	}
+	require(value != NULL, asprintf);
+	
+	/* the username and realm may be UTF-8, which %s in a CFString format would misread */
+	header = CFStringCreateWithCString(kCFAllocatorDefault, value, kCFStringEncodingUTF8);
+	free(value);
+	require(header != NULL, CFStringCreateWithCString);
+	
+	CFHTTPMessageSetHeaderFieldValue(request, CFSTR("Authorization"), header);
+	CFRelease(header);
+	result = TRUE;
+
+CFStringCreateWithCString:
+asprintf:
+	free(uri);
+malloc:
+CopyCFStringToCString:
+	if ( method != NULL )
+	{
+		free(method);
+	}
+	if ( path != NULL )
+	{
+		free(path);
+	}
+	if ( query != NULL )
+	{
+		free(query);
+	}
+	if ( pathRef != NULL )
+	{
+		CFRelease(pathRef);
+	}
+	if ( queryRef != NULL )
+	{
+		CFRelease(queryRef);
+	}
+	CFRelease(url);
+CFHTTPMessageCopyRequestURL:
+	CFRelease(methodRef);
+CFHTTPMessageCopyRequestMethod:
+
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/*
+ * RefreshStaleNonce
+ *
+ * Handles a 401 for an entry whose requests were authorized with its Digest
+ * state. If the server only says the nonce is stale, the credentials were
+ * good: adopt the new nonce and return TRUE so the request is simply resent.
+ * Otherwise return FALSE and let CFNetwork take over the entry.
+ */
+static
+int RefreshStaleNonce(struct authcache_entry *entry_ptr, CFHTTPMessageRef response)
+{
+	struct digest_state *challenge;
+	int stale;
+	int result;
+	
+	result = FALSE;
+	challenge = ParseDigestChallenge(response, FALSE, &stale);
+	if ( challenge != NULL )
+	{
+		/* a stale nonce that's the one we just used would loop forever */
+		if ( stale &&
+			 (strcmp(challenge->realm, entry_ptr->digest->realm) == 0) &&
+			 (strcmp(challenge->nonce, entry_ptr->digest->nonce) != 0) &&
+			 (challenge->md5_sess == entry_ptr->digest->md5_sess) )
+		{
+			/* the old state may still be in use without authcache_lock, so the new nonce replaces it */
+			challenge->username = strdup(entry_ptr->digest->username);
+			if ( challenge->username != NULL )
+			{
+				strlcpy(challenge->ha1_base, entry_ptr->digest->ha1_base, sizeof(challenge->ha1_base));
+				DigestSetNonce(challenge);
+				ReleaseDigestState(entry_ptr->digest);
+				entry_ptr->digest = challenge;
+				challenge = NULL;
+				result = TRUE;
+			}
+		}
+		if ( challenge != NULL )
+		{
+			ReleaseDigestState(challenge);
+		}
+	}
+	return ( result );
+}
+
+/*****************************************************************************/
+
 static
 int CopyMountCredentials(
 	CFHTTPAuthenticationRef auth,
@@ -491,6 +1185,7 @@ struct authcache_entry *CreateProxyAuthenticationFromResponse(
 	
 	result = AddProxyCredentials(entry_ptr, request);
 	require_noerr_quiet(result, AddProxyCredentials);
+	RenderCredentials(entry_ptr, response, TRUE);
 		
 	authcache_proxy_entry = entry_ptr;
 	++authcache_generation;
@@ -541,13 +1236,15 @@ struct authcache_entry *CreateAuthenticationFromResponse(
 	{
 		*result = AddServerCredentials(entry_ptr, request);
 		require_noerr_quiet(*result, AddServerCredentials);
+		RenderCredentials(entry_ptr, response, FALSE);
 		
 		LIST_INSERT_HEAD(&authcache_list, entry_ptr, entries);
 	}
 	else
 	{
 		*result = AddProxyCredentials(entry_ptr, request);
-		require_noerr_quiet(*result, AddProxyCredentials);		
+		require_noerr_quiet(*result, AddProxyCredentials);
+		RenderCredentials(entry_ptr, response, TRUE);
 	}
 	
 	++authcache_generation;
@@ -606,7 +1303,19 @@ static int ApplyCredentialsToRequest(struct authcache_entry *entry_ptr, CFHTTPMe
 {
 	int result;
 
-	if ( entry_ptr->domain != NULL ) {
+	if ( entry_ptr->prerendered ) {
+		stats_increment(WEBDAV_STATS_AUTH_PRERENDERED);
+		if ( entry_ptr->basic_authorization != NULL ) {
+			CFHTTPMessageSetHeaderFieldValue(request,
+				(entry_ptr == authcache_proxy_entry) ? CFSTR("Proxy-Authorization") : CFSTR("Authorization"),
+				entry_ptr->basic_authorization);
+			result = TRUE;
+		}
+		else {
+			result = ApplyDigestToRequest(entry_ptr->digest, request);
+		}
+	}
+	else if ( entry_ptr->domain != NULL ) {
 		CFMutableDictionaryRef dict;
 		
 		dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 3, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
@@ -708,11 +1417,25 @@ int DoServerAuthentication(
 	/* see if we already have an authcache_entry */
 	entry_ptr = FindAuthenticationForRequest(uid, request);
 	
+	/* a stale Digest nonce only needs the new nonce, not new credentials */
+	if ( (entry_ptr != NULL) && entry_ptr->prerendered && (entry_ptr->digest != NULL) &&
+		 RefreshStaleNonce(entry_ptr, response) )
+	{
+		stats_increment(WEBDAV_STATS_AUTH_STALE_NONCE);
+		return ( 0 );
+	}
+	
 	/* if we have one, we need to try to update it and use it */
 	if ( entry_ptr != NULL )
 	{
 		// Clear valid flag since we just got a 401 for this auth_entry
 		entry_ptr->authflags &= ~kCredentialsValid;	
+		
+		/*
+		 * The rendered credentials were rejected, so CFNetwork gets this entry
+		 * (and decides when the credentials are no good) until they work again.
+		 */
+		entry_ptr->prerendered = FALSE;
 	
 		/* ensure the CFHTTPAuthenticationRef is valid */
 		if ( CFHTTPAuthenticationIsValid(entry_ptr->auth, NULL) )
@@ -729,6 +1452,10 @@ int DoServerAuthentication(
 				if ( CFHTTPAuthenticationIsValid(entry_ptr->auth, NULL) )
 				{
 					result = AddServerCredentials(entry_ptr, request);
+					if ( result == 0 )
+					{
+						RenderCredentials(entry_ptr, response, FALSE);
+					}
 				}
 				else
 				{
@@ -773,6 +1500,7 @@ int AddProxyAuthentication(
 	if ( authcache_proxy_entry != NULL )
 	{
 		authcache_proxy_entry->authflags &= ~kCredentialsValid;
+		authcache_proxy_entry->prerendered = FALSE;
 		
 		/* ensure the CFHTTPAuthenticationRef is valid */
 		if ( CFHTTPAuthenticationIsValid(authcache_proxy_entry->auth, NULL) )
@@ -789,6 +1517,10 @@ int AddProxyAuthentication(
 				if ( CFHTTPAuthenticationIsValid(authcache_proxy_entry->auth, NULL) )
 				{
 					result = AddProxyCredentials(authcache_proxy_entry, request);
+					if ( result == 0 )
+					{
+						RenderCredentials(authcache_proxy_entry, response, TRUE);
+					}
 				}
 				else
 				{
@@ -824,6 +1556,246 @@ int AddProxyAuthentication(
 
 /*****************************************************************************/
 
+static
+void FreeAuthcacheCredentials(struct authcache_credentials *credentials)
+{
+	if ( credentials->authorization != NULL )
+	{
+		CFRelease(credentials->authorization);
+	}
+	if ( credentials->digest != NULL )
+	{
+		ReleaseDigestState(credentials->digest);
+	}
+	if ( credentials->proxy_authorization != NULL )
+	{
+		CFRelease(credentials->proxy_authorization);
+	}
+	free(credentials);
+}
+
+/*****************************************************************************/
+
+/*
+ * PublishAuthcacheCredentials
+ *
+ * Publishes authcache_credentials for the authcache as it is now (NULL if it
+ * hasn't settled), and frees the snapshots it replaced once no request can be
+ * using them. Must be called with authcache_lock held.
+ */
+static
+void PublishAuthcacheCredentials(void)
+{
+	struct authcache_entry *entry_ptr, *server_entry;
+	struct authcache_credentials *credentials, *published, *retired;
+	int settled;
+	
+	/* settled means every entry is valid and rendered, and there's at most one server entry */
+	settled = TRUE;
+	server_entry = NULL;
+	LIST_FOREACH(entry_ptr, &authcache_list, entries)
+	{
+		if ( (server_entry != NULL) || ((entry_ptr->authflags & kCredentialsValid) == 0) || !entry_ptr->prerendered ||
+			 ((entry_ptr->basic_authorization == NULL) && (entry_ptr->digest == NULL)) )
+		{
+			settled = FALSE;
+			break;
+		}
+		server_entry = entry_ptr;
+	}
+	if ( (authcache_proxy_entry != NULL) &&
+		 (((authcache_proxy_entry->authflags & kCredentialsValid) == 0) || !authcache_proxy_entry->prerendered ||
+		  (authcache_proxy_entry->basic_authorization == NULL)) )
+	{
+		settled = FALSE;
+	}
+	if ( (server_entry == NULL) && (authcache_proxy_entry == NULL) )
+	{
+		/* nothing to apply -- authcache_state already says so */
+		settled = FALSE;
+	}
+	
+	published = authcache_credentials;
+	credentials = NULL;
+	if ( settled )
+	{
+		/* keep the published snapshot if it still holds the same credentials */
+		if ( (published != NULL) &&
+			 (published->generation == authcache_generation) &&
+			 (published->uid == ((server_entry != NULL) ? server_entry->uid : 0)) &&
+			 (published->authorization == ((server_entry != NULL) ? server_entry->basic_authorization : NULL)) &&
+			 (published->digest == (((server_entry != NULL) && (server_entry->basic_authorization == NULL)) ? server_entry->digest : NULL)) &&
+			 (published->proxy_authorization == ((authcache_proxy_entry != NULL) ? authcache_proxy_entry->basic_authorization : NULL)) )
+		{
+			credentials = published;
+		}
+		else
+		{
+			credentials = calloc(1, sizeof(struct authcache_credentials));
+			if ( credentials != NULL )
+			{
+				credentials->generation = authcache_generation;
+				if ( server_entry != NULL )
+				{
+					credentials->uid = server_entry->uid;
+					if ( server_entry->basic_authorization != NULL )
+					{
+						credentials->authorization = server_entry->basic_authorization;
+						CFRetain(credentials->authorization);
+					}
+					else
+					{
+						credentials->digest = server_entry->digest;
+						OSAtomicIncrement32Barrier(&credentials->digest->refcount);
+					}
+				}
+				if ( authcache_proxy_entry != NULL )
+				{
+					credentials->proxy_authorization = authcache_proxy_entry->basic_authorization;
+					CFRetain(credentials->proxy_authorization);
+				}
+			}
+		}
+	}
+	
+	if ( credentials != published )
+	{
+		/* make the snapshot's contents visible before the snapshot */
+		OSMemoryBarrier();
+		authcache_credentials = credentials;
+		OSMemoryBarrier();
+		
+		if ( published != NULL )
+		{
+			published->next_retired = authcache_retired_credentials;
+			authcache_retired_credentials = published;
+		}
+	}
+	
+	/*
+	 * A request that counts itself in after the store above can only load the
+	 * new snapshot, so with no readers counted, nothing uses the retired ones.
+	 */
+	if ( (authcache_retired_credentials != NULL) && (authcache_credentials_readers == 0) )
+	{
+		while ( authcache_retired_credentials != NULL )
+		{
+			retired = authcache_retired_credentials;
+			authcache_retired_credentials = retired->next_retired;
+			FreeAuthcacheCredentials(retired);
+		}
+	}
+}
+
+/*****************************************************************************/
+
+/* returns TRUE if the request goes to the mount's server (the scheme, host and port of gBaseURL) */
+static
+int RequestIsForMountServer(CFHTTPMessageRef request)
+{
+	CFURLRef url;
+	CFStringRef scheme, host, base_scheme, base_host;
+	int result;
+	
+	result = FALSE;
+	
+	url = CFHTTPMessageCopyRequestURL(request);
+	require_quiet(url != NULL, CFHTTPMessageCopyRequestURL);
+	
+	scheme = CFURLCopyScheme(url);
+	host = CFURLCopyHostName(url);
+	base_scheme = CFURLCopyScheme(gBaseURL);
+	base_host = CFURLCopyHostName(gBaseURL);
+	
+	result = (scheme != NULL) && (host != NULL) && (base_scheme != NULL) && (base_host != NULL) &&
+		(CFStringCompare(scheme, base_scheme, kCFCompareCaseInsensitive) == kCFCompareEqualTo) &&
+		(CFStringCompare(host, base_host, kCFCompareCaseInsensitive) == kCFCompareEqualTo) &&
+		(CFURLGetPortNumber(url) == CFURLGetPortNumber(gBaseURL));
+	
+	if ( scheme != NULL )
+	{
+		CFRelease(scheme);
+	}
+	if ( host != NULL )
+	{
+		CFRelease(host);
+	}
+	if ( base_scheme != NULL )
+	{
+		CFRelease(base_scheme);
+	}
+	if ( base_host != NULL )
+	{
+		CFRelease(base_host);
+	}
+	CFRelease(url);
+
+CFHTTPMessageCopyRequestURL:
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/*
+ * ApplyPublishedCredentials
+ *
+ * Applies authcache_credentials to the request without taking
+ * authcache_lock. Returns FALSE if there is no snapshot or it can't be used
+ * for this request; the caller then applies the authcache with the lock held.
+ */
+static
+int ApplyPublishedCredentials(
+	uid_t uid,							/* -> uid of the user making the request */
+	CFHTTPMessageRef request,			/* -> the request message to apply authentication to */
+	UInt32 *generation)					/* <- the generation count the snapshot was taken at */
+{
+	struct authcache_credentials *credentials;
+	int result;
+	
+	result = FALSE;
+	
+	/* count in before loading the snapshot so it can't be freed while it's used */
+	OSAtomicIncrement32Barrier(&authcache_credentials_readers);
+	credentials = authcache_credentials;
+	require_quiet(credentials != NULL, no_credentials);
+	
+	if ( (credentials->authorization != NULL) || (credentials->digest != NULL) )
+	{
+		/* like FindAuthenticationForRequest, the server entry only goes to its server and its uid (or root) */
+		require_quiet(RequestIsForMountServer(request), not_mount_server);
+		if ( (credentials->uid == uid) || (0 == uid) )
+		{
+			if ( credentials->authorization != NULL )
+			{
+				CFHTTPMessageSetHeaderFieldValue(request, CFSTR("Authorization"), credentials->authorization);
+			}
+			else
+			{
+				require_quiet(ApplyDigestToRequest(credentials->digest, request), ApplyDigestToRequest);
+			}
+			stats_increment(WEBDAV_STATS_AUTH_PRERENDERED);
+		}
+	}
+	if ( credentials->proxy_authorization != NULL )
+	{
+		CFHTTPMessageSetHeaderFieldValue(request, CFSTR("Proxy-Authorization"), credentials->proxy_authorization);
+		stats_increment(WEBDAV_STATS_AUTH_PRERENDERED);
+	}
+	
+	*generation = credentials->generation;
+	result = TRUE;
+
+ApplyDigestToRequest:
+not_mount_server:
+no_credentials:
+	OSAtomicDecrement32Barrier(&authcache_credentials_readers);
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
 int authcache_apply(
 	uid_t uid,							/* -> uid of the user making the request */
 	CFHTTPMessageRef request,			/* -> the request message to apply authentication to */
@@ -832,10 +1804,37 @@ int authcache_apply(
 	UInt32 *generation)					/* <- the generation count of the cache entry */
 {
 	int result, result2;
+	int64_t state;
+	
+	/*
+	 * Without a challenge, the only work is applying existing authentications.
+	 * If there are none, or the uid can't use them, the snapshot is enough and
+	 * the lock isn't needed.
+	 */
+	if ( statusCode == 0 )
+	{
+		state = authcache_state;
+		OSMemoryBarrier();
+		if ( ((state & (kStateServerEntries | kStateProxyEntry)) == 0) ||
+			 ((gProcessUID != uid) && (0 != uid)) )
+		{
+			*generation = AUTHCACHE_STATE_GENERATION(state);
+			stats_increment(WEBDAV_STATS_AUTHCACHE_UNLOCKED);
+			return ( 0 );
+		}
 		
+		/* once the authcache has settled, the published credentials are enough */
+		if ( ApplyPublishedCredentials(uid, request, generation) )
+		{
+			stats_increment(WEBDAV_STATS_AUTHCACHE_UNLOCKED);
+			return ( 0 );
+		}
+	}
+	
 	/* lock the Authcache */
 	result = pthread_mutex_lock(&authcache_lock);
 	require_noerr_action(result, pthread_mutex_lock, webdav_kill(-1));
+	stats_increment(WEBDAV_STATS_AUTHCACHE_LOCKED);
 
 	switch (statusCode)
 	{
@@ -846,6 +1845,7 @@ int authcache_apply(
 		
 	case 401:
 		/* server challenge -- add server authentication */
+		stats_increment(WEBDAV_STATS_AUTH_CHALLENGES);
 		
 		/* only add server authentication if the uid is the mount's user or root user */
 		if ( (gProcessUID == uid) || (0 == uid) )
@@ -860,6 +1860,7 @@ int authcache_apply(
 		
 	case 407:
 		/* proxy challenge -- add proxy authentication */
+		stats_increment(WEBDAV_STATS_AUTH_CHALLENGES);
 		
 		/* only add proxy authentication if the uid is the mount's user or root user */
 		if ( (gProcessUID == uid) || (0 == uid) )
@@ -887,6 +1888,8 @@ int authcache_apply(
 	/* return the current authcache_generation */
 	*generation = authcache_generation;
 
+	PublishAuthcacheState();
+
 	/* unlock the Authcache */
 	result2 = pthread_mutex_unlock(&authcache_lock);
 	require_noerr_action(result2, pthread_mutex_unlock, result = result2; webdav_kill(-1));
@@ -905,13 +1908,27 @@ int authcache_valid(
 	UInt32 generation)					/* -> the generation count of the cache entry */
 {
 	int result, result2;
+	int64_t state;
 	
 	/* only validate authentications if the uid is the mount's user or root user */
 	require_quiet(((gProcessUID == uid) || (0 == uid)), not_owner_uid);
 
+	/*
+	 * Nothing changes if the authcache has moved on since the request was
+	 * authenticated, or if every entry is already marked valid.
+	 */
+	state = authcache_state;
+	OSMemoryBarrier();
+	if ( (AUTHCACHE_STATE_GENERATION(state) != generation) || (state & kStateAllValid) )
+	{
+		stats_increment(WEBDAV_STATS_AUTHCACHE_UNLOCKED);
+		goto snapshot_current;
+	}
+
 	/* lock the Authcache */
 	result = pthread_mutex_lock(&authcache_lock);
 	require_noerr_action(result, pthread_mutex_lock, webdav_kill(-1));
+	stats_increment(WEBDAV_STATS_AUTHCACHE_LOCKED);
 
 	if ( generation == authcache_generation )
 	{
@@ -923,21 +1940,28 @@ int authcache_valid(
 		{
 			/* mark this authentication valid */
 			entry_ptr->authflags |= kCredentialsValid;			
+			
+			/* the credentials work, so go back to the rendered ones if there are any */
+			entry_ptr->prerendered = (entry_ptr->basic_authorization != NULL) || (entry_ptr->digest != NULL);
 		}		
 		
 		if ( authcache_proxy_entry != NULL )
 		{
 			/* mark this authentication valid */
 			authcache_proxy_entry->authflags |= kCredentialsValid;
+			authcache_proxy_entry->prerendered = (authcache_proxy_entry->basic_authorization != NULL);
 		}
 	}
 	
+	PublishAuthcacheState();
+	
 	/* unlock the Authcache */
 	result2 = pthread_mutex_unlock(&authcache_lock);
 	require_noerr_action(result2, pthread_mutex_unlock, result = result2; webdav_kill(-1));
 
 pthread_mutex_unlock:
 pthread_mutex_lock:
+snapshot_current:
 not_owner_uid:
 
 	return ( 0 );
@@ -959,6 +1983,8 @@ int authcache_proxy_invalidate(void)
 		RemoveAuthentication(authcache_proxy_entry);
 	}
 
+	PublishAuthcacheState();
+
 	/* unlock the Authcache */
 	result2 = pthread_mutex_unlock(&authcache_lock);
 	require_noerr_action(result2, pthread_mutex_unlock, result = result2; webdav_kill(-1));
@@ -990,6 +2016,7 @@ int authcache_init(
 	
 	LIST_INIT(&authcache_list);
 	authcache_generation = 1;
+	PublishAuthcacheState();
 	
 	result = 0;
 	
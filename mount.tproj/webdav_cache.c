@@ -25,6 +25,7 @@
 
 #include <sys/syslog.h>
 #include <sys/errno.h>
+#include <sys/dirent.h>
 #include <stdlib.h>
 #include <strings.h>
 #include <stdio.h>
@@ -36,6 +37,7 @@
 #include "webdav_parse.h"
 #include "OpaqueIDs.h"
 #include "LogMessage.h"
+#include "webdav_stats.h"
 
 /*****************************************************************************/
 
@@ -66,6 +68,13 @@ struct node_entry *g_deleted_root_node;
 */
 u_int32_t g_next_fileid;
 
+/*
+ * Incremented whenever a node is renamed, moved or redirected, which
+ * makes every node's url_ref stale. Those are rare compared to the
+ * requests that need a node's URL, so one counter is enough.
+ */
+static u_int32_t g_url_generation;
+
 /*
  * The file_cache_head list.
  * Entries are stored in the order inserted into the list.
@@ -87,6 +96,8 @@ static int internal_node_appledoubleheader_valid(
 	uid_t uid);
 static void invalidate_level(
 	struct node_entry *dir_node);
+static void internal_discard_read_ahead(
+	struct node_entry *node);
 static void internal_remove_file_cache(
 	struct node_entry *node);
 static int internal_add_file_cache(
@@ -151,6 +162,7 @@ static int internal_add_attributes(
 		node->attr_appledoubleheader_time = current_time;
 	}
 	/* fill in the rest of the fields */
+	node->flags &= ~nodeAttrPrefetchedMask;
 	node->attr_uid = uid;
 	node->attr_time = current_time;
 	memcpy(&(node->attr_stat_info), statp, sizeof(struct webdav_stat_attr));
@@ -182,6 +194,87 @@ int nodecache_add_attributes(
 
 /*****************************************************************************/
 
+/*
+ * Same as nodecache_add_attributes, but marks the attributes as prefetched so
+ * node_attributes_valid can count the round trips the prefetch saved.
+ */
+int nodecache_add_prefetched_attributes(
+	struct node_entry *node,		/* the node_entry to update or add attributes_entry to */
+	uid_t uid,						/* the uid these attributes are valid for */
+	struct webdav_stat_attr *statp)	/* the stat buffer */
+{
+	int error;
+
+	lock_node_cache();
+
+	error = internal_add_attributes(node, uid, statp, NULL);
+	if ( error == 0 )
+	{
+		node->flags |= nodeAttrPrefetchedMask;
+	}
+
+	unlock_node_cache();
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * Called when a child of dir_node had to go to the server for its attributes.
+ * Returns TRUE when enough misses have happened in dir_node recently that the
+ * caller should queue a prefetch of the attributes of all of dir_node's
+ * children. Only one caller per window gets TRUE, and none do while a
+ * prefetch is queued (see nodecache_prefetch_done).
+ */
+int nodecache_note_attributes_miss(
+	struct node_entry *dir_node)	/* parent directory node */
+{
+	int result;
+	time_t current_time;
+
+	result = FALSE;
+	current_time = time(NULL);
+
+	lock_node_cache();
+
+	if ( (dir_node->node_type == WEBDAV_DIR_TYPE) && !NODE_IS_DELETED(dir_node) )
+	{
+		if ( current_time >= (dir_node->prefetch_window_start + PREFETCH_MISS_WINDOW) )
+		{
+			/* start a new window */
+			dir_node->prefetch_window_start = current_time;
+			dir_node->prefetch_misses = 0;
+		}
+		if ( (++dir_node->prefetch_misses >= PREFETCH_MISS_THRESHOLD) && !dir_node->prefetch_queued )
+		{
+			dir_node->prefetch_misses = 0;
+			dir_node->prefetch_queued = TRUE;
+			result = TRUE;
+		}
+	}
+
+	unlock_node_cache();
+
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/*
+ * Called when the prefetch nodecache_note_attributes_miss asked for is done
+ * (or couldn't be queued).
+ */
+void nodecache_prefetch_done(
+	struct node_entry *dir_node)	/* parent directory node */
+{
+	lock_node_cache();
+	dir_node->prefetch_queued = FALSE;
+	unlock_node_cache();
+}
+
+/*****************************************************************************/
+
 /* clear out the attribute fields and release any memory */
 static int internal_remove_attributes(
 	struct node_entry *node,
@@ -256,6 +349,7 @@ int node_attributes_valid(
 	uid_t uid)
 {
 	int result;
+	int prefetched;
 
 	lock_node_cache();
 
@@ -263,8 +357,21 @@ int node_attributes_valid(
 			 ((uid == node->attr_uid) || (0 == node->attr_uid)) && /* does this user or root have access to the cached attributes */
 			 (time(NULL) < (node->attr_time + ATTRIBUTES_TIMEOUT_MAX)) ); /* don't cache them too long */
 
+	/* count the first use of prefetched attributes */
+	prefetched = result && ((node->flags & nodeAttrPrefetchedMask) != 0);
+	if ( prefetched )
+	{
+		node->flags &= ~nodeAttrPrefetchedMask;
+	}
+
 	unlock_node_cache();
 
+	stats_increment(result ? WEBDAV_STATS_ATTR_CACHE_HIT : WEBDAV_STATS_ATTR_CACHE_MISS);
+	if ( prefetched )
+	{
+		stats_increment(WEBDAV_STATS_PREFETCH_HIT);
+	}
+
 	return ( result );
 
 #if 0 /* FUTURE */	
@@ -306,6 +413,57 @@ int node_attributes_valid(
 
 /*****************************************************************************/
 
+/*
+ * Returns how many seconds the kernel may cache node's attributes without
+ * asking again. The time is never longer than the node cache will keep using
+ * them itself, and is shortened for recently modified objects (the same
+ * heuristic NFS uses) since those are the ones most likely to change again.
+ */
+static u_int32_t internal_attributes_kernel_timeout(
+	struct node_entry *node)
+{
+	time_t current_time;
+	time_t remaining;
+	time_t attribute_time_out;
+
+	current_time = time(NULL);
+	remaining = (node->attr_time != 0) ? (node->attr_time + ATTRIBUTES_TIMEOUT_MAX - current_time) : 0;
+	
+	attribute_time_out = (current_time - node->attr_stat_info.attr_stat.st_mtimespec.tv_sec) / 10;
+	if (attribute_time_out < ATTRIBUTES_TIMEOUT_MIN)
+	{
+		attribute_time_out = ATTRIBUTES_TIMEOUT_MIN;
+	}
+	else if (attribute_time_out > ATTRIBUTES_TIMEOUT_MAX)
+	{
+		attribute_time_out = ATTRIBUTES_TIMEOUT_MAX;
+	}
+
+	if ( remaining <= 0 )
+	{
+		return ( 0 );
+	}
+	return ( (u_int32_t)((remaining < attribute_time_out) ? remaining : attribute_time_out) );
+}
+
+/*****************************************************************************/
+
+u_int32_t node_attributes_kernel_timeout(
+	struct node_entry *node)
+{
+	u_int32_t result;
+
+	lock_node_cache();
+
+	result = internal_attributes_kernel_timeout(node);
+
+	unlock_node_cache();
+
+	return ( result );
+}
+
+/*****************************************************************************/
+
 /* invalidate the node attribute and file cache caches for dir_node's children */
 static void invalidate_level(struct node_entry *dir_node)
 {
@@ -317,6 +475,7 @@ static void invalidate_level(struct node_entry *dir_node)
 		node->attr_time = 0;
 		node->attr_stat_info.attr_create_time.tv_sec = -1;
 		node->file_validated_time = 0;
+		++node->file_invalidations;
 		/* invalidate this node's children (if any) */
 		invalidate_level(node);
 	}
@@ -333,6 +492,7 @@ void nodecache_invalidate_caches(void)
 	node->attr_time = 0;
 	node->attr_stat_info.attr_create_time.tv_sec = -1;
 	node->file_validated_time = 0;
+	++node->file_invalidations;
 	/* invalidate this node's children (if any) */
 	invalidate_level(node);
 	
@@ -484,6 +644,7 @@ static int internal_add_file_cache(
 	node->file_fd = fd;
 	node->file_status = WEBDAV_DOWNLOAD_NEVER;
 	node->file_validated_time = 0;
+	node->dir_plus_written = FALSE;
 	node->file_inactive_time = 0;
 	node->file_last_modified = -1;
 	if ( node->file_entity_tag != NULL )
@@ -497,6 +658,18 @@ static int internal_add_file_cache(
 		free(node->file_locktoken);
 		node->file_locktoken = NULL;
 	}
+	if ( node->file_open_etag != NULL )
+	{
+		free(node->file_open_etag);
+		node->file_open_etag = NULL;
+	}
+	if ( node->upload_etag != NULL )
+	{
+		free(node->upload_etag);
+		node->upload_etag = NULL;
+	}
+	node->upload_committed = 0;
+	internal_discard_read_ahead(node);
 	
 	/* add it to the head of the g_file_active_list */
 	LIST_INSERT_HEAD(&g_file_list, node, file_list);
@@ -551,8 +724,17 @@ static void internal_remove_file_cache(struct node_entry *node)
 		node->file_list.le_prev = NULL;
 		node->file_status = WEBDAV_DOWNLOAD_NEVER;
 		node->file_validated_time = 0;
+		++node->file_invalidations;
+		node->file_listing_time = 0;
+		node->dir_plus_written = FALSE;
 		node->file_inactive_time = 0;
 		node->file_last_modified = -1;
+		/* a sync-token is only useful with the listing it describes */
+		if ( node->dir_sync_token != NULL )
+		{
+			free(node->dir_sync_token);
+			node->dir_sync_token = NULL;
+		}
 		if ( node->file_entity_tag != NULL )
 		{
 			free(node->file_entity_tag);
@@ -564,6 +746,18 @@ static void internal_remove_file_cache(struct node_entry *node)
 			free(node->file_locktoken);
 			node->file_locktoken = NULL;
 		}
+		if ( node->file_open_etag != NULL )
+		{
+			free(node->file_open_etag);
+			node->file_open_etag = NULL;
+		}
+		if ( node->upload_etag != NULL )
+		{
+			free(node->upload_etag);
+			node->upload_etag = NULL;
+		}
+		node->upload_committed = 0;
+		internal_discard_read_ahead(node);
 	}
 }
 
@@ -580,6 +774,122 @@ void nodecache_remove_file_cache(struct node_entry *node)
 
 /*****************************************************************************/
 
+static void internal_discard_read_ahead(struct node_entry *node)
+{
+	if ( node->read_ahead_data != NULL )
+	{
+		free(node->read_ahead_data);
+		node->read_ahead_data = NULL;
+	}
+	node->read_ahead_uid = 0;
+	node->read_ahead_offset = 0;
+	node->read_ahead_length = 0;
+	node->read_ahead_window = 0;
+}
+
+/*****************************************************************************/
+
+/*
+ * nodecache_get_read_ahead answers an out-of-band read from the bytes kept by
+ * the last one. If they don't cover the read, it returns ENOENT and the size
+ * of the Range GET the caller should send, growing the window when the read
+ * continues where the kept bytes are.
+ */
+int nodecache_get_read_ahead(
+	struct node_entry *node,
+	uid_t uid,
+	off_t offset,
+	size_t count,
+	char **buffer,
+	size_t *actual_count,
+	size_t *window)
+{
+	int error;
+	off_t kept_end;
+	
+	*buffer = NULL;
+	*actual_count = 0;
+	error = 0;
+	
+	lock_node_cache();
+	
+	kept_end = node->read_ahead_offset + (off_t)node->read_ahead_length;
+	if ( (node->read_ahead_data != NULL) && (node->read_ahead_uid == uid) &&
+		 (offset >= node->read_ahead_offset) && ((offset + (off_t)count) <= kept_end) )
+	{
+		*buffer = malloc(count);
+		require_action(*buffer != NULL, malloc_buffer, error = ENOMEM);
+		
+		memcpy(*buffer, node->read_ahead_data + (offset - node->read_ahead_offset), count);
+		*actual_count = count;
+	}
+	else
+	{
+		if ( (node->read_ahead_data != NULL) && (node->read_ahead_uid == uid) &&
+			 (offset >= node->read_ahead_offset) && (offset <= kept_end) )
+		{
+			/* the reader is moving through the file -- ask for more next time */
+			node->read_ahead_window = MIN(node->read_ahead_window * 2, READ_AHEAD_WINDOW_MAX);
+		}
+		else
+		{
+			node->read_ahead_window = READ_AHEAD_WINDOW_MIN;
+		}
+		*window = node->read_ahead_window;
+		error = ENOENT;
+	}
+
+malloc_buffer:
+
+	unlock_node_cache();
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+void nodecache_set_read_ahead(
+	struct node_entry *node,
+	uid_t uid,
+	off_t offset,
+	char *data,
+	size_t length)
+{
+	lock_node_cache();
+	
+	/* the bytes are only good while the cache file they're ahead of exists */
+	if ( NODE_FILE_IS_CACHED(node) )
+	{
+		if ( node->read_ahead_data != NULL )
+		{
+			free(node->read_ahead_data);
+		}
+		node->read_ahead_data = data;
+		node->read_ahead_uid = uid;
+		node->read_ahead_offset = offset;
+		node->read_ahead_length = length;
+	}
+	else
+	{
+		free(data);
+	}
+	
+	unlock_node_cache();
+}
+
+/*****************************************************************************/
+
+void nodecache_discard_read_ahead(struct node_entry *node)
+{
+	lock_node_cache();
+	
+	internal_discard_read_ahead(node);
+	
+	unlock_node_cache();
+}
+
+/*****************************************************************************/
+
 /* called at mount time to initialize */
 int nodecache_init(
 	size_t name_length,				/* length of root node name */
@@ -686,6 +996,8 @@ static int internal_get_node(
 		}
 		
 		CFRelease(name_string);
+		
+		stats_increment((node_ptr != NULL) ? WEBDAV_STATS_NODE_CACHE_HIT : WEBDAV_STATS_NODE_CACHE_MISS);
 	}
 	else
 	{
@@ -730,6 +1042,13 @@ static int internal_get_node(
 			
 			/* insert the node_entry into the parent's children list */
 			LIST_INSERT_HEAD(&parent->children, node_ptr, entries);
+			
+			/* the parent's cached directory listing doesn't have the new node (unless it's the listing being downloaded) */
+			parent->file_validated_time = 0;
+			if ( !parent->file_listing_in_progress || !pthread_equal(parent->file_listing_thread, pthread_self()) )
+			{
+				++parent->file_invalidations;
+			}
 		}
 		else
 		{
@@ -837,6 +1156,14 @@ static void internal_free_nodes(void)
 			CFRelease(node->name_ref);
 			if (node->redir_name != NULL) 
 				free (node->redir_name);
+			if (node->url_ref != NULL)
+				CFRelease(node->url_ref);
+			if (node->dir_sync_token != NULL)
+				free(node->dir_sync_token);
+			if (node->upload_etag != NULL)
+				free(node->upload_etag);
+			if (node->file_open_etag != NULL)
+				free(node->file_open_etag);
 
 			(void) internal_remove_attributes(node, TRUE);
 
@@ -869,6 +1196,15 @@ static int internal_move_node(
 	
 	error = 0;
 	
+	/* the cached directory listings of the old and new parents will be out of date */
+	if ( node->parent != NULL )
+	{
+		node->parent->file_validated_time = 0;
+		++node->parent->file_invalidations;
+	}
+	new_parent->file_validated_time = 0;
+	++new_parent->file_invalidations;
+	
 	/* new name? */
 	if ( (new_name_length != 0) && (new_name != NULL) )
 	{
@@ -895,6 +1231,9 @@ static int internal_move_node(
 			node->name[new_name_length] = '\0';
 			node->name_ref = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, node->name, kCFStringEncodingUTF8, kCFAllocatorNull);
 			node->name_length = new_name_length;
+			
+			/* the URLs of this node and its descendants changed */
+			++g_url_generation;
 		}
 	}
 
@@ -905,6 +1244,9 @@ static int internal_move_node(
 		LIST_REMOVE(node, entries);
 		LIST_INSERT_HEAD(&new_parent->children, node, entries);
 		node->parent = new_parent;
+		
+		/* the URLs of this node and its descendants changed */
+		++g_url_generation;
 	}
 
 malloc_name:
@@ -1084,6 +1426,331 @@ int nodecache_delete_invalid_directory_nodes(
 
 /*****************************************************************************/
 
+/*
+ * Rewrite dir_node's directory cache file from its children in the node cache.
+ * Used after a sync-collection delta has been applied to the node cache, when
+ * the children list is the complete listing.
+ */
+static int internal_write_directory(struct node_entry *dir_node)
+{
+	int error;
+	ssize_t size;
+	struct node_entry *node;
+	struct webdav_dirent dir_data;
+	
+	error = 0;
+	
+	require_action(dir_node->node_type == WEBDAV_DIR_TYPE, not_directory, error = ENOTDIR);
+	require_action(dir_node->file_fd != -1, no_cache_file, error = EINVAL);
+	
+	/* truncate the file, and reset the file pointer to 0 */
+	require_action(ftruncate(dir_node->file_fd, 0) == 0, write_error, error = errno);
+	require_action(lseek(dir_node->file_fd, 0, SEEK_SET) == 0, write_error, error = errno);
+	
+	/* write "." and ".." */
+	bzero(&dir_data, sizeof(dir_data));
+	dir_data.d_ino = dir_node->fileid;
+	dir_data.d_reclen = sizeof(struct webdav_dirent);
+	dir_data.d_type = DT_DIR;
+	dir_data.d_namlen = 1;
+	dir_data.d_name[0] = '.';
+	size = write(dir_node->file_fd, &dir_data, sizeof(struct webdav_dirent));
+	require_action(size == sizeof(struct webdav_dirent), write_error, error = EIO);
+	
+	dir_data.d_ino = (dir_node->fileid == WEBDAV_ROOTFILEID) ? WEBDAV_ROOTPARENTFILEID : dir_node->parent->fileid;
+	dir_data.d_namlen = 2;
+	dir_data.d_name[1] = '.';
+	size = write(dir_node->file_fd, &dir_data, sizeof(struct webdav_dirent));
+	require_action(size == sizeof(struct webdav_dirent), write_error, error = EIO);
+	
+	/* and one entry per child */
+	for ( node = (&(dir_node->children))->lh_first; node != NULL; node = node->entries.le_next )
+	{
+		bzero(&dir_data, sizeof(dir_data));
+		dir_data.d_ino = node->fileid;
+		dir_data.d_reclen = sizeof(struct webdav_dirent);
+		dir_data.d_type = (node->node_type == WEBDAV_DIR_TYPE) ? DT_DIR : DT_REG;
+		dir_data.d_namlen = node->name_length;
+		bcopy(node->name, dir_data.d_name, node->name_length);
+		size = write(dir_node->file_fd, &dir_data, sizeof(struct webdav_dirent));
+		require_action(size == sizeof(struct webdav_dirent), write_error, error = EIO);
+	}
+	
+	return ( 0 );
+	
+write_error:
+	/* directory is in unknown condition - erase whatever is there */
+	(void) ftruncate(dir_node->file_fd, 0);
+no_cache_file:
+not_directory:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * Fill in a readdir-plus record for node: what WEBDAV_LOOKUP and WEBDAV_GETATTR
+ * would return for it. If uid can't use node's cached attributes, attr_timeout
+ * is left 0 so the kernel ignores the record.
+ */
+static void internal_fill_dirattr(
+	struct node_entry *node,
+	uid_t uid,
+	struct webdav_dirattr *dirattr)
+{
+	struct stat *statp;
+	
+	bzero(dirattr, sizeof(struct webdav_dirattr));
+	
+	if ( (node->attr_time == 0) ||	/* 0 attr_time is invalid */
+		 ((uid != node->attr_uid) && (0 != node->attr_uid)) ) /* does this user or root have access to the cached attributes */
+	{
+		return;
+	}
+	
+	statp = &node->attr_stat_info.attr_stat;
+	
+	dirattr->lookup.obj_id = node->nodeid;
+	dirattr->lookup.obj_fileid = node->fileid;
+	dirattr->lookup.obj_type = node->node_type;
+	dirattr->lookup.obj_atime.tv_sec = statp->st_atimespec.tv_sec;
+	dirattr->lookup.obj_atime.tv_nsec = statp->st_atimespec.tv_nsec;
+	dirattr->lookup.obj_mtime.tv_sec = statp->st_mtimespec.tv_sec;
+	dirattr->lookup.obj_mtime.tv_nsec = statp->st_mtimespec.tv_nsec;
+	dirattr->lookup.obj_ctime.tv_sec = statp->st_ctimespec.tv_sec;
+	dirattr->lookup.obj_ctime.tv_nsec = statp->st_ctimespec.tv_nsec;
+	dirattr->lookup.obj_createtime.tv_sec = node->attr_stat_info.attr_create_time.tv_sec;
+	dirattr->lookup.obj_createtime.tv_nsec = node->attr_stat_info.attr_create_time.tv_nsec;
+	dirattr->lookup.obj_filesize = statp->st_size;
+	
+	dirattr->attr.st_dev = statp->st_dev;
+	dirattr->attr.st_ino = (webdav_ino_t) statp->st_ino;
+	dirattr->attr.st_mode = statp->st_mode;
+	dirattr->attr.st_nlink = statp->st_nlink;
+	dirattr->attr.st_uid = statp->st_uid;
+	dirattr->attr.st_gid = statp->st_gid;
+	dirattr->attr.st_rdev = statp->st_rdev;
+	dirattr->attr.st_atimespec = dirattr->lookup.obj_atime;
+	dirattr->attr.st_mtimespec = dirattr->lookup.obj_mtime;
+	dirattr->attr.st_ctimespec = dirattr->lookup.obj_ctime;
+	dirattr->attr.st_createtimespec = dirattr->lookup.obj_createtime;
+	dirattr->attr.st_size = statp->st_size;
+	dirattr->attr.st_blocks = statp->st_blocks;
+	dirattr->attr.st_blksize = statp->st_blksize;
+	dirattr->attr.st_flags = statp->st_flags;
+	dirattr->attr.st_gen = statp->st_gen;
+	
+	dirattr->attr_timeout = internal_attributes_kernel_timeout(node);
+}
+
+/*****************************************************************************/
+
+int nodecache_write_directory(
+	struct node_entry *dir_node)		/* directory node whose cache file is rewritten from its children */
+{
+	int error;
+
+	lock_node_cache();
+
+	error = internal_write_directory(dir_node);
+
+	unlock_node_cache();
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * Rewrite dir_node's directory cache file from its children in the node cache,
+ * followed by one readdir-plus record (struct webdav_dirattr) per child in the
+ * same order, so the kernel gets every entry's attributes with the listing.
+ * The entries and records are built with the node cache locked, but written
+ * after it's unlocked (the kernel doesn't send READDIRs of a directory
+ * concurrently).
+ */
+int nodecache_write_directory_plus(
+	struct node_entry *dir_node,	/* -> directory node whose cache file is rewritten from its children */
+	uid_t uid,						/* -> uid of the user reading the directory */
+	off_t *dirent_size,				/* <- bytes of directory entries at the start of the cache file */
+	u_int32_t *dirattr_count)		/* <- number of webdav_dirattr records that follow the entries */
+{
+	int error;
+	int fd;
+	ssize_t size;
+	size_t dirents_length, dirattrs_length;
+	u_int32_t count, index;
+	struct node_entry *node;
+	struct webdav_dirent *dirents;
+	struct webdav_dirattr *dirattrs;
+
+	*dirent_size = 0;
+	*dirattr_count = 0;
+	fd = -1;
+	dirents = NULL;
+	dirattrs = NULL;
+	
+	lock_node_cache();
+	
+	require_action(dir_node->node_type == WEBDAV_DIR_TYPE, not_directory, error = ENOTDIR);
+	require_action(dir_node->file_fd != -1, no_cache_file, error = EINVAL);
+	
+	count = 0;
+	for ( node = (&(dir_node->children))->lh_first; node != NULL; node = node->entries.le_next )
+	{
+		++count;
+	}
+	
+	dirents_length = (count + 2) * sizeof(struct webdav_dirent);
+	dirattrs_length = count * sizeof(struct webdav_dirattr);
+	dirents = calloc(1, dirents_length);
+	require_action(dirents != NULL, calloc, error = ENOMEM);
+	if ( count != 0 )
+	{
+		dirattrs = malloc(dirattrs_length);
+		require_action(dirattrs != NULL, calloc, error = ENOMEM);
+	}
+	
+	/* "." and ".." */
+	dirents[0].d_ino = dir_node->fileid;
+	dirents[0].d_reclen = sizeof(struct webdav_dirent);
+	dirents[0].d_type = DT_DIR;
+	dirents[0].d_namlen = 1;
+	dirents[0].d_name[0] = '.';
+	dirents[1] = dirents[0];
+	dirents[1].d_ino = (dir_node->fileid == WEBDAV_ROOTFILEID) ? WEBDAV_ROOTPARENTFILEID : dir_node->parent->fileid;
+	dirents[1].d_namlen = 2;
+	dirents[1].d_name[1] = '.';
+	
+	/* and one entry and one record per child */
+	index = 0;
+	for ( node = (&(dir_node->children))->lh_first; node != NULL; node = node->entries.le_next )
+	{
+		dirents[index + 2].d_ino = node->fileid;
+		dirents[index + 2].d_reclen = sizeof(struct webdav_dirent);
+		dirents[index + 2].d_type = (node->node_type == WEBDAV_DIR_TYPE) ? DT_DIR : DT_REG;
+		dirents[index + 2].d_namlen = node->name_length;
+		bcopy(node->name, dirents[index + 2].d_name, node->name_length);
+		internal_fill_dirattr(node, uid, &dirattrs[index]);
+		++index;
+	}
+	
+	/* the node cache may close file_fd once it's unlocked, so write to a duplicate */
+	fd = dup(dir_node->file_fd);
+	require_action(fd != -1, dup, error = errno);
+	
+	unlock_node_cache();
+	
+	require_action(ftruncate(fd, 0) == 0, write_error, error = errno);
+	size = pwrite(fd, dirents, dirents_length, 0);
+	require_action(size == (ssize_t)dirents_length, write_error, error = EIO);
+	*dirent_size = (off_t)dirents_length;
+	
+	if ( count != 0 )
+	{
+		size = pwrite(fd, dirattrs, dirattrs_length, (off_t)dirents_length);
+		if ( size == (ssize_t)dirattrs_length )
+		{
+			*dirattr_count = count;
+		}
+		else
+		{
+			/* drop the records -- the entries are still good, so the kernel can still read the directory */
+			(void) ftruncate(fd, (off_t)dirents_length);
+		}
+	}
+	error = 0;
+	goto done;
+
+write_error:
+	/* directory is in unknown condition - erase whatever is there */
+	(void) ftruncate(fd, 0);
+	*dirent_size = 0;
+	goto done;
+
+dup:
+calloc:
+no_cache_file:
+not_directory:
+
+	unlock_node_cache();
+
+done:
+	if ( fd != -1 )
+	{
+		close(fd);
+	}
+	if ( dirents != NULL )
+	{
+		free(dirents);
+	}
+	if ( dirattrs != NULL )
+	{
+		free(dirattrs);
+	}
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * Returns the opaque_ids of dir_node's children (or only its child
+ * directories). The ids (rather than the nodes) are returned because the
+ * nodes may be deleted once the node cache is unlocked.
+ */
+int nodecache_copy_children(
+	struct node_entry *dir_node,	/* -> parent directory node */
+	int directories_only,			/* -> if TRUE, only return child directories */
+	opaque_id **child_ids,			/* <- malloc'd array of the children's opaque_ids (caller must free), or NULL */
+	u_int32_t *count)				/* <- number of entries in child_ids */
+{
+	int error;
+	struct node_entry *node;
+	u_int32_t index;
+
+	error = 0;
+	*child_ids = NULL;
+	*count = 0;
+	
+	lock_node_cache();
+	
+	require_action(dir_node->node_type == WEBDAV_DIR_TYPE, not_directory, error = ENOTDIR);
+	
+	LIST_FOREACH(node, &(dir_node->children), entries)
+	{
+		if ( !directories_only || (node->node_type == WEBDAV_DIR_TYPE) )
+		{
+			++(*count);
+		}
+	}
+	
+	if ( *count != 0 )
+	{
+		*child_ids = malloc(*count * sizeof(opaque_id));
+		require_action(*child_ids != NULL, malloc_child_ids, error = ENOMEM; *count = 0);
+		
+		index = 0;
+		LIST_FOREACH(node, &(dir_node->children), entries)
+		{
+			if ( !directories_only || (node->node_type == WEBDAV_DIR_TYPE) )
+			{
+				(*child_ids)[index++] = node->nodeid;
+			}
+		}
+	}
+
+malloc_child_ids:
+not_directory:
+
+	unlock_node_cache();
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
 /*
  * nodecache_get_path_from_node
  *
@@ -1394,6 +2061,9 @@ int nodecache_redirect_node(
 		syslog(LOG_DEBUG, "Base node redirected to: %s", name_ptr);
 	}
 
+	/* the URLs of the redirected node and its descendants changed */
+	++g_url_generation;
+
 create_baseurl:
 	unlock_node_cache();
 out:
@@ -1516,6 +2186,59 @@ CFURLRef nodecache_get_baseURL(void)
 	return baseURL;
 }
 
+/*****************************************************************************/
+
+/*
+ * Returns a retained copy of node's cached URL, or NULL if there isn't a
+ * current one. When NULL is returned, the caller builds the URL and hands it
+ * back with nodecache_set_url along with the generation returned here, so a
+ * URL built from a path that was renamed in the meantime isn't cached.
+ */
+CFURLRef nodecache_copy_url(
+	struct node_entry *node,		/* -> node */
+	u_int32_t *generation)			/* <- pass to nodecache_set_url if NULL is returned */
+{
+	CFURLRef url;
+
+	url = NULL;
+
+	lock_node_cache();
+
+	*generation = g_url_generation;
+	if ( (node->url_ref != NULL) && (node->url_generation == g_url_generation) )
+	{
+		CFRetain(node->url_ref);
+		url = node->url_ref;
+	}
+
+	unlock_node_cache();
+
+	return ( url );
+}
+
+/*****************************************************************************/
+
+void nodecache_set_url(
+	struct node_entry *node,		/* -> node */
+	CFURLRef url,					/* -> the absolute URL to node */
+	u_int32_t generation)			/* -> the generation returned by nodecache_copy_url */
+{
+	lock_node_cache();
+
+	if ( (generation == g_url_generation) && !NODE_IS_DELETED(node) )
+	{
+		CFRetain(url);
+		if ( node->url_ref != NULL )
+		{
+			CFRelease(node->url_ref);
+		}
+		node->url_ref = url;
+		node->url_generation = generation;
+	}
+
+	unlock_node_cache();
+}
+
 /*****************************************************************************/
  void lock_node_cache(void)
 {
@@ -96,12 +96,27 @@ struct node_entry
 													 * Note: the download_status field should be word aligned.
 													 */
 	time_t					file_validated_time;	/* local time - when cache file was last validated by server */
+	u_int32_t				file_invalidations;		/* incremented (with lock_node_cache held) whenever something invalidates the cache file, so a validation that raced with it can tell */
+	int						file_listing_in_progress; /* TRUE while file_listing_thread downloads the listing (directories only) */
+	pthread_t				file_listing_thread;	/* the thread downloading the listing -- the nodes it adds don't invalidate it */
+	time_t					file_listing_time;		/* local time - when the directory listing in the cache file was downloaded (directories only) */
+	uid_t					file_listing_uid;		/* user the directory listing in the cache file was downloaded for (directories only) */
+	char					*dir_sync_token;		/* the DAV:sync-token for the listing in the cache file, or NULL (directories only) */
+	int						dir_plus_written;		/* TRUE if readdir-plus records follow the listing in the cache file (directories only) */
+	uid_t					dir_plus_uid;			/* the uid the readdir-plus records were written for */
+	time_t					dir_plus_time;			/* local time - when the readdir-plus records were written */
+	off_t					dir_plus_dirent_size;	/* bytes of directory entries before the readdir-plus records */
+	u_int32_t				dir_plus_count;			/* number of readdir-plus records */
 	time_t					file_inactive_time;		/* local time - when cache file was made inactive (the file this cache is for was closed) - 0 if active */
 	/* file system specific file cache data */
 	time_t					file_last_modified;		/* the HTTP-date converted to time_t from the Last-Modified entity-header or from the getlastmodified property, or -1 if no valid Last-Modified date */
 	char					*file_entity_tag;		/* The entity-tag from the ETag response-header or from the getetag property */
 	uid_t					file_locktoken_uid;		/* the uid associated with the locktoken (filesystem_close and filesystem_lock need it to renew locks and to unlock). */
 	char					*file_locktoken;		/* the lock token, or NULL */
+	char					*file_open_etag;		/* the strong entity tag the file had when it was opened for writing without a LOCK (see gLocklessOpens), "*" if it wasn't on the server, or NULL */
+	time_t					file_lock_time;			/* local time - when file_locktoken was obtained or last refreshed */
+	int						file_lock_refresh_queued; /* TRUE while a refresh of file_locktoken is waiting for or running on a request thread */
+	int						file_lock_refreshing;	/* TRUE while network_lock has a refresh of file_locktoken out to the server (protected by lock_node_cache) */
 
 	/* Context for sequential writes */
 	struct stream_put_ctx* put_ctx;
@@ -110,6 +125,28 @@ struct node_entry
 	boolean_t				isRedirected;		/* TRUE if this node has been redirected */
 	size_t					redir_name_length;	/* length of redirected name */
 	char					*redir_name;		/* the redirected utf8 name (From Location header of 3xx response) */
+
+	/* The absolute URL to this node, built on first use. It's stale if url_generation != g_url_generation */
+	CFURLRef				url_ref;			/* the URL, or NULL */
+	u_int32_t				url_generation;		/* the value of g_url_generation when url_ref was built */
+
+	/* Fields used to decide when to prefetch a directory's children's attributes */
+	time_t					prefetch_window_start;	/* local time - when prefetch_misses started counting */
+	u_int32_t				prefetch_misses;	/* children whose attributes had to be fetched from the server in this window */
+	int						prefetch_queued;	/* TRUE from when a prefetch is queued until a request thread has done it */
+
+	/* Fields used to answer out-of-band reads ahead of the background download (see nodecache_get_read_ahead) */
+	char					*read_ahead_data;	/* bytes from the last out-of-band Range GET, or NULL */
+	uid_t					read_ahead_uid;		/* user authorized to use read_ahead_data */
+	off_t					read_ahead_offset;	/* file offset of read_ahead_data */
+	size_t					read_ahead_length;	/* number of bytes in read_ahead_data */
+	size_t					read_ahead_window;	/* number of bytes the next out-of-band Range GET asks for, or 0 */
+
+	/* Fields used to resume a large PUT that didn't finish (see put_file_resumable) */
+	off_t					upload_committed;	/* bytes of the cache file the server has, or 0 */
+	char					*upload_etag;		/* the strong entity tag those bytes left the temporary resource with, or NULL */
+	off_t					upload_length;		/* length of the cache file when that upload started */
+	struct timespec			upload_mtime;		/* modification time of the cache file when that upload started */
 };
 
 #define WEBDAV_DOWNLOAD_NEVER		0
@@ -127,7 +164,9 @@ enum
 	nodeInFileListBit		= 1,			/* the node is cached and is on the file list */
 	nodeInFileListMask		= 0x00000002,
 	nodeRecentBit			= 2,			/* the file node was recently created by this client or the directory was recently read */
-	nodeRecentMask			= 0x00000004
+	nodeRecentMask			= 0x00000004,
+	nodeAttrPrefetchedBit	= 3,			/* the attributes came from a directory prefetch and haven't been used yet */
+	nodeAttrPrefetchedMask	= 0x00000008
 };
 
 /*****************************************************************************/
@@ -137,6 +176,25 @@ enum
 #define FILE_VALIDATION_TIMEOUT		60		/* Number of seconds file is valid from file_validated_time */
 #define FILE_CACHE_TIMEOUT			3600	/* 1 hour */
 #define FILE_RECENTLY_CREATED_TIMEOUT	1	/* Maximum number of seconds to skip GETs on opens after a create */
+#define DIR_LISTING_REVALIDATE_MAX	60	/* Maximum number of seconds a directory listing is reused by checking the directory's getlastmodified */
+
+/*
+ * After PREFETCH_MISS_THRESHOLD children of one directory miss the attribute
+ * cache within PREFETCH_MISS_WINDOW seconds, a single Depth 1 PROPFIND fetches
+ * the attributes of all of the directory's children.
+ */
+#define PREFETCH_MISS_THRESHOLD		4
+#define PREFETCH_MISS_WINDOW		2
+
+/*
+ * Out-of-band reads ask the server for at least read_ahead_window bytes and
+ * keep what the kernel didn't ask for so the reads that follow are answered
+ * without another Range GET. The window starts at READ_AHEAD_WINDOW_MIN and
+ * doubles, up to READ_AHEAD_WINDOW_MAX, each time a read lands in or just
+ * after the bytes kept from the last one; a read anywhere else starts over.
+ */
+#define READ_AHEAD_WINDOW_MIN		(64 * 1024)
+#define READ_AHEAD_WINDOW_MAX		(4 * 1024 * 1024)
 
 #define NODE_IS_DELETED(node)		(((node)->flags & nodeDeletedMask) != 0)
 
@@ -146,6 +204,8 @@ int node_appledoubleheader_valid(
 int node_attributes_valid(
 	struct node_entry *node,
 	uid_t uid);
+u_int32_t node_attributes_kernel_timeout(
+	struct node_entry *node);
 										  
 #define NODE_FILE_IS_CACHED(node)	( ((node)->flags & nodeInFileListMask) != 0 )
 #define NODE_FILE_IS_OPEN(node)		( (node)->file_inactive_time == 0 )
@@ -191,6 +251,17 @@ int nodecache_add_attributes(
 	struct webdav_stat_attr *statp,	/* the stat buffer */
 	char *appledoubleheader);		/* pointer appledoubleheader or NULL */
 	
+int nodecache_add_prefetched_attributes(
+	struct node_entry *node,		/* the node_entry to update or add attributes_entry to */
+	uid_t uid,						/* the uid these attributes are valid for */
+	struct webdav_stat_attr *statp);	/* the stat buffer */
+
+int nodecache_note_attributes_miss(
+	struct node_entry *dir_node);	/* parent directory node */
+
+void nodecache_prefetch_done(
+	struct node_entry *dir_node);	/* parent directory node */
+
 int nodecache_remove_attributes(
 	struct node_entry *node);		/* the node_entry to remove attributes from */
 
@@ -203,6 +274,25 @@ int nodecache_add_file_cache(
 void nodecache_remove_file_cache(
 	struct node_entry *node);		/* the node_entry to remove file_cache_entry from */
 
+int nodecache_get_read_ahead(
+	struct node_entry *node,		/* -> file node */
+	uid_t uid,						/* -> uid of the user making the request */
+	off_t offset,					/* -> position within the file at which the read is to begin */
+	size_t count,					/* -> number of bytes of data to be read */
+	char **buffer,					/* <- buffer data was copied into (allocated with malloc), or NULL */
+	size_t *actual_count,			/* <- number of bytes copied */
+	size_t *window);				/* <- if ENOENT is returned, number of bytes to ask the server for */
+
+void nodecache_set_read_ahead(
+	struct node_entry *node,		/* -> file node */
+	uid_t uid,						/* -> uid of the user the data was read for */
+	off_t offset,					/* -> file offset of data */
+	char *data,						/* -> data (allocated with malloc) -- the node cache frees it */
+	size_t length);					/* -> number of bytes in data */
+
+void nodecache_discard_read_ahead(
+	struct node_entry *node);		/* -> file node */
+
 struct node_entry *nodecache_get_next_file_cache_node(
 	int get_first);					/* if true, return first file cache node; otherwise, the next one */
 
@@ -223,8 +313,32 @@ int nodecache_invalidate_directory_node_time(
 int nodecache_delete_invalid_directory_nodes(
 	struct node_entry *dir_node);	/* parent directory node */
 
+int nodecache_write_directory(
+	struct node_entry *dir_node);	/* directory node whose cache file is rewritten from its children */
+
+int nodecache_write_directory_plus(
+	struct node_entry *dir_node,	/* -> directory node whose cache file is rewritten from its children */
+	uid_t uid,						/* -> uid of the user reading the directory */
+	off_t *dirent_size,				/* <- bytes of directory entries at the start of the cache file */
+	u_int32_t *dirattr_count);		/* <- number of webdav_dirattr records that follow the entries */
+
+int nodecache_copy_children(
+	struct node_entry *dir_node,	/* -> parent directory node */
+	int directories_only,			/* -> if TRUE, only return child directories */
+	opaque_id **child_ids,			/* <- malloc'd array of the children's opaque_ids (caller must free), or NULL */
+	u_int32_t *count);				/* <- number of entries in child_ids */
+
 CFURLRef nodecache_get_baseURL(void);
 
+CFURLRef nodecache_copy_url(
+	struct node_entry *node,		/* -> node */
+	u_int32_t *generation);			/* <- pass to nodecache_set_url if NULL is returned */
+
+void nodecache_set_url(
+	struct node_entry *node,		/* -> node */
+	CFURLRef url,					/* -> the absolute URL to node */
+	u_int32_t generation);			/* -> the generation returned by nodecache_copy_url */
+
 CFArrayRef nodecache_get_locktokens(
 	struct node_entry *a_node);		/* node or directory node */
 
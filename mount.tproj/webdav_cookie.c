@@ -44,6 +44,11 @@ WEBDAV_COOKIE *dequeueCookie(void);
 WEBDAV_COOKIE *find_cookie(WEBDAV_COOKIE *aCookie);
 boolean_t cookies_match(WEBDAV_COOKIE *cookie1, WEBDAV_COOKIE *cookie2);
 boolean_t checkCookieExpired(WEBDAV_COOKIE *aCookie);
+uint32_t cookie_hash_str(uint32_t hash, const char *str);
+uint32_t cookie_identity_hash(WEBDAV_COOKIE *aCookie);
+CFStringRef copy_cached_cookie_header(const char *cpath, uint32_t pathHash, boolean_t *found);
+void cache_cookie_header(const char *cpath, uint32_t pathHash, CFStringRef header);
+void flush_cookie_header_cache(void);
 
 // *************
 // Parse cookies
@@ -96,6 +101,21 @@ WEBDAV_COOKIE *cookie_head, *cookie_tail;
 uint32_t cookie_count;
 pthread_mutex_t cookie_lock;
 
+// Composed Cookie headers, indexed by a hash of the request's cookie path.
+// A slot is only used while its generation matches cookie_generation, which
+// changes whenever a cookie is added to or removed from the list.
+// Protected by cookie_lock.
+#define COOKIE_HEADER_CACHE_SIZE 64		/* must be a power of 2 */
+
+struct cookie_header_entry {
+	char		*path;			// cookie path of the request URL (NULL if the slot is empty)
+	uint32_t	generation;		// cookie_generation when the header was composed
+	CFStringRef	header;			// the Cookie header, or NULL if no cookie matched the path
+};
+
+struct cookie_header_entry cookie_header_cache[COOKIE_HEADER_CACHE_SIZE];
+uint32_t cookie_generation;
+
 extern int gSecureConnection;
 extern CFURLRef gBaseURL;				/* the base URL for this mount */
 extern CFStringRef gBasePath;			/* the base path (from gBaseURL) for this mount */
@@ -310,12 +330,16 @@ err_out:
 void add_cookie_headers(CFHTTPMessageRef message, CFURLRef url)
 {
 	CFStringRef urlPathStr;
+	CFStringRef cachedStr;
 	CFMutableStringRef cookieStr;
 	WEBDAV_COOKIE *aCookie;
 	char *cpath;
+	uint32_t pathHash;
+	boolean_t found;
 
 	cpath = NULL;
 	cookieStr = NULL;
+	cachedStr = NULL;
 	urlPathStr = NULL;
 
 	if (!cookie_count) {
@@ -333,7 +357,20 @@ void add_cookie_headers(CFHTTPMessageRef message, CFURLRef url)
 		goto err_out;
 	}
 
+	pathHash = cookie_hash_str(2166136261U, cpath);
+
 	lock_cookies();
+
+	// Requests for the same path send the same cookies until the list changes
+	cachedStr = copy_cached_cookie_header(cpath, pathHash, &found);
+	if (found == true) {
+		unlock_cookies();
+		if (cachedStr != NULL) {
+			CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Cookie"), cachedStr);
+		}
+		goto err_out;
+	}
+
 	aCookie = cookie_head;
 	while (aCookie != NULL) {
 		if  ((aCookie->cookie_secure == true) && (gSecureConnection != true)) {
@@ -365,6 +402,8 @@ void add_cookie_headers(CFHTTPMessageRef message, CFURLRef url)
 skip_cookie:
 		aCookie = aCookie->next;
 	}
+
+	cache_cookie_header(cpath, pathHash, cookieStr);
 	unlock_cookies();
 
 	if (cookieStr != NULL) {
@@ -376,11 +415,90 @@ err_out:
 		CFRelease(urlPathStr);
 	if (cookieStr != NULL)
 		CFRelease(cookieStr);
+	if (cachedStr != NULL)
+		CFRelease(cachedStr);
 	if (cpath != NULL)
 		free (cpath);
 	return;
 }
 
+// Returns a retained copy of the cached Cookie header for cpath, or NULL.
+// *found is set to true if the cache had an answer for cpath, which may be
+// that no cookies apply. Must be called with cookie_lock held.
+CFStringRef copy_cached_cookie_header(const char *cpath, uint32_t pathHash, boolean_t *found)
+{
+	struct cookie_header_entry *entry;
+	CFStringRef header;
+
+	header = NULL;
+	*found = false;
+
+	entry = &cookie_header_cache[pathHash & (COOKIE_HEADER_CACHE_SIZE - 1)];
+	if ((entry->path != NULL) && (entry->generation == cookie_generation) &&
+		(strcmp(entry->path, cpath) == 0)) {
+		if (entry->header != NULL) {
+			header = CFRetain(entry->header);
+		}
+		*found = true;
+	}
+
+	return (header);
+}
+
+// Caches the Cookie header composed for cpath (NULL if no cookies apply),
+// replacing whatever path last hashed to the same slot.
+// Must be called with cookie_lock held.
+void cache_cookie_header(const char *cpath, uint32_t pathHash, CFStringRef header)
+{
+	struct cookie_header_entry *entry;
+	char *pathCopy;
+	CFStringRef headerCopy;
+
+	headerCopy = NULL;
+	if (header != NULL) {
+		headerCopy = CFStringCreateCopy(kCFAllocatorDefault, header);
+		if (headerCopy == NULL) {
+			return;
+		}
+	}
+
+	pathCopy = strdup(cpath);
+	if (pathCopy == NULL) {
+		if (headerCopy != NULL)
+			CFRelease(headerCopy);
+		return;
+	}
+
+	entry = &cookie_header_cache[pathHash & (COOKIE_HEADER_CACHE_SIZE - 1)];
+	if (entry->path != NULL)
+		free(entry->path);
+	if (entry->header != NULL)
+		CFRelease(entry->header);
+
+	entry->path = pathCopy;
+	entry->header = headerCopy;
+	entry->generation = cookie_generation;
+}
+
+// Empties the Cookie header cache. Must be called with cookie_lock held.
+void flush_cookie_header_cache(void)
+{
+	struct cookie_header_entry *entry;
+	int i;
+
+	for (i = 0; i < COOKIE_HEADER_CACHE_SIZE; i++) {
+		entry = &cookie_header_cache[i];
+		if (entry->path != NULL) {
+			free(entry->path);
+			entry->path = NULL;
+		}
+		if (entry->header != NULL) {
+			CFRelease(entry->header);
+			entry->header = NULL;
+		}
+	}
+}
+
 void purge_expired_cookies(void)
 {
 	WEBDAV_COOKIE *aCookie, *nextCookie;
@@ -413,6 +531,8 @@ void purge_expired_cookies(void)
 
 void add_cookie(WEBDAV_COOKIE *newCookie)
 {
+	newCookie->cookie_hash = cookie_identity_hash(newCookie);
+
 	// Remove any matching cookie
 	lock_cookies();
 	removeMatchingCookie(newCookie);
@@ -444,6 +564,9 @@ out:
 
 void list_remove_cookie(WEBDAV_COOKIE *aCookie)
 {
+	// cached Cookie headers may include this cookie
+	cookie_generation++;
+
 	if (aCookie->prev == NULL) {
 		// head position
 		cookie_head = aCookie->next;
@@ -502,6 +625,7 @@ void list_insert_cookie(WEBDAV_COOKIE *newCookie)
 	}
 
 	cookie_count++;
+	cookie_generation++;
 
 	return;
 }
@@ -532,19 +656,27 @@ WEBDAV_COOKIE *dequeueCookie(void)
 	if (cookie_count)
 		cookie_count--;
 out:
+	if (aCookie != NULL)
+		cookie_generation++;
 	return (aCookie);
 }
 
 WEBDAV_COOKIE *find_cookie(WEBDAV_COOKIE *aCookie)
 {
 	WEBDAV_COOKIE *someCookie, *matchCookie;
+	uint32_t hash;
 
 	matchCookie = NULL;
 
+	// aCookie may be freshly parsed (an expired Set-Cookie deleting a stored one), so hash it here
+	hash = cookie_identity_hash(aCookie);
+
 	someCookie = cookie_head;
 
 	while (someCookie != NULL) {
-		if (cookies_match(aCookie, someCookie) == true) {
+		// the hash rules out most cookies without comparing strings
+		if ((someCookie->cookie_hash == hash) &&
+			(cookies_match(aCookie, someCookie) == true)) {
 			matchCookie = someCookie;
 			break;
 		}
@@ -576,7 +708,7 @@ boolean_t cookies_match(WEBDAV_COOKIE *cookie1, WEBDAV_COOKIE *cookie2)
 		goto out;
 	}
 
-	if(strncmp(cookie1->cookie_name_str, cookie1->cookie_name_str, len1) != 0) {
+	if(strncmp(cookie1->cookie_name_str, cookie2->cookie_name_str, len1) != 0) {
 		goto out;
 	}
 
@@ -633,6 +765,28 @@ out:
 	return (matched);
 }
 
+// FNV-1a of str, continuing from hash
+uint32_t cookie_hash_str(uint32_t hash, const char *str)
+{
+	if (str != NULL) {
+		while (*str != '\0') {
+			hash = (hash ^ (unsigned char)*str++) * 16777619U;
+		}
+	}
+	return (hash);
+}
+
+// Hash of the fields cookies_match() compares, so equal cookies hash equally
+uint32_t cookie_identity_hash(WEBDAV_COOKIE *aCookie)
+{
+	uint32_t hash;
+
+	hash = cookie_hash_str(2166136261U, aCookie->cookie_name_str);
+	hash = cookie_hash_str(hash ^ '\n', aCookie->cookie_path_str);
+	hash = cookie_hash_str(hash ^ '\n', aCookie->cookie_domain_str);
+	return (hash);
+}
+
 boolean_t checkCookieExpired(WEBDAV_COOKIE *aCookie)
 {
 	boolean_t hasExpired;
@@ -1596,6 +1750,8 @@ void cookies_init(void)
 	cookie_head = NULL;
 	cookie_tail = NULL;
 	cookie_count = 0;
+	cookie_generation = 0;
+	bzero(cookie_header_cache, sizeof(cookie_header_cache));
 }
 
 // Returns TRUE if path2 is enclosed in path1.
@@ -1725,6 +1881,7 @@ void reset_cookies(struct webdav_request_cookies *req)
 		num++;
 		aCookie = nextCookie;
 	}
+	flush_cookie_header_cache();
 	unlock_cookies();
 
 	syslog(LOG_ERR, "%s: Removed %u cookies\n", __FUNCTION__, num);
@@ -50,6 +50,9 @@ typedef struct cookie_type
     
     boolean_t   cookie_secure;
     boolean_t   cookie_httponly;
+
+	// Hash of name, path and domain, compared before cookies_match()
+	uint32_t	cookie_hash;
 	
 	struct cookie_type *next, *prev;
 } WEBDAV_COOKIE;
@@ -38,8 +38,10 @@
 
 #include "webdav_cache.h"
 #include "webdav_network.h"
+#include "webdav_requestqueue.h"
 #include "OpaqueIDs.h"
 #include "LogMessage.h"
+#include "webdav_stats.h"
 
 /*****************************************************************************/
 // The maximum size of an upload or download to allow the
@@ -62,6 +64,7 @@ static int webdav_cachefile;	/* file descriptor for an empty, unlinked cache fil
 static int get_cachefile(int *fd);
 static void save_cachefile(int fd);
 static int associate_cachefile(int ref, int fd);
+static int empty_directory(uid_t uid, struct node_entry *node);
 
 /*****************************************************************************/
 
@@ -190,6 +193,9 @@ static int associate_cachefile(int ref, int fd)
 	int error = 0;
 	int mib[5];
 	
+	/* no kext (filesystem_init was passed -1 by tools/webdav_bench) -- nothing to associate with */
+	require_quiet(g_vfc_typenum >= 0, no_kext);
+	
 	/* setup mib for the request */
 	mib[0] = CTL_VFS;
 	mib[1] = g_vfc_typenum;
@@ -200,6 +206,7 @@ static int associate_cachefile(int ref, int fd)
 	require_noerr_action(sysctl(mib, 5, NULL, NULL, NULL, 0), sysctl, error = errno);
 
 sysctl:
+no_kext:
 
 	return ( error );
 }
@@ -243,6 +250,7 @@ int filesystem_open(struct webdav_request_open *request_open,
 	char *locktoken;
 	
 	reply_open->pid = 0;
+	reply_open->writeseq = FALSE;
 	
 	locktoken = NULL;
 	
@@ -278,7 +286,12 @@ int filesystem_open(struct webdav_request_open *request_open,
 		
 		write_mode = ((request_open->flags & O_ACCMODE) != O_RDONLY);
 		
-		if ( write_mode )
+		if ( write_mode && gLocklessOpens )
+		{
+			/* no LOCK -- the PUTs are conditional on the entity tag the file has once it's open instead */
+			stats_increment(WEBDAV_STATS_LOCKLESS_OPEN);
+		}
+		else if ( write_mode )
 		{
 			/* If we are opening this file for write access, lock it first,
 			  before we copy it into the cache file from the server, 
@@ -317,14 +330,79 @@ int filesystem_open(struct webdav_request_open *request_open,
 				}
 			}
 		}
+		
+		/*
+		 * Without a LOCK, remember which version of the file this open is
+		 * replacing so its PUTs can be made conditional on it. An open that
+		 * kept the cache file is replacing the version the cache file holds;
+		 * a truncating open is replacing whatever the server has now. Weak
+		 * entity tags can't be used with If-Match, so if there's no strong
+		 * one, the file is LOCKed after all.
+		 */
+		if ( !error && write_mode && gLocklessOpens && (node->file_open_etag == NULL) && (node->file_locktoken == NULL) )
+		{
+			char *entity_tag;
+			
+			if ( !(request_open->flags & O_TRUNC) &&
+				 (node->file_entity_tag != NULL) && (strncmp(node->file_entity_tag, "W/", 2) != 0) )
+			{
+				entity_tag = strdup(node->file_entity_tag);
+				require_action(entity_tag != NULL, strdup, error = ENOMEM);
+			}
+			else
+			{
+				error = network_get_entity_tag(request_open->pcr.pcr_uid, node, &entity_tag);
+				if ( (error == ENOENT) && (request_open->flags & O_TRUNC) )
+				{
+					/* the server doesn't have it, so the PUT may only create it (If-None-Match: *) */
+					entity_tag = strdup("*");
+					require_action(entity_tag != NULL, strdup, error = ENOMEM);
+					error = 0;
+				}
+				else if ( !error && (entity_tag != NULL) && (strncmp(entity_tag, "W/", 2) == 0) )
+				{
+					free(entity_tag);
+					entity_tag = NULL;
+				}
+			}
+			
+			if ( !error && (entity_tag != NULL) )
+			{
+				node->file_open_etag = entity_tag;
+			}
+			else if ( error != ENOENT )
+			{
+				/* nothing to make the PUTs conditional on, so don't PUT unconditionally -- LOCK */
+				stats_increment(WEBDAV_STATS_LOCKLESS_LOCKED);
+				error = network_lock(request_open->pcr.pcr_uid, FALSE, node);
+			}
+			if ( error == ENOENT )
+			{
+				/* the server says it's gone so delete it and its descendants */
+				(void) nodecache_delete_node(node, TRUE);
+				error = ESTALE;
+				goto bad_obj_id;
+			}
+		}
 	}
 	else
 	{
 		/* it's a directory */
 		
-		error = nodecache_add_file_cache(node, theCacheFile);
-		require_noerr_action_quiet(error, nodecache_add_file_cache, save_cachefile(theCacheFile));
-		/* If we get an error beyond this point we need to call nodecache_remove_file_cache() */
+		if ( NODE_FILE_IS_CACHED(node) )
+		{
+			/* save the cache file we didn't need -- the old one may still hold a valid listing */
+			save_cachefile(theCacheFile);
+			
+			/* mark the old cache file active again */
+			node->file_inactive_time = 0;
+		}
+		else
+		{
+			error = nodecache_add_file_cache(node, theCacheFile);
+			require_noerr_action_quiet(error, nodecache_add_file_cache, save_cachefile(theCacheFile));
+			/* If we get an error beyond this point we need to call nodecache_remove_file_cache() */
+		}
 		
 		/* Directory opens are always done in the foreground so set the
 		 * download status to done
@@ -345,7 +423,26 @@ int filesystem_open(struct webdav_request_open *request_open,
 			error = errno;
 		}
 	}
+	
+	if ( !error && (node->node_type == WEBDAV_FILE_TYPE) &&
+		 ((request_open->flags & O_ACCMODE) != O_RDONLY) && network_streamed_uploads() &&
+		 ((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_FINISHED) )
+	{
+		struct stat cache_stat;
+		
+		/*
+		 * A new or truncated file can be sent to the server as it's written,
+		 * so writers that produce a file progressively don't have to wait for
+		 * close to upload all of it. The kernel falls back to a PUT at close
+		 * if the file isn't written from start to end.
+		 */
+		if ( (fstat(node->file_fd, &cache_stat) == 0) && (cache_stat.st_size == 0) )
+		{
+			reply_open->writeseq = TRUE;
+		}
+	}
 
+strdup:
 fchflags:
 ftruncate:
 
@@ -394,17 +491,41 @@ int filesystem_close(struct webdav_request_close *request_close)
 
 	/* set the file_inactive_time  */
 	time(&node->file_inactive_time);
+	
+	/* the next open for writing without a LOCK captures the entity tag again */
+	if ( node->file_open_etag != NULL )
+	{
+		free(node->file_open_etag);
+		node->file_open_etag = NULL;
+	}
 
 	/* if file was written sequentially, clean up the context that's hanging around */
 	if ( node->put_ctx != NULL ) {
 		error = cleanup_seq_write(node->put_ctx);
 		free (node->put_ctx);
 		node->put_ctx = NULL;
+		
+		if ( (error == ENOTSUP) && !NODE_IS_DELETED(node) ) {
+			off_t file_length;
+			time_t file_last_modified;
+			
+			/* the server wouldn't take the streamed body, but the cache file has all of it */
+			stats_increment(WEBDAV_STATS_STREAMED_UPLOAD_FALLBACK);
+			error = network_fsync(request_close->pcr.pcr_uid, node, &file_length, &file_last_modified);
+			(void)nodecache_remove_attributes(node);
+		}
 	}
 	
 	
 	lock_node_cache();
 	locked = true;
+	while ( node->file_lock_refreshing )
+	{
+		/* wait for an in-flight LOCK refresh so it can't hand back a token after the UNLOCK */
+		unlock_node_cache();
+		usleep(10000);	/* 10 milliseconds */
+		lock_node_cache();
+	}
 	/* if the file was locked, unlock it and if it is deleted and locked (which should not happen), leave it locked and let the lock expire */
 	if ( node->file_locktoken && !NODE_IS_DELETED(node) )
 	{
@@ -427,9 +548,9 @@ int filesystem_close(struct webdav_request_close *request_close)
 
 	/*
 	 * If something went wrong with this file, it was deleted, or it is
-	 * a directory, then remove it from the file cache.
+	 * a directory whose listing can't be reused, then remove it from the file cache.
 	 */
-	if ( error ||  NODE_IS_DELETED(node) || (node->node_type == WEBDAV_DIR_TYPE) )
+	if ( error ||  NODE_IS_DELETED(node) || ((node->node_type == WEBDAV_DIR_TYPE) && (gDirListingTimeout == 0)) )
 	{
 		(void)nodecache_remove_file_cache(node);
 	}
@@ -442,38 +563,79 @@ bad_obj_id:
 
 /*****************************************************************************/
 
-int filesystem_lookup(struct webdav_request_lookup *request_lookup, struct webdav_reply_lookup *reply_lookup)
+/*
+ * queue_prefetch has a request thread fetch the attributes of all of
+ * dir_node's children with one Depth 1 PROPFIND, so the lookups and getattrs
+ * that follow can be answered from the node cache. The request that noticed
+ * the misses doesn't wait for it -- in a big directory, that could take longer
+ * than the lookups it saves.
+ */
+static void queue_prefetch(
+	uid_t uid,						/* -> uid of the user making the request */
+	struct node_entry *dir_node)	/* -> directory to prefetch */
+{
+	if ( requestqueue_enqueue_prefetch(uid, dir_node->nodeid) != 0 )
+	{
+		nodecache_prefetch_done(dir_node);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * filesystem_prefetch_directory handles a prefetch request queued by
+ * queue_prefetch.
+ */
+void filesystem_prefetch_directory(uid_t uid, opaque_id dir_id)
 {
 	int error;
 	struct node_entry *node;
-	struct node_entry *parent_node;
-	struct webdav_stat_attr statbuf;
-	int lookup;
-	CFStringRef name_string;
 	
-	node = NULL;
-
-	// First make sure the name being looked up is valid UTF-8
-	if ( request_lookup->name != NULL && request_lookup->name_length != 0)
+	/* give up quietly if the directory went away or the server can't be reached */
+	error = RetrieveDataFromOpaqueID(dir_id, (void **)&node);
+	require_noerr_quiet(error, bad_obj_id);
+	
+	if ( !NODE_IS_DELETED(node) && (get_connectionstate() == WEBDAV_CONNECTION_UP) )
 	{
-		name_string = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)request_lookup->name,
-												request_lookup->name_length,
-												kCFStringEncodingUTF8, false);
-		require_action(name_string != NULL, out, error = EINVAL);
-		CFRelease(name_string);
+		(void) network_prefetch(uid, node);
 	}
 	
-	error = RetrieveDataFromOpaqueID(request_lookup->dir_id, (void **)&parent_node);
-	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
+	nodecache_prefetch_done(node);
+
+bad_obj_id:
+
+	return;
+}
+
+/*****************************************************************************/
+
+/*
+ * lookup_node finds name in parent_node, from the node cache when its
+ * attributes are still valid and from the server otherwise.
+ */
+static int lookup_node(
+	uid_t uid,						/* -> uid of the user making the request */
+	struct node_entry *parent_node,	/* -> directory to search */
+	char *name,						/* -> name to find (not NULL terminated) */
+	size_t name_length,				/* -> length of name */
+	int force_lookup,				/* -> if TRUE, don't use a cached lookup */
+	struct node_entry **node_out)	/* <- the node found */
+{
+	int error;
+	struct node_entry *node;
+	struct webdav_stat_attr statbuf;
+	int lookup;
 	
-	if ( request_lookup->force_lookup )
+	node = NULL;
+	
+	if ( force_lookup )
 	{
 		lookup = TRUE;
 	}
 	else
 	{
 		/* see if we already have a node */
-		error = nodecache_get_node(parent_node, request_lookup->name_length, request_lookup->name, FALSE, FALSE, 0, &node);
+		error = nodecache_get_node(parent_node, name_length, name, FALSE, FALSE, 0, &node);
 		if ( error )
 		{
 			/* no node, ask the server */
@@ -482,26 +644,32 @@ int filesystem_lookup(struct webdav_request_lookup *request_lookup, struct webda
 		else
 		{
 			/* can we used the cached node? */
-			lookup = !node_attributes_valid(node, request_lookup->pcr.pcr_uid);
+			lookup = !node_attributes_valid(node, uid);
+		}
+		
+		/* if lots of this directory's children are missing the cache, get the rest of them all at once */
+		if ( lookup && nodecache_note_attributes_miss(parent_node) )
+		{
+			queue_prefetch(uid, parent_node);
 		}
 	}
 	
+	error = 0;
 	if ( lookup )
 	{
 		/* look it up on the server */
-		error = network_lookup(request_lookup->pcr.pcr_uid, parent_node,
-			request_lookup->name, request_lookup->name_length, &statbuf);
+		error = network_lookup(uid, parent_node, name, name_length, &statbuf);
 		if ( !error )
 		{
 			/* create a new node */
-			error = nodecache_get_node(parent_node, request_lookup->name_length, request_lookup->name, TRUE, FALSE,
+			error = nodecache_get_node(parent_node, name_length, name, TRUE, FALSE,
 				S_ISREG(statbuf.attr_stat.st_mode) ? WEBDAV_FILE_TYPE : WEBDAV_DIR_TYPE, &node);
 			if ( !error )
 			{
 				/* network_lookup gets all of the struct stat fields except for st_ino so fill it in here with the fileid of the new node */
 				statbuf.attr_stat.st_ino = node->fileid;
 				/* cache the attributes */
-				error = nodecache_add_attributes(node, request_lookup->pcr.pcr_uid, &statbuf, NULL);
+				error = nodecache_add_attributes(node, uid, &statbuf, NULL);
 			}
 		}
 		else if ( (error == ENOENT) && (node != NULL) )
@@ -511,33 +679,147 @@ int filesystem_lookup(struct webdav_request_lookup *request_lookup, struct webda
 			node = NULL;
 		}
 	}
-	else if ( node == NULL )
-	{
-		/* we recently created/read the parent directory so assume the object doesn't exist */
-		error = ENOENT;
-	}
 	/* else use the cache node */
+	
+	*node_out = node;
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* fills in a lookup reply from a node whose attributes are cached */
+static void fill_reply_lookup(
+	struct node_entry *node,					/* -> the node found */
+	struct webdav_reply_lookup *reply_lookup)	/* <- the reply */
+{
+	reply_lookup->obj_id = node->nodeid;
+	reply_lookup->obj_fileid = node->fileid;
+	reply_lookup->obj_type = node->node_type;
+	
+	reply_lookup->obj_atime.tv_sec = node->attr_stat_info.attr_stat.st_atimespec.tv_sec;
+	reply_lookup->obj_atime.tv_nsec = node->attr_stat_info.attr_stat.st_atimespec.tv_nsec;
+	
+	reply_lookup->obj_mtime.tv_sec = node->attr_stat_info.attr_stat.st_mtimespec.tv_sec;
+	reply_lookup->obj_mtime.tv_nsec = node->attr_stat_info.attr_stat.st_mtimespec.tv_nsec;
+	
+	reply_lookup->obj_ctime.tv_sec = node->attr_stat_info.attr_stat.st_ctimespec.tv_sec;
+	reply_lookup->obj_ctime.tv_nsec = node->attr_stat_info.attr_stat.st_ctimespec.tv_nsec;
+	
+	reply_lookup->obj_createtime.tv_sec = node->attr_stat_info.attr_create_time.tv_sec;
+	reply_lookup->obj_createtime.tv_nsec = node->attr_stat_info.attr_create_time.tv_nsec;
+	
+	reply_lookup->obj_filesize = node->attr_stat_info.attr_stat.st_size;
+}
+
+/*****************************************************************************/
 
+int filesystem_lookup(struct webdav_request_lookup *request_lookup, struct webdav_reply_lookup *reply_lookup)
+{
+	int error;
+	struct node_entry *node;
+	struct node_entry *parent_node;
+	CFStringRef name_string;
+	
+	// First make sure the name being looked up is valid UTF-8
+	if ( request_lookup->name != NULL && request_lookup->name_length != 0)
+	{
+		name_string = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)request_lookup->name,
+												request_lookup->name_length,
+												kCFStringEncodingUTF8, false);
+		require_action(name_string != NULL, out, error = EINVAL);
+		CFRelease(name_string);
+	}
+	
+	error = RetrieveDataFromOpaqueID(request_lookup->dir_id, (void **)&parent_node);
+	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
+	
+	error = lookup_node(request_lookup->pcr.pcr_uid, parent_node, request_lookup->name, request_lookup->name_length,
+		request_lookup->force_lookup, &node);
 	if ( !error )
 	{
 		/* we have the attributes cached */
-		reply_lookup->obj_id = node->nodeid;
-		reply_lookup->obj_fileid = node->fileid;
-		reply_lookup->obj_type = node->node_type;
-		
-		reply_lookup->obj_atime.tv_sec = node->attr_stat_info.attr_stat.st_atimespec.tv_sec;
-		reply_lookup->obj_atime.tv_nsec = node->attr_stat_info.attr_stat.st_atimespec.tv_nsec;
+		fill_reply_lookup(node, reply_lookup);
+	}
+
+bad_obj_id:
+out:	
+	return (error);
+}
+
+/*****************************************************************************/
+
+/*
+ * filesystem_lookup_path resolves several components of a path in one
+ * request from the kernel. Each component is found the same way
+ * filesystem_lookup finds it. The lookup stops at the first component that
+ * can't be found, or at a file; the components resolved before that are
+ * returned and the kernel looks up the rest one at a time, so only a failure
+ * on the first component is an error.
+ */
+int filesystem_lookup_path(struct webdav_request_lookup_path *request_lookup_path,
+		struct webdav_reply_lookup_path *reply_lookup_path)
+{
+	int error;
+	struct node_entry *node;
+	struct node_entry *parent_node;
+	CFStringRef path_string;
+	char *name;
+	char *path_end;
+	size_t name_length;
+	
+	require_action(request_lookup_path->path_length != 0, out, error = EINVAL);
+	
+	// First make sure the path being looked up is valid UTF-8
+	path_string = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)request_lookup_path->path,
+											request_lookup_path->path_length,
+											kCFStringEncodingUTF8, false);
+	require_action(path_string != NULL, out, error = EINVAL);
+	CFRelease(path_string);
+	
+	error = RetrieveDataFromOpaqueID(request_lookup_path->dir_id, (void **)&parent_node);
+	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
+	
+	reply_lookup_path->count = 0;
+	name = request_lookup_path->path;
+	path_end = request_lookup_path->path + request_lookup_path->path_length;
+	while ( (name < path_end) && (reply_lookup_path->count < WEBDAV_LOOKUP_PATH_MAX_COMPONENTS) )
+	{
+		name_length = 0;
+		while ( ((name + name_length) < path_end) && (name[name_length] != '/') )
+		{
+			++name_length;
+		}
+		if ( name_length == 0 )
+		{
+			/* the kernel never sends empty components */
+			error = EINVAL;
+			break;
+		}
 		
-		reply_lookup->obj_mtime.tv_sec = node->attr_stat_info.attr_stat.st_mtimespec.tv_sec;
-		reply_lookup->obj_mtime.tv_nsec = node->attr_stat_info.attr_stat.st_mtimespec.tv_nsec;
+		error = lookup_node(request_lookup_path->pcr.pcr_uid, parent_node, name, name_length, FALSE, &node);
+		if ( error )
+		{
+			break;
+		}
 		
-		reply_lookup->obj_ctime.tv_sec = node->attr_stat_info.attr_stat.st_ctimespec.tv_sec;
-		reply_lookup->obj_ctime.tv_nsec = node->attr_stat_info.attr_stat.st_ctimespec.tv_nsec;
+		fill_reply_lookup(node, &reply_lookup_path->components[reply_lookup_path->count]);
+		++reply_lookup_path->count;
 		
-		reply_lookup->obj_createtime.tv_sec = node->attr_stat_info.attr_create_time.tv_sec;
-		reply_lookup->obj_createtime.tv_nsec = node->attr_stat_info.attr_create_time.tv_nsec;
+		if ( node->node_type != WEBDAV_DIR_TYPE )
+		{
+			/* nothing can be below a file */
+			break;
+		}
 		
-		reply_lookup->obj_filesize = node->attr_stat_info.attr_stat.st_size;
+		parent_node = node;
+		name += name_length + 1;
+	}
+	
+	if ( reply_lookup_path->count != 0 )
+	{
+		/* the kernel looks up whatever is left on its own */
+		error = 0;
 	}
 
 bad_obj_id:
@@ -562,6 +844,12 @@ int filesystem_getattr(struct webdav_request_getattr *request_getattr, struct we
 	/* see if we have valid attributes */
 	if ( !node_attributes_valid(node, request_getattr->pcr.pcr_uid) )
 	{
+		/* if lots of the parent directory's children are missing the cache, get the rest of them all at once */
+		if ( (node->parent != NULL) && nodecache_note_attributes_miss(node->parent) )
+		{
+			queue_prefetch(request_getattr->pcr.pcr_uid, node->parent);
+		}
+		
 		/* no... look it up on the server */
 		error = network_getattr( request_getattr->pcr.pcr_uid, node, &statbuf);
 		if ( !error )
@@ -605,6 +893,9 @@ int filesystem_getattr(struct webdav_request_getattr *request_getattr, struct we
 		wstat->st_blksize = node->attr_stat_info.attr_stat.st_blksize;
 		wstat->st_flags = node->attr_stat_info.attr_stat.st_flags;
 		wstat->st_gen = node->attr_stat_info.attr_stat.st_gen;
+		
+		/* let the kernel answer getattr itself while these are good */
+		reply_getattr->attr_timeout = node_attributes_kernel_timeout(node);
 	}
 	
 deleted_node:
@@ -893,16 +1184,63 @@ int filesystem_read(struct webdav_request_read *request_read, char **a_byte_addr
 {
 	int error;
 	struct node_entry *node;
+	size_t count;
+	size_t window;
+	char *data;
+	size_t data_count;
+	
+	*a_byte_addr = NULL;
+	*a_size = 0;
 	
 	error = RetrieveDataFromOpaqueID(request_read->obj_id, (void **)&node);
 	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
 
 	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
 
-	// Note: request_read->count has already been checked for overflow
+	require_action(request_read->count <= WEBDAV_MAX_IO_BUFFER_SIZE, bad_count, error = EINVAL);
+	count = (size_t)request_read->count;
+	
+	/* let the open path learn how much of this kind of file is read first */
+	network_note_read_offset(node, request_read->offset, count);
+	
+	/* answer the read from what the last out-of-band read kept if we can */
+	error = nodecache_get_read_ahead(node, request_read->pcr.pcr_uid,
+		request_read->offset, count, a_byte_addr, a_size, &window);
+	if ( error == 0 )
+	{
+		stats_increment(WEBDAV_STATS_READ_AHEAD_HIT);
+		goto done;
+	}
+	require_quiet(error == ENOENT, get_read_ahead);
+	
+	/* ask for the whole window and keep what wasn't asked for */
 	error = network_read(request_read->pcr.pcr_uid, node,
-		request_read->offset, (size_t)request_read->count, a_byte_addr, a_size);
+		request_read->offset, MAX(count, window), &data, &data_count);
+	require_noerr_quiet(error, network_read);
+	
+	if ( data_count > count )
+	{
+		*a_byte_addr = malloc(count);
+		require_action(*a_byte_addr != NULL, malloc_byte_addr, free(data); error = ENOMEM);
+		
+		memcpy(*a_byte_addr, data, count);
+		*a_size = count;
+		
+		/* the node cache owns data now */
+		nodecache_set_read_ahead(node, request_read->pcr.pcr_uid, request_read->offset, data, data_count);
+	}
+	else
+	{
+		/* the server had no more than was asked for */
+		*a_byte_addr = data;
+		*a_size = data_count;
+	}
 
+malloc_byte_addr:
+network_read:
+get_read_ahead:
+done:
+bad_count:
 deleted_node:
 bad_obj_id:
 
@@ -958,6 +1296,16 @@ int filesystem_rename(struct webdav_request_rename *request_rename)
 	{
 		error = network_rename(request_rename->pcr.pcr_uid, f_node, t_node,
 			parent_node, request_rename->to_name, request_rename->to_name_length, &rename_date);
+		if ( (error == ENOTEMPTY) && gTreeDeletes )
+		{
+			/* the directory being moved over isn't empty -- empty it and try again */
+			error = empty_directory(request_rename->pcr.pcr_uid, t_node);
+			if ( !error )
+			{
+				error = network_rename(request_rename->pcr.pcr_uid, f_node, t_node,
+					parent_node, request_rename->to_name, request_rename->to_name_length, &rename_date);
+			}
+		}
 		if ( !error )
 		{
 			/*
@@ -1034,7 +1382,7 @@ int filesystem_remove(struct webdav_request_remove *request_remove)
 
 	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
 	
-	error = network_remove(request_remove->pcr.pcr_uid, node, &remove_date);
+	error = network_remove(request_remove->pcr.pcr_uid, node, &remove_date, NULL);
 	
 	/*
 	 *  When connected to an Mac OS X Server, I can delete the main file (ie blah.dmg), but when I try
@@ -1095,6 +1443,15 @@ int filesystem_rmdir(struct webdav_request_rmdir *request_rmdir)
 	 * we need to get rid of the directory node and any of its children nodes.
 	 */
 	error = network_rmdir(request_rmdir->pcr.pcr_uid, node, &remove_date);
+	if ( (error == ENOTEMPTY) && gTreeDeletes )
+	{
+		/* empty the directory and try again */
+		error = empty_directory(request_rmdir->pcr.pcr_uid, node);
+		if ( !error )
+		{
+			error = network_rmdir(request_rmdir->pcr.pcr_uid, node, &remove_date);
+		}
+	}
 	if ( !error )
 	{
 		/*
@@ -1149,6 +1506,15 @@ int filesystem_fsync(struct webdav_request_fsync *request_fsync)
 	
 	/* The kernel should not send us an fsync until the file is downloaded */
 	require_action((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_FINISHED, still_downloading, error = EIO);
+	
+	/* The kernel gave up streaming this file (see filesystem_open) -- this PUT replaces that one */
+	if ( node->put_ctx != NULL )
+	{
+		stats_increment(WEBDAV_STATS_STREAMED_UPLOAD_FALLBACK);
+		(void) cancel_seq_write(node->put_ctx);
+		free(node->put_ctx);
+		node->put_ctx = NULL;
+	}
 
 	error = network_fsync(request_fsync->pcr.pcr_uid, node, &file_length, &file_last_modified);
 	
@@ -1204,19 +1570,17 @@ bad_obj_id:
 
 // This function sends a write request to the write manager.  
 // When the request offset is zero, this function also intializes the sequential write engine.
+// With a gWriteSeqWindow, it returns as soon as the range is queued and only waits
+// when the window is full; an error sending the range fails a later write or the close.
 //
 int filesystem_write_seq(struct webdav_request_writeseq *request_sq_wr)
 {
 	int error;
-	ssize_t bytesRead; 
-	// size_t totalBytesRead;
-	off_t totalBytesRead;
-	off_t nbytes;
 	struct node_entry *node;
 	struct stream_put_ctx *ctx = NULL;
 	struct seqwrite_mgr_req *mgr_req;
 	struct timespec timeout;
-	pthread_mutexattr_t mutexattr;
+	CFIndex lastWritten;
 	
 	mgr_req = NULL;
 	error = 0;
@@ -1234,6 +1598,12 @@ int filesystem_write_seq(struct webdav_request_writeseq *request_sq_wr)
 	if ( request_sq_wr->offset == 0 ) {
 		error = setup_seq_write(request_sq_wr->pcr.pcr_uid, node, request_sq_wr->file_len);
 		
+		/* counted here rather than at open -- the kernel may never send a WRITESEQ for the file */
+		if ( !error && !request_sq_wr->is_retry )
+		{
+			stats_increment(WEBDAV_STATS_STREAMED_UPLOAD);
+		}
+		
 		// If file is large, turn off data caching during the upload
 		if( request_sq_wr->file_len > webdavCacheMaximumSize)
 			fcntl(node->file_fd, F_NOCACHE, 1);
@@ -1251,35 +1621,30 @@ int filesystem_write_seq(struct webdav_request_writeseq *request_sq_wr)
 	// syslog(LOG_DEBUG, "%s: entered. offset %llu, count %lu\n", __FUNCTION__, request_sq_wr->offset, request_sq_wr->count);
 	
 	pthread_mutex_lock(&ctx->ctx_lock);
-	/* Set request data which is common across all requests for this call */
 	
-	mgr_req = (struct seqwrite_mgr_req *) malloc (sizeof(struct seqwrite_mgr_req));	
-	if (mgr_req == NULL) {
-		syslog(LOG_ERR, "%s: malloc of seqwrite_mgr_req failed", __FUNCTION__);
-		ctx->finalStatus = EIO;
-		ctx->finalStatusValid = true;
-		error = EIO;
+	// if the sequential write was cancelled, get outta dodge
+	if ( ctx->mgr_status == WR_MGR_DONE || ctx->finalStatusValid == true ) {
+		error = ctx->finalStatus;
 		pthread_mutex_unlock(&ctx->ctx_lock);
 		goto out1;
 	}
 	
-	bzero(mgr_req, sizeof(struct seqwrite_mgr_req));
-	mgr_req->refCount = 1;	// hold a reference until were done
-	mgr_req->req = request_sq_wr;
-	mgr_req->is_retry = request_sq_wr->is_retry;	
-	mgr_req->data = (unsigned char *)malloc(BODY_BUFFER_SIZE); /* 64K */
-	if ( mgr_req->data == NULL ) {
-		syslog(LOG_ERR, "%s: malloc of data buffer failed", __FUNCTION__);
-		ctx->finalStatus = EIO;
-		ctx->finalStatusValid = true;
-		error = EIO;
+	mgr_req = get_writemgr_request_locked(ctx, request_sq_wr->count);
+	if (mgr_req == NULL) {
+		if (ctx->finalStatusValid == false) {
+			syslog(LOG_ERR, "%s: timed out waiting for a seqwrite_mgr_req or window space", __FUNCTION__);
+			ctx->finalStatus = EIO;
+			ctx->finalStatusValid = true;
+		}
+		error = ctx->finalStatus;
 		pthread_mutex_unlock(&ctx->ctx_lock);
 		goto out1;
 	}
 	
-	error = pthread_mutexattr_init(&mutexattr);
-	if (error) {
-		syslog(LOG_ERR, "%s: init ctx mutexattr failed, error %d", __FUNCTION__, error);
+	if (node->file_fd == -1) 
+	{
+		/* cache file's no good, today just isn't our day */
+		syslog(LOG_ERR, "%s: cache file descriptor is -1, failed.", __FUNCTION__ );
 		ctx->finalStatus = EIO;
 		ctx->finalStatusValid = true;
 		error = EIO;
@@ -1287,130 +1652,66 @@ int filesystem_write_seq(struct webdav_request_writeseq *request_sq_wr)
 		goto out1;
 	}
 	
-	error = pthread_mutex_init(&mgr_req->req_lock, &mutexattr);
-	if (error) {
-		syslog(LOG_ERR, "%s: init ctx_lock failed, error %d", __FUNCTION__, error);
-		ctx->finalStatus = EIO;
-		ctx->finalStatusValid = true;
+	/*
+	 * The whole range goes to the manager as one chunk. The manager reads it
+	 * from the cache file a buffer at a time as the stream takes it.
+	 */
+	mgr_req->req = request_sq_wr;
+	mgr_req->is_retry = request_sq_wr->is_retry;
+	mgr_req->fd = node->file_fd;
+	mgr_req->offset = request_sq_wr->offset;
+	mgr_req->chunkLen = (CFIndex)request_sq_wr->count;
+	mgr_req->async = (gWriteSeqWindow != 0);
+	
+	// queue request
+	if (queue_writemgr_request_locked(ctx, mgr_req) < 0) {
+		syslog(LOG_ERR, "%s: queue_writemgr_request_locked failed.", __FUNCTION__);
 		error = EIO;
+		ctx->finalStatus = error;
+		ctx->finalStatusValid = true;
 		pthread_mutex_unlock(&ctx->ctx_lock);
 		goto out1;
 	}
 	
-	error = pthread_cond_init(&mgr_req->req_condvar, NULL);
-	if (error) {
-		syslog(LOG_ERR, "%s: init ctx_condvar failed, error %d", __FUNCTION__, error);
-		ctx->finalStatus = EIO;
-		ctx->finalStatusValid = true;
-		error = EIO;
-		pthread_mutex_unlock(&ctx->ctx_lock);
+	pthread_mutex_unlock(&ctx->ctx_lock);
+	
+	if ( mgr_req->async ) {
+		// the manager owns the range now
 		goto out1;
 	}
 	
-	if (node->file_fd == -1) 
-	{
-		/* cache file's no good, today just isn't our day */
-		syslog(LOG_ERR, "%s: cache file descriptor is -1, failed.", __FUNCTION__ );
-		ctx->finalStatus = EIO;
-		ctx->finalStatusValid = true;
-		error = EIO;
-		pthread_mutex_unlock(&ctx->ctx_lock);
-		goto out1;
-	}
-	
-	// Seek to the start of this offset
-	if ( lseek(node->file_fd, request_sq_wr->offset, SEEK_SET) < 0) {
-			/* seek failed, dammit */
-			syslog(LOG_ERR, "%s: lseek errno %d, failed.", __FUNCTION__, errno);
-			ctx->finalStatus = EIO;
-			ctx->finalStatusValid = true;
-			error = EIO;
-			pthread_mutex_unlock(&ctx->ctx_lock);
-			goto out1;
+	timeout.tv_sec = time(NULL) + WEBDAV_WRITESEQ_REQUEST_TIMEOUT;
+	timeout.tv_nsec = 0;
+	lastWritten = 0;
+	
+	// now wait on condition var until mgr is done with this request
+	pthread_mutex_lock(&mgr_req->req_lock);
+	/* wait for request to finish */
+	while (mgr_req->request_done == false && ctx->finalStatusValid == false) {
+		error = pthread_cond_timedwait(&mgr_req->req_condvar, &mgr_req->req_lock, &timeout);	
+		if ( (error == ETIMEDOUT) && (mgr_req->chunkWritten != lastWritten) ) {
+			// the stream is still taking data, so give the rest of the range more time
+			lastWritten = mgr_req->chunkWritten;
+			timeout.tv_sec = time(NULL) + WEBDAV_WRITESEQ_REQUEST_TIMEOUT;
+			continue;
 		}
-
-	pthread_mutex_unlock(&ctx->ctx_lock);
-	
-	totalBytesRead = 0, bytesRead = 0;
-	/* Loop until everything's written or an error occurs */
-	while( 1 ) {
-		pthread_mutex_lock(&ctx->ctx_lock);
-		
-		// if the sequential write was cancelled, get outta dodge
-		if ( ctx->mgr_status == WR_MGR_DONE || ctx->finalStatusValid == true ) {
-			// sequential write was cancelled
-			// syslog(LOG_DEBUG, "%s: WRITESEQ: cancelled at top of loop mgr_status %d, finalStatusValid %d",
-			//	__FUNCTION__, ctx->mgr_status == WR_MGR_DONE, ctx->finalStatusValid);
-			error = ctx->finalStatus;
-			pthread_mutex_unlock(&ctx->ctx_lock);
-			goto out1;
-		}
-		
-		// If we're done reading, break
-		if ( totalBytesRead >= request_sq_wr->count ) {
-			pthread_mutex_unlock(&ctx->ctx_lock);
-			break;
-		}
-		
-		nbytes = MIN( request_sq_wr->count - totalBytesRead, BODY_BUFFER_SIZE );
-
-		bytesRead = read( node->file_fd, mgr_req->data, (size_t)nbytes );
-		
-		/* bytesRead < 0 we got an error */
-		if ( bytesRead < 0 ) {
-			syslog(LOG_ERR, "%s: read() cache file returned error %d, failed.", __FUNCTION__, errno);
-			error = errno;
-			ctx->finalStatus = error;
-			ctx->finalStatusValid = true;
-			pthread_mutex_unlock(&ctx->ctx_lock);
-			goto out1;
-		}
-		
-		mgr_req->type = SEQWRITE_CHUNK;
-		mgr_req->request_done = false;
-		mgr_req->chunkLen = bytesRead;
-		mgr_req->chunkWritten = false;
-		mgr_req->error = 0;
-		
-		// queue request
-		if (queue_writemgr_request_locked(ctx, mgr_req) < 0) {
-			syslog(LOG_ERR, "%s: queue_writemgr_request_locked failed.", __FUNCTION__);
-			error = EIO;
-			ctx->finalStatus = error;
-			ctx->finalStatusValid = true;
+		if ( error != 0 ) {
+			syslog(LOG_ERR, "%s: pthread_cond_timedwait returned error %d, failed.", __FUNCTION__, error);
+			pthread_mutex_lock(&ctx->ctx_lock);
+			if ( error == ETIMEDOUT ) {
+				ctx->finalStatus = ETIMEDOUT;
+				ctx->finalStatusValid = true;
+			} else {
+				ctx->finalStatus = EIO;
+				ctx->finalStatusValid = true;
+				error = EIO;
+			}
 			pthread_mutex_unlock(&ctx->ctx_lock);
+			pthread_mutex_unlock(&mgr_req->req_lock);
 			goto out1;
 		}
-		
-		pthread_mutex_unlock(&ctx->ctx_lock);
-		
-		timeout.tv_sec = time(NULL) + WEBDAV_WRITESEQ_REQUEST_TIMEOUT;
-		timeout.tv_nsec = 0;
-		
-		// now wait on condition var until mgr is done with this request
-		pthread_mutex_lock(&mgr_req->req_lock);
-		/* wait for request to finish */
-		while (mgr_req->request_done == false && ctx->finalStatusValid == false) {
-			error = pthread_cond_timedwait(&mgr_req->req_condvar, &mgr_req->req_lock, &timeout);	
-			if ( error != 0 ) {
-				syslog(LOG_ERR, "%s: pthread_cond_timedwait returned error %d, failed.", __FUNCTION__, error);
-				pthread_mutex_lock(&ctx->ctx_lock);
-				if ( error == ETIMEDOUT ) {
-					ctx->finalStatus = ETIMEDOUT;
-					ctx->finalStatusValid = true;
-				} else {
-					ctx->finalStatus = EIO;
-					ctx->finalStatusValid = true;
-					error = EIO;
-				}
-				pthread_mutex_unlock(&ctx->ctx_lock);
-				pthread_mutex_unlock(&mgr_req->req_lock);
-				goto out1;
-			}
-		}
-		pthread_mutex_unlock(&mgr_req->req_lock);
-		totalBytesRead += bytesRead;
-	}	
+	}
+	pthread_mutex_unlock(&mgr_req->req_lock);
 	
 	if (mgr_req->request_done == true) {
 		error = mgr_req->error;
@@ -1435,17 +1736,166 @@ out1:
 
 /*****************************************************************************/
 
-int filesystem_readdir(struct webdav_request_readdir *request_readdir)
+/*
+ * Returns TRUE if the directory listing in node's cache file can be used
+ * by uid without downloading it again. The listing must have been downloaded
+ * for uid (or root), and either it was validated less than
+ * gDirListingTimeout seconds ago, or it was downloaded less than
+ * DIR_LISTING_REVALIDATE_MAX seconds ago and the directory's getlastmodified
+ * hasn't changed since then. The time limit on the second case protects
+ * against servers that don't change a collection's getlastmodified when
+ * its members change.
+ */
+static int directory_listing_valid(uid_t uid, struct node_entry *node)
+{
+	struct webdav_stat_attr statbuf;
+	time_t current_time;
+	u_int32_t invalidations;
+	int result;
+	
+	result = FALSE;
+	
+	require_quiet(gDirListingTimeout != 0, no_listing_cache);
+	require_quiet(node->file_validated_time != 0, no_listing);
+	/* does this user or root have access to the cached listing? */
+	require_quiet((uid == node->file_listing_uid) || (0 == node->file_listing_uid), no_listing);
+	
+	current_time = time(NULL);
+	if ( current_time < (node->file_validated_time + (time_t)gDirListingTimeout) )
+	{
+		stats_increment(WEBDAV_STATS_DIR_LISTING_REUSED);
+		result = TRUE;
+	}
+	else if ( (node->file_last_modified != -1) &&
+			  (current_time < (node->file_listing_time + DIR_LISTING_REVALIDATE_MAX)) )
+	{
+		/* ask the server if the directory changed */
+		lock_node_cache();
+		invalidations = node->file_invalidations;
+		unlock_node_cache();
+		if ( network_getattr(uid, node, &statbuf) == 0 )
+		{
+			/* we got the attributes anyway, so cache them */
+			(void) nodecache_add_attributes(node, uid, &statbuf, NULL);
+			
+			/* the listing is only still good if nothing invalidated it while the server was asked */
+			lock_node_cache();
+			if ( (statbuf.attr_stat.st_mtimespec.tv_sec == node->file_last_modified) &&
+				 (node->file_invalidations == invalidations) )
+			{
+				node->file_validated_time = current_time;
+				result = TRUE;
+			}
+			unlock_node_cache();
+			if ( result )
+			{
+				stats_increment(WEBDAV_STATS_DIR_LISTING_REVALIDATED);
+			}
+		}
+	}
+
+no_listing:
+no_listing_cache:
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
+int filesystem_readdir(struct webdav_request_readdir *request_readdir, struct webdav_reply_readdir *reply_readdir)
 {
 	int error;
+	int downloaded;
+	u_int32_t invalidations;
 	struct node_entry *node;
 
 	error = RetrieveDataFromOpaqueID(request_readdir->obj_id, (void **)&node);
 	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
 
 	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
+	
+	downloaded = FALSE;
+	if ( directory_listing_valid(request_readdir->pcr.pcr_uid, node) )
+	{
+		/* the cache file already has the listing */
+		error = 0;
+	}
+	else
+	{
+		/* the cache file is about to be rewritten, so it's not valid until network_readdir succeeds */
+		lock_node_cache();
+		node->file_validated_time = 0;
+		invalidations = node->file_invalidations;
+		node->file_listing_in_progress = TRUE;
+		node->file_listing_thread = pthread_self();
+		unlock_node_cache();
+		node->dir_plus_written = FALSE;
+		
+		error = network_readdir(request_readdir->pcr.pcr_uid, request_readdir->cache, node);
 		
-	error = network_readdir(request_readdir->pcr.pcr_uid, request_readdir->cache, node);
+		lock_node_cache();
+		node->file_listing_in_progress = FALSE;
+		unlock_node_cache();
+		
+		if ( !error )
+		{
+			downloaded = TRUE;
+			lock_node_cache();
+			time(&node->file_listing_time);
+			node->file_listing_uid = request_readdir->pcr.pcr_uid;
+			/*
+			 * If something invalidated the listing while it was downloaded (a
+			 * child was added, moved or deleted), the download may not have it,
+			 * so the listing is used this once but not validated.
+			 */
+			if ( node->file_invalidations == invalidations )
+			{
+				node->file_validated_time = node->file_listing_time;
+			}
+			/* parse_opendir cached the directory's own attributes along with the listing */
+			node->file_last_modified = (node->attr_stat_info.attr_stat.st_mtimespec.tv_sec != 0) ?
+				node->attr_stat_info.attr_stat.st_mtimespec.tv_sec : -1;
+			unlock_node_cache();
+		}
+	}
+	
+	if ( !error )
+	{
+		/*
+		 * Hand the kernel every entry's attributes along with the listing
+		 * (readdir-plus). The records already in the cache file are reused
+		 * unless the listing was just downloaded, they were written for
+		 * another user (who may not be allowed to see this user's cached
+		 * attributes), or they're older than a listing may be reused for.
+		 */
+		if ( downloaded || !node->dir_plus_written ||
+			 (node->dir_plus_uid != request_readdir->pcr.pcr_uid) ||
+			 (time(NULL) >= (node->dir_plus_time + (time_t)gDirListingTimeout)) )
+		{
+			node->dir_plus_written = FALSE;
+			error = nodecache_write_directory_plus(node, request_readdir->pcr.pcr_uid, &node->dir_plus_dirent_size, &node->dir_plus_count);
+			if ( !error )
+			{
+				node->dir_plus_uid = request_readdir->pcr.pcr_uid;
+				time(&node->dir_plus_time);
+				node->dir_plus_written = TRUE;
+			}
+			else
+			{
+				/* the cache file was erased */
+				lock_node_cache();
+				node->file_validated_time = 0;
+				unlock_node_cache();
+			}
+		}
+		if ( !error )
+		{
+			reply_readdir->dirent_size = (uint64_t)node->dir_plus_dirent_size;
+			reply_readdir->dirattr_count = node->dir_plus_count;
+			reply_readdir->dirattr_uid = node->dir_plus_uid;
+			stats_add(WEBDAV_STATS_READDIR_PLUS_ENTRIES, reply_readdir->dirattr_count);
+		}
+	}
 
 deleted_node:
 bad_obj_id:
@@ -1477,6 +1927,51 @@ null_node:
 
 /*****************************************************************************/
 
+/*
+ * Refreshes an open file's LOCK on a request thread. pulse_thread queues a
+ * refresh when the lock is WEBDAV_LOCK_REFRESH_AGE seconds old; the node is
+ * looked up again because the file may have been closed since.
+ */
+void filesystem_refresh_lock(opaque_id node_id)
+{
+	int error;
+	struct node_entry *node;
+	time_t lag;
+	
+	error = RetrieveDataFromOpaqueID(node_id, (void **)&node);
+	require_noerr_quiet(error, bad_obj_id);
+	
+	if ( NODE_FILE_IS_OPEN(node) && !NODE_IS_DELETED(node) && (node->file_locktoken != NULL) )
+	{
+		/* how long past its refresh time the lock is, and whether it may already have expired on the server */
+		lag = time(NULL) - (node->file_lock_time + WEBDAV_LOCK_REFRESH_AGE);
+		if ( lag > 0 )
+		{
+			stats_add(WEBDAV_STATS_LOCK_REFRESH_LAG_SEC, lag);
+		}
+		if ( lag >= (time_t)(gtimeout_val - WEBDAV_LOCK_REFRESH_AGE) )
+		{
+			stats_increment(WEBDAV_STATS_LOCK_REFRESH_LATE);
+		}
+		stats_increment(WEBDAV_STATS_LOCK_REFRESH);
+		
+		error = filesystem_lock(node);
+		if ( error )
+		{
+			stats_increment(WEBDAV_STATS_LOCK_REFRESH_FAILED);
+		}
+	}
+	
+	/* let pulse_thread queue the next refresh */
+	node->file_lock_refresh_queued = FALSE;
+
+bad_obj_id:
+
+	return;
+}
+
+/*****************************************************************************/
+
 int filesystem_invalidate_caches(struct webdav_request_invalcaches *request_invalcaches)
 {
 	int error;
@@ -1493,3 +1988,413 @@ not_permitted:
 }
 
 /*****************************************************************************/
+
+/* TRUE once the server has refused a Depth infinity PROPFIND -- warm-ups walk the tree from then on */
+static int gDepthInfinityDenied = FALSE;
+
+int filesystem_warmup(struct webdav_request_warmup *request_warmup)
+{
+	int error;
+	struct node_entry *node;
+	
+	error = RetrieveDataFromOpaqueID(request_warmup->dir_id, (void **)&node);
+	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
+
+	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
+	require_action_quiet(node->node_type == WEBDAV_DIR_TYPE, not_directory, error = ENOTDIR);
+	
+	/* the warm-up runs on the request threads; the kernel doesn't wait for it */
+	error = requestqueue_enqueue_warmup(request_warmup->pcr.pcr_uid, node->nodeid, request_warmup->depth, TRUE);
+
+not_directory:
+deleted_node:
+bad_obj_id:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
+/*
+ * filesystem_warmup_directory handles one warm-up request from the request
+ * queue. The top of the subtree first tries to get everything with a single
+ * Depth infinity PROPFIND. Otherwise, the directory's children are fetched
+ * with a Depth 1 PROPFIND and a warm-up request is queued for each child
+ * directory; the request queue runs up to WEBDAV_WALK_THREADS of them at
+ * once, so the tree is crawled breadth first with bounded concurrency.
+ */
+void filesystem_warmup_directory(
+	uid_t uid,					/* -> uid of the user who asked for the warm-up */
+	opaque_id dir_id,			/* -> the directory to warm up */
+	u_int32_t depth,			/* -> levels below dir_id to warm up, or 0 for all */
+	int first)					/* -> TRUE if dir_id is the top of the subtree */
+{
+	int error;
+	int forbidden;
+	struct node_entry *node;
+	opaque_id *child_ids;
+	u_int32_t child_count;
+	u_int32_t index;
+	
+	forbidden = FALSE;
+	
+	/* give up quietly if the directory went away or the server can't be reached */
+	error = RetrieveDataFromOpaqueID(dir_id, (void **)&node);
+	require_noerr_quiet(error, bad_obj_id);
+	require_quiet(!NODE_IS_DELETED(node) && (node->node_type == WEBDAV_DIR_TYPE), deleted_node);
+	require_quiet(get_connectionstate() == WEBDAV_CONNECTION_UP, connection_down);
+	
+	if ( first && (depth == 0) && !gDepthInfinityDenied )
+	{
+		error = network_warmup_subtree(uid, node, &forbidden);
+		if ( !error )
+		{
+			return;
+		}
+		/* anything else (a timeout, a busy server) may go better next time */
+	}
+	
+	stats_increment(WEBDAV_STATS_WARMUP_DIRECTORIES);
+	error = network_prefetch(uid, node);
+	require_noerr_quiet(error, network_prefetch);
+	
+	/*
+	 * The 403 response's body (which would hold DAV:propfind-finite-depth) isn't
+	 * kept, but if the same PROPFIND with Depth 1 just worked, it was the depth
+	 * the server refused, not the user or the collection.
+	 */
+	if ( forbidden && !gDepthInfinityDenied )
+	{
+		gDepthInfinityDenied = TRUE;
+		syslog(LOG_INFO, "%s: the server refuses Depth infinity PROPFINDs; warm-ups will walk the tree\n", __FUNCTION__);
+	}
+	
+	if ( depth != 1 )
+	{
+		error = nodecache_copy_children(node, TRUE, &child_ids, &child_count);
+		require_noerr_quiet(error, nodecache_copy_children);
+		
+		for ( index = 0; index < child_count; ++index )
+		{
+			(void) requestqueue_enqueue_warmup(uid, child_ids[index], (depth == 0) ? 0 : (depth - 1), FALSE);
+		}
+		free(child_ids);
+	}
+
+nodecache_copy_children:
+network_prefetch:
+connection_down:
+deleted_node:
+bad_obj_id:
+
+	return;
+}
+
+/*****************************************************************************/
+
+/*
+ * A directory whose contents are being deleted by filesystem_emptydir. Every
+ * child still to be deleted holds a count on its directory; when the count
+ * drops to zero the directory is empty, so a subdirectory is then deleted and
+ * its own count on its parent dropped -- the tree is removed bottom up.
+ */
+struct delete_dir
+{
+	struct delete_dir *parent;	/* the directory this one is in, or NULL for the directory being emptied */
+	opaque_id dir_id;			/* this directory */
+	uid_t uid;					/* the user who asked for the delete */
+	int pending;				/* children not yet deleted, plus one while children are being queued (protected by gDeleteLock) */
+	int error;					/* the first error deleting something in this directory (protected by gDeleteLock) */
+	int refused;				/* TRUE if the server refused to DELETE this directory with its contents */
+};
+
+static pthread_mutex_t gDeleteLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gDeleteCondvar = PTHREAD_COND_INITIALIZER;	/* signalled when the directory being emptied is empty */
+static int gDeleteBusy = FALSE;		/* TRUE while a filesystem_emptydir is running (protected by gDeleteLock) */
+/* TRUE once the server has refused to DELETE a non-empty collection -- deletes walk the tree from then on */
+static int gRecursiveDeleteDenied = FALSE;
+
+static void delete_dir_child_done(struct delete_dir *dir, int error);
+
+/*****************************************************************************/
+
+/*
+ * delete_dir_queue_children lists dir's children with a Depth 1 PROPFIND and
+ * queues a delete request for each one. The caller holds dir's queueing count.
+ */
+static int delete_dir_queue_children(
+	struct delete_dir *dir,		/* -> the directory being emptied */
+	struct node_entry *node)	/* -> dir's node */
+{
+	int error;
+	opaque_id *child_ids;
+	u_int32_t child_count;
+	u_int32_t index;
+	
+	/* find out what's really on the server, not just what we've cached */
+	error = network_prefetch(dir->uid, node);
+	require_noerr_quiet(error, network_prefetch);
+	
+	error = nodecache_copy_children(node, FALSE, &child_ids, &child_count);
+	require_noerr_quiet(error, nodecache_copy_children);
+	
+	for ( index = 0; index < child_count; ++index )
+	{
+		pthread_mutex_lock(&gDeleteLock);
+		++dir->pending;
+		pthread_mutex_unlock(&gDeleteLock);
+		
+		error = requestqueue_enqueue_tree_delete(dir, child_ids[index]);
+		if ( error )
+		{
+			/* drop the count the request would have dropped, and don't queue the rest */
+			delete_dir_child_done(dir, error);
+			break;
+		}
+	}
+	free(child_ids);
+
+nodecache_copy_children:
+network_prefetch:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * delete_dir_child_done drops one of dir's counts, recording error if it's
+ * the first. When the last count is dropped, dir is empty: the directory being
+ * emptied wakes up filesystem_emptydir, and a subdirectory is deleted from
+ * the server and reported done to its parent.
+ */
+static void delete_dir_child_done(
+	struct delete_dir *dir,		/* -> the directory the child was in */
+	int error)					/* -> the result of deleting the child */
+{
+	int empty;
+	struct node_entry *node;
+	time_t remove_date;
+	
+	pthread_mutex_lock(&gDeleteLock);
+	if ( (error != 0) && (dir->error == 0) )
+	{
+		dir->error = error;
+	}
+	empty = (--dir->pending == 0);
+	if ( empty && (dir->parent == NULL) )
+	{
+		pthread_cond_broadcast(&gDeleteCondvar);
+	}
+	pthread_mutex_unlock(&gDeleteLock);
+	
+	if ( !empty || (dir->parent == NULL) )
+	{
+		return;
+	}
+	
+	/* every child has been processed -- no other thread references dir now */
+	error = dir->error;
+	if ( error == 0 )
+	{
+		error = RetrieveDataFromOpaqueID(dir->dir_id, (void **)&node);
+		if ( error == 0 )
+		{
+			if ( !NODE_IS_DELETED(node) )
+			{
+				error = network_remove(dir->uid, node, &remove_date, NULL);
+				if ( (error == 0) || (error == ENOENT) )
+				{
+					(void) nodecache_delete_node(node, TRUE);
+					error = 0;
+					
+					/* the server deleted it once it was empty, so it was the contents it refused */
+					if ( dir->refused && !gRecursiveDeleteDenied )
+					{
+						gRecursiveDeleteDenied = TRUE;
+						syslog(LOG_INFO, "%s: the server refuses to DELETE collections that aren't empty; deletes will walk the tree\n", __FUNCTION__);
+					}
+				}
+			}
+		}
+		else
+		{
+			/* the node is gone, so the directory is too */
+			error = 0;
+		}
+	}
+	delete_dir_child_done(dir->parent, error);
+	free(dir);
+}
+
+/*****************************************************************************/
+
+/*
+ * filesystem_delete_tree_node handles one delete request from the request
+ * queue. Files, and collections when the server allows it, are deleted with a
+ * single DELETE. Other collections are walked: their children are queued for
+ * deletion and the collection itself is deleted by delete_dir_child_done once
+ * it's empty. The request queue runs up to WEBDAV_WALK_THREADS deletes at once.
+ */
+void filesystem_delete_tree_node(
+	struct delete_dir *dir,		/* -> the directory obj_id is in */
+	opaque_id obj_id)			/* -> the object to delete */
+{
+	int error;
+	int refused;
+	CFIndex statusCode;
+	struct node_entry *node;
+	struct delete_dir *subdir;
+	time_t remove_date;
+	
+	refused = FALSE;
+	
+	error = RetrieveDataFromOpaqueID(obj_id, (void **)&node);
+	if ( (error != 0) || NODE_IS_DELETED(node) )
+	{
+		/* already gone */
+		error = 0;
+		goto done;
+	}
+	if ( (node->node_type != WEBDAV_DIR_TYPE) || !gRecursiveDeleteDenied )
+	{
+		error = network_remove(dir->uid, node, &remove_date, &statusCode);
+		
+		/*
+		 * A server that won't DELETE a collection that isn't empty answers 403
+		 * Forbidden or 409 Conflict (which would otherwise read as ENOENT). The
+		 * walk below finds out which it was.
+		 */
+		refused = (node->node_type == WEBDAV_DIR_TYPE) && ((statusCode == 403) || (statusCode == 409));
+		if ( !refused && ((error == 0) || (error == ENOENT)) )
+		{
+			if ( node->node_type == WEBDAV_DIR_TYPE )
+			{
+				stats_increment(WEBDAV_STATS_TREE_DELETE_RECURSIVE);
+			}
+			(void) nodecache_delete_node(node, TRUE);
+			error = 0;
+			goto done;
+		}
+		if ( node->node_type != WEBDAV_DIR_TYPE )
+		{
+			goto done;
+		}
+		/* walk this collection, but only stop trying whole-collection DELETEs if the server refused one */
+	}
+	
+	/* walk the collection */
+	stats_increment(WEBDAV_STATS_TREE_DELETE_WALKED);
+	subdir = calloc(1, sizeof(struct delete_dir));
+	require_action(subdir != NULL, done, error = ENOMEM);
+	
+	subdir->parent = dir;
+	subdir->dir_id = obj_id;
+	subdir->uid = dir->uid;
+	subdir->pending = 1;
+	subdir->refused = refused;
+	
+	/* subdir's last count reports to dir, so this request is finished with dir */
+	delete_dir_child_done(subdir, delete_dir_queue_children(subdir, node));
+	return;
+
+done:
+
+	delete_dir_child_done(dir, error);
+}
+
+/*****************************************************************************/
+
+/*
+ * empty_directory deletes everything in node's directory and waits for it to
+ * finish. Only one runs at a time: this request thread blocks while the
+ * deletes run on up to WEBDAV_WALK_THREADS of the others, and the remaining
+ * threads are left for the kernel's requests.
+ */
+static int empty_directory(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node)	/* -> the directory to empty */
+{
+	int error;
+	struct delete_dir *dir;
+	
+	error = 0;
+	
+	pthread_mutex_lock(&gDeleteLock);
+	if ( gDeleteBusy )
+	{
+		error = EBUSY;
+	}
+	else
+	{
+		gDeleteBusy = TRUE;
+	}
+	pthread_mutex_unlock(&gDeleteLock);
+	require_noerr_quiet(error, busy);
+	
+	dir = calloc(1, sizeof(struct delete_dir));
+	require_action(dir != NULL, calloc_dir, error = ENOMEM);
+	
+	dir->parent = NULL;
+	dir->dir_id = node->nodeid;
+	dir->uid = uid;
+	dir->pending = 1;
+	
+	error = delete_dir_queue_children(dir, node);
+	
+	pthread_mutex_lock(&gDeleteLock);
+	if ( (error != 0) && (dir->error == 0) )
+	{
+		dir->error = error;
+	}
+	--dir->pending;
+	while ( dir->pending != 0 )
+	{
+		pthread_cond_wait(&gDeleteCondvar, &gDeleteLock);
+	}
+	error = dir->error;
+	pthread_mutex_unlock(&gDeleteLock);
+	free(dir);
+	
+	/* the directory's listing and attributes changed */
+	lock_node_cache();
+	node->file_validated_time = 0;
+	++node->file_invalidations;
+	unlock_node_cache();
+	(void) nodecache_remove_attributes(node);
+	statfs_cache_time = 0;
+
+calloc_dir:
+
+	pthread_mutex_lock(&gDeleteLock);
+	gDeleteBusy = FALSE;
+	pthread_mutex_unlock(&gDeleteLock);
+
+busy:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
+int filesystem_emptydir(struct webdav_request_emptydir *request_emptydir)
+{
+	int error;
+	struct node_entry *node;
+	
+	error = RetrieveDataFromOpaqueID(request_emptydir->dir_id, (void **)&node);
+	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
+
+	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
+	require_action_quiet(node->node_type == WEBDAV_DIR_TYPE, not_directory, error = ENOTDIR);
+	
+	error = empty_directory(request_emptydir->pcr.pcr_uid, node);
+
+not_directory:
+deleted_node:
+bad_obj_id:
+
+	return (error);
+}
+
+/*****************************************************************************/
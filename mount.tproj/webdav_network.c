@@ -30,10 +30,13 @@
 #include <CoreServices/CoreServicesPriv.h>
 #include <sched.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
 #include <sys/sysctl.h>
 #include <Security/Security.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <zlib.h>
 
 #include "webdav_parse.h"
 #include "webdav_requestqueue.h"
@@ -41,6 +44,8 @@
 #include "webdav_network.h"
 #include "webdav_utils.h"
 #include "webdav_cookie.h"
+#include "webdav_stats.h"
+#include "webdav_trace.h"
 #include "EncodedSourceID.h"
 #include "LogMessage.h"
 
@@ -53,6 +58,41 @@ extern char *CopyCFStringToCString(CFStringRef theString);
 
 #define X_APPLE_REALM_SUPPORT_VALUE "1.0"  /* Value for the X_APPLE_REALM_SUPPORT header field */
 
+/*
+ * How much of a file stream_get_transaction downloads before the open returns
+ * (the "head"). Files whose cached getcontentlength is at most
+ * FIRST_READ_WHOLE_FILE_MAX are downloaded completely so there's no hand off
+ * to a background download. Otherwise the head is first_read_len, or what has
+ * been learned about files with the same extension (see
+ * network_note_read_offset), up to FIRST_READ_LEN_MAX.
+ */
+#define FIRST_READ_WHOLE_FILE_MAX	(256 * 1024)
+#define FIRST_READ_LEN_MAX			(2 * 1024 * 1024)
+#define FIRST_READ_EXTENSION_MAX	16		/* longest extension (with its NUL) that is remembered */
+#define FIRST_READ_HINTS			64		/* number of extensions remembered -- must be a power of 2 */
+
+/*
+ * network_fsync sends files of at least RESUMABLE_UPLOAD_MIN bytes in
+ * RESUMABLE_UPLOAD_SEGMENT byte ranges to a temporary resource next to the
+ * file (".<name>.webdavfs-upload"): a plain PUT of the first range, then
+ * partial PUTs (with a Content-Range header) of the rest, and finally a MOVE
+ * of the temporary resource over the file, so the file is never left
+ * truncated. The bytes the server has, and the entity tag they left the
+ * temporary resource with, are recorded in the node, so a lost connection
+ * costs at most one range and a later fsync of the unchanged cache file picks
+ * up where this one stopped. The segment size must be a multiple of the page
+ * size.
+ */
+#define RESUMABLE_UPLOAD_MIN		(64 * 1024 * 1024)
+#define RESUMABLE_UPLOAD_SEGMENT	(16 * 1024 * 1024)
+#define RESUMABLE_UPLOAD_RETRIES	5		/* times a range is resent after the connection fails */
+#define RESUMABLE_UPLOAD_WAIT		30		/* most seconds to wait for the connection to come back before resending */
+
+/* gPartialPutSupport values */
+#define PARTIAL_PUT_UNKNOWN			0		/* no partial PUT has been checked yet */
+#define PARTIAL_PUT_SUPPORTED		1		/* the server appended a range sent with a partial PUT */
+#define PARTIAL_PUT_UNSUPPORTED		2		/* the server refused or ignored a partial PUT */
+
 struct HeaderFieldValue
 {
 	CFStringRef	headerField;
@@ -74,9 +114,34 @@ extern uint64_t webdavCacheMaximumSize;
 
 static CFStringRef userAgentHeaderValue = NULL;	/* The User-Agent request-header value */
 static CFIndex first_read_len = 4096;	/* bytes.  Amount to download at open so first read at offset 0 doesn't stall */
+static int gSyncCollectionFailures = 0;	/* consecutive sync-collection REPORTs that failed */
+static int gChunkedUploadsRefused = FALSE;	/* TRUE once the server has answered a chunked PUT body with 411 or 501 */
+static int gPartialPutSupport = PARTIAL_PUT_UNKNOWN;	/* whether the server takes PUTs with a Content-Range header */
 static CFStringRef X_Source_Id_HeaderValue = NULL;	/* the X-Source-Id header value, or NULL if not iDisk */
 static CFStringRef X_Apple_Realm_Support_HeaderValue = NULL;	/* the X-Apple-Realm-Support header value, or NULL if not iDisk */
 
+/* head lengths by extension -- a slot is reused when another extension hashes to it */
+struct first_read_hint
+{
+	char	extension[FIRST_READ_EXTENSION_MAX];	/* lower case extension without the dot, or "" if unused */
+	CFIndex	head_len;								/* bytes to download at open */
+};
+static pthread_mutex_t gFirstReadHintsLock = PTHREAD_MUTEX_INITIALIZER;
+static struct first_read_hint gFirstReadHints[FIRST_READ_HINTS];	/* protected by gFirstReadHintsLock */
+
+/* file types known to read well past the first page before anything else */
+static const struct first_read_hint gFirstReadSeeds[] =
+{
+	{ "jpg", 64 * 1024 },		/* EXIF data and thumbnails */
+	{ "jpeg", 64 * 1024 },
+	{ "tif", 256 * 1024 },		/* the first IFD and its tags */
+	{ "tiff", 256 * 1024 },
+	{ "psd", 1024 * 1024 },		/* image resources and layer info */
+	{ "mp3", 128 * 1024 },		/* ID3v2 tags with artwork */
+	{ "mkv", 256 * 1024 },		/* EBML header, seek head and tracks */
+	{ "avi", 256 * 1024 },		/* RIFF header and stream lists */
+};
+
 static SCDynamicStoreRef gProxyStore;
 
 /******************************************************************************/
@@ -700,6 +765,21 @@ CFStringCreateWithCString:
 
 /*****************************************************************************/
 
+static u_int32_t first_read_hint_index(const char *extension)
+{
+	u_int32_t hash;
+	
+	/* FNV-1a */
+	hash = 2166136261U;
+	while ( *extension != '\0' )
+	{
+		hash = (hash ^ (unsigned char)*extension++) * 16777619U;
+	}
+	return ( hash & (FIRST_READ_HINTS - 1) );
+}
+
+/*****************************************************************************/
+
 /*
  * The get_first_read_len function sets the global
  * first_read_len. It is set to the system's page size so that if the
@@ -712,6 +792,7 @@ static void get_first_read_len(void)
 	size_t	len;
 	int		result;
 	int		pagesize;
+	int		i;
 	
 	/* get the hardware page size */
 	mib[0] = CTL_HW;
@@ -727,6 +808,144 @@ static void get_first_read_len(void)
 	{
 		first_read_len = pagesize;
 	}
+	
+	/* seed the extension hints */
+	pthread_mutex_lock(&gFirstReadHintsLock);
+	for ( i = 0; i < (int)(sizeof(gFirstReadSeeds) / sizeof(gFirstReadSeeds[0])); ++i )
+	{
+		struct first_read_hint *hint;
+		
+		hint = &gFirstReadHints[first_read_hint_index(gFirstReadSeeds[i].extension)];
+		strlcpy(hint->extension, gFirstReadSeeds[i].extension, sizeof(hint->extension));
+		hint->head_len = MAX(gFirstReadSeeds[i].head_len, first_read_len);
+	}
+	pthread_mutex_unlock(&gFirstReadHintsLock);
+}
+
+/*****************************************************************************/
+
+/*
+ * Copies the lower case extension of node's name (without the dot) into
+ * extension. Returns FALSE if there is no extension or it's too long to
+ * be worth remembering.
+ */
+static int first_read_extension(struct node_entry *node, char extension[FIRST_READ_EXTENSION_MAX])
+{
+	size_t dot;
+	size_t length;
+	size_t i;
+	
+	if ( (node->name == NULL) || (node->name_length == 0) )
+	{
+		return ( FALSE );
+	}
+	
+	/* find the last dot -- a leading dot doesn't start an extension */
+	for ( dot = node->name_length - 1; (dot > 0) && (node->name[dot] != '.'); --dot )
+	{
+	}
+	if ( dot == 0 )
+	{
+		return ( FALSE );
+	}
+	
+	length = node->name_length - dot - 1;
+	if ( (length == 0) || (length >= FIRST_READ_EXTENSION_MAX) )
+	{
+		return ( FALSE );
+	}
+	for ( i = 0; i < length; ++i )
+	{
+		extension[i] = (char)tolower((unsigned char)node->name[dot + 1 + i]);
+	}
+	extension[length] = '\0';
+	
+	return ( TRUE );
+}
+
+/*****************************************************************************/
+
+/*
+ * Returns the number of bytes stream_get_transaction should download before
+ * the open returns.
+ */
+static CFIndex get_head_len(struct node_entry *node)
+{
+	CFIndex head_len;
+	char extension[FIRST_READ_EXTENSION_MAX];
+	struct first_read_hint *hint;
+	
+	/*
+	 * Small files are read whole. Ask for one more byte than the file has so
+	 * the read that hits the end of the stream is part of the head.
+	 */
+	if ( (node->attr_time != 0) &&
+		 (node->attr_stat_info.attr_stat.st_size >= 0) &&
+		 (node->attr_stat_info.attr_stat.st_size <= FIRST_READ_WHOLE_FILE_MAX) )
+	{
+		return ( MAX((CFIndex)node->attr_stat_info.attr_stat.st_size + 1, first_read_len) );
+	}
+	
+	head_len = first_read_len;
+	if ( first_read_extension(node, extension) )
+	{
+		pthread_mutex_lock(&gFirstReadHintsLock);
+		hint = &gFirstReadHints[first_read_hint_index(extension)];
+		if ( strcmp(hint->extension, extension) == 0 )
+		{
+			head_len = hint->head_len;
+		}
+		pthread_mutex_unlock(&gFirstReadHintsLock);
+	}
+	
+	return ( head_len );
+}
+
+/*****************************************************************************/
+
+/*
+ * network_note_read_offset is told about every out-of-band read. One that
+ * lands within FIRST_READ_LEN_MAX of the start of a file that's still
+ * downloading means the head was too short for this kind of file, so the
+ * head for files with the same extension grows to cover it.
+ */
+void network_note_read_offset(
+	struct node_entry *node,
+	off_t offset,
+	size_t count)
+{
+	char extension[FIRST_READ_EXTENSION_MAX];
+	struct first_read_hint *hint;
+	off_t end;
+	CFIndex head_len;
+	
+	end = offset + (off_t)count;
+	require_quiet((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_IN_PROGRESS, not_downloading);
+	require_quiet(end <= FIRST_READ_LEN_MAX, beyond_head);
+	require_quiet(first_read_extension(node, extension), no_extension);
+	
+	/* round up to a whole number of pages */
+	head_len = (CFIndex)(((end + first_read_len - 1) / first_read_len) * first_read_len);
+	
+	pthread_mutex_lock(&gFirstReadHintsLock);
+	hint = &gFirstReadHints[first_read_hint_index(extension)];
+	if ( strcmp(hint->extension, extension) != 0 )
+	{
+		/* take over the slot */
+		strlcpy(hint->extension, extension, sizeof(hint->extension));
+		hint->head_len = first_read_len;
+	}
+	if ( head_len > hint->head_len )
+	{
+		hint->head_len = MIN(head_len, FIRST_READ_LEN_MAX);
+	}
+	pthread_mutex_unlock(&gFirstReadHintsLock);
+
+no_extension:
+beyond_head:
+not_downloading:
+
+	return;
 }
 
 /******************************************************************************/
@@ -809,6 +1028,7 @@ int network_init(const UInt8 *uri, CFIndex uriLength, int *store_notify_fd, int
 	{
 		gReadStreams[index].inUse = 0; /* not in use */
 		gReadStreams[index].readStreamRef = NULL; /* no stream */
+		gReadStreams[index].inflater = NULL; /* no response body being decoded */
 		gReadStreams[index].uniqueValue = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%d"), index); /* unique string */
 	}
 
@@ -829,17 +1049,14 @@ pthread_mutexattr_init:
 /******************************************************************************/
 
 /*
- * create_cfurl_from_node
+ * build_cfurl_from_node
  *
- * Creates a CFURL to the node if no name is provided, or to the node's named
- * child if a name is provided.
+ * Builds the absolute CFURL to the node from the node's path.
  *
  * The caller is responsible for releasing the CFURL returned.
  */
-static CFURLRef create_cfurl_from_node(
-	struct node_entry *node,
-	char *name,
-	size_t name_length)
+static CFURLRef build_cfurl_from_node(
+	struct node_entry *node)
 {
 	CFURLRef tempUrlRef, baseURL;
 	CFURLRef urlRef;
@@ -857,12 +1074,6 @@ static CFURLRef create_cfurl_from_node(
 	error = nodecache_get_path_from_node(node, &pathHasRedirection, &node_path);
 	require_noerr_quiet(error, nodecache_get_path_from_node);
 
-	/* append the name (if any) */
-	if ( name != NULL && name_length != 0 )
-	{
-		strncat(node_path, name, name_length);
-	}
-	
 	/* is there any relative path? */
 	if ( *node_path != '\0' )
 	{
@@ -932,6 +1143,77 @@ nodecache_get_path_from_node:
 
 /******************************************************************************/
 
+/*
+ * create_cfurl_from_node
+ *
+ * Creates a CFURL to the node if no name is provided, or to the node's named
+ * child if a name is provided.
+ *
+ * The node's URL is built once and cached in the node (see nodecache_copy_url)
+ * so most requests don't have to walk the path to the root and percent escape
+ * it again. A child's URL is the escaped name resolved against the node's URL.
+ *
+ * The caller is responsible for releasing the CFURL returned.
+ */
+static CFURLRef create_cfurl_from_node(
+	struct node_entry *node,
+	char *name,
+	size_t name_length)
+{
+	CFURLRef nodeUrlRef, tempUrlRef;
+	CFURLRef urlRef;
+	CFStringRef stringRef;
+	CFStringRef escapedNameRef;
+	u_int32_t generation;
+	
+	urlRef = NULL;
+	
+	nodeUrlRef = nodecache_copy_url(node, &generation);
+	if ( nodeUrlRef == NULL )
+	{
+		nodeUrlRef = build_cfurl_from_node(node);
+		require_quiet(nodeUrlRef != NULL, build_cfurl_from_node);
+		
+		nodecache_set_url(node, nodeUrlRef, generation);
+	}
+	
+	if ( name == NULL || name_length == 0 )
+	{
+		/* the caller gets our reference */
+		return ( nodeUrlRef );
+	}
+	
+	/* convert the name to a CFString */
+	stringRef = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)name, name_length, kCFStringEncodingUTF8, false);
+	require_string(stringRef != NULL, CFStringCreateWithBytes, "name was not legal UTF8");
+	
+	/*
+	 * Percent escape the same characters build_cfurl_from_node does so that
+	 * a name with a ":" doesn't look like an absolute URL with some weird scheme.
+	 */
+	escapedNameRef = CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault, stringRef, NULL, CFSTR(":;?"), kCFStringEncodingUTF8);
+	require(escapedNameRef != NULL, CFURLCreateStringByAddingPercentEscapes);
+	
+	/* the node is a directory, so its URL ends with a slash */
+	tempUrlRef = CFURLCreateWithString(kCFAllocatorDefault, escapedNameRef, nodeUrlRef);
+	require(tempUrlRef != NULL, CFURLCreateWithString);
+	
+	urlRef = CFURLCopyAbsoluteURL(tempUrlRef);
+	CFRelease(tempUrlRef);
+
+CFURLCreateWithString:
+	CFRelease(escapedNameRef);
+CFURLCreateStringByAddingPercentEscapes:
+	CFRelease(stringRef);
+CFStringCreateWithBytes:
+	CFRelease(nodeUrlRef);
+build_cfurl_from_node:
+	
+	return ( urlRef );
+}
+
+/******************************************************************************/
+
 static int translate_status_to_error(UInt32 statusCode)
 {
 	int result;
@@ -991,6 +1273,7 @@ static int translate_status_to_error(UInt32 statusCode)
 					syslog(LOG_DEBUG,"unexpected statusCode %llu", code);
 					result = EINVAL;
 					break;
+				case 412:	/* Precondition Failed (an If-Match or If header didn't match -- someone else changed or locked it) */
 				case 423:	/* Locked (WebDAV) */
 				case 424:	/* Failed Dependency (WebDAV) (EBUSY when a directory cannot be MOVE'd) */
 					syslog(LOG_ERR,"unexpected statusCode %llu", code);
@@ -1040,6 +1323,232 @@ static int ApplySSLProperties(CFReadStreamRef readStreamRef)
 
 /******************************************************************************/
 
+/*
+ * Response bodies are asked for with "Accept-Encoding: gzip" where they're
+ * worth compressing (see add_accept_encoding_header). CFReadStream hands
+ * back the body as it came off the wire, so read_response_body() inflates
+ * it as it's read: callers see the same bytes an unencoded response would
+ * have given them, and the encoded body is never held in memory whole.
+ */
+struct response_inflater
+{
+	z_stream	zstream;		/* the inflate state */
+	int			finished;		/* TRUE once inflate() has reached the gzip trailer */
+	UInt8		*in_buffer;		/* encoded bytes read from the stream */
+	CFIndex		in_size;		/* size of in_buffer */
+	int64_t		wire_bytes;		/* encoded bytes read so far */
+	int64_t		decoded_bytes;	/* bytes handed to the caller so far */
+};
+
+/******************************************************************************/
+
+/*
+ * Returns TRUE if the response body has a gzip Content-Encoding. Only gzip
+ * is asked for; a body in any other coding is passed through as is.
+ */
+static int response_is_gzip_encoded(CFHTTPMessageRef response)
+{
+	CFStringRef encodingRef;
+	int result;
+	
+	result = FALSE;
+	encodingRef = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("Content-Encoding"));
+	if ( encodingRef != NULL )
+	{
+		result = (CFStringCompare(encodingRef, CFSTR("gzip"), kCFCompareCaseInsensitive) == kCFCompareEqualTo) ||
+			(CFStringCompare(encodingRef, CFSTR("x-gzip"), kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+		CFRelease(encodingRef);
+	}
+	
+	return ( result );
+}
+
+/******************************************************************************/
+
+/*
+ * Asks for the response body to be gzip encoded. Byte ranges of an encoded
+ * body are ranges of the encoded bytes, so this is only for requests that
+ * get the whole body.
+ */
+static void add_accept_encoding_header(CFHTTPMessageRef message)
+{
+	CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Accept-Encoding"), CFSTR("gzip"));
+}
+
+/******************************************************************************/
+
+/* creates an inflater whose first input is the length encoded bytes at data */
+static struct response_inflater *create_response_inflater(const UInt8 *data, CFIndex length)
+{
+	struct response_inflater *inflater;
+	
+	inflater = calloc(1, sizeof(struct response_inflater));
+	require(inflater != NULL, calloc_inflater);
+	
+	/* the first read may have been larger than the reads that follow */
+	inflater->in_size = (length > BODY_BUFFER_SIZE) ? length : BODY_BUFFER_SIZE;
+	inflater->in_buffer = malloc(inflater->in_size);
+	require(inflater->in_buffer != NULL, malloc_in_buffer);
+	
+	/* 16 + MAX_WBITS: expect a gzip header and trailer */
+	require(inflateInit2(&inflater->zstream, 16 + MAX_WBITS) == Z_OK, inflateInit2);
+	
+	memcpy(inflater->in_buffer, data, length);
+	inflater->zstream.next_in = inflater->in_buffer;
+	inflater->zstream.avail_in = (uInt)length;
+	inflater->wire_bytes = length;
+	
+	return ( inflater );
+
+inflateInit2:
+	free(inflater->in_buffer);
+malloc_in_buffer:
+	free(inflater);
+calloc_inflater:
+	return ( NULL );
+}
+
+/******************************************************************************/
+
+static void free_response_inflater(struct response_inflater *inflater)
+{
+	stats_increment(WEBDAV_STATS_GZIP_RESPONSES);
+	stats_add(WEBDAV_STATS_GZIP_WIRE_BYTES, inflater->wire_bytes);
+	stats_add(WEBDAV_STATS_GZIP_DECODED_BYTES, inflater->decoded_bytes);
+	
+	(void) inflateEnd(&inflater->zstream);
+	free(inflater->in_buffer);
+	free(inflater);
+}
+
+/******************************************************************************/
+
+/*
+ * read_response_body
+ *
+ * Reads up to length bytes of the response body like CFReadStreamRead(),
+ * inflating a gzip Content-Encoding as the bytes arrive. Returns the number
+ * of bytes put in buffer, 0 at the end of the body, or -1 on errors. If the
+ * error was in the encoded data rather than the stream, bodyCorrupt is set.
+ */
+static CFIndex read_response_body(
+	struct ReadStreamRec *readStreamRecPtr,	/* -> the ReadStreamRec with the response */
+	UInt8 *buffer,							/* <- the decoded bytes */
+	CFIndex length)							/* -> size of buffer */
+{
+	struct response_inflater *inflater;
+	CFTypeRef theResponsePropertyRef;
+	CFIndex bytesRead;
+	int encoded;
+	int zerror;
+	
+	if ( !readStreamRecPtr->bodyStarted )
+	{
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, length);
+		if ( bytesRead <= 0 )
+		{
+			return ( bytesRead );
+		}
+		readStreamRecPtr->bodyStarted = TRUE;
+		
+		/* the response header is complete once the body has started */
+		theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
+		if ( theResponsePropertyRef == NULL )
+		{
+			return ( bytesRead );
+		}
+		encoded = response_is_gzip_encoded(*((CFHTTPMessageRef*)((void*)&theResponsePropertyRef)));
+		CFRelease(theResponsePropertyRef);
+		
+		/* a body labeled gzip that doesn't start with the gzip magic number is passed through as is */
+		if ( !encoded || (buffer[0] != 0x1f) )
+		{
+			return ( bytesRead );
+		}
+		
+		readStreamRecPtr->inflater = create_response_inflater(buffer, bytesRead);
+		if ( readStreamRecPtr->inflater == NULL )
+		{
+			syslog(LOG_ERR, "%s: cannot decode gzip response body", __FUNCTION__);
+			readStreamRecPtr->bodyCorrupt = TRUE;
+			return ( -1 );
+		}
+	}
+	else if ( readStreamRecPtr->inflater == NULL )
+	{
+		return ( CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, length) );
+	}
+	
+	inflater = readStreamRecPtr->inflater;
+	inflater->zstream.next_out = buffer;
+	inflater->zstream.avail_out = (uInt)length;
+	
+	/* return as soon as there's some output, like CFReadStreamRead does */
+	while ( inflater->zstream.avail_out == (uInt)length )
+	{
+		if ( inflater->finished )
+		{
+			/* read past anything after the gzip trailer so the stream reaches its end */
+			bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, inflater->in_buffer, inflater->in_size);
+			if ( bytesRead <= 0 )
+			{
+				return ( bytesRead );
+			}
+			continue;
+		}
+		
+		if ( inflater->zstream.avail_in == 0 )
+		{
+			bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, inflater->in_buffer, inflater->in_size);
+			if ( bytesRead < 0 )
+			{
+				return ( -1 );
+			}
+			else if ( bytesRead == 0 )
+			{
+				syslog(LOG_ERR, "%s: gzip response body ended early", __FUNCTION__);
+				readStreamRecPtr->bodyCorrupt = TRUE;
+				return ( -1 );
+			}
+			inflater->zstream.next_in = inflater->in_buffer;
+			inflater->zstream.avail_in = (uInt)bytesRead;
+			inflater->wire_bytes += bytesRead;
+		}
+		
+		zerror = inflate(&inflater->zstream, Z_NO_FLUSH);
+		if ( zerror == Z_STREAM_END )
+		{
+			inflater->finished = TRUE;
+		}
+		else if ( zerror != Z_OK )
+		{
+			syslog(LOG_ERR, "%s: gzip response body is corrupt (%d)", __FUNCTION__, zerror);
+			readStreamRecPtr->bodyCorrupt = TRUE;
+			return ( -1 );
+		}
+	}
+	
+	bytesRead = length - (CFIndex)inflater->zstream.avail_out;
+	inflater->decoded_bytes += bytesRead;
+	
+	return ( bytesRead );
+}
+
+/******************************************************************************/
+
+/* returns TRUE if read_response_body() has no more bytes to return */
+static int response_body_at_end(struct ReadStreamRec *readStreamRecPtr)
+{
+	if ( (readStreamRecPtr->inflater != NULL) && !readStreamRecPtr->inflater->finished )
+	{
+		return ( FALSE );
+	}
+	
+	return ( CFReadStreamGetStatus(readStreamRecPtr->readStreamRef) == kCFStreamStatusAtEnd );
+}
+
+/******************************************************************************/
+
 /*
  * get_ReadStreamRec
  *
@@ -1106,6 +1615,13 @@ static void release_ReadStreamRec(struct ReadStreamRec *theReadStreamRec)
 {
 	int mutexerror;
 	
+	/* the transaction is over, so is its response body */
+	if ( theReadStreamRec->inflater != NULL )
+	{
+		free_response_inflater(theReadStreamRec->inflater);
+		theReadStreamRec->inflater = NULL;
+	}
+	
 	/* grab gNetworkGlobals_lock */
 	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
 	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
@@ -1389,6 +1905,8 @@ static int open_stream_for_transaction(
 
 	/* save new read stream */
 	theReadStreamRec->readStreamRef = newReadStreamRef;
+	theReadStreamRec->bodyStarted = FALSE;
+	theReadStreamRec->bodyCorrupt = FALSE;
 	
 	/* return the ReadStreamRec to the caller */
 	*readStreamRecPtr = theReadStreamRec;
@@ -1443,8 +1961,11 @@ static int stream_get_transaction(
 	CFStringRef setCookieHeaderRef;
 	CFHTTPMessageRef responseMessage;
 	int result;
+	CFIndex head_len;
+	uint64_t start;
 	
 	result = 0;
+	start = stats_start();
 		
 	/*
 	 * If we're down and the mount is supposed to fail on disconnects
@@ -1456,22 +1977,27 @@ static int stream_get_transaction(
 	require_noerr_quiet(result, open_stream_for_transaction);
 	
 	/* malloc a buffer big enough for first read */
-	buffer = malloc(first_read_len);
+	head_len = get_head_len(node);
+	buffer = malloc(head_len);
 	require(buffer != NULL, malloc_buffer);
 
-	/* Send the message and get up to first_read_len bytes of response */
+	/* Send the message and get up to head_len bytes of response */
 	totalRead = 0;
 	background_load = FALSE;
 	while ( 1 )
 	{
-		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer + totalRead, first_read_len - totalRead);
+		bytesRead = read_response_body(readStreamRecPtr, buffer + totalRead, head_len - totalRead);
 		if ( bytesRead > 0 )
 		{
+			if ( totalRead == 0 )
+			{
+				stats_add(WEBDAV_STATS_OPEN_FIRST_BYTE_USEC, (int64_t)stats_elapsed_usec(start));
+			}
 			totalRead += bytesRead;
-			if ( totalRead >= first_read_len )
+			if ( totalRead >= head_len )
 			{
 				/* is there more data to read? */
-				if ( CFReadStreamGetStatus(readStreamRecPtr->readStreamRef) == kCFStreamStatusAtEnd )
+				if ( response_body_at_end(readStreamRecPtr) )
 				{
 					/* there are no more bytes to read */
 					background_load = FALSE;
@@ -1490,6 +2016,12 @@ static int stream_get_transaction(
 			background_load = FALSE;
 			break;
 		}
+		else if ( readStreamRecPtr->bodyCorrupt )
+		{
+			/* the connection is fine, the server's encoding isn't */
+			result = EIO;
+			goto CFReadStreamRead;
+		}
 		else
 		{
 			CFStreamError streamError;
@@ -1517,6 +2049,13 @@ static int stream_get_transaction(
 		}
 	};
 	
+	stats_increment(WEBDAV_STATS_OPEN_HEAD);
+	stats_add(WEBDAV_STATS_OPEN_HEAD_USEC, (int64_t)stats_elapsed_usec(start));
+	if ( !background_load && (totalRead > first_read_len) )
+	{
+		stats_increment(WEBDAV_STATS_OPEN_WHOLE_FILE);
+	}
+	
 	/* get the response header */
 	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
 	require(theResponsePropertyRef != NULL, GetResponseHeader);
@@ -1614,6 +2153,9 @@ static int stream_get_transaction(
 		 */
 		require(fchflags(node->file_fd, UF_NODUMP) == 0, fchflags);
 		
+		/* bytes read ahead of an earlier download may not match what we're about to get */
+		nodecache_discard_read_ahead(node);
+		
 		node->file_status = WEBDAV_DOWNLOAD_IN_PROGRESS;
 		
 		/* pass the node and readStreamRef off to another thread to finish */
@@ -1685,14 +2227,20 @@ connection_down:
  *
  * Creates an HTTP stream with the read stream coming from file_fd,
  * sends the request and returns the response. The response body (if any) is
- * read and disposed.
+ * read and disposed. If length isn't -1, only length bytes of the file
+ * starting at offset are sent; they're mapped rather than copied.
  */
 static int stream_transaction_from_file(
 	CFHTTPMessageRef request,
 	int file_fd,
+	off_t offset,				/* -> first byte of the file to send */
+	off_t length,				/* -> number of bytes to send, or -1 to send the whole file */
 	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
 	CFHTTPMessageRef *response)
 {
+	void *mapAddr;
+	size_t mapLength;
+	off_t mapOffset;
 	CFReadStreamRef fdStream;
 	struct ReadStreamRec *readStreamRecPtr;
 	void *buffer;
@@ -1706,6 +2254,8 @@ static int stream_transaction_from_file(
 	int result;
 	
 	result = 0;
+	mapAddr = MAP_FAILED;
+	mapLength = 0;
 		
 	/*
 	 * If we're down and the mount is supposed to fail on disconnects
@@ -1714,8 +2264,15 @@ static int stream_transaction_from_file(
 	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
 	
 	/* get the file length */
-	contentLength = lseek(file_fd, 0LL, SEEK_END);
-	require(contentLength != -1, lseek);
+	if ( length < 0 )
+	{
+		contentLength = lseek(file_fd, 0LL, SEEK_END);
+		require(contentLength != -1, lseek);
+	}
+	else
+	{
+		contentLength = length;
+	}
 	
 	/* create a string with the file length for the Content-Length header */
 	contentLengthString = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%qd"), contentLength);
@@ -1726,11 +2283,24 @@ static int stream_transaction_from_file(
 		CFRelease(contentLengthString);
 	}
 	
-	/* set the file position to 0 */
-	verify(lseek(file_fd, 0LL, SEEK_SET) != -1);
-	
-	/* create a stream from the file */
-	CFStreamCreatePairWithSocket(kCFAllocatorDefault, file_fd, &fdStream, NULL);
+	if ( length < 0 )
+	{
+		/* set the file position to 0 */
+		verify(lseek(file_fd, 0LL, SEEK_SET) != -1);
+		
+		/* create a stream from the file */
+		CFStreamCreatePairWithSocket(kCFAllocatorDefault, file_fd, &fdStream, NULL);
+	}
+	else
+	{
+		/* map the range (mmap wants a page aligned offset) and create a stream from the mapping */
+		mapOffset = offset - (offset % getpagesize());
+		mapLength = (size_t)(length + (offset - mapOffset));
+		mapAddr = mmap(NULL, mapLength, PROT_READ, MAP_SHARED, file_fd, mapOffset);
+		require(mapAddr != MAP_FAILED, mmap);
+		fdStream = CFReadStreamCreateWithBytesNoCopy(kCFAllocatorDefault,
+			(const UInt8 *)mapAddr + (offset - mapOffset), (CFIndex)length, kCFAllocatorNull);
+	}
 	require(fdStream != NULL, CFReadStreamCreateWithFile);
 	
 	result = open_stream_for_transaction(request, fdStream, FALSE, retryTransaction, &readStreamRecPtr);
@@ -1813,7 +2383,11 @@ static int stream_transaction_from_file(
 	}
 
 	CFRelease(fdStream);
-
+	if ( mapAddr != MAP_FAILED )
+	{
+		(void) munmap(mapAddr, mapLength);
+	}
+
 	/* make this ReadStreamRec is available again */
 	release_ReadStreamRec(readStreamRecPtr);
 	
@@ -1838,12 +2412,19 @@ malloc_currentbuffer:
 	/* make this ReadStreamRec is available again */
 	release_ReadStreamRec(readStreamRecPtr);
 
+open_stream_for_transaction:
+
 	CFRelease(fdStream);
 
 CFReadStreamCreateWithFile:
 
+	if ( mapAddr != MAP_FAILED )
+	{
+		(void) munmap(mapAddr, mapLength);
+	}
+
+mmap:
 lseek:
-open_stream_for_transaction:
 connection_down:
 
 	*response = NULL;
@@ -1906,7 +2487,7 @@ static int stream_transaction(
 	while ( 1 )
 	{
 		bytesToRead = bufferSize - totalRead;
-		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, currentbuffer + totalRead, bytesToRead);
+		bytesRead = read_response_body(readStreamRecPtr, currentbuffer + totalRead, bytesToRead);
 		if ( bytesRead > 0 )
 		{
 			totalRead += bytesRead;
@@ -1927,6 +2508,12 @@ static int stream_transaction(
 			/* there are no more bytes to read */
 			break;
 		}
+		else if ( readStreamRecPtr->bodyCorrupt )
+		{
+			/* the connection is fine, the server's encoding isn't */
+			result = EIO;
+			goto CFReadStreamRead;
+		}
 		else
 		{
 			result = HandleSSLErrors(readStreamRecPtr->readStreamRef);
@@ -2071,6 +2658,9 @@ static int send_transaction(
 	CFIndex responseBufferLength;
 	int retryTransaction;
 	int auto_redirect;
+	uint64_t start_time;
+	enum webdav_stats_method method;
+	int64_t bytes;
 	
 	error = 0;
 	responseBuffer = NULL;
@@ -2080,6 +2670,9 @@ static int send_transaction(
 	statusCode = 0;
 	auth_generation = 0;
 	retryTransaction = TRUE;
+	start_time = stats_start();
+	
+	method = stats_method_index(requestMethod);
 	
 	if (redirectAction == REDIRECT_AUTO)
 		auto_redirect = TRUE;
@@ -2123,6 +2716,12 @@ static int send_transaction(
 		/* add cookies (if any) */
 		add_cookie_headers(message, url);
 		
+		/* multistatus bodies are large and repetitive, so ask for them compressed */
+		if ( (method == WEBDAV_STATS_METHOD_PROPFIND) || (method == WEBDAV_STATS_METHOD_REPORT) )
+		{
+			add_accept_encoding_header(message);
+		}
+		
 		/* add other HTTP headers (if any) */
 		for ( i = 0, headerPtr = headers; i < headerCount; ++i, ++headerPtr )
 		{
@@ -2211,6 +2810,10 @@ CFHTTPMessageCreateRequest:
 		CFRelease(message);
 	}
 	
+	bytes = (int64_t)responseBufferLength + ((bodyData != NULL) ? CFDataGetLength(bodyData) : 0);
+	stats_record_http(method, start_time, bytes, error);
+	trace_record(WEBDAV_TRACE_HTTP, method, (node != NULL) ? node->fileid : 0, start_time, bytes, error);
+	
 	/* return requested output parameters */
 	if ( buffer != NULL )
 	{
@@ -2821,7 +3424,7 @@ int network_finish_download(
 			 * the only way to know at termination if the download was
 			 * finished, or if the download was incomplete.
 			 */
-			bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, 1); /* make it a small read */
+			bytesRead = read_response_body(readStreamRecPtr, buffer, 1); /* make it a small read */
 			if ( bytesRead == 0 )
 			{
 				/*
@@ -2841,7 +3444,7 @@ int network_finish_download(
 			}
 		}
 		
-		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, BODY_BUFFER_SIZE);
+		bytesRead = read_response_body(readStreamRecPtr, buffer, BODY_BUFFER_SIZE);
 		if ( bytesRead > 0 )
 		{
 			require(write(node->file_fd, buffer, (size_t)bytesRead) == (ssize_t)bytesRead, write);
@@ -2855,8 +3458,12 @@ int network_finish_download(
 		{
 			CFStreamError streamError;
 			
-			streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
-			syslog(LOG_ERR,"network_finish_download: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
+			/* read_response_body has already logged a body that couldn't be decoded */
+			if ( !readStreamRecPtr->bodyCorrupt )
+			{
+				streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
+				syslog(LOG_ERR,"network_finish_download: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
+			}
 			goto CFReadStreamRead;
 			break;
 		}
@@ -3076,7 +3683,21 @@ void writeseqReadResponseCallback(CFReadStreamRef str, CFStreamEventType event,
 			/* fun with casting a "const void *" CFTypeRef away */
 			responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));			
 			statusCode = CFHTTPMessageGetResponseStatusCode(responseMessage);
-			error = translate_status_to_error((UInt32)statusCode);
+			if ( (statusCode == 411) || (statusCode == 501) ) {
+				/*
+				 * Length Required or Not Implemented: the server (or a proxy) won't
+				 * take a body without a Content-Length. Remember that for the rest
+				 * of the mount, and let filesystem_close PUT the cache file instead.
+				 */
+				if ( !gChunkedUploadsRefused ) {
+					syslog(LOG_INFO, "%s: server refused a streamed upload (status %ld), buffering uploads", __FUNCTION__, (long)statusCode);
+					gChunkedUploadsRefused = TRUE;
+				}
+				error = ENOTSUP;
+			}
+			else {
+				error = translate_status_to_error((UInt32)statusCode);
+			}
 			
 			// Handle cookies
 			setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Set-Cookie"));
@@ -3184,6 +3805,97 @@ CFDataRef managerMessagePortCallback(CFMessagePortRef local, SInt32 msgid, CFDat
 	return NULL;
 }
 
+/******************************************************************************/
+// Called by the manager thread when it's done with a chunk
+static void complete_writemgr_request(struct stream_put_ctx *ctx, struct seqwrite_mgr_req *req, int error)
+{
+	// whatever is left in mgr_buf belonged to this chunk
+	ctx->mgr_buf_len = ctx->mgr_buf_pos = 0;
+	
+	// wake thread sleeping on this request
+	pthread_mutex_lock(&req->req_lock);
+	req->error = error;
+	req->request_done = true;
+	pthread_cond_signal(&req->req_condvar);
+	pthread_mutex_unlock(&req->req_lock);
+	
+	pthread_mutex_lock(&ctx->ctx_lock);
+	if ( (error != 0) && req->async && (ctx->finalStatusValid == false) ) {
+		// the writer has already returned, so fail the sequential write
+		// and let the next write or the close report it
+		ctx->finalStatus = error;
+		ctx->finalStatusValid = true;
+	}
+	release_writemgr_request_locked(ctx, req);
+	pthread_mutex_unlock(&ctx->ctx_lock);
+}
+
+/******************************************************************************/
+
+static int init_writemgr_pool(struct stream_put_ctx *ctx)
+{
+	int error;
+	int i;
+	
+	ctx->pool = calloc(WEBDAV_WRITESEQ_POOL_SIZE, sizeof(struct seqwrite_mgr_req));
+	require_action(ctx->pool != NULL, calloc_pool, error = ENOMEM);
+	
+	ctx->mgr_buf = malloc(BODY_BUFFER_SIZE);
+	require_action(ctx->mgr_buf != NULL, malloc_mgr_buf, error = ENOMEM);
+	
+	error = pthread_cond_init(&ctx->pool_condvar, NULL);
+	require_noerr_action(error, pthread_cond_init, error = EIO);
+	
+	ctx->pool_free = NULL;
+	for ( i = 0; i < WEBDAV_WRITESEQ_POOL_SIZE; ++i ) {
+		error = pthread_mutex_init(&ctx->pool[i].req_lock, NULL);
+		require_noerr_action(error, pthread_mutex_init, error = EIO);
+		
+		error = pthread_cond_init(&ctx->pool[i].req_condvar, NULL);
+		require_noerr_action(error, pthread_cond_init, error = EIO);
+		
+		ctx->pool[i].pooled = true;
+		ctx->pool[i].next = ctx->pool_free;
+		ctx->pool_free = &ctx->pool[i];
+	}
+	
+	return (0);
+	
+pthread_mutex_init:
+pthread_cond_init:
+	/* cleanup_seq_write frees the rest with free_writemgr_pool */
+	return (error);
+
+malloc_mgr_buf:
+	free(ctx->pool);
+	ctx->pool = NULL;
+calloc_pool:
+	return (error);
+}
+
+/******************************************************************************/
+
+static void free_writemgr_pool(struct stream_put_ctx *ctx)
+{
+	int i;
+	
+	if (ctx->pool != NULL) {
+		for ( i = 0; i < WEBDAV_WRITESEQ_POOL_SIZE; ++i ) {
+			pthread_mutex_destroy(&ctx->pool[i].req_lock);
+			pthread_cond_destroy(&ctx->pool[i].req_condvar);
+		}
+		pthread_cond_destroy(&ctx->pool_condvar);
+		free(ctx->pool);
+		ctx->pool = NULL;
+		ctx->pool_free = NULL;
+	}
+	
+	if (ctx->mgr_buf != NULL) {
+		free(ctx->mgr_buf);
+		ctx->mgr_buf = NULL;
+	}
+}
+
 /******************************************************************************/
 
 int cleanup_seq_write(struct stream_put_ctx *ctx) 
@@ -3233,7 +3945,7 @@ int cleanup_seq_write(struct stream_put_ctx *ctx)
 	}
 	
 	error = ctx->finalStatus;
-	release_writemgr_request_locked(mgr_req);
+	release_writemgr_request_locked(ctx, mgr_req);
 	pthread_mutex_unlock(&ctx->ctx_lock);
 
 	/* clean up the streams */
@@ -3269,12 +3981,47 @@ int cleanup_seq_write(struct stream_put_ctx *ctx)
 		CFRelease(ctx->mgr_rl);
 		ctx->mgr_rl = NULL;
 	}
+	
+	free_writemgr_pool(ctx);
 
 	return (error);
 }
 
 /******************************************************************************/
 
+int cancel_seq_write(struct stream_put_ctx *ctx)
+{
+	if ( ctx == NULL ) {
+		syslog(LOG_ERR, "%s: context passed in was NULL", __FUNCTION__);
+		return (-1);
+	}
+	
+	// the manager stops without closing the write stream, so the server sees
+	// the connection drop in the middle of the body
+	pthread_mutex_lock(&ctx->ctx_lock);
+	if (ctx->finalStatusValid == false) {
+		ctx->finalStatus = ECANCELED;
+		ctx->finalStatusValid = true;
+	}
+	if (ctx->mgr_rl != NULL) {
+		// the manager may be waiting for the stream to take more bytes
+		CFRunLoopStop(ctx->mgr_rl);
+	}
+	pthread_mutex_unlock(&ctx->ctx_lock);
+	
+	return (cleanup_seq_write(ctx));
+}
+
+/******************************************************************************/
+
+int network_streamed_uploads(void)
+{
+	/* only if the mount asked for them (the streamedupload option) and the server hasn't refused one */
+	return ( gStreamedUploads && !gChunkedUploadsRefused );
+}
+
+/******************************************************************************/
+
 int network_open(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> node to open */
@@ -3329,8 +4076,10 @@ int network_open(
 		CFIndex statusCode;
 		UInt32 auth_generation;
 		int retryTransaction;
+		uint64_t start_time;
 				
 		error = 0;
+		start_time = stats_start();
 		message = NULL;
 		responseRef = NULL;
 		statusCode = 0;
@@ -3375,6 +4124,20 @@ int network_open(
 			/* add other HTTP headers */
 			CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Accept"), CFSTR("*/*"));
 			
+			/*
+			 * A download that picks up where an earlier one stopped asks for a byte range
+			 * of the unencoded file; anything else gets the whole body and can have it
+			 * compressed. read_response_body inflates it into the cache file.
+			 * A lockless open for writing needs the ETag of the unencoded file for
+			 * its If-Match, and an encoded response's ETag isn't that one.
+			 */
+			if ( (((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_NEVER) ||
+				  ((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_FINISHED)) &&
+				 !(write_access && gLocklessOpens) )
+			{
+				add_accept_encoding_header(message);
+			}
+			
 			/*
 			 * If the status isn't WEBDAV_DOWNLOAD_NEVER, we need to add some conditional headers.
 			 * If adding the headers fails, then we can continue without them -- it'll just
@@ -3452,6 +4215,10 @@ int network_open(
 
 CFHTTPMessageCreateRequest:
 		
+		/* only the synchronous part of the GET is measured -- the rest of the download happens in the background */
+		stats_record_http(WEBDAV_STATS_METHOD_GET, start_time, 0, error);
+		trace_record(WEBDAV_TRACE_HTTP, WEBDAV_STATS_METHOD_GET, node->fileid, start_time, 0, error);
+		
 		if ( error == 0 )
 		{
 			/* 304 Not Modified means the cache file is still good, so make it 200 before translating */
@@ -3483,7 +4250,24 @@ CFHTTPMessageCreateRequest:
 						node->file_last_modified = DateStringToTime(headerRef);
 						CFRelease(headerRef);
 					}
-					headerRef = CFHTTPMessageCopyHeaderFieldValue(responseRef, CFSTR("ETag"));
+					/*
+					 * Servers may give an encoded body an entity tag of its own, which
+					 * wouldn't match the file on a later If-Match, so only keep the tag
+					 * of an unencoded body. The tag we had is for an older version.
+					 */
+					if ( response_is_gzip_encoded(responseRef) )
+					{
+						headerRef = NULL;
+						if ( node->file_entity_tag != NULL )
+						{
+							free(node->file_entity_tag);
+							node->file_entity_tag = NULL;
+						}
+					}
+					else
+					{
+						headerRef = CFHTTPMessageCopyHeaderFieldValue(responseRef, CFSTR("ETag"));
+					}
 					if ( headerRef )
 					{
 						field_value = CFStringGetCStringPtr(headerRef, kCFStringEncodingUTF8);
@@ -3541,6 +4325,75 @@ create_cfurl_from_node:
 
 /******************************************************************************/
 
+int network_get_entity_tag(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> file node */
+	char **entity_tag)			/* <- the file's entity tag, or NULL if it has none (caller must free) */
+{
+	int error;
+	CFURLRef urlRef;
+	UInt8 *responseBuffer;
+	CFIndex count;
+	CFDataRef bodyData;
+	time_t last_modified;
+	/* the xml for the message body */
+	const UInt8 xmlString[] =
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<D:propfind xmlns:D=\"DAV:\">\n"
+			"<D:prop>\n"
+				"<D:getetag/>\n"
+			"</D:prop>\n"
+		"</D:propfind>\n";
+	/* the 3 headers */
+	CFIndex headerCount = 3;
+	struct HeaderFieldValue headers[] = {
+		{ CFSTR("Accept"), CFSTR("*/*") },
+		{ CFSTR("Content-Type"), CFSTR("text/xml") },
+		{ CFSTR("Depth"), CFSTR("0") },
+		{ CFSTR("translate"), CFSTR("f") }
+	};
+
+	if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
+		/* translate flag only for Microsoft IIS Server */
+		headerCount += 1;
+	}
+	
+	*entity_tag = NULL;
+	
+	/* create the message body with the xml */
+	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, xmlString, strlen((const char *)xmlString), kCFAllocatorNull);
+	require_action(bodyData != NULL, CFDataCreateWithBytesNoCopy, error = EIO);
+	
+	/* create a CFURL to the node */
+	urlRef = create_cfurl_from_node(node, NULL, 0);
+	require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
+	
+	/* send request to the server and get the response */
+	error = send_transaction(uid, urlRef, node, CFSTR("PROPFIND"), bodyData,
+		headerCount, headers, REDIRECT_AUTO, &responseBuffer, &count, NULL);
+	if ( !error )
+	{
+		/* parse responseBuffer to get the entity tag */
+		last_modified = -1;
+		error = parse_cachevalidators(responseBuffer, count, &last_modified, entity_tag);
+		/* free the response buffer */
+		free(responseBuffer);
+	}
+	
+	CFRelease(urlRef);
+
+create_cfurl_from_node:
+
+	/* release the message body */
+	CFRelease(bodyData);
+
+CFDataCreateWithBytesNoCopy:
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
 int network_statfs(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> root node */
@@ -3725,6 +4578,34 @@ static void create_http_request_message(CFHTTPMessageRef *message_p, CFURLRef ur
 
 /******************************************************************************/
 
+/*
+ * If node was opened for writing without a LOCK (see gLocklessOpens), makes
+ * the PUT conditional on the server's copy still being the one that was
+ * opened, so a change made by someone else isn't silently overwritten. If
+ * the file wasn't on the server when it was opened, the PUT may only create it.
+ */
+static void add_if_match_header(CFHTTPMessageRef message, struct node_entry *node)
+{
+	CFStringRef etagRef;
+	
+	if ( (node->file_locktoken == NULL) && (node->file_open_etag != NULL) && (strcmp(node->file_open_etag, "*") == 0) )
+	{
+		CFHTTPMessageSetHeaderFieldValue(message, CFSTR("If-None-Match"), CFSTR("*"));
+	}
+	else if ( (node->file_locktoken == NULL) && (node->file_open_etag != NULL) )
+	{
+		/* in the unlikely event that this fails, the PUT is unconditional */
+		etagRef = CFStringCreateWithCString(kCFAllocatorDefault, node->file_open_etag, kCFStringEncodingUTF8);
+		if ( etagRef != NULL )
+		{
+			CFHTTPMessageSetHeaderFieldValue(message, CFSTR("If-Match"), etagRef);
+			CFRelease(etagRef);
+		}
+	}
+}
+
+/******************************************************************************/
+
 static void add_last_mod_etag(CFHTTPMessageRef responseRef, time_t *file_last_modified, char **file_entity_tag) {
 	CFStringRef headerRef;
 	const char *field_value;
@@ -3862,6 +4743,12 @@ int setup_seq_write(
 		return (error);
 	}
 	
+	error = init_writemgr_pool(node->put_ctx);
+	if (error) {
+		syslog(LOG_ERR, "%s: init_writemgr_pool failed, error %d", __FUNCTION__, error);
+		return (error);
+	}
+	
 	/* create a CFURL to the node */
 	urlRef = create_cfurl_from_node(node, NULL, 0);
 	if (urlRef == NULL)
@@ -3895,6 +4782,7 @@ int setup_seq_write(
 	else
 	{
 		lockTokenRef = NULL;
+		add_if_match_header(node->put_ctx->request, node);
 	}
 	
 	/* apply credentials (if any) */
@@ -3974,6 +4862,7 @@ void network_seqwrite_manager(struct stream_put_ctx *ctx)
 	CFRunLoopSourceRef runLoopSource;
 	CFStreamError streamError;
 	CFIndex bytesWritten, len;
+	ssize_t bytesRead;
 	struct seqwrite_mgr_req *curr_req = NULL;
 	CFStringRef msgPortNameString = NULL;
 	int result;
@@ -4173,10 +5062,12 @@ void network_seqwrite_manager(struct stream_put_ctx *ctx)
 		// Are we all done?
 		if ((curr_req != NULL) && (curr_req->type == SEQWRITE_CLOSE)) {
 			// syslog(LOG_DEBUG, "%s: SEQWRITE_CLOSE, closing write stream", __FUNCTION__);
-			release_writemgr_request_locked(curr_req);
+			release_writemgr_request_locked(ctx, curr_req);
 			curr_req = NULL;
 			didReceiveClose = true;
-			CFWriteStreamClose(ctx->wrStreamRef);
+			// a cancelled write must not end the body, or the server would keep it
+			if (ctx->finalStatusValid == false)
+				CFWriteStreamClose(ctx->wrStreamRef);
 		}
 		
 		if (ctx->finalStatusValid == true) {
@@ -4197,14 +5088,15 @@ void network_seqwrite_manager(struct stream_put_ctx *ctx)
 					pthread_cond_signal(&curr_req->req_condvar);
 					pthread_mutex_unlock(&curr_req->req_lock);
 				}
-				release_writemgr_request_locked(curr_req);
+				release_writemgr_request_locked(ctx, curr_req);
 
 				curr_req = dequeue_writemgr_request_locked(ctx);
 			}
 
-			// signal cleanup thread and exit
+			// signal cleanup thread and any writers waiting for the window, and exit
 			ctx->mgr_status = WR_MGR_DONE;
 			pthread_cond_signal(&ctx->ctx_condvar);
+			pthread_cond_broadcast(&ctx->pool_condvar);
 			pthread_mutex_unlock(&ctx->ctx_lock);
 
 			break;
@@ -4214,22 +5106,35 @@ void network_seqwrite_manager(struct stream_put_ctx *ctx)
 		if ( (ctx->canAcceptBytesEvents !=0) && (curr_req != NULL)  && (didReceiveClose == false) ) {
 			pthread_mutex_unlock(&ctx->ctx_lock);
 			
+			// Refill mgr_buf from the cache file once the stream has taken all of it
+			if ( (ctx->mgr_buf_pos == ctx->mgr_buf_len) && (curr_req->chunkWritten < curr_req->chunkLen) ) {
+				bytesRead = pread(curr_req->fd, ctx->mgr_buf,
+					(size_t)MIN(curr_req->chunkLen - curr_req->chunkWritten, BODY_BUFFER_SIZE),
+					curr_req->offset + curr_req->chunkWritten);
+				if (bytesRead < 0) {
+					syslog(LOG_ERR, "%s: pread() cache file returned error %d", __FUNCTION__, errno);
+					complete_writemgr_request(ctx, curr_req, EIO);
+					curr_req = NULL;
+					continue;
+				}
+				if (bytesRead == 0) {
+					// the cache file is shorter than the kernel said -- send what there is
+					curr_req->chunkLen = curr_req->chunkWritten;
+				}
+				ctx->mgr_buf_len = bytesRead;
+				ctx->mgr_buf_pos = 0;
+			}
+			
 			// Now write the data
-			len = curr_req->chunkLen - curr_req->chunkWritten;
+			len = ctx->mgr_buf_len - ctx->mgr_buf_pos;
 			if (len <= 0) {
 				// syslog(LOG_DEBUG,"%s: chunk written succesfully",__FUNCTION__);
 				
-				if (len < 0)
-					 syslog(LOG_DEBUG,"%s: negative len value %ld for chunkLen %ld, chunkWritten %ld",
-							__FUNCTION__, len, curr_req->chunkLen, curr_req->chunkWritten);
+				if (curr_req->chunkWritten != curr_req->chunkLen)
+					 syslog(LOG_DEBUG,"%s: chunkWritten %ld is not chunkLen %ld",
+							__FUNCTION__, curr_req->chunkWritten, curr_req->chunkLen);
 						
-				// wake thread sleeping on this request
-				pthread_mutex_lock(&curr_req->req_lock);
-				curr_req->error = 0;
-				curr_req->request_done = true;
-				pthread_cond_signal(&curr_req->req_condvar);
-				pthread_mutex_unlock(&curr_req->req_lock);
-				release_writemgr_request(ctx, curr_req);
+				complete_writemgr_request(ctx, curr_req, 0);
 				curr_req = NULL;
 				continue;
 			} else {
@@ -4239,7 +5144,7 @@ void network_seqwrite_manager(struct stream_put_ctx *ctx)
 				pthread_mutex_lock(&ctx->ctx_lock);
 				ctx->canAcceptBytesEvents--;
 				pthread_mutex_unlock(&ctx->ctx_lock);
-				bytesWritten = CFWriteStreamWrite(ctx->wrStreamRef, (UInt8*)(curr_req->data + curr_req->chunkWritten), len);
+				bytesWritten = CFWriteStreamWrite(ctx->wrStreamRef, (UInt8*)(ctx->mgr_buf + ctx->mgr_buf_pos), len);
 					
 				if (bytesWritten < 0 ) {
 					// bad
@@ -4255,13 +5160,7 @@ void network_seqwrite_manager(struct stream_put_ctx *ctx)
 						syslog(LOG_DEBUG,"%s: bytesWritten < 0, CFStreamError: domain %ld, error %lld (retrying)",
 							__FUNCTION__, streamError.domain, (SInt64)streamError.error);
 
-						// wake thread sleeping on this request
-						pthread_mutex_lock(&curr_req->req_lock);
-						curr_req->error = EAGAIN;
-						curr_req->request_done = true;
-						pthread_cond_signal(&curr_req->req_condvar);
-						pthread_mutex_unlock(&curr_req->req_lock);
-						release_writemgr_request(ctx, curr_req);
+						complete_writemgr_request(ctx, curr_req, EAGAIN);
 						curr_req = NULL;
 					}
 					else
@@ -4273,18 +5172,15 @@ void network_seqwrite_manager(struct stream_put_ctx *ctx)
 						}
 						set_connectionstate(WEBDAV_CONNECTION_DOWN);							
 							
-						// wake thread sleeping on this request
-						pthread_mutex_lock(&curr_req->req_lock);
-						curr_req->error = EIO;
-						curr_req->request_done = true;
-						pthread_cond_signal(&curr_req->req_condvar);
-						pthread_mutex_unlock(&curr_req->req_lock);
-						release_writemgr_request(ctx, curr_req);
+						complete_writemgr_request(ctx, curr_req, EIO);
 						curr_req = NULL;
 					}
 				}
-				else
+				else {
+					ctx->mgr_buf_pos += bytesWritten;
+					ctx->bytes_sent += bytesWritten;
 					curr_req->chunkWritten += bytesWritten;
+				}
 			}
 		}		
 		else
@@ -4345,6 +5241,12 @@ int queue_writemgr_request_locked(struct stream_put_ctx *ctx, struct seqwrite_mg
 	// Add a reference
 	req->refCount++;
 	
+	// The manager looks at the queue before it sleeps, so it only
+	// needs waking if it may have found the queue empty
+	if (req != ctx->req_head) {
+		return (0);
+	}
+	
 	// fire manager's runloop source
 	status = CFMessagePortSendRequest(
 		ctx->mgrPort,
@@ -4386,16 +5288,24 @@ struct seqwrite_mgr_req *dequeue_writemgr_request_locked(struct stream_put_ctx *
 
 /******************************************************************************/
 // Note: ctx->lock must be held before calling this routine
-void release_writemgr_request_locked(struct seqwrite_mgr_req *req)
+void release_writemgr_request_locked(struct stream_put_ctx *ctx, struct seqwrite_mgr_req *req)
 {
 	if (req->refCount)
 		req->refCount--;
 	
 	if (req->refCount == 0) {
-		// no references remain, can free now
-		if (req->data != NULL)
-			free(req->data);
-		free(req);
+		// no references remain, so its bytes leave the window
+		ctx->window_bytes -= req->windowLen;
+		req->windowLen = 0;
+		if (req->pooled) {
+			// give it back to the pool
+			req->next = ctx->pool_free;
+			ctx->pool_free = req;
+			pthread_cond_broadcast(&ctx->pool_condvar);
+		}
+		else {
+			free(req);
+		}
 	}
 }
 
@@ -4403,75 +5313,169 @@ void release_writemgr_request_locked(struct seqwrite_mgr_req *req)
 void release_writemgr_request(struct stream_put_ctx *ctx, struct seqwrite_mgr_req *req)
 {
 	pthread_mutex_lock(&ctx->ctx_lock);
-	release_writemgr_request_locked(req);
+	release_writemgr_request_locked(ctx, req);
 	pthread_mutex_unlock(&ctx->ctx_lock);								
 }
 
+/******************************************************************************/
+// Note: ctx->lock must be held before calling this routine.
+// Waits for a descriptor to come back to the pool if they're all in use, and
+// for count bytes to fit in the gWriteSeqWindow bytes allowed in flight. A
+// chunk larger than the window only has to wait for the window to empty.
+// The count bytes are charged to the window until the descriptor's last
+// reference is released.
+// Returns NULL if the manager stopped making progress or the sequential write failed.
+struct seqwrite_mgr_req *get_writemgr_request_locked(struct stream_put_ctx *ctx, size_t count)
+{
+	struct seqwrite_mgr_req *req;
+	struct timespec timeout;
+	off_t lastSent;
+	uint64_t start;
+	int stalled;
+	
+	timeout.tv_sec = time(NULL) + WEBDAV_WRITESEQ_REQUEST_TIMEOUT;
+	timeout.tv_nsec = 0;
+	lastSent = ctx->bytes_sent;
+	start = 0;
+	stalled = FALSE;
+	while ( ((ctx->pool_free == NULL) ||
+			 ((ctx->window_bytes != 0) && (ctx->window_bytes + (off_t)count > (off_t)gWriteSeqWindow))) &&
+			(ctx->finalStatusValid == false) ) {
+		if ( !stalled ) {
+			stalled = TRUE;
+			start = stats_start();
+		}
+		if (pthread_cond_timedwait(&ctx->pool_condvar, &ctx->ctx_lock, &timeout) == ETIMEDOUT) {
+			if (ctx->bytes_sent == lastSent) {
+				break;
+			}
+			// the manager is still sending, so keep waiting
+			lastSent = ctx->bytes_sent;
+			timeout.tv_sec = time(NULL) + WEBDAV_WRITESEQ_REQUEST_TIMEOUT;
+		}
+	}
+	
+	if ( stalled ) {
+		stats_increment(WEBDAV_STATS_WRITESEQ_WINDOW_STALLS);
+		stats_add(WEBDAV_STATS_WRITESEQ_WINDOW_STALL_USEC, (int64_t)stats_elapsed_usec(start));
+	}
+	
+	req = ctx->pool_free;
+	if ( (req != NULL) && (ctx->window_bytes != 0) &&
+		 (ctx->window_bytes + (off_t)count > (off_t)gWriteSeqWindow) ) {
+		// timed out waiting for room in the window
+		req = NULL;
+	}
+	if ( (req != NULL) && (ctx->finalStatusValid == false) ) {
+		ctx->pool_free = req->next;
+		
+		// everything but the lock, condvar and pooled flag starts over
+		req->type = SEQWRITE_CHUNK;
+		req->prev = req->next = NULL;
+		req->req = NULL;
+		req->request_done = false;
+		req->is_retry = 0;
+		req->error = 0;
+		req->fd = -1;
+		req->offset = 0;
+		req->chunkLen = req->chunkWritten = 0;
+		req->async = false;
+		req->refCount = 1;	// the caller's reference
+		
+		// charge the chunk to the window
+		req->windowLen = (CFIndex)count;
+		ctx->window_bytes += (off_t)count;
+		stats_increment(WEBDAV_STATS_WRITESEQ_CHUNKS);
+		stats_add(WEBDAV_STATS_WRITESEQ_WINDOW_BYTES, (int64_t)ctx->window_bytes);
+	}
+	else {
+		req = NULL;
+	}
+	
+	return (req);
+}
+
 /******************************************************************************/
 
-int network_fsync(
+/*
+ * put_from_file
+ *
+ * PUTs length bytes of node's cache file starting at offset, or the whole
+ * file if length is -1, answering authentication challenges along the way.
+ * A range that doesn't start at byte 0 is sent as a partial PUT with a
+ * Content-Range header. PUTs to the node are conditional on its lock token or,
+ * for a lockless open, its entity tag; PUTs of a range after the first to a
+ * temporary resource are conditional on the entity tag the previous range
+ * left it with. The last request and response are left in *message
+ * and *responseRef for the caller to release, and the response's status code
+ * in *statusCode.
+ */
+static int put_from_file(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> node to sync with server */
-	off_t *file_length,			/* <- length of file */
-	time_t *file_last_modified)	/* <- date of last modification */
+	CFURLRef urlRef,			/* -> url to the node, or to the temporary resource of a resumable upload */
+	int upload,					/* -> TRUE if urlRef is the temporary resource of a resumable upload */
+	const char *upload_etag,	/* -> if upload, the entity tag the previous range left the temporary resource with, or NULL */
+	off_t offset,				/* -> first byte of the cache file to send */
+	off_t length,				/* -> number of bytes to send, or -1 to send the whole file */
+	off_t file_length,			/* -> length of the cache file */
+	CFHTTPMessageRef *message,	/* <> the request */
+	CFHTTPMessageRef *responseRef,	/* <> the response */
+	UInt32 *auth_generation,	/* <> the authcache generation of the credentials applied */
+	CFIndex *statusCode)		/* <- the status code of the response, or 0 if there wasn't one */
 {
 	int error;
-	CFURLRef urlRef;
-	CFHTTPMessageRef message;
-	CFHTTPMessageRef responseRef;
-	CFIndex statusCode;
-	UInt32 auth_generation;
-	CFStringRef lockTokenRef;
-	char *file_entity_tag;
 	int retryTransaction;
+	CFStringRef lockTokenRef;
+	CFStringRef contentRangeRef;
+	CFStringRef ifMatchRef;
 	
 	error = 0;
-	*file_last_modified = -1;
-	*file_length = -1;
-	file_entity_tag = NULL;
-	message = NULL;
-	responseRef = NULL;
-	statusCode = 0;
-	auth_generation = 0;
+	*statusCode = 0;
 	retryTransaction = TRUE;
-	off_t contentLength;
-	
-	/* create a CFURL to the node */
-	urlRef = create_cfurl_from_node(node, NULL, 0);
-	require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
-
-	/* get the file length */
-	contentLength = lseek(node->file_fd, 0LL, SEEK_END);	
-	
-	/* set the file position back to 0 */
-	lseek(node->file_fd, 0LL, SEEK_SET);
-
 	
-	// If this file is large, turn off data caching during the upload
-	if (contentLength > (off_t)webdavCacheMaximumSize)
-		fcntl(node->file_fd, F_NOCACHE, 1);
-
 	/* the transaction/authentication loop */
 	do
 	{
-		create_http_request_message(&message, urlRef, 0);
-		require_action(message != NULL, CFHTTPMessageCreateRequest, error = EIO);
+		create_http_request_message(message, urlRef, 0);
+		require_action(*message != NULL, CFHTTPMessageCreateRequest, error = EIO);
 		
+		if ( upload )
+		{
+			/* a range after the first must add to exactly the bytes the earlier ranges left */
+			if ( (offset != 0) && (upload_etag != NULL) )
+			{
+				ifMatchRef = CFStringCreateWithCString(kCFAllocatorDefault, upload_etag, kCFStringEncodingUTF8);
+				require_action(ifMatchRef != NULL, CFStringCreateWithCString, error = ENOMEM);
+				CFHTTPMessageSetHeaderFieldValue(*message, CFSTR("If-Match"), ifMatchRef);
+				CFRelease(ifMatchRef);
+			}
+		}
 		/* is there a lock token? */
-		if ( node->file_locktoken != NULL )
+		else if ( node->file_locktoken != NULL )
 		{
 			/* in the unlikely event that this fails, the PUT may fail */
 			lockTokenRef = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("(<%s>)"), node->file_locktoken);
 			if ( lockTokenRef != NULL )
 			{
-				CFHTTPMessageSetHeaderFieldValue(message, CFSTR("If"), lockTokenRef );
+				CFHTTPMessageSetHeaderFieldValue(*message, CFSTR("If"), lockTokenRef );
 				CFRelease(lockTokenRef);
 				lockTokenRef = NULL;
 			}
 		}
 		else
 		{
-			lockTokenRef = NULL;
+			add_if_match_header(*message, node);
+		}
+		
+		/* a range after the first byte replaces only those bytes */
+		if ( offset != 0 )
+		{
+			contentRangeRef = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("bytes %qd-%qd/%qd"),
+				offset, offset + length - 1, file_length);
+			require_action(contentRangeRef != NULL, CFStringCreateWithFormat, error = ENOMEM);
+			CFHTTPMessageSetHeaderFieldValue(*message, CFSTR("Content-Range"), contentRangeRef);
+			CFRelease(contentRangeRef);
 		}
 		
 		/* apply credentials (if any) */
@@ -4479,40 +5483,446 @@ int network_fsync(
 		 * statusCode will be 401 or 407 and responseRef will not be NULL if we've already been through the loop;
 		 * statusCode will be 0 and responseRef will be NULL if this is the first time through.
 		 */
-		error = authcache_apply(uid, message, (UInt32)statusCode, responseRef, &auth_generation);
+		error = authcache_apply(uid, *message, (UInt32)*statusCode, *responseRef, auth_generation);
 		if ( error != 0 )
 		{
 			break;
 		}
 		
 		/* stream_transaction returns responseRef so release it if left from previous loop */
-		if ( responseRef != NULL )
+		if ( *responseRef != NULL )
 		{
-			CFRelease(responseRef);
-			responseRef = NULL;
+			CFRelease(*responseRef);
+			*responseRef = NULL;
 		}
 		/* now that everything's ready to send, send it */
 		
-		error = stream_transaction_from_file(message, node->file_fd, &retryTransaction, &responseRef);
+		error = stream_transaction_from_file(*message, node->file_fd, offset, length, &retryTransaction, responseRef);
 		if ( error == EAGAIN )
 		{
-			statusCode = 0;
+			*statusCode = 0;
 			/* responseRef will be left NULL on retries */
 		}
 		else if ( error != 0 )
 		{
+			*statusCode = 0;
 			break;
 		}
 		else
 		{
 			/* get the status code */
-			statusCode = CFHTTPMessageGetResponseStatusCode(responseRef);
+			*statusCode = CFHTTPMessageGetResponseStatusCode(*responseRef);
 		}
 
-	} while ( error == EAGAIN || statusCode == 401 || statusCode == 407 );
+	} while ( error == EAGAIN || *statusCode == 401 || *statusCode == 407 );
 
+CFStringCreateWithFormat:
+CFStringCreateWithCString:
 CFHTTPMessageCreateRequest:
 
+	return ( error );
+}
+
+/******************************************************************************/
+
+/*
+ * Creates the URL of the temporary resource a resumable upload of node is
+ * sent to: ".<name>.webdavfs-upload" in node's parent collection.
+ */
+static CFURLRef create_upload_url(struct node_entry *node)
+{
+	CFURLRef uploadUrlRef;
+	char *upload_name;
+	int upload_name_length;
+	
+	uploadUrlRef = NULL;
+	require_quiet(node->parent != NULL, no_parent);
+	
+	upload_name_length = asprintf(&upload_name, ".%.*s.webdavfs-upload", (int)node->name_length, node->name);
+	require(upload_name_length > 0, asprintf);
+	
+	uploadUrlRef = create_cfurl_from_node(node->parent, upload_name, (size_t)upload_name_length);
+	free(upload_name);
+
+asprintf:
+no_parent:
+	
+	return ( uploadUrlRef );
+}
+
+/******************************************************************************/
+
+/* replaces node->upload_etag with the strong entity tag in responseRef (if not NULL), if any */
+static void set_upload_etag(struct node_entry *node, CFHTTPMessageRef responseRef)
+{
+	time_t last_modified;
+	char *entity_tag;
+	
+	entity_tag = NULL;
+	if ( responseRef != NULL )
+	{
+		add_last_mod_etag(responseRef, &last_modified, &entity_tag);
+	}
+	
+	/* If-Match only matches strong entity tags */
+	if ( (entity_tag != NULL) && (strncmp(entity_tag, "W/", 2) == 0) )
+	{
+		free(entity_tag);
+		entity_tag = NULL;
+	}
+	
+	if ( node->upload_etag != NULL )
+	{
+		free(node->upload_etag);
+	}
+	node->upload_etag = entity_tag;
+}
+
+/******************************************************************************/
+
+/* deletes the temporary resource of an upload that won't be finished */
+static void delete_upload_resource(uid_t uid, CFURLRef uploadUrlRef)
+{
+	CFIndex headerCount = 1;
+	struct HeaderFieldValue headers[] = {
+		{ CFSTR("Accept"), CFSTR("*/*") },
+		{ CFSTR("translate"), CFSTR("f") }
+	};
+	
+	if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
+		/* translate flag only for Microsoft IIS Server */
+		headerCount += 1;
+	}
+	
+	/* nothing we can do if this fails -- it's only a stray hidden file */
+	(void) send_transaction(uid, uploadUrlRef, NULL, CFSTR("DELETE"), NULL, headerCount, headers, REDIRECT_DISABLE, NULL, NULL, NULL);
+}
+
+/******************************************************************************/
+
+/*
+ * move_upload_resource
+ *
+ * MOVEs the completed temporary resource of a resumable upload over node.
+ * The MOVE carries the same condition a PUT to node would: the lock token,
+ * or for a lockless open the entity tag the file had when it was opened (or,
+ * if it wasn't on the server then, no overwriting).
+ * The response is left in *responseRef and its status code in *statusCode.
+ */
+static int move_upload_resource(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> node being synced */
+	CFURLRef urlRef,			/* -> url to the node */
+	CFURLRef uploadUrlRef,		/* -> url to the temporary resource */
+	CFHTTPMessageRef *responseRef,	/* <> the response */
+	CFIndex *statusCode)		/* <- the status code of the response, or 0 if there wasn't one */
+{
+	int error;
+	CFStringRef ifRef;
+	CFHTTPMessageRef response;
+	CFIndex headerCount;
+	struct HeaderFieldValue headers[] = {
+		{ CFSTR("Accept"), CFSTR("*/*") },
+		{ CFSTR("Destination"), NULL },
+		{ CFSTR("Overwrite"), CFSTR("T") },
+		{ CFSTR("If"), NULL },
+		{ CFSTR("translate"), CFSTR("f") }
+	};
+	
+	*statusCode = 0;
+	ifRef = NULL;
+	response = NULL;
+	
+	headers[1].value = CFURLGetString(urlRef);
+	require_action(headers[1].value != NULL, CFURLGetString, error = EIO);
+	
+	/* the condition is on the destination, so it's tagged with its URL */
+	if ( node->file_locktoken != NULL )
+	{
+		ifRef = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("<%@> (<%s>)"), headers[1].value, node->file_locktoken);
+		require_action(ifRef != NULL, CFStringCreateWithFormat, error = ENOMEM);
+	}
+	else if ( (node->file_open_etag != NULL) && (strcmp(node->file_open_etag, "*") == 0) )
+	{
+		headers[2].value = CFSTR("F");
+	}
+	else if ( node->file_open_etag != NULL )
+	{
+		ifRef = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("<%@> ([%s])"), headers[1].value, node->file_open_etag);
+		require_action(ifRef != NULL, CFStringCreateWithFormat, error = ENOMEM);
+	}
+	
+	if ( ifRef != NULL )
+	{
+		headers[3].value = ifRef;
+		headerCount = 4;
+		if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
+			/* translate flag only for Microsoft IIS Server */
+			headerCount += 1;
+		}
+	}
+	else
+	{
+		/* no If header */
+		headers[3] = headers[4];
+		headerCount = 3;
+		if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
+			/* translate flag only for Microsoft IIS Server */
+			headerCount += 1;
+		}
+	}
+	
+	error = send_transaction(uid, uploadUrlRef, NULL, CFSTR("MOVE"), NULL,
+		headerCount, headers, REDIRECT_DISABLE, NULL, NULL, &response);
+	if ( response != NULL )
+	{
+		/* the caller translates the status code, like it does a PUT's */
+		if ( *responseRef != NULL )
+		{
+			CFRelease(*responseRef);
+		}
+		*responseRef = response;
+		*statusCode = CFHTTPMessageGetResponseStatusCode(response);
+		error = 0;
+	}
+	
+	if ( ifRef != NULL )
+	{
+		CFRelease(ifRef);
+	}
+
+CFStringCreateWithFormat:
+CFURLGetString:
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+/*
+ * put_file_resumable
+ *
+ * PUTs node's cache file in RESUMABLE_UPLOAD_SEGMENT byte ranges to a
+ * temporary resource, recording in the node how much of it the server has,
+ * then MOVEs the temporary resource over the file. If the connection fails,
+ * the range is resent once the connection is back (or after a while), and if
+ * that doesn't work, a later call for the unchanged cache file starts with the
+ * range after the last one the server took -- provided the temporary resource
+ * still has the entity tag that range left it with. Falls back to a PUT of the
+ * whole file if the server turns out not to handle partial PUTs.
+ */
+static int put_file_resumable(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> node to sync with server */
+	CFURLRef urlRef,			/* -> url to the node */
+	off_t file_length,			/* -> length of the cache file */
+	CFHTTPMessageRef *message,	/* <> the last request */
+	CFHTTPMessageRef *responseRef,	/* <> the last response */
+	UInt32 *auth_generation,	/* <> the authcache generation of the credentials applied */
+	CFIndex *statusCode)		/* <- the status code of the last response */
+{
+	int error;
+	int attempts;
+	int waited;
+	int refused;
+	int restarted;
+	off_t offset;
+	off_t length;
+	uid_t lock_uid;
+	struct stat cache_stat;
+	struct webdav_stat_attr statbuf;
+	CFURLRef uploadUrlRef;
+	
+	uploadUrlRef = create_upload_url(node);
+	if ( uploadUrlRef == NULL )
+	{
+		/* nowhere to put the temporary resource, so send the whole file */
+		return ( put_from_file(uid, node, urlRef, FALSE, NULL, 0, -1, file_length, message, responseRef, auth_generation, statusCode) );
+	}
+	
+	require_action(fstat(node->file_fd, &cache_stat) == 0, fstat, error = errno);
+	
+	/*
+	 * Pick up where an interrupted upload of this same cache file stopped. The
+	 * next range is sent with If-Match on the entity tag the last range left
+	 * the temporary resource with, so if the server's copy isn't what we think
+	 * it is, the upload starts over.
+	 */
+	offset = 0;
+	if ( (node->upload_committed > 0) && (node->upload_etag != NULL) && (node->upload_length == file_length) &&
+		 (node->upload_mtime.tv_sec == cache_stat.st_mtimespec.tv_sec) &&
+		 (node->upload_mtime.tv_nsec == cache_stat.st_mtimespec.tv_nsec) )
+	{
+		offset = node->upload_committed;
+		stats_increment(WEBDAV_STATS_UPLOAD_RESUMED);
+		stats_add(WEBDAV_STATS_UPLOAD_RESUMED_BYTES, (int64_t)offset);
+	}
+	node->upload_committed = offset;
+	node->upload_length = file_length;
+	node->upload_mtime = cache_stat.st_mtimespec;
+	
+	error = 0;
+	attempts = 0;
+	restarted = FALSE;
+	while ( offset < file_length )
+	{
+		length = MIN(RESUMABLE_UPLOAD_SEGMENT, file_length - offset);
+		error = put_from_file(uid, node, uploadUrlRef, TRUE, node->upload_etag, offset, length, file_length,
+			message, responseRef, auth_generation, statusCode);
+		
+		if ( (error == 0) && (*statusCode == 412) && (offset != 0) && !restarted )
+		{
+			/* the temporary resource isn't what the last range left -- start over */
+			syslog(LOG_INFO, "%s: upload resource changed on the server, restarting the upload", __FUNCTION__);
+			restarted = TRUE;
+			offset = 0;
+			node->upload_committed = 0;
+			continue;
+		}
+		
+		refused = (error == 0) && (offset != 0) &&
+			((*statusCode == 400) || (*statusCode == 416) || (*statusCode == 501));
+		if ( (error == 0) && (*statusCode / 100 == 2) && (offset != 0) && (gPartialPutSupport == PARTIAL_PUT_UNKNOWN) )
+		{
+			/*
+			 * Servers that don't know about Content-Range on a PUT may store the
+			 * range as the whole resource, so make sure this one appended it.
+			 */
+			if ( (network_stat(uid, node, uploadUrlRef, REDIRECT_DISABLE, &statbuf) == 0) &&
+				 (statbuf.attr_stat.st_size == offset + length) )
+			{
+				gPartialPutSupport = PARTIAL_PUT_SUPPORTED;
+			}
+			else
+			{
+				refused = TRUE;
+			}
+		}
+		
+		if ( (error == 0) && (*statusCode / 100 == 2) && !refused )
+		{
+			/* the server has this range */
+			stats_increment(WEBDAV_STATS_UPLOAD_SEGMENTS);
+			set_upload_etag(node, *responseRef);
+			offset += length;
+			node->upload_committed = offset;
+			attempts = 0;
+			continue;
+		}
+		
+		if ( refused )
+		{
+			/* the server doesn't do partial PUTs, so send the whole file */
+			syslog(LOG_INFO, "%s: server does not support partial PUTs (status %ld), sending whole files", __FUNCTION__, (long)*statusCode);
+			gPartialPutSupport = PARTIAL_PUT_UNSUPPORTED;
+			node->upload_committed = 0;
+			delete_upload_resource(uid, uploadUrlRef);
+			error = put_from_file(uid, node, urlRef, FALSE, NULL, 0, -1, file_length, message, responseRef, auth_generation, statusCode);
+			goto done;
+		}
+		
+		if ( (error != 0) && (*statusCode == 0) && !gSuppressAllUI &&
+			 (get_connectionstate() == WEBDAV_CONNECTION_DOWN) && (++attempts <= RESUMABLE_UPLOAD_RETRIES) )
+		{
+			/*
+			 * The connection was lost. The server ping sets the connection state
+			 * back to up when the server answers again; then resend the range.
+			 */
+			stats_increment(WEBDAV_STATS_UPLOAD_RETRIED);
+			for ( waited = 0; (waited < RESUMABLE_UPLOAD_WAIT) && (get_connectionstate() == WEBDAV_CONNECTION_DOWN); ++waited )
+			{
+				sleep(1);
+			}
+			continue;
+		}
+		
+		/* give up for now; the file on the server is untouched and node->upload_committed says where the next try starts */
+		goto done;
+	}
+	
+	/* the temporary resource has the whole file -- put it in the file's place */
+	error = move_upload_resource(uid, node, urlRef, uploadUrlRef, responseRef, statusCode);
+	if ( (error == 0) && (*statusCode / 100 == 2) )
+	{
+		/* all done -- there's nothing to resume */
+		node->upload_committed = 0;
+		set_upload_etag(node, NULL);
+		
+		/*
+		 * Overwriting a resource with MOVE deletes it first (rfc 4918, section
+		 * 9.9.3), and the lock with it, so take a new lock. If the server kept
+		 * the old lock, this fails and the old lock token stays.
+		 */
+		if ( node->file_locktoken != NULL )
+		{
+			lock_uid = node->file_locktoken_uid;
+			(void) network_lock(lock_uid, FALSE, node);
+		}
+	}
+
+done:
+fstat:
+	
+	CFRelease(uploadUrlRef);
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+int network_fsync(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> node to sync with server */
+	off_t *file_length,			/* <- length of file */
+	time_t *file_last_modified)	/* <- date of last modification */
+{
+	int error;
+	CFURLRef urlRef;
+	CFHTTPMessageRef message;
+	CFHTTPMessageRef responseRef;
+	CFIndex statusCode;
+	UInt32 auth_generation;
+	char *file_entity_tag;
+	int lock_needed;
+	
+	error = 0;
+	*file_last_modified = -1;
+	*file_length = -1;
+	file_entity_tag = NULL;
+	lock_needed = FALSE;
+	message = NULL;
+	responseRef = NULL;
+	statusCode = 0;
+	auth_generation = 0;
+	off_t contentLength;
+	uint64_t start_time;
+	
+	start_time = stats_start();
+	
+	/* create a CFURL to the node */
+	urlRef = create_cfurl_from_node(node, NULL, 0);
+	require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
+
+	/* get the file length */
+	contentLength = lseek(node->file_fd, 0LL, SEEK_END);	
+	
+	/* set the file position back to 0 */
+	lseek(node->file_fd, 0LL, SEEK_SET);
+
+	
+	// If this file is large, turn off data caching during the upload
+	if (contentLength > (off_t)webdavCacheMaximumSize)
+		fcntl(node->file_fd, F_NOCACHE, 1);
+
+	if ( (contentLength >= RESUMABLE_UPLOAD_MIN) && (gPartialPutSupport != PARTIAL_PUT_UNSUPPORTED) )
+	{
+		error = put_file_resumable(uid, node, urlRef, contentLength, &message, &responseRef, &auth_generation, &statusCode);
+	}
+	else
+	{
+		error = put_from_file(uid, node, urlRef, FALSE, NULL, 0, -1, contentLength, &message, &responseRef, &auth_generation, &statusCode);
+	}
+
 	if ( error == 0 )
 	{
 		error = translate_status_to_error((UInt32)statusCode);
@@ -4527,8 +5937,17 @@ CFHTTPMessageCreateRequest:
 			(void) authcache_valid(uid, message, auth_generation);
 			add_last_mod_etag(responseRef, file_last_modified, &file_entity_tag);
 		}
+		else if ( (statusCode == 412) && (node->file_open_etag != NULL) )
+		{
+			syslog(LOG_ERR, "%s: file changed on the server since it was opened, not replacing it", __FUNCTION__);
+			stats_increment(WEBDAV_STATS_LOCKLESS_CONFLICT);
+		}
 	}
 	
+	stats_record_http(WEBDAV_STATS_METHOD_PUT, start_time, (contentLength > 0) ? contentLength : 0, error);
+	trace_record(WEBDAV_TRACE_HTTP, WEBDAV_STATS_METHOD_PUT, node->fileid, start_time,
+		(contentLength > 0) ? contentLength : 0, error);
+	
 	if ( message != NULL )
 	{
 		CFRelease(message);
@@ -4539,12 +5958,22 @@ CFHTTPMessageCreateRequest:
 		CFRelease(responseRef);
 	}
 	
-	if ( (error == 0) && (*file_last_modified == -1) && (file_entity_tag == NULL) )
+	/* a lockless open's next PUT is conditional on the strong entity tag this one leaves */
+	if ( (error == 0) && (node->file_open_etag != NULL) &&
+		 (file_entity_tag != NULL) && (strncmp(file_entity_tag, "W/", 2) == 0) )
+	{
+		free(file_entity_tag);
+		file_entity_tag = NULL;
+	}
+	
+	if ( (error == 0) && (((*file_last_modified == -1) && (file_entity_tag == NULL)) ||
+						  ((node->file_open_etag != NULL) && (file_entity_tag == NULL))) )
 	{
 		int propError;
 		UInt8 *responseBuffer;
 		CFIndex count;
 		CFDataRef bodyData;
+		time_t prop_last_modified;
 		/* the xml for the message body */
 		const UInt8 xmlString[] =
 			"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
@@ -4581,7 +6010,11 @@ CFHTTPMessageCreateRequest:
 		if ( propError == 0 )
 		{
 			/* parse responseBuffer to get file_last_modified and/or file_entity_tag */
-			propError = parse_cachevalidators(responseBuffer, count, file_last_modified, &file_entity_tag);
+			propError = parse_cachevalidators(responseBuffer, count, &prop_last_modified, &file_entity_tag);
+			if ( *file_last_modified == -1 )
+			{
+				*file_last_modified = prop_last_modified;
+			}
 			/* free the response buffer */
 			free(responseBuffer);
 		}
@@ -4606,8 +6039,30 @@ create_cfurl_from_node:
 		}
 		node->file_entity_tag = file_entity_tag;
 		
+		/* the next PUT from this open replaces what this one stored */
+		if ( node->file_open_etag != NULL )
+		{
+			free(node->file_open_etag);
+			node->file_open_etag = NULL;
+			if ( (file_entity_tag != NULL) && (strncmp(file_entity_tag, "W/", 2) != 0) )
+			{
+				node->file_open_etag = strdup(file_entity_tag);
+			}
+			if ( node->file_open_etag == NULL )
+			{
+				/* nothing to make the next PUT conditional on, so don't PUT unconditionally -- LOCK */
+				stats_increment(WEBDAV_STATS_LOCKLESS_LOCKED);
+				lock_needed = TRUE;
+			}
+		}
+		
 		/* get the file length */
 		*file_length = lseek(node->file_fd, 0LL, SEEK_END);
+		
+		if ( lock_needed )
+		{
+			error = network_lock(uid, FALSE, node);
+		}
 	}
 
 	return ( error );
@@ -4730,7 +6185,8 @@ static int network_delete(
 	uid_t uid,					/* -> uid of the user making the request */
 	CFURLRef urlRef,			/* -> url to delete */
 	struct node_entry *node,	/* -> node to remove on the server */
-	time_t *remove_date)		/* <- date of the removal */
+	time_t *remove_date,		/* <- date of the removal */
+	CFIndex *failedStatusCode)	/* <- if not NULL, the HTTP status of a DELETE the server failed, or 0 */
 {
 	int error;
 	CFStringRef lockTokenRef;
@@ -4753,6 +6209,10 @@ static int network_delete(
 	};
 
 	*remove_date = -1;
+	if ( failedStatusCode != NULL )
+	{
+		*failedStatusCode = 0;
+	}
 	
 	responseRef = NULL;
 	urlStrRef = NULL;
@@ -4854,6 +6314,14 @@ static int network_delete(
 
 		CFRelease(responseRef);
 	}
+	else if ( responseRef != NULL )
+	{
+		if ( failedStatusCode != NULL )
+		{
+			*failedStatusCode = CFHTTPMessageGetResponseStatusCode(responseRef);
+		}
+		CFRelease(responseRef);
+	}
 	
 	if ( lockTokenRef != NULL )
 	{
@@ -4868,7 +6336,8 @@ static int network_delete(
 int network_remove(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> file node to remove on the server */
-	time_t *remove_date)		/* <- date of the removal */
+	time_t *remove_date,		/* <- date of the removal */
+	CFIndex *failedStatusCode)	/* <- if not NULL, the HTTP status of a DELETE the server failed, or 0 */
 {
 	int error;
 	CFURLRef urlRef;
@@ -4880,7 +6349,7 @@ int network_remove(
 	require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
 	
 	/* let network_delete do the rest of the work */
-	error = network_delete(uid, urlRef, node, remove_date);
+	error = network_delete(uid, urlRef, node, remove_date, failedStatusCode);
 	
 	CFRelease(urlRef);
 
@@ -4910,7 +6379,7 @@ int network_rmdir(
 	if ( !error )
 	{
 		/* let network_delete do the rest of the work */
-		error = network_delete(uid, urlRef, node, remove_date);
+		error = network_delete(uid, urlRef, node, remove_date, NULL);
 	}
 	
 	CFRelease(urlRef);
@@ -5098,7 +6567,7 @@ int network_lock(
 	CFDataRef bodyData;
 	CFStringRef urlStrRef;
 	char *urlStr;
-	char* locktokentofree = NULL;
+	char *refreshtoken = NULL;
 	uid_t file_locktoken_uid = 0;
 	const UInt8 xmlString[] =
 		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
@@ -5134,12 +6603,33 @@ int network_lock(
 	urlStrRef = NULL;
 	urlStr = NULL;
 
-	lock_node_cache();
-	locktokentofree = node->file_locktoken;
-	node->file_locktoken = NULL;
-	file_locktoken_uid = node->file_locktoken_uid;
-	node->file_locktoken_uid = 0;
-	unlock_node_cache();
+	error = 0;
+	if ( refresh )
+	{
+		/*
+		 * Leave file_locktoken in place while the LOCK is out (it's only replaced
+		 * if the refresh succeeds) and mark the node so filesystem_close waits
+		 * for the refresh before it UNLOCKs.
+		 */
+		lock_node_cache();
+		if ( node->file_locktoken != NULL )
+		{
+			refreshtoken = strdup(node->file_locktoken);
+			if ( refreshtoken != NULL )
+			{
+				file_locktoken_uid = node->file_locktoken_uid;
+				node->file_lock_refreshing = TRUE;
+			}
+			else
+			{
+				error = ENOMEM;
+			}
+		}
+		unlock_node_cache();
+		
+		/* nothing to refresh if the file was closed (and unlocked) since the refresh was queued */
+		require_quiet(refreshtoken != NULL, no_locktoken);
+	}
 
 	/* create a CFURL to the node */
 	urlRef = create_cfurl_from_node(node, NULL, 0);
@@ -5161,7 +6651,7 @@ int network_lock(
 		
 		headerCount = 5;
 		headers5[3].value = CFSTR("text/xml");
-		lockTokenRef = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("(<%s>)"), locktokentofree);
+		lockTokenRef = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("(<%s>)"), refreshtoken);
 		require_action(lockTokenRef != NULL, CFStringCreateWithFormat_lockTokenRef, error = EIO);
 		
 		headers5[4].value = lockTokenRef;
@@ -5245,22 +6735,27 @@ int network_lock(
 			lock_node_cache();
 			if (!error)
 			{
-				node->file_locktoken = locktoken;
-				if ( locktokentofree != NULL )
+				/* a refresh only replaces the token it refreshed -- the file may have been relocked meanwhile */
+				if ( !refresh || ((node->file_locktoken != NULL) && (strcmp(node->file_locktoken, refreshtoken) == 0)) )
 				{
-				
-					free(locktokentofree);
-					locktokentofree = NULL;
+					if ( node->file_locktoken != NULL )
+					{
+						free(node->file_locktoken);
+					}
+					node->file_locktoken = locktoken;
+					node->file_lock_time = time(NULL);
+					/* file_locktoken_uid is already set if refreshing */
+					if ( !refresh )
+					{
+						node->file_locktoken_uid = uid;
+					}
 				}
-				/* file_locktoken_uid is already set if refreshing */
-				if ( !refresh )
+				else
 				{
-					node->file_locktoken_uid = uid;
+					free(locktoken);
 				}
-			} else {
-				node->file_locktoken = locktokentofree;
-				locktokentofree = NULL;
 			}
+			/* on failure, the old token (if any) stays so the refresh can be retried and close can UNLOCK */
 			unlock_node_cache();
 		}
 	
@@ -5289,6 +6784,16 @@ CFStringCreateWithFormat_timeoutSpecifierRef:
 	CFRelease(urlRef);
 
 create_cfurl_from_node:
+
+	if ( refreshtoken != NULL )
+	{
+		lock_node_cache();
+		node->file_lock_refreshing = FALSE;
+		unlock_node_cache();
+		free(refreshtoken);
+	}
+
+no_locktoken:
 	
 	return ( error );
 }
@@ -5372,16 +6877,187 @@ create_cfurl_from_node:
 
 /******************************************************************************/
 
-int network_readdir(
+/*
+ * After this many sync-collection REPORTs in a row fail, the server probably
+ * hands out sync-tokens without supporting REPORT, so stop asking.
+ */
+#define SYNC_COLLECTION_MAX_FAILURES 3
+
+/*
+ * A server may truncate a sync-collection delta (a 507 on the request-URI)
+ * and return a token to continue from. After this many continuations, give
+ * up and fall back to a full listing.
+ */
+#define SYNC_COLLECTION_MAX_CONTINUATIONS 8
+
+/*
+ * network_sync_collection_report sends one sync-collection REPORT (RFC 6578)
+ * for the changes to a directory since old_sync_token and applies them to the
+ * node cache. Unless the server truncated the delta, the directory cache file
+ * is rewritten too.
+ */
+static int network_sync_collection_report(
 	uid_t uid,					/* -> uid of the user making the request */
 	int cache,					/* -> if TRUE, perform additional caching */
-	struct node_entry *node)	/* -> directory node to read */
+	struct node_entry *node,	/* -> directory node to read */
+	const char *old_sync_token,	/* -> the sync-token to ask for changes since */
+	char **sync_token,			/* <- the new sync-token, or NULL (caller must free) */
+	int *truncated)				/* <- TRUE if the server truncated the delta */
+{
+	int error;
+	CFURLRef urlRef;
+	UInt8 *responseBuffer;
+	CFIndex count;
+	CFDataRef bodyData;
+	char *xmlString;
+	/* the 3 headers */
+	CFIndex headerCount = 3;
+	struct HeaderFieldValue headers[] = {
+		{ CFSTR("Accept"), CFSTR("*/*") },
+		{ CFSTR("Content-Type"), CFSTR("text/xml") },
+		{ CFSTR("Depth"), CFSTR("0") },
+		{ CFSTR("translate"), CFSTR("f") }
+	};
+
+	if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
+		/* translate flag only for Microsoft IIS Server */
+		headerCount += 1;
+	}
+
+	*sync_token = NULL;
+	*truncated = FALSE;
+	
+	/* the token is sent back as element text, so don't send one that would need escaping */
+	require_action_quiet(strpbrk(old_sync_token, "<>&") == NULL, bad_sync_token, error = EINVAL);
+	
+	require_action(asprintf(&xmlString,
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<D:sync-collection xmlns:D=\"DAV:\">\n"
+			"<D:sync-token>%s</D:sync-token>\n"
+			"<D:sync-level>1</D:sync-level>\n"
+			"<D:prop%s>\n"
+				"<D:getlastmodified/>\n"
+				"<D:getcontentlength/>\n"
+				"<D:creationdate/>\n"
+				"<D:resourcetype/>\n"
+				"%s"
+			"</D:prop>\n"
+		"</D:sync-collection>\n",
+		old_sync_token,
+		cache ? " xmlns:A=\"http://www.apple.com/webdav_fs/props/\"" : "",
+		cache ? "<A:appledoubleheader/>\n" : "") != -1, asprintf, error = ENOMEM);
+
+	/* create a CFDataRef with the xml that is our message body */
+	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, (const UInt8 *)xmlString, strlen(xmlString), kCFAllocatorNull);
+	require_action(bodyData != NULL, CFDataCreateWithBytesNoCopy, error = EIO);
+
+	/* create a CFURL to the node */
+	urlRef = create_cfurl_from_node(node, NULL, 0);
+	require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
+	
+	stats_increment(WEBDAV_STATS_SYNC_COLLECTION_REQUEST);
+	
+	/* redirects are left to the full listing that follows a failure */
+	error = send_transaction(uid, urlRef, node, CFSTR("REPORT"), bodyData,
+							 headerCount, headers, REDIRECT_DISABLE, &responseBuffer, &count, NULL);
+	if ( !error )
+	{
+		/* parse responseBuffer to apply the changes */
+		error = parse_sync_collection(responseBuffer, count, urlRef, uid, node, sync_token, truncated);
+		/* free the response buffer */
+		free(responseBuffer);
+	}
+	
+	CFRelease(urlRef);
+
+create_cfurl_from_node:
+
+	/* release the message body */
+	CFRelease(bodyData);
+
+CFDataCreateWithBytesNoCopy:
+
+	free(xmlString);
+
+asprintf:
+bad_sync_token:
+
+	return ( error );
+}
+
+/******************************************************************************/
+
+/*
+ * network_sync_collection asks for the changes to a directory since the
+ * listing described by node->dir_sync_token, and applies them to the node
+ * cache and the directory cache file. If the server truncates the delta, the
+ * rest is asked for with the token it returned. If it fails, the caller falls
+ * back to a full listing.
+ */
+static int network_sync_collection(
+	uid_t uid,					/* -> uid of the user making the request */
+	int cache,					/* -> if TRUE, perform additional caching */
+	struct node_entry *node,	/* -> directory node to read */
+	char **sync_token)			/* <- the new sync-token, or NULL (caller must free) */
+{
+	int error;
+	int truncated;
+	int continuations;
+	char *continuation_token;
+	
+	continuation_token = NULL;
+	for ( continuations = 0; ; ++continuations )
+	{
+		error = network_sync_collection_report(uid, cache, node,
+			(continuation_token != NULL) ? continuation_token : node->dir_sync_token, sync_token, &truncated);
+		free(continuation_token);
+		continuation_token = NULL;
+		if ( error || !truncated )
+		{
+			break;
+		}
+		
+		/* the changes already applied are in the node cache; the directory cache file is rewritten once the rest are */
+		continuation_token = *sync_token;
+		*sync_token = NULL;
+		if ( (continuation_token == NULL) || (continuations == SYNC_COLLECTION_MAX_CONTINUATIONS) )
+		{
+			free(continuation_token);
+			error = EIO;
+			break;
+		}
+	}
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+/* network_read_directory modes */
+#define READ_DIRECTORY_LISTING		0	/* Depth 1: write the directory cache file */
+#define READ_DIRECTORY_PREFETCH		1	/* Depth 1: only update the node cache */
+#define READ_DIRECTORY_SUBTREE		2	/* Depth infinity: only update the node cache */
+
+/*
+ * network_read_directory handles requests from network_readdir,
+ * network_prefetch and network_warmup_subtree. In READ_DIRECTORY_LISTING
+ * mode, if the server gave us a sync-token with the last listing, only the
+ * changes since then are downloaded.
+ */
+static int network_read_directory(
+	uid_t uid,					/* -> uid of the user making the request */
+	int cache,					/* -> if TRUE, perform additional caching */
+	struct node_entry *node,	/* -> directory node to read */
+	int mode,					/* -> one of the READ_DIRECTORY_* modes */
+	CFIndex *failedStatusCode)	/* <- if not NULL, the HTTP status of a PROPFIND the server failed, or 0 */
 {
 	int error, redir_cnt;
 	CFURLRef urlRef;
+	CFHTTPMessageRef responseRef;
 	UInt8 *responseBuffer;
 	CFIndex count;
 	CFDataRef bodyData;
+	char *sync_token;
 	const UInt8 xmlString[] =
 		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
 		"<D:propfind xmlns:D=\"DAV:\">\n"
@@ -5390,6 +7066,7 @@ int network_readdir(
 				"<D:getcontentlength/>\n"
 				"<D:creationdate/>\n"
 				"<D:resourcetype/>\n"
+				"<D:sync-token/>\n"
 			"</D:prop>\n"
 		"</D:propfind>\n";
 	const UInt8 xmlStringCache[] =
@@ -5400,6 +7077,7 @@ int network_readdir(
 				"<D:getcontentlength/>\n"
 				"<D:creationdate/>\n"
 				"<D:resourcetype/>\n"
+				"<D:sync-token/>\n"
 				"<A:appledoubleheader/>\n"
 			"</D:prop>\n"
 		"</D:propfind>\n";
@@ -5408,7 +7086,7 @@ int network_readdir(
 	struct HeaderFieldValue headers[] = {
 		{ CFSTR("Accept"), CFSTR("*/*") },
 		{ CFSTR("Content-Type"), CFSTR("text/xml") },
-		{ CFSTR("Depth"), CFSTR("1") },
+		{ CFSTR("Depth"), (mode == READ_DIRECTORY_SUBTREE) ? CFSTR("infinity") : CFSTR("1") },
 		{ CFSTR("translate"), CFSTR("f") }
 	};
 
@@ -5416,6 +7094,39 @@ int network_readdir(
 		/* translate flag only for Microsoft IIS Server */
 		headerCount += 1;
 	}
+	
+	if ( failedStatusCode != NULL )
+	{
+		*failedStatusCode = 0;
+	}
+
+	if ( (mode == READ_DIRECTORY_LISTING) && (node->dir_sync_token != NULL) )
+	{
+		/* only the user (or root) the listing was downloaded for may ask for the changes to it */
+		if ( (gSyncCollectionFailures < SYNC_COLLECTION_MAX_FAILURES) &&
+			 ((uid == node->file_listing_uid) || (0 == node->file_listing_uid)) )
+		{
+			error = network_sync_collection(uid, cache, node, &sync_token);
+			if ( !error )
+			{
+				gSyncCollectionFailures = 0;
+				free(node->dir_sync_token);
+				node->dir_sync_token = sync_token;
+				return ( 0 );
+			}
+			
+			/* the token may have expired, or the server may not support REPORT */
+			stats_increment(WEBDAV_STATS_SYNC_COLLECTION_FALLBACK);
+			if ( ++gSyncCollectionFailures == SYNC_COLLECTION_MAX_FAILURES )
+			{
+				syslog(LOG_INFO, "%s: sync-collection REPORT keeps failing (error %d); using full directory listings\n", __FUNCTION__, error);
+			}
+		}
+		
+		/* the full listing below gets a new token */
+		free(node->dir_sync_token);
+		node->dir_sync_token = NULL;
+	}
 
 	/* create a CFDataRef with the xml that is our message body */
 	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault,
@@ -5433,12 +7144,40 @@ int network_readdir(
 			break;
 		}
 		
+		responseRef = NULL;
 		error = send_transaction(uid, urlRef, node, CFSTR("PROPFIND"), bodyData,
-								 headerCount, headers, REDIRECT_MANUAL, &responseBuffer, &count, NULL);
+								 headerCount, headers, REDIRECT_MANUAL, &responseBuffer, &count, &responseRef);
+		if ( responseRef != NULL )
+		{
+			if ( failedStatusCode != NULL )
+			{
+				*failedStatusCode = error ? CFHTTPMessageGetResponseStatusCode(responseRef) : 0;
+			}
+			CFRelease(responseRef);
+		}
 		if ( !error )
 		{
-			/* parse responseBuffer to create the directory file */
-			error = parse_opendir(responseBuffer, count, urlRef, uid, node);
+			if ( mode == READ_DIRECTORY_LISTING )
+			{
+				/* parse responseBuffer to create the directory file */
+				error = parse_opendir(responseBuffer, count, urlRef, uid, node, &sync_token);
+				if ( !error )
+				{
+					/* a collection that returns a DAV:sync-token supports sync-collection REPORTs */
+					free(node->dir_sync_token);
+					node->dir_sync_token = sync_token;
+				}
+			}
+			else if ( mode == READ_DIRECTORY_PREFETCH )
+			{
+				/* parse responseBuffer to cache the children's attributes */
+				error = parse_prefetch(responseBuffer, count, urlRef, uid, node);
+			}
+			else
+			{
+				/* parse responseBuffer to cache the attributes of everything below node */
+				error = parse_subtree(responseBuffer, count, urlRef, uid, node);
+			}
 			/* free the response buffer */
 			free(responseBuffer);
 			CFRelease(urlRef);
@@ -5463,6 +7202,56 @@ CFDataCreateWithBytesNoCopy:
 
 /******************************************************************************/
 
+int network_readdir(
+	uid_t uid,					/* -> uid of the user making the request */
+	int cache,					/* -> if TRUE, perform additional caching */
+	struct node_entry *node)	/* -> directory node to read */
+{
+	return ( network_read_directory(uid, cache, node, READ_DIRECTORY_LISTING, NULL) );
+}
+
+/******************************************************************************/
+
+/*
+ * network_prefetch gets the attributes of all of a directory's children with
+ * one Depth 1 PROPFIND so that the lookups and getattrs which follow can be
+ * answered from the node cache.
+ */
+int network_prefetch(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node)	/* -> directory node to prefetch */
+{
+	stats_increment(WEBDAV_STATS_PREFETCH_REQUEST);
+	
+	return ( network_read_directory(uid, FALSE, node, READ_DIRECTORY_PREFETCH, NULL) );
+}
+
+/******************************************************************************/
+
+/*
+ * network_warmup_subtree gets the attributes of everything below a directory
+ * with one Depth infinity PROPFIND. Many servers refuse those (RFC 4918 lets
+ * them, answering 403 Forbidden with a DAV:propfind-finite-depth
+ * precondition), so the caller must be prepared to walk the tree instead.
+ */
+int network_warmup_subtree(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> directory node at the top of the subtree */
+	int *forbidden)				/* <- TRUE if the server answered 403 Forbidden */
+{
+	int error;
+	CFIndex statusCode;
+	
+	stats_increment(WEBDAV_STATS_WARMUP_SUBTREE);
+	
+	error = network_read_directory(uid, FALSE, node, READ_DIRECTORY_SUBTREE, &statusCode);
+	*forbidden = (statusCode == 403);
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
 int network_mkdir(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> parent node */
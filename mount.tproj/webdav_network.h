@@ -42,6 +42,9 @@ struct ReadStreamRec
 	CFReadStreamRef readStreamRef;	/* the read stream, or NULL */
 	CFStringRef uniqueValue;		/* CFString used to make stream unique */
 	int connectionClose;			/* if TRUE, readStreamRef should be closed when transaction is complete */
+	int bodyStarted;				/* TRUE once read_response_body() has checked the response's Content-Encoding */
+	int bodyCorrupt;				/* TRUE if read_response_body() failed because the encoded body couldn't be decoded */
+	struct response_inflater *inflater; /* decodes a gzip Content-Encoding response body, or NULL */
 };
 
 int network_init(
@@ -106,8 +109,9 @@ enum {WRITE_MGR_NEW_REQUEST_ID = 1};
 
 int queue_writemgr_request_locked(struct stream_put_ctx *ctx, struct seqwrite_mgr_req *req);
 struct seqwrite_mgr_req *dequeue_writemgr_request_locked(struct stream_put_ctx *ctx);
-void release_writemgr_request_locked(struct seqwrite_mgr_req *req);
+void release_writemgr_request_locked(struct stream_put_ctx *ctx, struct seqwrite_mgr_req *req);
 void release_writemgr_request(struct stream_put_ctx *ctx, struct seqwrite_mgr_req *req);
+struct seqwrite_mgr_req *get_writemgr_request_locked(struct stream_put_ctx *ctx, size_t count);
 
 void writeseqReadResponseCallback(CFReadStreamRef str, 
 								  CFStreamEventType event, 
@@ -124,11 +128,26 @@ CFDataRef managerMessagePortCallback(CFMessagePortRef local,
 
 int cleanup_seq_write(struct stream_put_ctx *ctx);
 
+/* Abandons a sequential write without finishing its PUT body (see filesystem_fsync) */
+int cancel_seq_write(struct stream_put_ctx *ctx);
+
+/* Returns TRUE unless the server has refused a streamed (chunked) PUT body */
+int network_streamed_uploads(void);
+
 int network_open(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> node to open */
 	int write_access);			/* -> open requires write access */
 
+/*
+ * Gets a file's entity tag with a Depth 0 PROPFIND for getetag. Returns
+ * ENOENT if the server doesn't have the file.
+ */
+int network_get_entity_tag(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> file node */
+	char **entity_tag);			/* <- the file's entity tag, or NULL if it has none (caller must free) */
+
 int network_statfs(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> root node */
@@ -155,7 +174,8 @@ int network_fsync(
 int network_remove(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> file node to remove on the server */
-	time_t *remove_date);		/* <- date of the removal */
+	time_t *remove_date,		/* <- date of the removal */
+	CFIndex *failedStatusCode);	/* <- if not NULL, the HTTP status of a DELETE the server failed, or 0 */
 
 int network_rmdir(
 	uid_t uid,					/* -> uid of the user making the request */
@@ -191,6 +211,15 @@ int network_readdir(
 	int cache,					/* -> if TRUE, perform additional caching */
 	struct node_entry *node);	/* -> directory node to read */
 
+int network_prefetch(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node);	/* -> directory node to prefetch */
+
+int network_warmup_subtree(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> directory node at the top of the subtree */
+	int *forbidden);			/* <- TRUE if the server answered 403 Forbidden */
+
 int network_mkdir(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> parent node */
@@ -206,6 +235,11 @@ int network_read(
 	char **buffer,				/* <- buffer data was read into (allocated by network_read) */
 	size_t *actual_count);		/* <- number of bytes actually read */
 
+void network_note_read_offset(
+	struct node_entry *node,	/* -> node the kernel read out-of-band */
+	off_t offset,				/* -> position within the file at which the read began */
+	size_t count);				/* -> number of bytes read */
+
 /* Read the response CFReadStream of a sequential write */	
 int network_read_seqwrite_rsp(
 	struct stream_put_ctx *ctx);	/* -> sequential write context */
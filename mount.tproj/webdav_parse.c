@@ -32,6 +32,7 @@
 #include "webdav_parse.h"
 #include "webdav_cache.h"
 #include "webdav_network.h"
+#include "webdav_stats.h"
 #include "LogMessage.h"
 
 extern long long
@@ -329,9 +330,13 @@ void parser_opendir_end(void *ctx,
 						const xmlChar *prefix,
 						const xmlChar *URI)
 {
-	#pragma unused(localname,prefix,URI)
+	#pragma unused(prefix,URI)
 	webdav_parse_opendir_struct_t * struct_ptr = (webdav_parse_opendir_struct_t *)ctx;
 	struct_ptr->start = false;
+	if ( strcasecmp((const char *)localname, "propstat") == 0 )
+	{
+		struct_ptr->in_propstat = FALSE;
+	}
 }
 /*****************************************************************************/
 
@@ -619,6 +624,36 @@ void parser_opendir_create (void *ctx,
 		struct_ptr->id = WEBDAV_OPENDIR_ELEMENT_RESPONSE;
 		struct_ptr->data_ptr = (void *)NULL;
 	}
+	else if (((CFStringCompare(nodeString, CFSTR("propstat"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	{
+		struct_ptr->in_propstat = TRUE;
+		struct_ptr->id = WEBDAV_OPENDIR_IGNORE;
+		struct_ptr->data_ptr = (void *)NULL;
+	}
+	else if (((CFStringCompare(nodeString, CFSTR("status"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo) &&
+			 !struct_ptr->in_propstat && (struct_ptr->tail != NULL) && struct_ptr->tail->seen_href)
+	{
+		/*
+		 * A <D:status> directly inside <D:response> (not inside <D:propstat>) is
+		 * how a sync-collection REPORT says a member was removed (RFC 6578).
+		 */
+		struct_ptr->id = WEBDAV_OPENDIR_ELEMENT_STATUS;
+		struct_ptr->data_ptr = (void *)struct_ptr->tail;
+	}
+	else if (((CFStringCompare(nodeString, CFSTR("sync-token"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	{
+		if ( struct_ptr->in_propstat && (struct_ptr->tail == NULL) )
+		{
+			/* a property with no response to attach it to */
+			struct_ptr->id = WEBDAV_OPENDIR_IGNORE;
+			struct_ptr->data_ptr = (void *)NULL;
+		}
+		else
+		{
+			struct_ptr->id = WEBDAV_OPENDIR_SYNC_TOKEN;
+			struct_ptr->data_ptr = struct_ptr->in_propstat ? (void *)struct_ptr->tail : (void *)NULL;
+		}
+	}
 	else {
 		struct_ptr->id = WEBDAV_OPENDIR_IGNORE;
 		struct_ptr->data_ptr = (void *)NULL;
@@ -1063,6 +1098,49 @@ void parser_opendir_add(void *ctx, const xmlChar *localname, int length)
 			}
 				break;
 				
+			case WEBDAV_OPENDIR_ELEMENT_STATUS:
+			{
+				char *ch;
+				
+				/* "HTTP/1.1 404 Not Found" -- only a 404 or a 507 means anything to us */
+				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
+				ch = strchr((const char *)text_ptr->name, ' ');
+				if ( ch != NULL )
+				{
+					switch ( strtoul(ch + 1, &ep, 10) )
+					{
+						case 404:
+							element_ptr->removed = TRUE;
+							break;
+						case 507:
+							element_ptr->truncated = TRUE;
+							break;
+						default:
+							break;
+					}
+				}
+			}
+				break;
+				
+			case WEBDAV_OPENDIR_SYNC_TOKEN:
+				/*
+				 * Inside <D:propstat> it's a collection's DAV:sync-token property;
+				 * outside, it's the new token at the end of a sync-collection REPORT.
+				 */
+				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
+				if ( element_ptr != NULL )
+				{
+					if ( element_ptr->sync_token == NULL )
+					{
+						element_ptr->sync_token = strndup((const char *)text_ptr->name, text_ptr->size);
+					}
+				}
+				else if ( parent_ptr->sync_token == NULL )
+				{
+					parent_ptr->sync_token = strndup((const char *)text_ptr->name, text_ptr->size);
+				}
+				break;
+				
 			default:
 				break;
 		}	/* end of switch statement */
@@ -1450,29 +1528,17 @@ CFURLCopyAbsoluteURL:
 /*****************************************************************************/
 
 /*
- * GetComponentName determines if the URI combined with the parent URL is a
- * child of the parent or is the parent itself, and if it is a child, extracts
- * the child's component name.
- *
- * GetComponentName returns TRUE if the URI is for a child, or returns FALSE if
- * the URI is the parent itself. The componentName buffer will contain the child's
- * component name if the result is TRUE.
- *
- * The parentPathLength parameter allows this routine to determine child/parent
- * status without comparing the path strings.
+ * CreateURIURL creates a CFURL from an http URI returned by the WebDAV server
+ * and the parent directory's URL it is relative to.
  */
-static Boolean GetComponentName(	/* <- TRUE if http URI was not parent and component name was returned */
-								CFURLRef urlRef,				/* -> the parent directory's URL  */
-								CFIndex parentPathLength,		/* -> the parent directory's percent decoded path length */
-								char *uri,						/* -> the http URI from the WebDAV server */
-								char *componentName)			/* <-> point to buffer of MAXNAMLEN + 1 bytes where URI's LastPathComponent is returned if result it TRUE */
+static CFURLRef CreateURIURL(
+							 CFURLRef urlRef,				/* -> the parent directory's URL  */
+							 char *uri)						/* -> the http URI from the WebDAV server */
 {
-	Boolean result;
 	CFStringRef uriString;				/* URI as CFString */
 	CFURLRef uriURL;					/* URI converted to full URL */
-	CFStringRef uriName;				/* URI's LastPathComponent as CFString */
 	
-	result = FALSE;
+	uriURL = NULL;
 	
 	/* create a CFString from the c-string containing URI */
 	uriString = CFStringCreateWithCString(kCFAllocatorDefault, uri, kCFStringEncodingUTF8);
@@ -1501,9 +1567,43 @@ static Boolean GetComponentName(	/* <- TRUE if http URI was not parent and compo
 		/* try again to create a CFURL from the reEscapedString and the parent URL */
 		uriURL = CFURLCreateWithString(kCFAllocatorDefault, reEscapedString, urlRef);
 		CFRelease(reEscapedString);
-		require(uriURL != NULL, CFURLCreateWithString);
 	}
 	
+CFURLCreateWithString:
+CFStringCreateWithCString:
+	
+	return ( uriURL );
+}
+
+/*****************************************************************************/
+
+/*
+ * GetComponentName determines if the URI combined with the parent URL is a
+ * child of the parent or is the parent itself, and if it is a child, extracts
+ * the child's component name.
+ *
+ * GetComponentName returns TRUE if the URI is for a child, or returns FALSE if
+ * the URI is the parent itself. The componentName buffer will contain the child's
+ * component name if the result is TRUE.
+ *
+ * The parentPathLength parameter allows this routine to determine child/parent
+ * status without comparing the path strings.
+ */
+static Boolean GetComponentName(	/* <- TRUE if http URI was not parent and component name was returned */
+								CFURLRef urlRef,				/* -> the parent directory's URL  */
+								CFIndex parentPathLength,		/* -> the parent directory's percent decoded path length */
+								char *uri,						/* -> the http URI from the WebDAV server */
+								char *componentName)			/* <-> point to buffer of MAXNAMLEN + 1 bytes where URI's LastPathComponent is returned if result it TRUE */
+{
+	Boolean result;
+	CFURLRef uriURL;					/* URI converted to full URL */
+	CFStringRef uriName;				/* URI's LastPathComponent as CFString */
+	
+	result = FALSE;
+	
+	uriURL = CreateURIURL(urlRef, uri);
+	require(uriURL != NULL, CreateURIURL);
+	
 	/* see if this is the parent or a child */
 	if ( GetNormalizedPathLength(uriURL) > parentPathLength ) {
 		/* this is a child */
@@ -1529,19 +1629,163 @@ CFURLCopyLastPathComponent:
 	
 	CFRelease(uriURL);
 	
-CFURLCreateWithString:
-CFStringCreateWithCString:
+CreateURIURL:
 	
 	return ( result );
 }
 
 /*****************************************************************************/
 
-int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of 1 */
+/*
+ * GetDescendantName is GetComponentName for the responses to a Depth infinity
+ * PROPFIND, where the URI may be anywhere below the parent. If the URI is not
+ * the parent, its last path component is returned in componentName and dirNode
+ * is changed from the parent's node to the node of the directory that contains
+ * it, creating the nodes for the directories in between. If that fails, dirNode
+ * is set to NULL (and the result is still TRUE).
+ */
+static Boolean GetDescendantName(	/* <- TRUE if http URI was not parent and component name was returned */
+								CFURLRef urlRef,				/* -> the parent directory's URL  */
+								CFIndex parentPathLength,		/* -> the parent directory's percent decoded path length */
+								char *uri,						/* -> the http URI from the WebDAV server */
+								char *componentName,			/* <-> point to buffer of MAXNAMLEN + 1 bytes where URI's LastPathComponent is returned if result it TRUE */
+								struct node_entry **dirNode)	/* <-> in: the parent directory's node; out: the node of the directory containing the URI, or NULL */
+{
+	Boolean result;
+	CFURLRef uriURL;					/* URI converted to full URL */
+	CFURLRef absoluteURL;
+	CFStringRef escapedPath;
+	CFStringRef unescapedPath;
+	CFStringRef relativePath;			/* the percent decoded path below the parent */
+	char pathBuffer[MAXPATHLEN];
+	char *path;
+	char *component;
+	size_t length;
+	
+	result = FALSE;
+	
+	uriURL = CreateURIURL(urlRef, uri);
+	require(uriURL != NULL, CreateURIURL);
+	
+	absoluteURL = CFURLCopyAbsoluteURL(uriURL);
+	require(absoluteURL != NULL, CFURLCopyAbsoluteURL);
+	
+	escapedPath = CFURLCopyPath(absoluteURL);
+	require(escapedPath != NULL, CFURLCopyPath);
+	
+	unescapedPath = CFURLCreateStringByReplacingPercentEscapes(kCFAllocatorDefault, escapedPath, CFSTR(""));
+	require_string(unescapedPath != NULL, CFURLCreateStringByReplacingPercentEscapes, "name was not legal UTF8");
+	
+	/* see if this is the parent or a descendant */
+	if ( CFStringGetLength(unescapedPath) > parentPathLength )
+	{
+		result = TRUE;
+		
+		relativePath = CFStringCreateWithSubstring(kCFAllocatorDefault, unescapedPath,
+			CFRangeMake(parentPathLength, CFStringGetLength(unescapedPath) - parentPathLength));
+		if ( (relativePath == NULL) ||
+			 !CFStringGetCString(relativePath, pathBuffer, sizeof(pathBuffer), kCFStringEncodingUTF8) )
+		{
+			debug_string("could not get descendant path (too long?)");
+			*dirNode = NULL;
+		}
+		else
+		{
+			/* trim the slashes at either end */
+			path = pathBuffer;
+			while ( *path == '/' )
+			{
+				++path;
+			}
+			length = strlen(path);
+			while ( (length != 0) && (path[length - 1] == '/') )
+			{
+				path[--length] = '\0';
+			}
+			
+			/* walk down to the directory containing the last component */
+			while ( (component = strsep(&path, "/")) != NULL )
+			{
+				length = strlen(component);
+				if ( (length == 0) || (length > MAXNAMLEN) )
+				{
+					*dirNode = NULL;
+					break;
+				}
+				if ( path == NULL )
+				{
+					/* this is the last component */
+					bcopy(component, componentName, length + 1);
+					break;
+				}
+				if ( nodecache_get_node(*dirNode, length, component, TRUE, FALSE, WEBDAV_DIR_TYPE, dirNode) != 0 )
+				{
+					*dirNode = NULL;
+					break;
+				}
+			}
+		}
+		
+		if ( relativePath != NULL )
+		{
+			CFRelease(relativePath);
+		}
+	}
+	
+	CFRelease(unescapedPath);
+	
+CFURLCreateStringByReplacingPercentEscapes:
+	
+	CFRelease(escapedPath);
+	
+CFURLCopyPath:
+	
+	CFRelease(absoluteURL);
+	
+CFURLCopyAbsoluteURL:
+	
+	CFRelease(uriURL);
+	
+CreateURIURL:
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/* parse_directory modes */
+#define PARSE_DIRECTORY_LISTING		0	/* full listing: rewrite the directory cache file */
+#define PARSE_DIRECTORY_PREFETCH	1	/* full listing: cache the children's attributes only */
+#define PARSE_DIRECTORY_SYNC		2	/* sync-collection delta: update the node cache, then rebuild the directory cache file from it */
+#define PARSE_DIRECTORY_SUBTREE		3	/* Depth infinity listing: cache the attributes of everything below the directory */
+
+/* the parser each mode is counted as in the stats */
+static const enum webdav_stats_parser gParseDirectoryStats[] = {
+	WEBDAV_STATS_PARSE_OPENDIR, WEBDAV_STATS_PARSE_OPENDIR, WEBDAV_STATS_PARSE_SYNC_COLLECTION, WEBDAV_STATS_PARSE_SUBTREE
+};
+
+/*
+ * parse_directory does the work for parse_opendir, parse_prefetch,
+ * parse_sync_collection and parse_subtree. In PARSE_DIRECTORY_PREFETCH mode,
+ * the children's nodes and attributes are cached but the parent's directory
+ * cache file (which may not exist) is left alone. In PARSE_DIRECTORY_SYNC mode,
+ * the xml only describes the children that changed, so children that aren't
+ * mentioned are left alone and children reported as removed are deleted.
+ * If the server truncated the delta (a 507 on the request-URI), the changes
+ * it did report are applied to the node cache but the directory cache file
+ * isn't rewritten, and *truncated tells the caller to ask for the rest.
+ * PARSE_DIRECTORY_SUBTREE is like PARSE_DIRECTORY_PREFETCH, but for all of
+ * the directory's descendants; since the xml may be incomplete (servers can
+ * limit Depth infinity responses), no nodes are deleted.
+ */
+static int parse_directory(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of 1 or a sync-collection REPORT */
 				  CFIndex xmlp_len,				/* -> length of xml data */
 				  CFURLRef urlRef,				/* -> the CFURL to the parent directory */
 				  uid_t uid,						/* -> uid of the user making the request */
-				  struct node_entry *parent_node)	/* -> pointer to the parent directory's node_entry */
+				  struct node_entry *parent_node,	/* -> pointer to the parent directory's node_entry */
+				  int mode,						/* -> one of the PARSE_DIRECTORY_* modes */
+				  char **sync_token,			/* <- the DAV:sync-token in the xml, or NULL (may be NULL) */
+				  int *truncated)				/* <- TRUE if a sync-collection REPORT's delta was truncated (may be NULL) */
 {
 	int error = 0;
 	ssize_t size = 0;
@@ -1549,8 +1793,21 @@ int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with dept
 	CFIndex parentPathLength;
 	webdav_parse_opendir_struct_t opendir_struct;
 	webdav_parse_opendir_element_t *element_ptr, *prev_element_ptr;
+	uint64_t start_time = stats_start();
+	int64_t entries = 0;
 	opendir_struct.head = opendir_struct.tail = NULL;
 	opendir_struct.error = 0;
+	opendir_struct.in_propstat = FALSE;
+	opendir_struct.sync_token = NULL;
+	
+	if ( sync_token != NULL )
+	{
+		*sync_token = NULL;
+	}
+	if ( truncated != NULL )
+	{
+		*truncated = FALSE;
+	}
 	
 	xmlSAXHandler sh;
     memset(&sh,0,sizeof(sh));
@@ -1559,19 +1816,25 @@ int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with dept
 	sh.endElementNs = parser_opendir_end;
     sh.initialized = XML_SAX2_MAGIC;
 	
-	/* truncate the file, and reset the file pointer to 0 */
-	require(ftruncate(parent_node->file_fd, 0) == 0, ftruncate);
-	require(lseek(parent_node->file_fd, 0, SEEK_SET) == 0, lseek);
+	if ( mode == PARSE_DIRECTORY_LISTING )
+	{
+		/* truncate the file, and reset the file pointer to 0 */
+		require(ftruncate(parent_node->file_fd, 0) == 0, ftruncate);
+		require(lseek(parent_node->file_fd, 0, SEEK_SET) == 0, lseek);
+	}
 	
 	if(xmlp != NULL)
 	{
 		int result = xmlSAXUserParseMemory( &sh,&opendir_struct,(char*)xmlp,(int)xmlp_len);
 		require(result == 0, ParserCreate);
 		/* parse the XML -- exit now if error during parse */
+		
+		/* a delta we couldn't completely parse would leave the listing wrong */
+		require((mode != PARSE_DIRECTORY_SYNC) || (opendir_struct.error == 0), ParserCreate);
 	}
 	
 	/* if the directory is not deleted, write "." and ".."  */
-	if ( !NODE_IS_DELETED(parent_node) )
+	if ( (mode == PARSE_DIRECTORY_LISTING) && !NODE_IS_DELETED(parent_node) )
 	{
 		bzero(dir_data, sizeof(dir_data));
 		
@@ -1610,13 +1873,17 @@ int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with dept
 	parentPathLength = GetNormalizedPathLength(urlRef);
 	
 	/* invalidate any children nodes -- they'll be marked valid by nodecache_get_node */
-	(void) nodecache_invalidate_directory_node_time(parent_node);
+	if ( (mode == PARSE_DIRECTORY_LISTING) || (mode == PARSE_DIRECTORY_PREFETCH) )
+	{
+		(void) nodecache_invalidate_directory_node_time(parent_node);
+	}
 	
 	/* look at the list of elements */
 	for (element_ptr = opendir_struct.head; element_ptr != NULL; element_ptr = element_ptr->next)
 	{
 		char namebuffer[MAXNAMLEN + 1];
 		struct webdav_stat_attr statbuf;
+		struct node_entry *element_parent;
 		
 		// Skip any placeholder that never saw a matching <D:href> element
 		if (element_ptr->seen_href == FALSE)
@@ -1625,17 +1892,42 @@ int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with dept
 		/* make element_ptr->dir_data.d_name a cstring */
 		element_ptr->dir_data.d_name[element_ptr->dir_data.d_name_URI_length] = '\0';
 		//syslog(LOG_ERR,"element_ptr->dir_data.d_name is %s\n",element_ptr->dir_data.d_name);
+		
+		if ( element_ptr->removed )
+		{
+			struct node_entry *removed_node;
+			
+			/* a sync-collection REPORT says this child is gone */
+			if ( (mode == PARSE_DIRECTORY_SYNC) &&
+				 GetComponentName(urlRef, parentPathLength, element_ptr->dir_data.d_name, namebuffer) &&
+				 (nodecache_get_node(parent_node, strlen(namebuffer), namebuffer, FALSE, FALSE, 0, &removed_node) == 0) )
+			{
+				(void) nodecache_delete_node(removed_node, TRUE);
+				++entries;
+			}
+			continue;
+		}
+		
 		/* get the component name if this element is not the parent */
-		if ( GetComponentName(urlRef, parentPathLength, element_ptr->dir_data.d_name, namebuffer) )
+		element_parent = parent_node;
+		if ( (mode == PARSE_DIRECTORY_SUBTREE) ?
+			 GetDescendantName(urlRef, parentPathLength, element_ptr->dir_data.d_name, namebuffer, &element_parent) :
+			 GetComponentName(urlRef, parentPathLength, element_ptr->dir_data.d_name, namebuffer) )
 		{
-			/* this is a child */
+			/* this is a child (or in PARSE_DIRECTORY_SUBTREE mode, a child of element_parent) */
 			struct node_entry *element_node;
 			size_t name_len;
 			
+			if ( element_parent == NULL )
+			{
+				debug_string("could not find descendant's directory");
+				continue;
+			}
+			
 			name_len = strlen(namebuffer);
 			//syslog(LOG_ERR,"namebuffer is %s\n",namebuffer);
 			/* get (or create) a cache node for this element */
-			error = nodecache_get_node(parent_node, name_len, namebuffer, TRUE, FALSE,
+			error = nodecache_get_node(element_parent, name_len, namebuffer, TRUE, FALSE,
 									   element_ptr->dir_data.d_type == DT_DIR ? WEBDAV_DIR_TYPE : WEBDAV_FILE_TYPE, &element_node);
 			if (error)
 			{
@@ -1707,19 +1999,50 @@ int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with dept
 			statbuf.attr_stat.st_ino = element_node->fileid;
 			
 			/* Now cache the stat structure (ignoring errors) */
-			(void) nodecache_add_attributes(element_node, uid, &statbuf,
-											element_ptr->appledoubleheadervalid ? element_ptr->appledoubleheader : NULL);
-			
-			/* Complete the task of getting the regular name into the dirent */
+			if ( (mode == PARSE_DIRECTORY_PREFETCH) || (mode == PARSE_DIRECTORY_SUBTREE) )
+			{
+				(void) nodecache_add_prefetched_attributes(element_node, uid, &statbuf);
+			}
+			else
+			{
+				(void) nodecache_add_attributes(element_node, uid, &statbuf,
+												element_ptr->appledoubleheadervalid ? element_ptr->appledoubleheader : NULL);
+			}
 			
-			size = write(parent_node->file_fd, (void *)&element_ptr->dir_data, element_ptr->dir_data.d_reclen);
-			require(size == element_ptr->dir_data.d_reclen, write_element);
+			if ( mode == PARSE_DIRECTORY_LISTING )
+			{
+				/* Complete the task of getting the regular name into the dirent */
+				
+				size = write(parent_node->file_fd, (void *)&element_ptr->dir_data, element_ptr->dir_data.d_reclen);
+				require(size == element_ptr->dir_data.d_reclen, write_element);
+			}
+			++entries;
 		}
 		else
 		{
 			struct node_entry *temp_node;
 			/* it was the parent */
 			
+			if ( mode == PARSE_DIRECTORY_SYNC )
+			{
+				/*
+				 * A sync-collection REPORT only reports the request-URI to say the
+				 * delta was truncated (RFC 6578) -- it carries no attributes.
+				 */
+				if ( element_ptr->truncated && (truncated != NULL) )
+				{
+					*truncated = TRUE;
+				}
+				continue;
+			}
+			
+			/* a full listing carries the directory's sync-token as a property */
+			if ( (mode == PARSE_DIRECTORY_LISTING) && (element_ptr->sync_token != NULL) && (opendir_struct.sync_token == NULL) )
+			{
+				opendir_struct.sync_token = element_ptr->sync_token;
+				element_ptr->sync_token = NULL;
+			}
+			
 			/* we are reading this directory, so mark it "recent" */
 			(void) nodecache_get_node(parent_node, 0, NULL, TRUE, TRUE, WEBDAV_DIR_TYPE, &temp_node);
 			
@@ -1766,8 +2089,16 @@ int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with dept
 		}
 	}	/* for element_ptr */
 	
-	/* delete any children nodes that are still invalid */
-	(void) nodecache_delete_invalid_directory_nodes(parent_node);
+	if ( (mode == PARSE_DIRECTORY_LISTING) || (mode == PARSE_DIRECTORY_PREFETCH) )
+	{
+		/* delete any children nodes that are still invalid */
+		(void) nodecache_delete_invalid_directory_nodes(parent_node);
+	}
+	else if ( (mode == PARSE_DIRECTORY_SYNC) && ((truncated == NULL) || !*truncated) )
+	{
+		/* the node cache now holds the complete listing -- write it out */
+		require_noerr(nodecache_write_directory(parent_node), write_element);
+	}
 	
 	/* free any elements allocated */
 	element_ptr = opendir_struct.head;
@@ -1775,9 +2106,23 @@ int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with dept
 	{
 		prev_element_ptr = element_ptr;
 		element_ptr = element_ptr->next;
+		free(prev_element_ptr->sync_token);
 		free(prev_element_ptr);
 	}
 	
+	if ( sync_token != NULL )
+	{
+		*sync_token = opendir_struct.sync_token;
+		opendir_struct.sync_token = NULL;
+	}
+	free(opendir_struct.sync_token);
+	
+	stats_record_parse(gParseDirectoryStats[mode], start_time, xmlp_len, entries, 0);
+	if ( (mode == PARSE_DIRECTORY_PREFETCH) || (mode == PARSE_DIRECTORY_SUBTREE) )
+	{
+		stats_add(WEBDAV_STATS_PREFETCH_ENTRIES, entries);
+	}
+	
 	return ( 0 );
 	
 	/**********************/
@@ -1789,17 +2134,70 @@ write_element:
 	{
 		prev_element_ptr = element_ptr;
 		element_ptr = element_ptr->next;
+		free(prev_element_ptr->sync_token);
 		free(prev_element_ptr);
 	}
 write_dot_dotdot:
 	/* directory is in unknown condition - erase whatever is there */
-	(void) ftruncate(parent_node->file_fd, 0);
+	if ( (mode == PARSE_DIRECTORY_LISTING) || (mode == PARSE_DIRECTORY_SYNC) )
+	{
+		(void) ftruncate(parent_node->file_fd, 0);
+	}
 ParserCreate:
 lseek:
 ftruncate:
+	free(opendir_struct.sync_token);
+	stats_record_parse(gParseDirectoryStats[mode], start_time, xmlp_len, entries, EIO);
 	return ( EIO );
 }
 
+/*****************************************************************************/
+
+int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of 1 */
+				  CFIndex xmlp_len,				/* -> length of xml data */
+				  CFURLRef urlRef,				/* -> the CFURL to the parent directory */
+				  uid_t uid,						/* -> uid of the user making the request */
+				  struct node_entry *parent_node,	/* -> pointer to the parent directory's node_entry */
+				  char **sync_token)			/* <- the directory's DAV:sync-token property, or NULL */
+{
+	return ( parse_directory(xmlp, xmlp_len, urlRef, uid, parent_node, PARSE_DIRECTORY_LISTING, sync_token, NULL) );
+}
+
+/*****************************************************************************/
+
+int parse_prefetch(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of 1 */
+				  CFIndex xmlp_len,				/* -> length of xml data */
+				  CFURLRef urlRef,				/* -> the CFURL to the parent directory */
+				  uid_t uid,						/* -> uid of the user making the request */
+				  struct node_entry *parent_node)	/* -> pointer to the parent directory's node_entry */
+{
+	return ( parse_directory(xmlp, xmlp_len, urlRef, uid, parent_node, PARSE_DIRECTORY_PREFETCH, NULL, NULL) );
+}
+
+/*****************************************************************************/
+
+int parse_sync_collection(UInt8 *xmlp,			/* -> xml data returned by a sync-collection REPORT */
+				  CFIndex xmlp_len,				/* -> length of xml data */
+				  CFURLRef urlRef,				/* -> the CFURL to the parent directory */
+				  uid_t uid,						/* -> uid of the user making the request */
+				  struct node_entry *parent_node,	/* -> pointer to the parent directory's node_entry */
+				  char **sync_token,			/* <- the new sync-token, or NULL */
+				  int *truncated)				/* <- TRUE if the server truncated the delta; the changes after sync_token are still to come */
+{
+	return ( parse_directory(xmlp, xmlp_len, urlRef, uid, parent_node, PARSE_DIRECTORY_SYNC, sync_token, truncated) );
+}
+
+/*****************************************************************************/
+
+int parse_subtree(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of infinity */
+				  CFIndex xmlp_len,				/* -> length of xml data */
+				  CFURLRef urlRef,				/* -> the CFURL to the directory */
+				  uid_t uid,						/* -> uid of the user making the request */
+				  struct node_entry *parent_node)	/* -> pointer to the directory's node_entry */
+{
+	return ( parse_directory(xmlp, xmlp_len, urlRef, uid, parent_node, PARSE_DIRECTORY_SUBTREE, NULL, NULL) );
+}
+
 /*****************************************************************************/
 webdav_parse_multistatus_list_t *
 parse_multi_status(
@@ -1807,6 +2205,10 @@ parse_multi_status(
 				   CFIndex xmlp_len)				/* -> length of xml data */
 {
 	webdav_parse_multistatus_list_t *multistatus_list;
+	webdav_parse_multistatus_element_t *element_ptr;
+	uint64_t start_time = stats_start();
+	int64_t entries = 0;
+	int result = 0;
 	
 	multistatus_list = malloc(sizeof(webdav_parse_multistatus_list_t));
 	require(multistatus_list != NULL, malloc_list);
@@ -1824,11 +2226,16 @@ parse_multi_status(
 	
 	if(xmlp != NULL)
 	{
-		int result = xmlSAXUserParseMemory( &sh,multistatus_list,(char*)xmlp,(int)xmlp_len);
+		result = xmlSAXUserParseMemory( &sh,multistatus_list,(char*)xmlp,(int)xmlp_len);
 		require(result == 0, ParserCreate);
 	}
 
 ParserCreate:
+	for (element_ptr = multistatus_list->head; element_ptr != NULL; element_ptr = element_ptr->next)
+	{
+		++entries;
+	}
+	stats_record_parse(WEBDAV_STATS_PARSE_MULTISTATUS, start_time, xmlp_len, entries, (result == 0) ? 0 : EIO);
 malloc_list:
 	return (multistatus_list);
 	
@@ -1840,6 +2247,8 @@ malloc_list:
 
 int parse_file_count(const UInt8 *xmlp, CFIndex xmlp_len, int *file_count)
 {
+	uint64_t start_time = stats_start();
+	int result = 0;
 	xmlSAXHandler sh;
     memset(&sh,0,sizeof(sh));
     sh.startElementNs = parser_file_count_create;
@@ -1849,9 +2258,11 @@ int parse_file_count(const UInt8 *xmlp, CFIndex xmlp_len, int *file_count)
 	
 	if(xmlp != NULL)
 	{
-		xmlSAXUserParseMemory( &sh,file_count,(char*)xmlp,(int)xmlp_len);
+		result = xmlSAXUserParseMemory( &sh,file_count,(char*)xmlp,(int)xmlp_len);
 	}
 	
+	stats_record_parse(WEBDAV_STATS_PARSE_FILE_COUNT, start_time, xmlp_len, *file_count, (result == 0) ? 0 : EIO);
+	
 	return ( 0 );
 }
 
@@ -1859,6 +2270,8 @@ int parse_file_count(const UInt8 *xmlp, CFIndex xmlp_len, int *file_count)
 
 int parse_stat(const UInt8 *xmlp, CFIndex xmlp_len, struct webdav_stat_attr *statbuf)
 {
+	uint64_t start_time = stats_start();
+	int result = 0;
 	xmlSAXHandler sh;
     memset(&sh,0,sizeof(sh));
     sh.startElementNs = parser_stat_create;
@@ -1869,7 +2282,7 @@ int parse_stat(const UInt8 *xmlp, CFIndex xmlp_len, struct webdav_stat_attr *sta
 	
 	if(xmlp != NULL)
 	{
-		xmlSAXUserParseMemory( &sh,statbuf,(char*)xmlp,(int)xmlp_len);
+		result = xmlSAXUserParseMemory( &sh,statbuf,(char*)xmlp,(int)xmlp_len);
 	}
 	/* Coming back from the parser:
 	 *   statbuf->attr_stat_info.attr_stat.st_mode will be 0 or will have S_IFDIR set if the object is a directory.
@@ -1916,6 +2329,8 @@ int parse_stat(const UInt8 *xmlp, CFIndex xmlp_len, struct webdav_stat_attr *sta
 	/* calculate number of S_BLKSIZE blocks */
 	statbuf->attr_stat.st_blocks = ((statbuf->attr_stat.st_size + S_BLKSIZE - 1) / S_BLKSIZE);
 	
+	stats_record_parse(WEBDAV_STATS_PARSE_STAT, start_time, xmlp_len, 1, (result == 0) ? 0 : EIO);
+	
 	return ( 0 );
 }
 
@@ -1923,6 +2338,8 @@ int parse_stat(const UInt8 *xmlp, CFIndex xmlp_len, struct webdav_stat_attr *sta
 
 int parse_statfs(const UInt8 *xmlp, CFIndex xmlp_len, struct statfs *statfsbuf)
 {
+	uint64_t start_time = stats_start();
+	int result = 0;
 	xmlSAXHandler sh;
     memset(&sh,0,sizeof(sh));
     sh.startElementNs = parser_statfs_create;
@@ -1936,7 +2353,7 @@ int parse_statfs(const UInt8 *xmlp, CFIndex xmlp_len, struct statfs *statfsbuf)
 	
 	if(xmlp != NULL)
 	{
-		xmlSAXUserParseMemory( &sh,&quotas,(char*)xmlp,(int)xmlp_len);
+		result = xmlSAXUserParseMemory( &sh,&quotas,(char*)xmlp,(int)xmlp_len);
 	}
 	/* were the IETF quota properties returned? */
 	if ( quotas.use_bytes_values )
@@ -1997,6 +2414,8 @@ int parse_statfs(const UInt8 *xmlp, CFIndex xmlp_len, struct statfs *statfsbuf)
 	
 	statfsbuf->f_iosize = WEBDAV_IOSIZE;
 	
+	stats_record_parse(WEBDAV_STATS_PARSE_STATFS, start_time, xmlp_len, 1, (result == 0) ? 0 : EIO);
+	
 	return ( 0 );
 }
 
@@ -2004,6 +2423,8 @@ int parse_statfs(const UInt8 *xmlp, CFIndex xmlp_len, struct statfs *statfsbuf)
 
 int parse_lock(const UInt8 *xmlp, CFIndex xmlp_len, char **locktoken)
 {
+	uint64_t start_time = stats_start();
+	int result = 0;
 	xmlSAXHandler sh;
     memset(&sh,0,sizeof(sh));
     sh.startElementNs = parser_lock_create;
@@ -2016,7 +2437,7 @@ int parse_lock(const UInt8 *xmlp, CFIndex xmlp_len, char **locktoken)
 	
 	if(xmlp != NULL)
 	{
-		xmlSAXUserParseMemory( &sh,&lock_struct,(char*)xmlp,(int)xmlp_len);
+		result = xmlSAXUserParseMemory( &sh,&lock_struct,(char*)xmlp,(int)xmlp_len);
 	}
 	
 	*locktoken = (char *)lock_struct.locktoken;
@@ -2025,6 +2446,8 @@ int parse_lock(const UInt8 *xmlp, CFIndex xmlp_len, char **locktoken)
 		debug_string("error parsing lock token");
 	}
 	
+	stats_record_parse(WEBDAV_STATS_PARSE_LOCK, start_time, xmlp_len, 1, ((result == 0) && (*locktoken != NULL)) ? 0 : EIO);
+	
 	return ( 0 );
 }
 
@@ -2032,6 +2455,8 @@ int parse_lock(const UInt8 *xmlp, CFIndex xmlp_len, char **locktoken)
 
 int parse_cachevalidators(const UInt8 *xmlp, CFIndex xmlp_len, time_t *last_modified, char **entity_tag)
 {
+	uint64_t start_time = stats_start();
+	int result = 0;
 	xmlSAXHandler sh;
     memset(&sh,0,sizeof(sh));
     sh.startElementNs = parser_cachevalidators_create;
@@ -2045,7 +2470,7 @@ int parse_cachevalidators(const UInt8 *xmlp, CFIndex xmlp_len, time_t *last_modi
 	
 	if(xmlp != NULL)
 	{
-		xmlSAXUserParseMemory( &sh,&cachevalidators_struct,(char*)xmlp,(int)xmlp_len);
+		result = xmlSAXUserParseMemory( &sh,&cachevalidators_struct,(char*)xmlp,(int)xmlp_len);
 	}
 	
 	if ( cachevalidators_struct.last_modified != 0 )
@@ -2058,6 +2483,8 @@ int parse_cachevalidators(const UInt8 *xmlp, CFIndex xmlp_len, time_t *last_modi
 	}
 	*entity_tag = cachevalidators_struct.entity_tag;
 	
+	stats_record_parse(WEBDAV_STATS_PARSE_CACHEVALIDATORS, start_time, xmlp_len, 1, (result == 0) ? 0 : EIO);
+	
 	return ( 0 );
 }
 
@@ -124,6 +124,9 @@ typedef struct webdav_parse_opendir_element_tag
 	int appledoubleheadervalid;	/* TRUE if appledoubleheader field is valid */
 	int seen_href;	/* TRUE if we've seen the <D:href> entity for this element (otherwise this is a place holder) */
 	int seen_response_end; /* TRUE if we've seen <d:/response> for this element */
+	int removed;	/* TRUE if the response's <D:status> was 404 (a sync-collection REPORT reporting a removed member) */
+	int truncated;	/* TRUE if the response's <D:status> was 507 (a sync-collection REPORT that didn't report every change) */
+	char *sync_token;	/* the DAV:sync-token property, or NULL */
 	char appledoubleheader[APPLEDOUBLEHEADER_LENGTH];
 	struct webdav_parse_opendir_element_tag *next;
 } webdav_parse_opendir_element_t;
@@ -134,6 +137,8 @@ typedef struct
 	int id;
 	void *data_ptr;
 	Boolean start; /*For characters callback to work only after start tag and no end tag*/
+	Boolean in_propstat; /* TRUE between <D:propstat> and </D:propstat> so a <D:status> there isn't taken for the response's status */
+	char *sync_token; /* the sync-collection REPORT's <D:sync-token> (not the property), or NULL */
 	webdav_parse_opendir_element_t *head;
 	webdav_parse_opendir_element_t *tail;
 } webdav_parse_opendir_struct_t;
@@ -194,11 +199,32 @@ extern int parse_stat(const UInt8 *xmlp, CFIndex xmlp_len, struct webdav_stat_at
 extern int parse_statfs(const UInt8 *xmlp, CFIndex xmlp_len, struct statfs *statfsbuf);
 extern int parse_lock(const UInt8 *xmlp, CFIndex xmlp_len, char **locktoken);
 extern int parse_opendir(
+	UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of 1 */
+	CFIndex xmlp_len,				/* -> length of xml data */
+	CFURLRef urlRef,				/* -> the CFURL to the parent directory (may be a relative CFURL) */
+	uid_t uid,						/* -> uid of the user making the request */ 
+	struct node_entry *parent_node,	/* -> pointer to the parent directory's node_entry */
+	char **sync_token);				/* <- the directory's DAV:sync-token property, or NULL (caller must free) */
+extern int parse_prefetch(
 	UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of 1 */
 	CFIndex xmlp_len,				/* -> length of xml data */
 	CFURLRef urlRef,				/* -> the CFURL to the parent directory (may be a relative CFURL) */
 	uid_t uid,						/* -> uid of the user making the request */ 
 	struct node_entry *parent_node);/* -> pointer to the parent directory's node_entry */
+extern int parse_sync_collection(
+	UInt8 *xmlp,					/* -> xml data returned by a sync-collection REPORT */
+	CFIndex xmlp_len,				/* -> length of xml data */
+	CFURLRef urlRef,				/* -> the CFURL to the parent directory (may be a relative CFURL) */
+	uid_t uid,						/* -> uid of the user making the request */ 
+	struct node_entry *parent_node,	/* -> pointer to the parent directory's node_entry */
+	char **sync_token,				/* <- the new sync-token, or NULL (caller must free) */
+	int *truncated);				/* <- TRUE if the server truncated the delta; the changes after sync_token are still to come */
+extern int parse_subtree(
+	UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of infinity */
+	CFIndex xmlp_len,				/* -> length of xml data */
+	CFURLRef urlRef,				/* -> the CFURL to the directory (may be a relative CFURL) */
+	uid_t uid,						/* -> uid of the user making the request */ 
+	struct node_entry *parent_node);/* -> pointer to the directory's node_entry */
 extern int parse_file_count(const UInt8 *xmlp, CFIndex xmlp_len, int *file_count);
 extern int parse_cachevalidators(const UInt8 *xmlp, CFIndex xmlp_len, time_t *last_modified, char **entity_tag);
 extern webdav_parse_multistatus_list_t *parse_multi_status(	UInt8 *xmlp, CFIndex xmlp_len);
@@ -212,6 +238,8 @@ extern webdav_parse_multistatus_list_t *parse_multi_status(	UInt8 *xmlp, CFIndex
 #define WEBDAV_OPENDIR_APPLEDOUBLEHEADER 6
 #define WEBDAV_OPENDIR_ELEMENT_RESPONSE 7
 #define WEBDAV_OPENDIR_IGNORE 8		/* Same Rules Apply */
+#define WEBDAV_OPENDIR_ELEMENT_STATUS 9
+#define WEBDAV_OPENDIR_SYNC_TOKEN 10
 
 #define WEBDAV_MULTISTATUS_ELEMENT 1
 #define WEBDAV_MULTISTATUS_STATUS 2
@@ -36,6 +36,9 @@
 #include "webdav_requestqueue.h"
 #include "webdav_network.h"
 #include "webdav_cookie.h"
+#include "webdav_stats.h"
+#include "webdav_trace.h"
+#include "OpaqueIDs.h"
 
 /*****************************************************************************/
 
@@ -71,6 +74,31 @@ typedef struct webdav_requestqueue_element_tag
 		{
 			struct stream_put_ctx *ctx;
 		} seqwrite_read_rsp;
+		
+		struct prefetch
+		{
+			uid_t uid;							/* the user whose lookups missed the cache */
+			opaque_id dir_id;					/* the directory whose children's attributes to fetch */
+		} prefetch;								/* Struct used for attribute prefetch requests */
+		struct warmup
+		{
+			uid_t uid;							/* the user who asked for the warm-up */
+			opaque_id dir_id;					/* the directory to warm up */
+			u_int32_t depth;					/* levels below dir_id to warm up, or 0 for all */
+			int first;							/* TRUE if dir_id is the top of the subtree */
+		} warmup;								/* Struct used for subtree warm-up requests */
+		
+		struct tree_delete
+		{
+			struct delete_dir *dir;				/* the directory being emptied */
+			opaque_id obj_id;					/* the child of dir to delete */
+		} tree_delete;							/* Struct used for subtree delete requests */
+		
+		struct lock_refresh
+		{
+			opaque_id node_id;					/* the open file whose LOCK needs refreshing */
+			time_t refresh_time;				/* when the LOCK reached WEBDAV_LOCK_REFRESH_AGE */
+		} lock_refresh;							/* Struct used for LOCK refresh requests */
 				
 	} element;
 } webdav_requestqueue_element_t;
@@ -89,24 +117,40 @@ typedef struct
 #define WEBDAV_DOWNLOAD_TYPE 2
 #define WEBDAV_SERVER_PING_TYPE 3
 #define WEBDAV_SEQWRITE_MANAGER_TYPE 4
+#define WEBDAV_PREFETCH_TYPE 5
+#define WEBDAV_WARMUP_TYPE 6
+#define WEBDAV_TREE_DELETE_TYPE 7
+#define WEBDAV_LOCK_REFRESH_TYPE 8
 
 #define WEBDAV_MAX_IDLE_TIME 10		/* in seconds */
+#define WEBDAV_TRACE_SNAPSHOT_INTERVAL 600	/* in seconds -- at most one trace snapshot per outage this often */
 
 
 /* connectionstate_lock used to make connectionstate thread safe */
 static pthread_mutex_t connectionstate_lock;
 /* connectionstate is set to either WEBDAV_CONNECTION_UP or WEBDAV_CONNECTION_DOWN */
 static int connectionstate;
+/* when the last connection lost trace snapshot was taken (protected by connectionstate_lock) */
+static time_t connectionstate_snapshot_time = 0;
 
 static pthread_mutex_t requests_lock;
 static pthread_cond_t requests_condvar;
 static webdav_requestqueue_header_t waiting_requests;
+static webdav_requestqueue_header_t waiting_walks;	/* tree walk (warm-up and delete) requests not yet on waiting_requests (protected by requests_lock) */
+static int gWalkCount = 0;	/* tree walk requests on waiting_requests or being handled (protected by requests_lock) */
+static webdav_requestqueue_header_t waiting_lock_refreshes;	/* LOCK refresh requests not yet on waiting_requests (protected by requests_lock) */
+static int gLockRefreshCount = 0;	/* LOCK refresh requests on waiting_requests or being handled (protected by requests_lock) */
 
 static pthread_mutex_t pulse_lock;
 static pthread_cond_t pulse_condvar;
 static int purge_cache_files;	/* TRUE if closed cache files should be immediately removed from file cache */
 
 static int handle_request_thread(void *arg);
+static int queue_waiting_request(webdav_requestqueue_element_t *request_element_ptr);
+static int dispatch_walks(void);
+static int enqueue_walk(webdav_requestqueue_element_t *request_element_ptr);
+static int dispatch_lock_refreshes(void);
+static int enqueue_lock_refresh(opaque_id node_id, time_t refresh_time);
 
 static int gCurrThreadCount = 0;
 static int gIdleThreadCount = 0;
@@ -188,6 +232,10 @@ static void notify_reconnected(void)
 void set_connectionstate(int state)
 {
 	int error;
+	int take_snapshot;
+	time_t now;
+	
+	take_snapshot = FALSE;
 	
 	error = pthread_mutex_lock(&connectionstate_lock);
 	require_noerr(error, pthread_mutex_lock);
@@ -201,6 +249,15 @@ void set_connectionstate(int state)
 				/* transition to DOWN state */
 				connectionstate = WEBDAV_CONNECTION_DOWN;
 				
+				/* capture what led up to the outage (after unlocking), unless a flapping connection already has */
+				now = time(NULL);
+				if ( (connectionstate_snapshot_time == 0) ||
+					 ((now - connectionstate_snapshot_time) >= WEBDAV_TRACE_SNAPSHOT_INTERVAL) )
+				{
+					connectionstate_snapshot_time = now;
+					take_snapshot = TRUE;
+				}
+				
 				/* start pinging the server, specifying 0 delay for the 1st ping */
 				requestqueue_enqueue_server_ping(0);
 			}
@@ -219,6 +276,11 @@ void set_connectionstate(int state)
 	
 	error = pthread_mutex_unlock(&connectionstate_lock);
 	require_noerr(error, pthread_mutex_unlock);
+	
+	if ( take_snapshot )
+	{
+		trace_snapshot("connection lost", LOG_INFO);
+	}
 
 pthread_mutex_unlock:
 pthread_mutex_lock:
@@ -314,6 +376,70 @@ static void send_reply(int so, void *data, size_t size, int error)
 
 /*****************************************************************************/
 
+/* returns the opaque_id a request operates on, or kInvalidOpaqueID */
+static opaque_id request_object_id(int operation, void *key)
+{
+	switch ( operation )
+	{
+		case WEBDAV_LOOKUP:
+			return ( ((struct webdav_request_lookup *)key)->dir_id );
+		case WEBDAV_LOOKUP_PATH:
+			return ( ((struct webdav_request_lookup_path *)key)->dir_id );
+		case WEBDAV_CREATE:
+			return ( ((struct webdav_request_create *)key)->dir_id );
+		case WEBDAV_MKDIR:
+			return ( ((struct webdav_request_mkdir *)key)->dir_id );
+		case WEBDAV_OPEN:
+			return ( ((struct webdav_request_open *)key)->obj_id );
+		case WEBDAV_CLOSE:
+			return ( ((struct webdav_request_close *)key)->obj_id );
+		case WEBDAV_GETATTR:
+			return ( ((struct webdav_request_getattr *)key)->obj_id );
+		case WEBDAV_READ:
+			return ( ((struct webdav_request_read *)key)->obj_id );
+		case WEBDAV_FSYNC:
+			return ( ((struct webdav_request_fsync *)key)->obj_id );
+		case WEBDAV_REMOVE:
+			return ( ((struct webdav_request_remove *)key)->obj_id );
+		case WEBDAV_RMDIR:
+			return ( ((struct webdav_request_rmdir *)key)->obj_id );
+		case WEBDAV_RENAME:
+			return ( ((struct webdav_request_rename *)key)->from_obj_id );
+		case WEBDAV_READDIR:
+			return ( ((struct webdav_request_readdir *)key)->obj_id );
+		case WEBDAV_WRITESEQ:
+			return ( ((struct webdav_request_writeseq *)key)->obj_id );
+		case WEBDAV_WARMUP:
+			return ( ((struct webdav_request_warmup *)key)->dir_id );
+		case WEBDAV_EMPTYDIR:
+			return ( ((struct webdav_request_emptydir *)key)->dir_id );
+		default:
+			return ( kInvalidOpaqueID );
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * returns the fileid of the node a request operates on (for tracing, so the
+ * request's event has the same id as the HTTP events it causes), or 0
+ */
+static webdav_ino_t request_fileid(int operation, void *key)
+{
+	opaque_id obj_id;
+	struct node_entry *node;
+	
+	obj_id = request_object_id(operation, key);
+	if ( (obj_id == kInvalidOpaqueID) || (RetrieveDataFromOpaqueID(obj_id, (void **)&node) != 0) )
+	{
+		return ( 0 );
+	}
+	
+	return ( node->fileid );
+}
+
+/*****************************************************************************/
+
 static void handle_filesystem_request(int so)
 {
 	int error;
@@ -322,32 +448,19 @@ static void handle_filesystem_request(int so)
 	size_t num_bytes;
 	char *bytes;
 	union webdav_reply reply;
+	uint64_t start_time;
+	webdav_ino_t fileid;
+	
+	num_bytes = 0;
 	
 	/* get the request from the socket */
 	error = get_request(so, &operation, key, sizeof(key));
 	if ( !error ) {
+		start_time = stats_start();
+		/* get it now -- the request may delete the node */
+		fileid = request_fileid(operation, key);
 #if DEBUG	
-		LogMessage(kTrace, "handle_filesystem_request: %s(%d)\n",
-				(operation==WEBDAV_LOOKUP) ? "LOOKUP" :
-				(operation==WEBDAV_CREATE) ? "CREATE" :
-				(operation==WEBDAV_OPEN) ? "OPEN" :
-				(operation==WEBDAV_CLOSE) ? "CLOSE" :
-				(operation==WEBDAV_GETATTR) ? "GETATTR" :
-				(operation==WEBDAV_SETATTR) ? "SETATTR" :
-				(operation==WEBDAV_READ) ? "READ" :
-				(operation==WEBDAV_WRITE) ? "WRITE" :
-				(operation==WEBDAV_FSYNC) ? "FSYNC" :
-				(operation==WEBDAV_REMOVE) ? "REMOVE" :
-				(operation==WEBDAV_RENAME) ? "RENAME" :
-				(operation==WEBDAV_MKDIR) ? "MKDIR" :
-				(operation==WEBDAV_RMDIR) ? "RMDIR" :
-				(operation==WEBDAV_READDIR) ? "READDIR" :
-				(operation==WEBDAV_STATFS) ? "STATFS" :
-				(operation==WEBDAV_UNMOUNT) ? "UNMOUNT" :
-				(operation==WEBDAV_INVALCACHES) ? "INVALCACHES" :
-				"???",
-				operation
-				);
+		LogMessage(kTrace, "handle_filesystem_request: %s(%d)\n", stats_op_name(operation), operation);
 #endif
 		bzero((void *)&reply, sizeof(union webdav_reply));
 		
@@ -370,6 +483,12 @@ static void handle_filesystem_request(int so)
 					send_reply(so, (void *)&reply, sizeof(struct webdav_reply_lookup), error);
 					break;
 
+				case WEBDAV_LOOKUP_PATH:
+					error = filesystem_lookup_path((struct webdav_request_lookup_path *)key,
+							(struct webdav_reply_lookup_path *)&reply);
+					send_reply(so, (void *)&reply, sizeof(struct webdav_reply_lookup_path), error);
+					break;
+
 				case WEBDAV_CREATE:
 					error = filesystem_create((struct webdav_request_create *)key,
 							(struct webdav_reply_create *)&reply);
@@ -432,8 +551,9 @@ static void handle_filesystem_request(int so)
 					break;
 
 				case WEBDAV_READDIR:
-					error = filesystem_readdir((struct webdav_request_readdir *)key);
-					send_reply(so, (void *)0, 0, error);
+					error = filesystem_readdir((struct webdav_request_readdir *)key,
+							(struct webdav_reply_readdir *)&reply);
+					send_reply(so, (void *)&reply, sizeof(struct webdav_reply_readdir), error);
 					break;
 
 				case WEBDAV_STATFS:
@@ -467,6 +587,31 @@ static void handle_filesystem_request(int so)
 					send_reply(so, (void *)0, 0, error);
 					break;
 				
+				case WEBDAV_DUMP_STATS:
+					dump_stats((struct webdav_request_stats *)key);
+					send_reply(so, (void *)0, 0, error);
+					break;
+				
+				case WEBDAV_CLEAR_STATS:
+					reset_stats((struct webdav_request_stats *)key);
+					send_reply(so, (void *)0, 0, error);
+					break;
+				
+				case WEBDAV_DUMP_TRACE:
+					dump_trace((struct webdav_request_trace *)key);
+					send_reply(so, (void *)0, 0, error);
+					break;
+				
+				case WEBDAV_WARMUP:
+					error = filesystem_warmup((struct webdav_request_warmup *)key);
+					send_reply(so, (void *)0, 0, error);
+					break;
+				
+				case WEBDAV_EMPTYDIR:
+					error = filesystem_emptydir((struct webdav_request_emptydir *)key);
+					send_reply(so, (void *)0, 0, error);
+					break;
+				
 				default:
 					error = ENOTSUP;
 					break;
@@ -474,28 +619,10 @@ static void handle_filesystem_request(int so)
 		}
 
 #if DEBUG
-		LogMessage(kError, "handle_filesystem_request: error %d, %s(%d)\n", error,
-					(operation==WEBDAV_LOOKUP) ? "LOOKUP" :
-					(operation==WEBDAV_CREATE) ? "CREATE" :
-					(operation==WEBDAV_OPEN) ? "OPEN" :
-					(operation==WEBDAV_CLOSE) ? "CLOSE" :
-					(operation==WEBDAV_GETATTR) ? "GETATTR" :
-					(operation==WEBDAV_SETATTR) ? "SETATTR" :
-					(operation==WEBDAV_READ) ? "READ" :
-					(operation==WEBDAV_WRITE) ? "WRITE" :
-					(operation==WEBDAV_FSYNC) ? "FSYNC" :
-					(operation==WEBDAV_REMOVE) ? "REMOVE" :
-					(operation==WEBDAV_RENAME) ? "RENAME" :
-					(operation==WEBDAV_MKDIR) ? "MKDIR" :
-					(operation==WEBDAV_RMDIR) ? "RMDIR" :
-					(operation==WEBDAV_READDIR) ? "READDIR" :
-					(operation==WEBDAV_STATFS) ? "STATFS" :
-					(operation==WEBDAV_UNMOUNT) ? "UNMOUNT" :
-					(operation==WEBDAV_INVALCACHES) ? "INVALCACHES" :
-					"???",
-					operation
-					);
+		LogMessage(kError, "handle_filesystem_request: error %d, %s(%d)\n", error, stats_op_name(operation), operation);
 #endif
+		stats_record_op(operation, start_time, num_bytes, error);
+		trace_record(WEBDAV_TRACE_OP, (uint16_t)operation, fileid, start_time, num_bytes, error);
 	}
 	else {
 		LogMessage(kError, "handle_filesystem_request: get_request failed %d\n", error);
@@ -512,6 +639,7 @@ static void pulse_thread(void *arg)
 	#pragma unused(arg)
 	int error;
 	struct node_entry *node;
+	time_t now, next_pulse, refresh_time;
 	
 	error = 0;
 	while ( TRUE )
@@ -523,16 +651,42 @@ static void pulse_thread(void *arg)
 		
 		LogMessage(kTrace, "pulse_thread running\n");
 		
+		now = time(NULL);
+		next_pulse = now + (gtimeout_val / 2);
+		
 		node = nodecache_get_next_file_cache_node(TRUE);
 		while ( node != NULL )
 		{
 			if ( NODE_FILE_IS_OPEN(node) )
 			{
 				/* open node */
-				if ( !NODE_IS_DELETED(node) )
+				if ( !NODE_IS_DELETED(node) && (node->file_locktoken != NULL) )
 				{
-					/* renew the lock if not deleted */
-					(void) filesystem_lock(node);
+					/*
+					 * Renew the lock (if not deleted) once it's WEBDAV_LOCK_REFRESH_AGE old.
+					 * The LOCK is sent on a request thread so refreshes run concurrently
+					 * and a slow server doesn't hold up the pulse.
+					 */
+					refresh_time = node->file_lock_time + WEBDAV_LOCK_REFRESH_AGE;
+					if ( node->file_lock_refresh_queued )
+					{
+						/* already on its way -- check back soon in case it fails */
+						refresh_time = now + WEBDAV_LOCK_REFRESH_RETRY;
+					}
+					else if ( refresh_time <= now )
+					{
+						node->file_lock_refresh_queued = TRUE;
+						if ( enqueue_lock_refresh(node->nodeid, refresh_time) != 0 )
+						{
+							node->file_lock_refresh_queued = FALSE;
+						}
+						/* check back soon in case the refresh fails */
+						refresh_time = now + WEBDAV_LOCK_REFRESH_RETRY;
+					}
+					if ( refresh_time < next_pulse )
+					{
+						next_pulse = refresh_time;
+					}
 				}
 			}
 			else
@@ -552,8 +706,8 @@ static void pulse_thread(void *arg)
 		
 		purge_cache_files = FALSE; /* reset gPurgeCacheFiles (if it was set) */
 		
-		/* sleep for a while */
-		pulsetime.tv_sec = time(NULL) + (gtimeout_val / 2);
+		/* sleep until the next lock needs refreshing, or for a while */
+		pulsetime.tv_sec = next_pulse;
 		pulsetime.tv_nsec = 0;
 		error = pthread_cond_timedwait(&pulse_condvar, &pulse_lock, &pulsetime);
 		require((error == ETIMEDOUT || error == 0), pthread_cond_timedwait);
@@ -646,6 +800,48 @@ static int handle_request_thread(void *arg)
 					network_seqwrite_manager(myrequest->element.seqwrite_read_rsp.ctx);
 				break;
 				
+				case WEBDAV_PREFETCH_TYPE:
+					/* fetch the attributes of a directory's children */
+					filesystem_prefetch_directory(myrequest->element.prefetch.uid, myrequest->element.prefetch.dir_id);
+				break;
+				
+				case WEBDAV_WARMUP_TYPE:
+				case WEBDAV_TREE_DELETE_TYPE:
+					if ( myrequest->type == WEBDAV_WARMUP_TYPE )
+					{
+						/* fetch one directory's (or a whole subtree's) attributes */
+						filesystem_warmup_directory(myrequest->element.warmup.uid, myrequest->element.warmup.dir_id,
+							myrequest->element.warmup.depth, myrequest->element.warmup.first);
+					}
+					else
+					{
+						/* delete one object (and, if needed, walk what's inside it) */
+						filesystem_delete_tree_node(myrequest->element.tree_delete.dir, myrequest->element.tree_delete.obj_id);
+					}
+					
+					/* let the next waiting tree walk request run */
+					error = pthread_mutex_lock(&requests_lock);
+					require_noerr(error, pthread_mutex_lock);
+					--gWalkCount;
+					/* this thread will pick up the request if no other thread can be started */
+					(void) dispatch_walks();
+					error = pthread_mutex_unlock(&requests_lock);
+					require_noerr(error, pthread_mutex_unlock);
+				break;
+				
+				case WEBDAV_LOCK_REFRESH_TYPE:
+					/* send the LOCK refresh */
+					filesystem_refresh_lock(myrequest->element.lock_refresh.node_id);
+					
+					/* let the next waiting LOCK refresh run */
+					error = pthread_mutex_lock(&requests_lock);
+					require_noerr(error, pthread_mutex_lock);
+					--gLockRefreshCount;
+					(void) dispatch_lock_refreshes();
+					error = pthread_mutex_unlock(&requests_lock);
+					require_noerr(error, pthread_mutex_unlock);
+				break;
+				
 				default:
 					/* nothing we can do, just get the next request */
 					break;
@@ -728,6 +924,8 @@ int requestqueue_init()
 	
 	/* initialize requestqueue */
 	bzero(&waiting_requests, sizeof(waiting_requests));
+	bzero(&waiting_walks, sizeof(waiting_walks));
+	bzero(&waiting_lock_refreshes, sizeof(waiting_lock_refreshes));
 
 	error = pthread_cond_init(&requests_condvar, NULL);
 	require_noerr(error, pthread_cond_init);
@@ -1017,6 +1215,336 @@ pthread_mutex_lock:
 
 /*****************************************************************************/
 
+int requestqueue_enqueue_prefetch(
+	uid_t uid,							/* the user whose lookups missed the cache */
+	opaque_id dir_id)					/* the directory whose children's attributes to fetch */
+{
+	int error, error2;
+	webdav_requestqueue_element_t * request_element_ptr;
+	pthread_t request_thread;
+
+	error = pthread_mutex_lock(&requests_lock);
+	require_noerr_action(error, pthread_mutex_lock, webdav_kill(-1));
+
+	request_element_ptr = malloc(sizeof(webdav_requestqueue_element_t));
+	require_action(request_element_ptr != NULL, malloc_request_element_ptr, error = ENOMEM);
+
+	request_element_ptr->type = WEBDAV_PREFETCH_TYPE;
+	request_element_ptr->element.prefetch.uid = uid;
+	request_element_ptr->element.prefetch.dir_id = dir_id;
+	
+	/* Insert prefetches at the tail of the request queue -- nothing is waiting for them */
+	request_element_ptr->next = 0;
+	++(waiting_requests.request_count);
+
+	if (!(waiting_requests.item_tail)) {
+		waiting_requests.item_head = waiting_requests.item_tail = request_element_ptr;
+	}
+	else {
+		waiting_requests.item_tail->next = request_element_ptr;
+		waiting_requests.item_tail = request_element_ptr;
+	}
+
+	if (gIdleThreadCount > 0) {
+		/* Already have one or more threads just waiting for work to do.  Just kick the requests_condvar to wake 
+		up the threads */
+		error = pthread_cond_signal(&requests_condvar);
+		require_noerr(error, pthread_cond_signal);
+	}
+	else {
+		/* No idle threads, so try to create one if we have not reached out maximum number of threads */
+		if (gCurrThreadCount < WEBDAV_REQUEST_THREADS) {
+			error = pthread_create(&request_thread, &gRequest_thread_attr, (void *) handle_request_thread, (void *) NULL);
+			require_noerr(error, pthread_create_signal);
+
+			gCurrThreadCount += 1;
+		}
+	}
+
+pthread_create_signal:
+pthread_cond_signal:
+malloc_request_element_ptr:
+
+	error2 = pthread_mutex_unlock(&requests_lock);
+	require_noerr_action(error2, pthread_mutex_unlock, error = (error == 0) ? error2 : error; webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
+/*
+ * queue_waiting_request adds a request to the end of waiting_requests and
+ * wakes (or starts) a request thread to handle it.
+ * requests_lock must be held.
+ */
+static int queue_waiting_request(webdav_requestqueue_element_t *request_element_ptr)
+{
+	int error;
+	pthread_t request_thread;
+	
+	error = 0;
+	
+	request_element_ptr->next = NULL;
+	++(waiting_requests.request_count);
+	if (!(waiting_requests.item_tail)) {
+		waiting_requests.item_head = waiting_requests.item_tail = request_element_ptr;
+	}
+	else {
+		waiting_requests.item_tail->next = request_element_ptr;
+		waiting_requests.item_tail = request_element_ptr;
+	}
+	
+	if (gIdleThreadCount > 0) {
+		/* Already have one or more threads just waiting for work to do.  Just kick the requests_condvar to wake 
+		up the threads */
+		error = pthread_cond_signal(&requests_condvar);
+		require_noerr(error, pthread_cond_signal);
+	}
+	else {
+		/* No idle threads, so try to create one if we have not reached out maximum number of threads */
+		if (gCurrThreadCount < WEBDAV_REQUEST_THREADS) {
+			error = pthread_create(&request_thread, &gRequest_thread_attr, (void *) handle_request_thread, (void *) NULL);
+			require_noerr(error, pthread_create_signal);
+
+			gCurrThreadCount += 1;
+		}
+	}
+
+pthread_create_signal:
+pthread_cond_signal:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * dispatch_walks moves tree walk requests (warm-ups and deletes) from
+ * waiting_walks to the end of waiting_requests until WEBDAV_WALK_THREADS of
+ * them are queued or running, so a large subtree can't starve the requests
+ * from the kernel.
+ * requests_lock must be held.
+ */
+static int dispatch_walks(void)
+{
+	int error;
+	webdav_requestqueue_element_t * request_element_ptr;
+	
+	error = 0;
+	
+	while ( (error == 0) && (gWalkCount < WEBDAV_WALK_THREADS) && (waiting_walks.item_head != NULL) )
+	{
+		/* dequeue from waiting_walks */
+		request_element_ptr = waiting_walks.item_head;
+		waiting_walks.item_head = request_element_ptr->next;
+		if ( waiting_walks.item_head == NULL )
+		{
+			waiting_walks.item_tail = NULL;
+		}
+		--(waiting_walks.request_count);
+		
+		/* and add to the end of waiting_requests */
+		++gWalkCount;
+		error = queue_waiting_request(request_element_ptr);
+	}
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * enqueue_walk adds a tree walk request to the end of waiting_walks (walks
+ * are breadth first) and dispatches what it can. If there is an error, the
+ * request is freed.
+ */
+static int enqueue_walk(webdav_requestqueue_element_t *request_element_ptr)
+{
+	int error, error2;
+
+	error = pthread_mutex_lock(&requests_lock);
+	require_noerr_action(error, pthread_mutex_lock, free(request_element_ptr); webdav_kill(-1));
+
+	request_element_ptr->next = NULL;
+	++(waiting_walks.request_count);
+	if (!(waiting_walks.item_tail)) {
+		waiting_walks.item_head = waiting_walks.item_tail = request_element_ptr;
+	}
+	else {
+		waiting_walks.item_tail->next = request_element_ptr;
+		waiting_walks.item_tail = request_element_ptr;
+	}
+	
+	error = dispatch_walks();
+
+	error2 = pthread_mutex_unlock(&requests_lock);
+	require_noerr_action(error2, pthread_mutex_unlock, error = (error == 0) ? error2 : error; webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
+/*
+ * dispatch_lock_refreshes moves LOCK refresh requests from
+ * waiting_lock_refreshes to the end of waiting_requests until
+ * WEBDAV_LOCK_REFRESH_THREADS of them are queued or running, so many open
+ * files needing refreshes at once can't starve the requests from the kernel.
+ * requests_lock must be held.
+ */
+static int dispatch_lock_refreshes(void)
+{
+	int error;
+	webdav_requestqueue_element_t * request_element_ptr;
+	
+	error = 0;
+	
+	while ( (error == 0) && (gLockRefreshCount < WEBDAV_LOCK_REFRESH_THREADS) && (waiting_lock_refreshes.item_head != NULL) )
+	{
+		/* dequeue from waiting_lock_refreshes */
+		request_element_ptr = waiting_lock_refreshes.item_head;
+		waiting_lock_refreshes.item_head = request_element_ptr->next;
+		if ( waiting_lock_refreshes.item_head == NULL )
+		{
+			waiting_lock_refreshes.item_tail = NULL;
+		}
+		--(waiting_lock_refreshes.request_count);
+		
+		/* and add to the end of waiting_requests */
+		++gLockRefreshCount;
+		error = queue_waiting_request(request_element_ptr);
+	}
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * enqueue_lock_refresh adds a LOCK refresh request for an open file to
+ * waiting_lock_refreshes, which is kept in refresh_time order so the locks
+ * closest to timing out are refreshed first, and dispatches what it can.
+ */
+static int enqueue_lock_refresh(opaque_id node_id, time_t refresh_time)
+{
+	int error, error2;
+	webdav_requestqueue_element_t * request_element_ptr;
+	webdav_requestqueue_element_t * prev_element_ptr;
+
+	request_element_ptr = malloc(sizeof(webdav_requestqueue_element_t));
+	require_action(request_element_ptr != NULL, malloc_request_element_ptr, error = ENOMEM);
+
+	request_element_ptr->type = WEBDAV_LOCK_REFRESH_TYPE;
+	request_element_ptr->element.lock_refresh.node_id = node_id;
+	request_element_ptr->element.lock_refresh.refresh_time = refresh_time;
+
+	error = pthread_mutex_lock(&requests_lock);
+	require_noerr_action(error, pthread_mutex_lock, free(request_element_ptr); webdav_kill(-1));
+
+	/* insert after the requests that are due no later than this one */
+	prev_element_ptr = NULL;
+	if ( (waiting_lock_refreshes.item_tail != NULL) &&
+		 (waiting_lock_refreshes.item_tail->element.lock_refresh.refresh_time <= refresh_time) )
+	{
+		/* the usual case -- pulse_thread finds the locks in about the order they were obtained */
+		prev_element_ptr = waiting_lock_refreshes.item_tail;
+	}
+	else
+	{
+		webdav_requestqueue_element_t * element_ptr;
+		
+		for ( element_ptr = waiting_lock_refreshes.item_head;
+			  (element_ptr != NULL) && (element_ptr->element.lock_refresh.refresh_time <= refresh_time);
+			  element_ptr = element_ptr->next )
+		{
+			prev_element_ptr = element_ptr;
+		}
+	}
+	
+	++(waiting_lock_refreshes.request_count);
+	if ( prev_element_ptr == NULL ) {
+		request_element_ptr->next = waiting_lock_refreshes.item_head;
+		waiting_lock_refreshes.item_head = request_element_ptr;
+	}
+	else {
+		request_element_ptr->next = prev_element_ptr->next;
+		prev_element_ptr->next = request_element_ptr;
+	}
+	if ( request_element_ptr->next == NULL ) {
+		waiting_lock_refreshes.item_tail = request_element_ptr;
+	}
+	
+	error = dispatch_lock_refreshes();
+
+	error2 = pthread_mutex_unlock(&requests_lock);
+	require_noerr_action(error2, pthread_mutex_unlock, error = (error == 0) ? error2 : error; webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+malloc_request_element_ptr:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
+int requestqueue_enqueue_warmup(
+	uid_t uid,							/* the user making the request */
+	opaque_id dir_id,					/* the directory to warm up */
+	u_int32_t depth,					/* levels below dir_id to warm up, or 0 for all */
+	int first)							/* TRUE if dir_id is the top of the subtree */
+{
+	int error;
+	webdav_requestqueue_element_t * request_element_ptr;
+
+	request_element_ptr = malloc(sizeof(webdav_requestqueue_element_t));
+	require_action(request_element_ptr != NULL, malloc_request_element_ptr, error = ENOMEM);
+
+	request_element_ptr->type = WEBDAV_WARMUP_TYPE;
+	request_element_ptr->element.warmup.uid = uid;
+	request_element_ptr->element.warmup.dir_id = dir_id;
+	request_element_ptr->element.warmup.depth = depth;
+	request_element_ptr->element.warmup.first = first;
+	
+	error = enqueue_walk(request_element_ptr);
+
+malloc_request_element_ptr:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
+int requestqueue_enqueue_tree_delete(
+	struct delete_dir *dir,				/* the directory being emptied */
+	opaque_id obj_id)					/* the child of dir to delete */
+{
+	int error;
+	webdav_requestqueue_element_t * request_element_ptr;
+
+	request_element_ptr = malloc(sizeof(webdav_requestqueue_element_t));
+	require_action(request_element_ptr != NULL, malloc_request_element_ptr, error = ENOMEM);
+
+	request_element_ptr->type = WEBDAV_TREE_DELETE_TYPE;
+	request_element_ptr->element.tree_delete.dir = dir;
+	request_element_ptr->element.tree_delete.obj_id = obj_id;
+	
+	error = enqueue_walk(request_element_ptr);
+
+malloc_request_element_ptr:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
 int requestqueue_purge_cache_files(void)
 {
 	int error;
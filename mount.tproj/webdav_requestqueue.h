@@ -46,5 +46,16 @@ extern int requestqueue_enqueue_download(
 extern int requestqueue_enqueue_server_ping(u_int32_t delay);
 extern int requestqueue_purge_cache_files(void);
 extern int requestqueue_enqueue_seqwrite_manager(struct stream_put_ctx *);
+extern int requestqueue_enqueue_prefetch(
+			uid_t uid,							/* the user whose lookups missed the cache */
+			opaque_id dir_id);					/* the directory whose children's attributes to fetch */
+extern int requestqueue_enqueue_warmup(
+			uid_t uid,							/* the user making the request */
+			opaque_id dir_id,					/* the directory to warm up */
+			u_int32_t depth,					/* levels below dir_id to warm up, or 0 for all */
+			int first);							/* TRUE if dir_id is the top of the subtree */
+extern int requestqueue_enqueue_tree_delete(
+			struct delete_dir *dir,				/* the directory being emptied */
+			opaque_id obj_id);					/* the child of dir to delete */
 
 #endif
@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <sys/syslog.h>
+#include <stdio.h>
+#include <string.h>
+#include <mach/mach_time.h>
+#include <libkern/OSAtomic.h>
+
+#include "webdav_stats.h"
+
+/*****************************************************************************/
+
+static mach_timebase_info_data_t gStatsTimebase;
+static uint64_t gStatsResetTime;		/* stats_start() timestamp of the last reset */
+
+static struct webdav_stats_histogram gOpStats[WEBDAV_STATS_MAX_OPERATION + 1];
+static struct webdav_stats_histogram gMethodStats[WEBDAV_STATS_METHOD_COUNT];
+static struct webdav_stats_histogram gParseStats[WEBDAV_STATS_PARSE_COUNT];
+static volatile int64_t gParseEntries[WEBDAV_STATS_PARSE_COUNT];
+static volatile int64_t gStatsCounters[WEBDAV_STATS_COUNTER_COUNT];
+
+static const char *gMethodNames[WEBDAV_STATS_METHOD_COUNT] = {
+	"GET", "PUT", "PROPFIND", "LOCK", "UNLOCK", "DELETE", "MOVE", "MKCOL", "OPTIONS", "REPORT", "OTHER"
+};
+
+static const char *gParserNames[WEBDAV_STATS_PARSE_COUNT] = {
+	"opendir", "stat", "statfs", "lock", "cachevalidators", "multistatus", "file_count", "sync_collection", "subtree"
+};
+
+static const char *gCounterNames[WEBDAV_STATS_COUNTER_COUNT] = {
+	"node_cache_hit",
+	"node_cache_miss",
+	"attr_cache_hit",
+	"attr_cache_miss",
+	"prefetch_request",
+	"prefetch_entries",
+	"prefetch_hit",
+	"dir_listing_reused",
+	"dir_listing_revalidated",
+	"sync_collection_request",
+	"sync_collection_fallback",
+	"warmup_subtree",
+	"warmup_directories",
+	"tree_delete_recursive",
+	"tree_delete_walked",
+	"readdir_plus_entries",
+	"read_ahead_hit",
+	"open_head",
+	"open_first_byte_usec",
+	"open_head_usec",
+	"open_whole_file",
+	"writeseq_chunks",
+	"writeseq_window_bytes",
+	"writeseq_window_stalls",
+	"writeseq_window_stall_usec",
+	"streamed_upload",
+	"streamed_upload_fallback",
+	"upload_segments",
+	"upload_retried",
+	"upload_resumed",
+	"upload_resumed_bytes",
+	"authcache_unlocked",
+	"authcache_locked",
+	"auth_challenges",
+	"auth_prerendered",
+	"auth_stale_nonce",
+	"lock_refresh",
+	"lock_refresh_failed",
+	"lock_refresh_lag_sec",
+	"lock_refresh_late",
+	"lockless_open",
+	"lockless_conflict",
+	"lockless_locked",
+	"gzip_responses",
+	"gzip_wire_bytes",
+	"gzip_decoded_bytes"
+};
+
+/*****************************************************************************/
+
+void stats_init(void)
+{
+	(void) mach_timebase_info(&gStatsTimebase);
+	gStatsResetTime = mach_absolute_time();
+}
+
+/*****************************************************************************/
+
+uint64_t stats_start(void)
+{
+	return ( mach_absolute_time() );
+}
+
+/*****************************************************************************/
+
+uint64_t stats_ticks_to_usec(uint64_t ticks)
+{
+	if ( gStatsTimebase.denom == 0 )
+	{
+		/* stats_init() hasn't been called */
+		return ( 0 );
+	}
+
+	return ( (ticks * gStatsTimebase.numer / gStatsTimebase.denom) / 1000 );
+}
+
+/*****************************************************************************/
+
+uint64_t stats_elapsed_usec(uint64_t start)
+{
+	return ( stats_ticks_to_usec(mach_absolute_time() - start) );
+}
+
+/*****************************************************************************/
+
+static void stats_record(struct webdav_stats_histogram *hist, uint64_t start, int64_t bytes, int error)
+{
+	int64_t usec, old_max;
+	int bucket;
+
+	usec = (int64_t)stats_elapsed_usec(start);
+
+	/* find the latency bucket -- the last bucket catches everything larger */
+	for ( bucket = 0; bucket < (WEBDAV_STATS_LATENCY_BUCKETS - 1); ++bucket )
+	{
+		if ( usec < ((int64_t)WEBDAV_STATS_BUCKET_BASE_USEC << bucket) )
+		{
+			break;
+		}
+	}
+
+	OSAtomicIncrement64(&hist->count);
+	if ( error != 0 )
+	{
+		OSAtomicIncrement64(&hist->errors);
+	}
+	if ( bytes > 0 )
+	{
+		OSAtomicAdd64(bytes, &hist->bytes);
+	}
+	OSAtomicAdd64(usec, &hist->total_usec);
+	OSAtomicIncrement64(&hist->buckets[bucket]);
+
+	/* raise max_usec if this sample is larger; retry if another thread got there first */
+	do
+	{
+		old_max = hist->max_usec;
+		if ( usec <= old_max )
+		{
+			break;
+		}
+	} while ( !OSAtomicCompareAndSwap64(old_max, usec, &hist->max_usec) );
+}
+
+/*****************************************************************************/
+
+void stats_record_op(int operation, uint64_t start, size_t bytes, int error)
+{
+	if ( (operation < 0) || (operation > WEBDAV_STATS_MAX_OPERATION) )
+	{
+		/* lump unknown operations together in slot 0 which isn't a valid operation */
+		operation = 0;
+	}
+	stats_record(&gOpStats[operation], start, (int64_t)bytes, error);
+}
+
+/*****************************************************************************/
+
+enum webdav_stats_method stats_method_index(CFStringRef requestMethod)
+{
+	enum webdav_stats_method method;
+	char buffer[16];
+
+	if ( (requestMethod == NULL) ||
+		 !CFStringGetCString(requestMethod, buffer, sizeof(buffer), kCFStringEncodingASCII) )
+	{
+		return ( WEBDAV_STATS_METHOD_OTHER );
+	}
+
+	for ( method = WEBDAV_STATS_METHOD_GET; method < WEBDAV_STATS_METHOD_OTHER; ++method )
+	{
+		if ( strcmp(buffer, gMethodNames[method]) == 0 )
+		{
+			break;
+		}
+	}
+
+	return ( method );
+}
+
+/*****************************************************************************/
+
+const char *stats_method_name(enum webdav_stats_method method)
+{
+	if ( (method < WEBDAV_STATS_METHOD_GET) || (method >= WEBDAV_STATS_METHOD_COUNT) )
+	{
+		method = WEBDAV_STATS_METHOD_OTHER;
+	}
+	return ( gMethodNames[method] );
+}
+
+/*****************************************************************************/
+
+void stats_record_http(enum webdav_stats_method method, uint64_t start, int64_t bytes, int error)
+{
+	stats_record(&gMethodStats[method], start, bytes, error);
+}
+
+/*****************************************************************************/
+
+/*
+ * Parser samples also count the resources described by the body so the
+ * cost per directory entry (usec_total / entries) can be compared across
+ * servers and listing sizes without a separate benchmark.
+ */
+void stats_record_parse(enum webdav_stats_parser parser, uint64_t start, int64_t bytes, int64_t entries, int error)
+{
+	stats_record(&gParseStats[parser], start, bytes, error);
+	if ( entries > 0 )
+	{
+		OSAtomicAdd64(entries, &gParseEntries[parser]);
+	}
+}
+
+/*****************************************************************************/
+
+void stats_increment(enum webdav_stats_counter counter)
+{
+	OSAtomicIncrement64(&gStatsCounters[counter]);
+}
+
+/*****************************************************************************/
+
+void stats_add(enum webdav_stats_counter counter, int64_t amount)
+{
+	OSAtomicAdd64(amount, &gStatsCounters[counter]);
+}
+
+/*****************************************************************************/
+
+const char *stats_op_name(int operation)
+{
+	switch ( operation )
+	{
+		case WEBDAV_LOOKUP:			return ( "LOOKUP" );
+		case WEBDAV_CREATE:			return ( "CREATE" );
+		case WEBDAV_OPEN:			return ( "OPEN" );
+		case WEBDAV_CLOSE:			return ( "CLOSE" );
+		case WEBDAV_GETATTR:		return ( "GETATTR" );
+		case WEBDAV_SETATTR:		return ( "SETATTR" );
+		case WEBDAV_READ:			return ( "READ" );
+		case WEBDAV_WRITE:			return ( "WRITE" );
+		case WEBDAV_FSYNC:			return ( "FSYNC" );
+		case WEBDAV_REMOVE:			return ( "REMOVE" );
+		case WEBDAV_RENAME:			return ( "RENAME" );
+		case WEBDAV_MKDIR:			return ( "MKDIR" );
+		case WEBDAV_RMDIR:			return ( "RMDIR" );
+		case WEBDAV_READDIR:		return ( "READDIR" );
+		case WEBDAV_STATFS:			return ( "STATFS" );
+		case WEBDAV_UNMOUNT:		return ( "UNMOUNT" );
+		case WEBDAV_INVALCACHES:	return ( "INVALCACHES" );
+		case WEBDAV_WRITESEQ:		return ( "WRITESEQ" );
+		case WEBDAV_DUMP_COOKIES:	return ( "DUMP_COOKIES" );
+		case WEBDAV_CLEAR_COOKIES:	return ( "CLEAR_COOKIES" );
+		case WEBDAV_DUMP_STATS:		return ( "DUMP_STATS" );
+		case WEBDAV_DUMP_TRACE:		return ( "DUMP_TRACE" );
+		case WEBDAV_CLEAR_STATS:	return ( "CLEAR_STATS" );
+		case WEBDAV_WARMUP:			return ( "WARMUP" );
+		case WEBDAV_EMPTYDIR:		return ( "EMPTYDIR" );
+		case WEBDAV_LOOKUP_PATH:	return ( "LOOKUP_PATH" );
+		default:					return ( "???" );
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * Writes one line per histogram in "key=value" form so the output can be
+ * scraped from the system log, e.g.:
+ *
+ * webdav_stats op=GETATTR count=12 errors=0 bytes=1104 usec_total=5200 usec_max=910 p50=256 p90=512 p99=1024 hist=3,7,2,0,...
+ *
+ * The percentiles are the upper bound of the bucket the percentile falls in
+ * (the last bucket reports usec_max), so they over-estimate by at most 2x.
+ */
+static int64_t stats_percentile_usec(struct webdav_stats_histogram *hist, int64_t count, int percent)
+{
+	int64_t target, seen;
+	int i;
+
+	/* the sample number (1-based) the percentile falls on */
+	target = (count * percent + 99) / 100;
+	seen = 0;
+	for ( i = 0; i < (WEBDAV_STATS_LATENCY_BUCKETS - 1); ++i )
+	{
+		seen += hist->buckets[i];
+		if ( seen >= target )
+		{
+			return ( (int64_t)WEBDAV_STATS_BUCKET_BASE_USEC << i );
+		}
+	}
+	return ( hist->max_usec );
+}
+
+static void stats_log_histogram(const char *kind, const char *name, struct webdav_stats_histogram *hist)
+{
+	char buckets[WEBDAV_STATS_LATENCY_BUCKETS * 21];
+	size_t len;
+	int64_t count;
+	int i;
+
+	/* use the bucket total so the percentiles agree with hist= even while samples are being added */
+	count = 0;
+	for ( i = 0; i < WEBDAV_STATS_LATENCY_BUCKETS; ++i )
+	{
+		count += hist->buckets[i];
+	}
+	if ( count == 0 )
+	{
+		return;
+	}
+
+	len = 0;
+	buckets[0] = '\0';
+	for ( i = 0; i < WEBDAV_STATS_LATENCY_BUCKETS; ++i )
+	{
+		len += snprintf(&buckets[len], sizeof(buckets) - len, (i == 0) ? "%lld" : ",%lld", hist->buckets[i]);
+		if ( len >= sizeof(buckets) )
+		{
+			break;
+		}
+	}
+
+	syslog(LOG_ERR, "webdav_stats %s=%s count=%lld errors=%lld bytes=%lld usec_total=%lld usec_max=%lld p50=%lld p90=%lld p99=%lld hist=%s\n",
+		kind, name, hist->count, hist->errors, hist->bytes, hist->total_usec, hist->max_usec,
+		stats_percentile_usec(hist, count, 50), stats_percentile_usec(hist, count, 90),
+		stats_percentile_usec(hist, count, 99), buckets);
+}
+
+/*****************************************************************************/
+
+void dump_stats(struct webdav_request_stats *req)
+{
+	int64_t requests;
+	int i;
+
+	if (req == NULL) {
+		syslog(LOG_DEBUG, "%s: req is null\n", __FUNCTION__);
+	}
+
+	/* interval_usec lets the reader turn count= and bytes= into rates */
+	syslog(LOG_ERR, "webdav_stats version=4 bucket_base_usec=%d buckets=%d interval_usec=%llu\n",
+		WEBDAV_STATS_BUCKET_BASE_USEC, WEBDAV_STATS_LATENCY_BUCKETS, stats_elapsed_usec(gStatsResetTime));
+
+	for ( i = 0; i <= WEBDAV_STATS_MAX_OPERATION; ++i )
+	{
+		stats_log_histogram("op", stats_op_name(i), &gOpStats[i]);
+	}
+
+	for ( i = 0; i < WEBDAV_STATS_METHOD_COUNT; ++i )
+	{
+		stats_log_histogram("method", gMethodNames[i], &gMethodStats[i]);
+	}
+
+	for ( i = 0; i < WEBDAV_STATS_PARSE_COUNT; ++i )
+	{
+		stats_log_histogram("parser", gParserNames[i], &gParseStats[i]);
+		if ( gParseStats[i].count != 0 )
+		{
+			syslog(LOG_ERR, "webdav_stats parser=%s entries=%lld\n", gParserNames[i], gParseEntries[i]);
+		}
+	}
+
+	for ( i = 0; i < WEBDAV_STATS_COUNTER_COUNT; ++i )
+	{
+		syslog(LOG_ERR, "webdav_stats counter=%s value=%lld\n", gCounterNames[i], gStatsCounters[i]);
+	}
+
+	/* authentication round trips relative to all requests sent */
+	requests = 0;
+	for ( i = 0; i < WEBDAV_STATS_METHOD_COUNT; ++i )
+	{
+		requests += gMethodStats[i].count;
+	}
+	if ( requests != 0 )
+	{
+		syslog(LOG_ERR, "webdav_stats ratio=auth_challenges_per_1000 value=%lld\n",
+			(gStatsCounters[WEBDAV_STATS_AUTH_CHALLENGES] * 1000) / requests);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * Zeroes every histogram and counter so a benchmark or an investigation can
+ * measure just the interval that follows. Samples recorded while the reset is
+ * in progress may be partially lost.
+ */
+void reset_stats(struct webdav_request_stats *req)
+{
+	int i;
+
+	if (req == NULL) {
+		syslog(LOG_DEBUG, "%s: req is null\n", __FUNCTION__);
+	}
+
+	bzero(gOpStats, sizeof(gOpStats));
+	bzero(gMethodStats, sizeof(gMethodStats));
+	bzero(gParseStats, sizeof(gParseStats));
+	for ( i = 0; i < WEBDAV_STATS_PARSE_COUNT; ++i )
+	{
+		gParseEntries[i] = 0;
+	}
+	for ( i = 0; i < WEBDAV_STATS_COUNTER_COUNT; ++i )
+	{
+		gStatsCounters[i] = 0;
+	}
+	gStatsResetTime = mach_absolute_time();
+
+	syslog(LOG_ERR, "%s: statistics reset\n", __FUNCTION__);
+}
+
+/*****************************************************************************/
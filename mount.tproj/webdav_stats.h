@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef webdavfs_webdav_stats_h
+#define webdavfs_webdav_stats_h
+
+#include <sys/types.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include "webdav.h"
+
+/*
+ * Operation and HTTP method statistics.
+ *
+ * Every counter is updated with atomic adds so the request threads never
+ * take a lock to record a sample. The numbers are only approximately
+ * consistent with each other while requests are in flight, which is
+ * fine for monitoring.
+ */
+
+/* Latency histogram: bucket n counts samples below (WEBDAV_STATS_BUCKET_BASE_USEC << n) */
+#define WEBDAV_STATS_LATENCY_BUCKETS	16
+#define WEBDAV_STATS_BUCKET_BASE_USEC	128		/* upper bound of the first bucket, in microseconds */
+
+/* Largest kext operation number tracked (see the "Webdav file operation constants" in webdav.h) */
+#define WEBDAV_STATS_MAX_OPERATION		63
+
+/* HTTP request methods tracked by stats_record_http() */
+enum webdav_stats_method
+{
+	WEBDAV_STATS_METHOD_GET = 0,
+	WEBDAV_STATS_METHOD_PUT,
+	WEBDAV_STATS_METHOD_PROPFIND,
+	WEBDAV_STATS_METHOD_LOCK,
+	WEBDAV_STATS_METHOD_UNLOCK,
+	WEBDAV_STATS_METHOD_DELETE,
+	WEBDAV_STATS_METHOD_MOVE,
+	WEBDAV_STATS_METHOD_MKCOL,
+	WEBDAV_STATS_METHOD_OPTIONS,
+	WEBDAV_STATS_METHOD_REPORT,
+	WEBDAV_STATS_METHOD_OTHER,
+	WEBDAV_STATS_METHOD_COUNT
+};
+
+/* Simple event counters */
+enum webdav_stats_counter
+{
+	WEBDAV_STATS_NODE_CACHE_HIT = 0,	/* name found in the node cache */
+	WEBDAV_STATS_NODE_CACHE_MISS,		/* name not found in the node cache */
+	WEBDAV_STATS_ATTR_CACHE_HIT,		/* cached attributes were still valid */
+	WEBDAV_STATS_ATTR_CACHE_MISS,		/* cached attributes were missing or stale */
+	WEBDAV_STATS_PREFETCH_REQUEST,		/* Depth 1 PROPFINDs sent to prefetch a directory's children's attributes */
+	WEBDAV_STATS_PREFETCH_ENTRIES,		/* children whose attributes were prefetched */
+	WEBDAV_STATS_PREFETCH_HIT,			/* lookups and getattrs answered by prefetched attributes (hits minus requests is round trips saved) */
+	WEBDAV_STATS_DIR_LISTING_REUSED,	/* readdirs answered from the cached listing without asking the server */
+	WEBDAV_STATS_DIR_LISTING_REVALIDATED, /* readdirs answered from the cached listing after a Depth 0 PROPFIND */
+	WEBDAV_STATS_SYNC_COLLECTION_REQUEST, /* readdirs that asked for a sync-collection delta instead of a full listing */
+	WEBDAV_STATS_SYNC_COLLECTION_FALLBACK, /* sync-collection REPORTs that failed and fell back to a full listing */
+	WEBDAV_STATS_WARMUP_SUBTREE,		/* Depth infinity PROPFINDs sent to warm up a subtree */
+	WEBDAV_STATS_WARMUP_DIRECTORIES,	/* directories warmed up one Depth 1 PROPFIND at a time */
+	WEBDAV_STATS_TREE_DELETE_RECURSIVE,	/* collections deleted with a single DELETE while emptying a directory */
+	WEBDAV_STATS_TREE_DELETE_WALKED,	/* collections walked because the server wouldn't DELETE them whole */
+	WEBDAV_STATS_READDIR_PLUS_ENTRIES,	/* directory entries handed to the kernel with their attributes */
+	WEBDAV_STATS_READ_AHEAD_HIT,		/* out-of-band reads answered from an earlier out-of-band read's window */
+	WEBDAV_STATS_OPEN_HEAD,				/* GETs on open that downloaded the head of a file before the open returned */
+	WEBDAV_STATS_OPEN_FIRST_BYTE_USEC,	/* microseconds those GETs waited for the first byte of the body */
+	WEBDAV_STATS_OPEN_HEAD_USEC,		/* microseconds those GETs waited for the whole head (divide by open_head) */
+	WEBDAV_STATS_OPEN_WHOLE_FILE,		/* small files downloaded completely on open, with no background download */
+	WEBDAV_STATS_WRITESEQ_CHUNKS,		/* sequential-write ranges queued to the write manager */
+	WEBDAV_STATS_WRITESEQ_WINDOW_BYTES,	/* bytes in flight as each range was queued, itself included (divide by writeseq_chunks) */
+	WEBDAV_STATS_WRITESEQ_WINDOW_STALLS, /* ranges that had to wait for room in the in-flight window */
+	WEBDAV_STATS_WRITESEQ_WINDOW_STALL_USEC, /* microseconds those ranges waited */
+	WEBDAV_STATS_STREAMED_UPLOAD,		/* empty files opened for writing that the kernel was told to stream to the server */
+	WEBDAV_STATS_STREAMED_UPLOAD_FALLBACK, /* streamed uploads abandoned and replaced by a PUT of the whole cache file */
+	WEBDAV_STATS_UPLOAD_SEGMENTS,		/* ranges of large files the server took (see put_file_resumable) */
+	WEBDAV_STATS_UPLOAD_RETRIED,		/* ranges resent after the connection was lost */
+	WEBDAV_STATS_UPLOAD_RESUMED,		/* uploads that started after the bytes an earlier upload left on the server */
+	WEBDAV_STATS_UPLOAD_RESUMED_BYTES,	/* bytes those uploads didn't have to send again */
+	WEBDAV_STATS_AUTHCACHE_UNLOCKED,	/* authcache_apply and authcache_valid calls answered from the authcache snapshot */
+	WEBDAV_STATS_AUTHCACHE_LOCKED,		/* authcache_apply and authcache_valid calls that took authcache_lock */
+	WEBDAV_STATS_AUTH_CHALLENGES,		/* 401 and 407 responses handed to the authcache (see auth_challenges_per_1000) */
+	WEBDAV_STATS_AUTH_PRERENDERED,		/* requests authorized with a pre-rendered Basic header or client-side Digest */
+	WEBDAV_STATS_AUTH_STALE_NONCE,		/* Digest 401s answered by adopting the server's new nonce */
+	WEBDAV_STATS_LOCK_REFRESH,			/* LOCK refreshes sent by request threads for pulse_thread */
+	WEBDAV_STATS_LOCK_REFRESH_FAILED,	/* those refreshes that failed */
+	WEBDAV_STATS_LOCK_REFRESH_LAG_SEC,	/* seconds those refreshes were sent after the lock reached WEBDAV_LOCK_REFRESH_AGE */
+	WEBDAV_STATS_LOCK_REFRESH_LATE,		/* refreshes sent after the lock may already have timed out on the server */
+	WEBDAV_STATS_LOCKLESS_OPEN,			/* opens for writing that skipped the LOCK (lockless mount option) */
+	WEBDAV_STATS_LOCKLESS_CONFLICT,		/* PUTs refused because the file changed on the server after it was opened */
+	WEBDAV_STATS_LOCKLESS_LOCKED,		/* lockless opens and PUTs that LOCKed the file because the server had no strong entity tag for it */
+	WEBDAV_STATS_GZIP_RESPONSES,		/* response bodies received with a gzip Content-Encoding */
+	WEBDAV_STATS_GZIP_WIRE_BYTES,		/* encoded bytes those responses took on the wire */
+	WEBDAV_STATS_GZIP_DECODED_BYTES,	/* bytes they decoded to (divide by gzip_wire_bytes for the compression ratio) */
+	WEBDAV_STATS_COUNTER_COUNT
+};
+
+/* XML parser entry points tracked by stats_record_parse() (see webdav_parse.h) */
+enum webdav_stats_parser
+{
+	WEBDAV_STATS_PARSE_OPENDIR = 0,
+	WEBDAV_STATS_PARSE_STAT,
+	WEBDAV_STATS_PARSE_STATFS,
+	WEBDAV_STATS_PARSE_LOCK,
+	WEBDAV_STATS_PARSE_CACHEVALIDATORS,
+	WEBDAV_STATS_PARSE_MULTISTATUS,
+	WEBDAV_STATS_PARSE_FILE_COUNT,
+	WEBDAV_STATS_PARSE_SYNC_COLLECTION,
+	WEBDAV_STATS_PARSE_SUBTREE,
+	WEBDAV_STATS_PARSE_COUNT
+};
+
+struct webdav_stats_histogram
+{
+	volatile int64_t	count;			/* number of samples */
+	volatile int64_t	errors;			/* number of samples that returned an error */
+	volatile int64_t	bytes;			/* payload bytes moved */
+	volatile int64_t	total_usec;		/* sum of latencies */
+	volatile int64_t	max_usec;		/* largest latency seen */
+	volatile int64_t	buckets[WEBDAV_STATS_LATENCY_BUCKETS];
+};
+
+void stats_init(void);
+
+/* returns a timestamp to pass to stats_record_op() or stats_record_http() */
+uint64_t stats_start(void);
+
+/* returns the number of microseconds since a stats_start() timestamp */
+uint64_t stats_elapsed_usec(uint64_t start);
+
+/* converts a difference between two stats_start() timestamps to microseconds */
+uint64_t stats_ticks_to_usec(uint64_t ticks);
+
+void stats_record_op(
+	int operation,				/* -> WEBDAV_* operation from the kext */
+	uint64_t start,				/* -> value returned by stats_start() */
+	size_t bytes,				/* -> reply payload bytes */
+	int error);					/* -> result of the operation */
+
+void stats_record_http(
+	enum webdav_stats_method method, /* -> the request method (see stats_method_index()) */
+	uint64_t start,				/* -> value returned by stats_start() */
+	int64_t bytes,				/* -> request plus response body bytes */
+	int error);					/* -> result of the transaction */
+
+void stats_record_parse(
+	enum webdav_stats_parser parser, /* -> the parser entry point */
+	uint64_t start,				/* -> value returned by stats_start() */
+	int64_t bytes,				/* -> length of the XML body */
+	int64_t entries,			/* -> number of resources (responses) the body described */
+	int error);					/* -> result of the parse */
+
+void stats_increment(enum webdav_stats_counter counter);
+void stats_add(enum webdav_stats_counter counter, int64_t amount);
+
+enum webdav_stats_method stats_method_index(CFStringRef requestMethod);
+
+const char *stats_op_name(int operation);
+const char *stats_method_name(enum webdav_stats_method method);
+
+void dump_stats(struct webdav_request_stats *req);
+void reset_stats(struct webdav_request_stats *req);
+
+#endif
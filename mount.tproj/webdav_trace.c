@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include "webdavd.h"
+
+#include <sys/syslog.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libkern/OSAtomic.h>
+
+#include "webdav_trace.h"
+#include "webdav_stats.h"
+
+/*****************************************************************************/
+
+#define WEBDAV_TRACE_RINGS			(WEBDAV_REQUEST_THREADS + 3)	/* request threads, pulse thread, and some slack */
+#define WEBDAV_TRACE_RING_EVENTS	256								/* must be a power of 2 */
+
+struct trace_ring
+{
+	int					in_use;			/* TRUE if a thread owns this ring (protected by gTraceLock) */
+	uint32_t			owner;			/* sequence number of the thread that last owned this ring */
+	volatile uint64_t	next;			/* number of events ever written to this ring */
+	struct webdav_trace_event events[WEBDAV_TRACE_RING_EVENTS];
+};
+
+/* a snapshot entry -- an event plus the ring it came from */
+struct trace_snapshot_entry
+{
+	struct webdav_trace_event event;
+	uint32_t owner;
+};
+
+static pthread_once_t gTraceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t gTraceKey;
+static pthread_mutex_t gTraceLock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring gTraceRings[WEBDAV_TRACE_RINGS];
+static uint32_t gTraceNextOwner = 0;			/* protected by gTraceLock */
+static volatile int64_t gTraceDropped = 0;		/* events dropped because no ring was free */
+
+/*****************************************************************************/
+
+/* called when a thread that owns a ring exits -- the ring's events are kept for later snapshots */
+static void trace_release_ring(void *arg)
+{
+	struct trace_ring *ring = (struct trace_ring *)arg;
+
+	pthread_mutex_lock(&gTraceLock);
+	ring->in_use = FALSE;
+	pthread_mutex_unlock(&gTraceLock);
+}
+
+/*****************************************************************************/
+
+static void trace_init_once(void)
+{
+	(void) pthread_key_create(&gTraceKey, trace_release_ring);
+}
+
+/*****************************************************************************/
+
+static struct trace_ring *trace_get_ring(void)
+{
+	struct trace_ring *ring;
+	struct trace_ring *oldest;
+	int i;
+
+	pthread_once(&gTraceOnce, trace_init_once);
+
+	ring = (struct trace_ring *)pthread_getspecific(gTraceKey);
+	if ( ring != NULL )
+	{
+		return ( ring );
+	}
+
+	/*
+	 * Claim a free ring, preferring the one whose previous owner is the
+	 * oldest so the most recent history of exited threads survives longest.
+	 */
+	oldest = NULL;
+	pthread_mutex_lock(&gTraceLock);
+	for ( i = 0; i < WEBDAV_TRACE_RINGS; ++i )
+	{
+		if ( !gTraceRings[i].in_use &&
+			 ((oldest == NULL) || (gTraceRings[i].owner < oldest->owner)) )
+		{
+			oldest = &gTraceRings[i];
+		}
+	}
+	if ( oldest != NULL )
+	{
+		oldest->in_use = TRUE;
+		oldest->owner = ++gTraceNextOwner;
+		oldest->next = 0;
+	}
+	pthread_mutex_unlock(&gTraceLock);
+
+	if ( oldest != NULL )
+	{
+		(void) pthread_setspecific(gTraceKey, oldest);
+	}
+
+	return ( oldest );
+}
+
+/*****************************************************************************/
+
+void trace_record(uint16_t kind, uint16_t code, webdav_ino_t fileid, uint64_t start, uint64_t bytes, int status)
+{
+	struct trace_ring *ring;
+	struct webdav_trace_event *event;
+
+	ring = trace_get_ring();
+	if ( ring == NULL )
+	{
+		OSAtomicIncrement64(&gTraceDropped);
+		return;
+	}
+
+	/* this thread is the only writer of the ring */
+	event = &ring->events[ring->next & (WEBDAV_TRACE_RING_EVENTS - 1)];
+	event->start = start;
+	event->bytes = bytes;
+	event->usec = (uint32_t)stats_elapsed_usec(start);
+	event->fileid = fileid;
+	event->status = status;
+	event->kind = kind;
+	event->code = code;
+
+	/* make the event visible before advancing next */
+	OSMemoryBarrier();
+	ring->next = ring->next + 1;
+}
+
+/*****************************************************************************/
+
+static int trace_compare_entries(const void *a, const void *b)
+{
+	const struct trace_snapshot_entry *entry_a = (const struct trace_snapshot_entry *)a;
+	const struct trace_snapshot_entry *entry_b = (const struct trace_snapshot_entry *)b;
+
+	if ( entry_a->event.start < entry_b->event.start )
+	{
+		return ( -1 );
+	}
+	else if ( entry_a->event.start > entry_b->event.start )
+	{
+		return ( 1 );
+	}
+	else
+	{
+		return ( 0 );
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * Decodes every ring into one timeline ordered by start time and writes it to
+ * the system log at priority. Rings are copied without stopping their writers, so an event
+ * being written while the snapshot is taken may be torn; that's an acceptable
+ * price for never blocking the request threads.
+ */
+void trace_snapshot(const char *reason, int priority)
+{
+	struct trace_snapshot_entry *entries;
+	struct webdav_trace_event *event;
+	uint64_t next, first, base;
+	int count, i;
+
+	entries = malloc(sizeof(struct trace_snapshot_entry) * WEBDAV_TRACE_RINGS * WEBDAV_TRACE_RING_EVENTS);
+	if ( entries == NULL )
+	{
+		syslog(LOG_ERR, "%s: no memory for snapshot\n", __FUNCTION__);
+		return;
+	}
+
+	count = 0;
+	pthread_mutex_lock(&gTraceLock);
+	for ( i = 0; i < WEBDAV_TRACE_RINGS; ++i )
+	{
+		next = gTraceRings[i].next;
+		OSMemoryBarrier();
+		first = (next > WEBDAV_TRACE_RING_EVENTS) ? (next - WEBDAV_TRACE_RING_EVENTS) : 0;
+		for ( ; first < next; ++first )
+		{
+			entries[count].event = gTraceRings[i].events[first & (WEBDAV_TRACE_RING_EVENTS - 1)];
+			entries[count].owner = gTraceRings[i].owner;
+			++count;
+		}
+	}
+	pthread_mutex_unlock(&gTraceLock);
+
+	qsort(entries, count, sizeof(struct trace_snapshot_entry), trace_compare_entries);
+
+	syslog(priority, "webdav_trace begin reason=\"%s\" events=%d dropped=%lld\n",
+		(reason != NULL) ? reason : "", count, gTraceDropped);
+
+	base = (count != 0) ? entries[0].event.start : 0;
+	for ( i = 0; i < count; ++i )
+	{
+		uint64_t offset_usec;
+
+		event = &entries[i].event;
+		offset_usec = stats_ticks_to_usec(event->start - base);
+		syslog(priority, "webdav_trace +%llu.%03llums thread=%u %s=%s fileid=%llu usec=%u bytes=%llu status=%d\n",
+			offset_usec / 1000, offset_usec % 1000, entries[i].owner,
+			(event->kind == WEBDAV_TRACE_HTTP) ? "method" : "op",
+			(event->kind == WEBDAV_TRACE_HTTP) ? stats_method_name(event->code) : stats_op_name(event->code),
+			(unsigned long long)event->fileid, event->usec, event->bytes, event->status);
+	}
+
+	syslog(priority, "webdav_trace end\n");
+
+	free(entries);
+}
+
+/*****************************************************************************/
+
+void dump_trace(struct webdav_request_trace *req)
+{
+	if (req == NULL) {
+		syslog(LOG_DEBUG, "%s: req is null\n", __FUNCTION__);
+	}
+
+	trace_snapshot("requested", LOG_ERR);
+}
+
+/*****************************************************************************/
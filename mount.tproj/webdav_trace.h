@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef webdavfs_webdav_trace_h
+#define webdavfs_webdav_trace_h
+
+#include <sys/types.h>
+#include "webdav.h"
+
+/*
+ * Always-on event trace.
+ *
+ * Each thread that records an event claims one of a fixed number of rings
+ * and is the only writer of that ring, so recording an event is a handful
+ * of stores with no locks and no formatting. The rings are only decoded
+ * when a snapshot is requested with WEBDAV_DUMP_TRACE, or (at LOG_INFO, and
+ * at most once every WEBDAV_TRACE_SNAPSHOT_INTERVAL) when the connection to
+ * the server is lost.
+ */
+
+/* webdav_trace_event kind values */
+#define WEBDAV_TRACE_OP				1		/* code is a WEBDAV_* operation from the kext */
+#define WEBDAV_TRACE_HTTP			2		/* code is an enum webdav_stats_method */
+
+struct webdav_trace_event
+{
+	uint64_t	start;			/* mach_absolute_time() when the event started */
+	uint64_t	bytes;			/* payload bytes */
+	uint32_t	usec;			/* duration in microseconds */
+	webdav_ino_t fileid;		/* fileid of the node involved, or 0 */
+	int32_t		status;			/* errno result */
+	uint16_t	kind;			/* WEBDAV_TRACE_OP or WEBDAV_TRACE_HTTP */
+	uint16_t	code;			/* operation or method */
+};
+
+void trace_record(
+	uint16_t kind,				/* -> WEBDAV_TRACE_OP or WEBDAV_TRACE_HTTP */
+	uint16_t code,				/* -> operation or method */
+	webdav_ino_t fileid,		/* -> fileid of the node involved, or 0 */
+	uint64_t start,				/* -> value returned by stats_start() */
+	uint64_t bytes,				/* -> payload bytes */
+	int status);				/* -> errno result */
+
+void trace_snapshot(
+	const char *reason,			/* -> why the snapshot was taken */
+	int priority);				/* -> syslog priority of the timeline's lines */
+
+void dump_trace(struct webdav_request_trace *req);
+
+#endif
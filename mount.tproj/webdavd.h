@@ -70,6 +70,12 @@
 /* the number of threads available to handle requests from the kernel file system and downloads */
 #define WEBDAV_REQUEST_THREADS 5
 
+/* the most request threads working on a tree walk (WEBDAV_WARMUP and WEBDAV_EMPTYDIR) at once -- the rest are left for the kernel's requests */
+#define WEBDAV_WALK_THREADS 3
+
+/* the most request threads refreshing LOCKs at once */
+#define WEBDAV_LOCK_REFRESH_THREADS 3
+
 #define PRIVATE_CERT_UI_COMMAND "/System/Library/Filesystems/webdav.fs/Support/webdav_cert_ui.app/Contents/MacOS/webdav_cert_ui"
 #define PRIVATE_UNMOUNT_COMMAND "/sbin/umount"
 #define PRIVATE_UNMOUNT_FLAGS "-f"
@@ -77,6 +83,18 @@
 /* the time interval (in seconds) for holding LOCKs on the server. The pulse thread runs at doublew this rate. */
 #define WEBDAV_PULSE_TIMEOUT "600"		/* Default time out = 10 minutes */
 
+/* a LOCK is refreshed once it's this many seconds old (the old pulse_thread rate), leaving half of gtimeout_val to retry a failed refresh */
+#define WEBDAV_LOCK_REFRESH_AGE (gtimeout_val / 2)
+
+/* seconds before a LOCK refresh that failed is tried again */
+#define WEBDAV_LOCK_REFRESH_RETRY 30
+
+/* the default number of seconds a directory listing is reused without asking the server (see the dirlisttimeout mount option) */
+#define WEBDAV_DIR_LISTING_TIMEOUT 5
+
+/* the default number of bytes a sequential write may have queued to the server before the kernel's writes wait (see the writeseqwindow mount option) */
+#define WEBDAV_WRITESEQ_WINDOW (8 * 1024 * 1024)
+
 #define APPLEDOUBLEHEADER_LENGTH 82		/* length of AppleDouble header property */
 
 /*
@@ -98,6 +116,7 @@
 #define WEBDAV_WRITESEQ_RSPBUF_LEN 4096
 #define WEBDAV_WRITESEQ_REQUEST_TIMEOUT 30  /* in seconds  */
 #define WEBDAV_MANAGER_STARTUP_TIMEOUT 5 /* in seconds */
+#define WEBDAV_WRITESEQ_POOL_SIZE 64		/* chunk descriptors preallocated for each sequential write */
 
 /* Macro to simplify common CFRelease usage */
 #define CFReleaseNull(obj) do { if(obj != NULL) { CFRelease(obj); obj = NULL; } } while (0)
@@ -134,6 +153,22 @@ struct stream_put_ctx {
 	CFMessagePortRef mgrPort;
 	struct seqwrite_mgr_req *req_head, *req_tail;
 	
+	// Chunk descriptors are taken from pool (through pool_free) and
+	// returned to it when their last reference is released
+	struct seqwrite_mgr_req *pool;
+	struct seqwrite_mgr_req *pool_free;
+	pthread_cond_t pool_condvar;	/* writers wait here for a free descriptor or room in the window */
+	
+	// Bytes of the chunks queued to the manager that it hasn't finished
+	// with, and bytes it has written to the stream (for progress checks)
+	off_t window_bytes;
+	off_t bytes_sent;
+	
+	// The manager reads each chunk from the cache file into mgr_buf
+	// just before writing it to the stream
+	unsigned char *mgr_buf;
+	CFIndex mgr_buf_len, mgr_buf_pos;
+	
 	// *************************************
 	// *** Response stream thread fields ***
 	// *************************************
@@ -177,13 +212,15 @@ struct seqwrite_mgr_req
 	uint32_t is_retry;	// true if this request is a retry (due to a previous EPIPE)
 	int  error;
 	
-	// chunk state
+	// chunk state -- the chunk is chunkLen bytes of the cache file at offset
+	int fd;
+	off_t offset;
 	CFIndex chunkLen, chunkWritten;
+	CFIndex windowLen;	// bytes this chunk holds in the ctx's window_bytes
+	bool async;			// true if nobody waits for this chunk -- its error goes to the ctx
 	
 	uint32_t refCount;
-	
-	// Where we store data read from the cache before we throw it on the wire.
-	unsigned char *data;
+	bool pooled;	// true if this descriptor belongs to the ctx's pool
 };
 
 /* Global functions */
@@ -206,6 +243,11 @@ extern CFURLRef gBaseURL;				/* the base URL for this mount */
 extern CFStringRef gBasePath;			/* the base path (from gBaseURL) for this mount */
 extern char gBasePathStr[MAXPATHLEN];	/* gBasePath as a c-string */
 extern uint32_t	gServerIdent;			/* identifies some (not all) types of servers we are connected to (i.e. WEBDAV_IDISK_SERVER) */
+extern unsigned int gDirListingTimeout;	/* seconds a directory listing is reused without asking the server, 0 to always ask */
+extern unsigned int gWriteSeqWindow;	/* bytes a sequential write may have in flight, 0 to wait for each write */
+extern int gLocklessOpens;				/* if TRUE, files are opened for writing without a LOCK and PUT with If-Match */
+extern int gStreamedUploads;			/* if TRUE, new files are sent to the server as they are written (chunked PUT) */
+extern int gTreeDeletes;				/* if TRUE, rmdir and rename delete what's in a directory that isn't empty */
 
 /*
  * filesystem functions
@@ -216,6 +258,9 @@ extern uint32_t	gServerIdent;			/* identifies some (not all) types of servers we
 extern int filesystem_lookup(struct webdav_request_lookup *request_lookup,
 		struct webdav_reply_lookup *reply_lookup);
 
+extern int filesystem_lookup_path(struct webdav_request_lookup_path *request_lookup_path,
+		struct webdav_reply_lookup_path *reply_lookup_path);
+
 extern int filesystem_create(struct webdav_request_create *request_create,
 		struct webdav_reply_create *reply_create);
 
@@ -243,16 +288,25 @@ extern int filesystem_rmdir(struct webdav_request_rmdir *request_rmdir);
 
 extern int filesystem_write_seq(struct webdav_request_writeseq *request_sq_wr);
 
-extern int filesystem_readdir(struct webdav_request_readdir *request_readdir);
+extern int filesystem_readdir(struct webdav_request_readdir *request_readdir,
+		struct webdav_reply_readdir *reply_readdir);
 
 extern int filesystem_statfs(struct webdav_request_statfs *request_statfs,
 		struct webdav_reply_statfs *reply_statfs);
 
 extern int filesystem_invalidate_caches(struct webdav_request_invalcaches *request_invalcaches);
+extern void filesystem_prefetch_directory(uid_t uid, opaque_id dir_id);
+extern int filesystem_warmup(struct webdav_request_warmup *request_warmup);
+extern void filesystem_warmup_directory(uid_t uid, opaque_id dir_id, u_int32_t depth, int first);
+
+struct delete_dir;
+extern int filesystem_emptydir(struct webdav_request_emptydir *request_emptydir);
+extern void filesystem_delete_tree_node(struct delete_dir *dir, opaque_id obj_id);
 
 extern int filesystem_mount(int *a_mount_args);
 
 extern int filesystem_lock(struct node_entry *node);
+extern void filesystem_refresh_lock(opaque_id node_id);
 
 extern int filesystem_init(int typenum);
 
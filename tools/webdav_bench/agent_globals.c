@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * agent_globals.c stands in for webdav_agent.c (which has webdavfs_agent's
+ * main) in the tools that link the agent's sources: it defines the globals
+ * and functions webdavd.h says webdav_agent.c provides.
+ */
+
+#include "webdavd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*****************************************************************************/
+
+/*
+ * shared globals (see webdav_agent.c)
+ */
+unsigned int gtimeout_val;
+char *gtimeout_string;
+int gWebdavfsDebug = FALSE;
+uid_t gProcessUID = -1;
+int gSuppressAllUI = TRUE;
+int gSecureServerAuth = FALSE;
+char gWebdavCachePath[MAXPATHLEN + 1] = "";
+int gSecureConnection = FALSE;
+CFURLRef gBaseURL = NULL;
+CFStringRef gBasePath = NULL;
+char gBasePathStr[MAXPATHLEN];
+uint32_t gServerIdent = 0;
+unsigned int gDirListingTimeout = WEBDAV_DIR_LISTING_TIMEOUT;
+unsigned int gWriteSeqWindow = WEBDAV_WRITESEQ_WINDOW;
+int gLocklessOpens = FALSE;
+int gStreamedUploads = FALSE;
+int gTreeDeletes = FALSE;
+fsid_t g_fsid = { { -1, -1 } };
+char g_mountPoint[MAXPATHLEN] = "";
+uint64_t webdavCacheMaximumSize = WEBDAV_DEFAULT_CACHE_MAX_SIZE;
+
+/*****************************************************************************/
+
+void webdav_debug_assert(const char *componentNameString, const char *assertionString,
+	const char *exceptionLabelString, const char *errorString,
+	const char *fileName, long lineNumber, uint64_t errorCode)
+{
+	#pragma unused(componentNameString, exceptionLabelString, errorString)
+
+	if ( gWebdavfsDebug )
+	{
+		fprintf(stderr, "(%s) failed with %d; file: %s; line: %ld\n",
+			(assertionString != NULL) ? assertionString : "", (int)errorCode, fileName, lineNumber);
+	}
+}
+
+/*****************************************************************************/
+
+void webdav_kill(int message)
+{
+	fprintf(stderr, "webdav_kill(%d)\n", message);
+	exit(EXIT_FAILURE);
+}
+
+/*****************************************************************************/
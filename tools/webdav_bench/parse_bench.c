@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * parse_bench times each of webdav_parse.c's parsers over the response bodies
+ * in a corpus directory (see corpus/MANIFEST) and reports nanoseconds per
+ * entry, megabytes per second, and heap allocations per entry. With -x, each
+ * directory listing is also grown to 100, 1000 and 10000 entries by repeating
+ * its last child, so the per-entry costs can be compared across sizes.
+ */
+
+#include "parse_targets.h"
+
+#include <mach/mach_time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*****************************************************************************/
+
+/*
+ * libmalloc calls malloc_logger (when it's set) for every allocation and free;
+ * it's what MallocStackLogging uses. The type bits are from libmalloc.
+ */
+typedef void (malloc_logger_t)(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3,
+	uintptr_t result, uint32_t num_hot_frames_to_skip);
+extern malloc_logger_t *malloc_logger;
+#define MALLOC_LOG_TYPE_ALLOCATE 2
+
+#define PARSE_BENCH_MIN_MSEC	200		/* default minimum time to run each parser */
+#define PARSE_BENCH_MAX_LINE	(MAXPATHLEN * 2)
+
+/* the sizes -x grows listings to */
+static const u_int32_t gScaledEntries[] = { 100, 1000, 10000, 0 };
+
+struct corpus_body
+{
+	const char *file;			/* name of the corpus file */
+	u_int32_t kind;				/* PARSE_KIND_* */
+	UInt8 *xml;
+	CFIndex length;
+	u_int32_t entries;			/* number of DAV:response elements */
+};
+
+static u_int64_t gMinNsec = PARSE_BENCH_MIN_MSEC * 1000000ULL;
+static mach_timebase_info_data_t gTimebase;
+static volatile u_int64_t gAllocations;
+
+/*****************************************************************************/
+
+static void count_allocations(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3,
+	uintptr_t result, uint32_t num_hot_frames_to_skip)
+{
+	#pragma unused(arg1, arg2, arg3, result, num_hot_frames_to_skip)
+	
+	if ( type & MALLOC_LOG_TYPE_ALLOCATE )
+	{
+		++gAllocations;
+	}
+}
+
+/*****************************************************************************/
+
+static u_int64_t elapsed_nsec(u_int64_t start)
+{
+	return ( (mach_absolute_time() - start) * gTimebase.numer / gTimebase.denom );
+}
+
+/*****************************************************************************/
+
+/*
+ * find_response_tag determines whether the "response" at xml[offset] is the
+ * name in a response start tag (returns 1) or end tag (returns 2), with or
+ * without a namespace prefix, and returns where the tag's '<' is.
+ */
+static int find_response_tag(const UInt8 *xml, CFIndex length, CFIndex offset, CFIndex *tag_start)
+{
+	CFIndex index;
+	CFIndex after;
+	
+	after = offset + (CFIndex)strlen("response");
+	if ( (after >= length) ||
+		 ((xml[after] != '>') && (xml[after] != ' ') && (xml[after] != '\t') &&
+		  (xml[after] != '\r') && (xml[after] != '\n') && (xml[after] != '/')) )
+	{
+		/* something else, like responsedescription */
+		return ( 0 );
+	}
+	
+	/* back up over the prefix, if any */
+	index = offset;
+	if ( (index > 0) && (xml[index - 1] == ':') )
+	{
+		--index;
+		while ( (index > 0) && (xml[index - 1] != '<') && (xml[index - 1] != '/') &&
+				(xml[index - 1] != '>') && (xml[index - 1] != ' ') )
+		{
+			--index;
+		}
+	}
+	if ( (index > 0) && (xml[index - 1] == '<') )
+	{
+		*tag_start = index - 1;
+		return ( 1 );
+	}
+	else if ( (index > 1) && (xml[index - 1] == '/') && (xml[index - 2] == '<') )
+	{
+		*tag_start = index - 2;
+		return ( 2 );
+	}
+	return ( 0 );
+}
+
+/*****************************************************************************/
+
+/*
+ * scan_responses counts the response elements in xml and finds the last one
+ * (from the '<' of its start tag to past the '>' of its end tag).
+ */
+static u_int32_t scan_responses(const UInt8 *xml, CFIndex length, CFIndex *last_start, CFIndex *last_end)
+{
+	u_int32_t entries;
+	CFIndex offset;
+	CFIndex tag_start;
+	CFIndex open_start;
+	const UInt8 *found;
+	
+	entries = 0;
+	open_start = -1;
+	*last_start = *last_end = -1;
+	offset = 0;
+	while ( (found = memmem(xml + offset, (size_t)(length - offset), "response", strlen("response"))) != NULL )
+	{
+		offset = found - xml;
+		switch ( find_response_tag(xml, length, offset, &tag_start) )
+		{
+			case 1:
+				open_start = tag_start;
+				break;
+			case 2:
+				++entries;
+				*last_start = open_start;
+				found = memchr(xml + offset, '>', (size_t)(length - offset));
+				*last_end = (found != NULL) ? (found - xml) + 1 : length;
+				break;
+			default:
+				break;
+		}
+		offset += (CFIndex)strlen("response");
+	}
+	return ( entries );
+}
+
+/*****************************************************************************/
+
+/*
+ * scale_listing returns a copy of body with copies more responses after its
+ * last one. Each is the last response with "-<n>" appended to the href's
+ * last path component, so each is a different child.
+ */
+static int scale_listing(const struct corpus_body *body, u_int32_t copies, struct corpus_body *scaled)
+{
+	int error;
+	CFIndex start;
+	CFIndex end;
+	CFIndex href;
+	CFIndex href_end;
+	CFIndex insert;
+	const UInt8 *found;
+	UInt8 *out;
+	u_int32_t copy;
+	char suffix[16];
+	size_t suffix_length;
+	
+	error = 0;
+	(void)scan_responses(body->xml, body->length, &start, &end);
+	require_action((start >= 0) && (end > start), no_response, error = EINVAL);
+	
+	/* find the text of the last response's href (its start tag comes first) */
+	href = start;
+	do
+	{
+		found = memmem(body->xml + href, (size_t)(end - href), "href", strlen("href"));
+		require_action(found != NULL, no_href, error = EINVAL);
+		href = (found - body->xml) + (CFIndex)strlen("href");
+	} while ( (body->xml[href] != '>') && (body->xml[href] != ' ') );
+	found = memchr(body->xml + href, '>', (size_t)(end - href));
+	require_action(found != NULL, no_href, error = EINVAL);
+	href = (found - body->xml) + 1;
+	found = memchr(body->xml + href, '<', (size_t)(end - href));
+	require_action(found != NULL, no_href, error = EINVAL);
+	href_end = found - body->xml;
+	
+	/* the suffix goes before a collection's trailing slash */
+	insert = ((href_end > href) && (body->xml[href_end - 1] == '/')) ? href_end - 1 : href_end;
+	
+	out = malloc((size_t)body->length + (size_t)copies * ((size_t)(end - start) + sizeof(suffix)));
+	require_action(out != NULL, malloc_out, error = ENOMEM);
+	
+	*scaled = *body;
+	scaled->xml = out;
+	memcpy(out, body->xml, (size_t)end);
+	out += end;
+	for ( copy = 1; copy <= copies; ++copy )
+	{
+		suffix_length = (size_t)snprintf(suffix, sizeof(suffix), "-%u", copy);
+		memcpy(out, body->xml + start, (size_t)(insert - start));
+		out += insert - start;
+		memcpy(out, suffix, suffix_length);
+		out += suffix_length;
+		memcpy(out, body->xml + insert, (size_t)(end - insert));
+		out += end - insert;
+	}
+	memcpy(out, body->xml + end, (size_t)(body->length - end));
+	out += body->length - end;
+	scaled->length = out - scaled->xml;
+	scaled->entries = body->entries + copies;
+	
+malloc_out:
+no_href:
+no_response:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* runs target over body until gMinNsec have passed, then once more counting allocations */
+static void bench_target(const struct parse_target *target, const struct corpus_body *body, struct parse_dir *dir)
+{
+	int error;
+	u_int64_t iterations;
+	u_int64_t start;
+	u_int64_t nsec;
+	u_int32_t entries;
+	
+	/* the first run adds the children to the node cache; the timed runs find them there */
+	error = target->run(dir, body->xml, body->length);
+	
+	iterations = 0;
+	start = mach_absolute_time();
+	do
+	{
+		(void)target->run(dir, body->xml, body->length);
+		++iterations;
+		nsec = elapsed_nsec(start);
+	} while ( nsec < gMinNsec );
+	
+	/* a separate run so the logger's cost isn't timed */
+	gAllocations = 0;
+	malloc_logger = count_allocations;
+	(void)target->run(dir, body->xml, body->length);
+	malloc_logger = NULL;
+	
+	/* bodies without responses (LOCK replies) count as one entry */
+	entries = MAX(body->entries, 1);
+	printf("%-36s %7u %9ld %-16s %10.1f %9.1f %12.1f%s\n",
+		body->file, body->entries, (long)body->length, target->name,
+		(double)nsec / iterations / entries,
+		((double)body->length * iterations / 1000000.0) / ((double)nsec / 1000000000.0),
+		(double)gAllocations / entries, (error != 0) ? "  (parse error)" : "");
+	
+	parse_dir_clear(dir);
+}
+
+/*****************************************************************************/
+
+static int bench_body(const struct corpus_body *body, const char *path, int argc, char *argv[])
+{
+	int error;
+	int index;
+	struct parse_dir dir;
+	const struct parse_target *target;
+	
+	error = parse_dir_create(path, &dir);
+	require_noerr(error, parse_dir_create);
+	
+	for ( target = gParseTargets; target->name != NULL; ++target )
+	{
+		if ( (target->kinds & body->kind) == 0 )
+		{
+			continue;
+		}
+		if ( argc != 0 )
+		{
+			for ( index = 0; index < argc; ++index )
+			{
+				if ( strcmp(argv[index], target->name) == 0 )
+				{
+					break;
+				}
+			}
+			if ( index == argc )
+			{
+				continue;
+			}
+		}
+		bench_target(target, body, &dir);
+	}
+	
+	/* the directory node stays; its children are gone */
+	CFRelease(dir.url);
+	
+parse_dir_create:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static int read_body(const char *corpus_dir, const char *file, struct corpus_body *body)
+{
+	int error;
+	char path[MAXPATHLEN];
+	FILE *fp;
+	long length;
+	
+	error = 0;
+	snprintf(path, sizeof(path), "%s/%s", corpus_dir, file);
+	fp = fopen(path, "r");
+	require_action(fp != NULL, fopen, error = errno);
+	
+	require_action((fseek(fp, 0, SEEK_END) == 0) && ((length = ftell(fp)) >= 0) &&
+		(fseek(fp, 0, SEEK_SET) == 0), fseek, error = errno);
+	
+	body->xml = malloc((size_t)length + 1);
+	require_action(body->xml != NULL, malloc_xml, error = ENOMEM);
+	
+	require_action(fread(body->xml, 1, (size_t)length, fp) == (size_t)length, fread,
+		free(body->xml); body->xml = NULL; error = EIO);
+	body->length = (CFIndex)length;
+	
+fread:
+malloc_xml:
+fseek:
+	fclose(fp);
+fopen:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static void usage(void)
+{
+	(void)fprintf(stderr,
+		"usage: parse_bench [-d] [-x] [-t msec] <corpus_dir> [parser ...]\n"
+		"parsers: opendir prefetch subtree file_count sync_collection stat statfs\n"
+		"\tcachevalidators lock multi_status (default all)\n");
+}
+
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+	int error;
+	int ch;
+	int scale;
+	const char *corpus_dir;
+	char manifest_path[MAXPATHLEN];
+	char line[PARSE_BENCH_MAX_LINE];
+	char file[MAXPATHLEN];
+	char kind[32];
+	char path[MAXPATHLEN];
+	FILE *manifest;
+	struct corpus_body body;
+	struct corpus_body scaled;
+	CFIndex last_start;
+	CFIndex last_end;
+	const u_int32_t *size;
+
+	error = 0;
+	scale = FALSE;
+	while ( (error == 0) && ((ch = getopt(argc, argv, "dxt:")) != -1) )
+	{
+		switch ( ch )
+		{
+			case 'd':
+				gWebdavfsDebug = TRUE;
+				break;
+			case 'x':
+				scale = TRUE;
+				break;
+			case 't':
+				gMinNsec = MAX(strtoull(optarg, NULL, 10), 1) * 1000000ULL;
+				break;
+			default:
+				error = EINVAL;
+				break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	require_action_quiet((error == 0) && (argc >= 1), usage, usage(); error = EINVAL);
+	corpus_dir = argv[0];
+	--argc;
+	++argv;
+
+	openlog("parse_bench", LOG_PERROR | LOG_PID, LOG_DAEMON);
+	(void)mach_timebase_info(&gTimebase);
+
+	error = parse_targets_init();
+	require_noerr(error, parse_targets_init);
+
+	snprintf(manifest_path, sizeof(manifest_path), "%s/MANIFEST", corpus_dir);
+	manifest = fopen(manifest_path, "r");
+	if ( manifest == NULL )
+	{
+		error = errno;
+		fprintf(stderr, "parse_bench: %s: %s\n", manifest_path, strerror(error));
+		goto fopen;
+	}
+
+	printf("%-36s %7s %9s %-16s %10s %9s %12s\n",
+		"file", "entries", "bytes", "parser", "ns/entry", "MB/sec", "allocs/entry");
+	/* each line is: <file> <kind> <path of the directory the body is from> */
+	while ( fgets(line, sizeof(line), manifest) != NULL )
+	{
+		if ( (line[0] == '#') || (sscanf(line, "%1023s %31s %1023s", file, kind, path) != 3) )
+		{
+			continue;
+		}
+		bzero(&body, sizeof(body));
+		body.file = file;
+		body.kind = parse_kind(kind);
+		if ( body.kind == 0 )
+		{
+			fprintf(stderr, "parse_bench: %s: unknown kind %s\n", file, kind);
+			continue;
+		}
+		error = read_body(corpus_dir, file, &body);
+		if ( error != 0 )
+		{
+			fprintf(stderr, "parse_bench: %s: %s\n", file, strerror(error));
+			continue;
+		}
+		body.entries = scan_responses(body.xml, body.length, &last_start, &last_end);
+
+		error = bench_body(&body, path, argc, argv);
+
+		if ( scale && (body.kind & (PARSE_KIND_LISTING | PARSE_KIND_SYNC)) )
+		{
+			for ( size = gScaledEntries; (error == 0) && (*size != 0); ++size )
+			{
+				if ( *size <= body.entries )
+				{
+					continue;
+				}
+				error = scale_listing(&body, *size - body.entries, &scaled);
+				if ( error == 0 )
+				{
+					error = bench_body(&scaled, path, argc, argv);
+					free(scaled.xml);
+				}
+			}
+		}
+		free(body.xml);
+		if ( error != 0 )
+		{
+			fprintf(stderr, "parse_bench: %s: %s\n", file, strerror(error));
+			error = 0;
+		}
+	}
+	fclose(manifest);
+
+fopen:
+parse_targets_init:
+usage:
+
+	return ( (error == 0) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
+
+/*****************************************************************************/
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * parse_fuzz is a libFuzzer target that runs every one of webdav_parse.c's
+ * entry points over each input, as the body a server sent for a directory.
+ * Build it with "make parse_fuzz" and seed it with the corpus directory:
+ *
+ *	./parse_fuzz -dict=parse_fuzz.dict fuzz_corpus corpus
+ */
+
+#include "parse_targets.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*****************************************************************************/
+
+/* the directory the inputs are parsed as a listing of */
+#define PARSE_FUZZ_DIR_PATH "/dav/fuzz/"
+
+static struct parse_dir gDir;
+
+/*****************************************************************************/
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static int initialized = FALSE;
+	UInt8 *xml;
+	const struct parse_target *target;
+	
+	if ( !initialized )
+	{
+		openlog("parse_fuzz", LOG_PID, LOG_DAEMON);
+		if ( (parse_targets_init() != 0) || (parse_dir_create(PARSE_FUZZ_DIR_PATH, &gDir) != 0) )
+		{
+			fprintf(stderr, "parse_fuzz: set up failed\n");
+			abort();
+		}
+		initialized = TRUE;
+	}
+	
+	/* libxml2 takes an int length */
+	if ( size > INT_MAX )
+	{
+		return ( 0 );
+	}
+	
+	/* the parsers take a non-const buffer; a copy also lets ASan catch reads past the end */
+	xml = malloc(size);
+	if ( xml == NULL )
+	{
+		return ( 0 );
+	}
+	memcpy(xml, data, size);
+	
+	for ( target = gParseTargets; target->name != NULL; ++target )
+	{
+		(void)target->run(&gDir, xml, (CFIndex)size);
+	}
+	free(xml);
+	
+	/* start each input with an empty directory */
+	parse_dir_clear(&gDir);
+	
+	return ( 0 );
+}
+
+/*****************************************************************************/
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * parse_targets.c wraps each of webdav_parse.c's entry points so parse_bench
+ * and parse_fuzz can run them over a response body without a server.
+ */
+
+#include "parse_targets.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "webdav_cache.h"
+#include "webdav_parse.h"
+#include "webdav_stats.h"
+
+/*****************************************************************************/
+
+/* the directory URLs are made by appending the directory's path to this */
+#define PARSE_BASE_URL "http://bench.invalid"
+
+static struct node_entry *gRootNode;
+static u_int32_t gDirCount;
+
+/*****************************************************************************/
+
+static int run_opendir(struct parse_dir *dir, UInt8 *xml, CFIndex length)
+{
+	int error;
+	char *sync_token;
+	
+	error = parse_opendir(xml, length, dir->url, gProcessUID, dir->node, &sync_token);
+	free(sync_token);
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static int run_prefetch(struct parse_dir *dir, UInt8 *xml, CFIndex length)
+{
+	return ( parse_prefetch(xml, length, dir->url, gProcessUID, dir->node) );
+}
+
+/*****************************************************************************/
+
+static int run_subtree(struct parse_dir *dir, UInt8 *xml, CFIndex length)
+{
+	return ( parse_subtree(xml, length, dir->url, gProcessUID, dir->node) );
+}
+
+/*****************************************************************************/
+
+static int run_sync_collection(struct parse_dir *dir, UInt8 *xml, CFIndex length)
+{
+	int error;
+	char *sync_token;
+	int truncated;
+	
+	error = parse_sync_collection(xml, length, dir->url, gProcessUID, dir->node, &sync_token, &truncated);
+	free(sync_token);
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static int run_stat(struct parse_dir *dir, UInt8 *xml, CFIndex length)
+{
+	#pragma unused(dir)
+	struct webdav_stat_attr statbuf;
+	
+	bzero(&statbuf, sizeof(statbuf));
+	return ( parse_stat(xml, length, &statbuf) );
+}
+
+/*****************************************************************************/
+
+static int run_statfs(struct parse_dir *dir, UInt8 *xml, CFIndex length)
+{
+	#pragma unused(dir)
+	struct statfs statfsbuf;
+	
+	bzero(&statfsbuf, sizeof(statfsbuf));
+	return ( parse_statfs(xml, length, &statfsbuf) );
+}
+
+/*****************************************************************************/
+
+static int run_lock(struct parse_dir *dir, UInt8 *xml, CFIndex length)
+{
+	#pragma unused(dir)
+	int error;
+	char *locktoken;
+	
+	locktoken = NULL;
+	error = parse_lock(xml, length, &locktoken);
+	free(locktoken);
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static int run_file_count(struct parse_dir *dir, UInt8 *xml, CFIndex length)
+{
+	#pragma unused(dir)
+	int file_count;
+	
+	return ( parse_file_count(xml, length, &file_count) );
+}
+
+/*****************************************************************************/
+
+static int run_cachevalidators(struct parse_dir *dir, UInt8 *xml, CFIndex length)
+{
+	#pragma unused(dir)
+	int error;
+	time_t last_modified;
+	char *entity_tag;
+	
+	entity_tag = NULL;
+	error = parse_cachevalidators(xml, length, &last_modified, &entity_tag);
+	free(entity_tag);
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static int run_multi_status(struct parse_dir *dir, UInt8 *xml, CFIndex length)
+{
+	#pragma unused(dir)
+	webdav_parse_multistatus_list_t *list;
+	webdav_parse_multistatus_element_t *element;
+	webdav_parse_multistatus_element_t *next_element;
+	
+	list = parse_multi_status(xml, length);
+	if ( list == NULL )
+	{
+		return ( EIO );
+	}
+	for ( element = list->head; element != NULL; element = next_element )
+	{
+		next_element = element->next;
+		free(element);
+	}
+	free(list);
+	return ( 0 );
+}
+
+/*****************************************************************************/
+
+const struct parse_target gParseTargets[] =
+{
+	{ "opendir",			run_opendir,			PARSE_KIND_LISTING },
+	{ "prefetch",			run_prefetch,			PARSE_KIND_LISTING },
+	{ "subtree",			run_subtree,			PARSE_KIND_LISTING },
+	{ "file_count",			run_file_count,			PARSE_KIND_LISTING },
+	{ "sync_collection",	run_sync_collection,	PARSE_KIND_SYNC },
+	{ "stat",				run_stat,				PARSE_KIND_PROPS },
+	{ "statfs",				run_statfs,				PARSE_KIND_PROPS },
+	{ "cachevalidators",	run_cachevalidators,	PARSE_KIND_PROPS },
+	{ "lock",				run_lock,				PARSE_KIND_LOCK },
+	{ "multi_status",		run_multi_status,		PARSE_KIND_LISTING | PARSE_KIND_MULTISTATUS | PARSE_KIND_SYNC },
+	{ NULL,					NULL,					0 }
+};
+
+/*****************************************************************************/
+
+u_int32_t parse_kind(const char *name)
+{
+	if ( strcmp(name, "listing") == 0 )
+	{
+		return ( PARSE_KIND_LISTING );
+	}
+	else if ( strcmp(name, "props") == 0 )
+	{
+		return ( PARSE_KIND_PROPS );
+	}
+	else if ( strcmp(name, "lock") == 0 )
+	{
+		return ( PARSE_KIND_LOCK );
+	}
+	else if ( strcmp(name, "multistatus") == 0 )
+	{
+		return ( PARSE_KIND_MULTISTATUS );
+	}
+	else if ( strcmp(name, "sync") == 0 )
+	{
+		return ( PARSE_KIND_SYNC );
+	}
+	else
+	{
+		return ( 0 );
+	}
+}
+
+/*****************************************************************************/
+
+int parse_targets_init(void)
+{
+	int error;
+	
+	gProcessUID = getuid();
+	gtimeout_string = WEBDAV_PULSE_TIMEOUT;
+	gtimeout_val = atoi(gtimeout_string);
+	
+	/* the parsers record their times in the stats */
+	stats_init();
+	
+	error = nodecache_init(strlen(PARSE_BASE_URL "/"), PARSE_BASE_URL "/", &gRootNode);
+	require_noerr(error, nodecache_init);
+	
+nodecache_init:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+int parse_dir_create(const char *path, struct parse_dir *dir)
+{
+	int error;
+	int fd;
+	char name[32];
+	char *url_string;
+	char cache_template[] = "/tmp/parse_bench.XXXXXX";
+	
+	dir->node = NULL;
+	dir->url = NULL;
+	url_string = NULL;
+	
+	require_action(path[0] == '/', bad_path, error = EINVAL);
+	
+	require_action(asprintf(&url_string, "%s%s", PARSE_BASE_URL, path) != -1, asprintf, error = ENOMEM);
+	dir->url = CFURLCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)url_string, (CFIndex)strlen(url_string), kCFStringEncodingUTF8, NULL);
+	require_action(dir->url != NULL, CFURLCreateWithBytes, error = EINVAL);
+	
+	/* each directory gets its own node so the corpus files don't share children */
+	snprintf(name, sizeof(name), "dir%u", gDirCount++);
+	error = nodecache_get_node(gRootNode, strlen(name), name, TRUE, FALSE, WEBDAV_DIR_TYPE, &dir->node);
+	require_noerr(error, nodecache_get_node);
+	
+	/* parse_opendir writes the directory entries to the node's cache file */
+	fd = mkstemp(cache_template);
+	require_action(fd != -1, mkstemp, error = errno);
+	(void)unlink(cache_template);
+	
+	error = nodecache_add_file_cache(dir->node, fd);
+	require_noerr_action(error, nodecache_add_file_cache, close(fd));
+	
+	free(url_string);
+	return ( 0 );
+	
+nodecache_add_file_cache:
+mkstemp:
+	(void)nodecache_delete_node(dir->node, TRUE);
+	dir->node = NULL;
+nodecache_get_node:
+	CFRelease(dir->url);
+	dir->url = NULL;
+CFURLCreateWithBytes:
+	free(url_string);
+asprintf:
+bad_path:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+void parse_dir_clear(struct parse_dir *dir)
+{
+	struct node_entry *child_node;
+	
+	/* nothing else uses the node cache, so the children can be walked without lock_node_cache */
+	while ( (child_node = (dir->node->children).lh_first) != NULL )
+	{
+		if ( nodecache_delete_node(child_node, TRUE) != 0 )
+		{
+			break;
+		}
+	}
+	
+	/* the deleted nodes aren't referenced by anything, so free them now */
+	nodecache_free_nodes();
+}
+
+/*****************************************************************************/
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _PARSE_TARGETS_H_INCLUDE
+#define _PARSE_TARGETS_H_INCLUDE
+
+#include "webdavd.h"
+
+/*****************************************************************************/
+
+/*
+ * parse_targets.c runs webdav_parse.c's entry points outside of the agent
+ * for parse_bench and parse_fuzz.
+ */
+
+/* what a directory parser needs: a directory node with a cache file, and the directory's URL */
+struct parse_dir
+{
+	struct node_entry *node;	/* directory node the parsers add children to */
+	CFURLRef url;				/* the directory's URL */
+};
+
+/* runs one parser over xml, freeing whatever it returns */
+typedef int (*parse_run_t)(struct parse_dir *dir, UInt8 *xml, CFIndex length);
+
+/* the kinds of response body a parser reads (the corpus MANIFEST's kind column) */
+#define PARSE_KIND_LISTING		0x01	/* PROPFIND Depth 1 (or infinity) of a collection */
+#define PARSE_KIND_PROPS		0x02	/* PROPFIND Depth 0 */
+#define PARSE_KIND_LOCK			0x04	/* LOCK */
+#define PARSE_KIND_MULTISTATUS	0x08	/* 207 from DELETE, MOVE, COPY or PROPPATCH */
+#define PARSE_KIND_SYNC			0x10	/* sync-collection REPORT */
+
+struct parse_target
+{
+	const char *name;
+	parse_run_t run;
+	u_int32_t kinds;			/* the PARSE_KIND_* bodies the parser reads */
+};
+
+/* every webdav_parse.c entry point, ended by a NULL name */
+extern const struct parse_target gParseTargets[];
+
+/* returns the PARSE_KIND_* for name ("listing", "props", ...), or 0 */
+u_int32_t parse_kind(const char *name);
+
+/* the set up the parsers need (the node cache and stats) */
+int parse_targets_init(void);
+
+/* creates a directory node with a cache file for the directory at path (e.g. "/dav/photos/") */
+int parse_dir_create(const char *path, struct parse_dir *dir);
+
+/* deletes the children the parsers added to dir */
+void parse_dir_clear(struct parse_dir *dir);
+
+#endif
@@ -0,0 +1,818 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * webdav_bench drives webdavfs_agent's filesystem_* entry points directly,
+ * without the kext or a mount, against a WebDAV server (normally
+ * webdav_standin.py) and reports throughput and latency percentiles for
+ * each workload. It links the agent's sources (see the Makefile), so it
+ * measures exactly the code webdavfs_agent runs. agent_globals.c stands in
+ * for webdav_agent.c.
+ */
+
+#include "webdavd.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syslog.h>
+#include <fcntl.h>
+#include <libkern/OSAtomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "OpaqueIDs.h"
+#include "webdav_authcache.h"
+#include "webdav_cache.h"
+#include "webdav_cookie.h"
+#include "webdav_network.h"
+#include "webdav_requestqueue.h"
+#include "webdav_stats.h"
+
+/*****************************************************************************/
+
+/*
+ * The layout webdav_standin.py generates
+ */
+#define BENCH_LIST_PATH		"list"		/* BENCH_LIST_NAME_FORMAT files */
+#define BENCH_LIST_NAME_FORMAT "f%06u"
+#define BENCH_TREE_PATH		"tree"		/* "d0" ... directories, each a tree */
+#define BENCH_DATA_PATH		"data"		/* holds "blob" and the files the write workload creates */
+#define BENCH_BLOB_NAME		"blob"
+
+struct bench_options
+{
+	u_int32_t threads;			/* threads running the operations (for the workloads that allow it) */
+	u_int32_t ops;				/* operations per workload, or 0 for the workload's default */
+	u_int32_t list_entries;		/* files in BENCH_LIST_PATH (webdav_standin.py --list-entries) */
+	u_int32_t tree_width;		/* directories directly in BENCH_TREE_PATH (webdav_standin.py --tree-width) */
+	u_int32_t io_size;			/* bytes per randread read */
+	u_int32_t write_size;		/* bytes per write workload file */
+	int force_lookup;			/* if TRUE, lookups don't use the node cache */
+};
+
+struct bench_run;
+
+/* runs operation number index, returning its result and the payload bytes it moved */
+typedef int (*bench_op_t)(struct bench_run *run, u_int32_t index, u_int64_t *bytes);
+
+struct bench_workload
+{
+	const char *name;
+	int (*setup)(struct bench_run *run);	/* NULL if there's nothing to set up */
+	bench_op_t op;
+	u_int32_t default_ops;
+	int single_threaded;		/* TRUE if the operations must run one at a time */
+};
+
+struct bench_run
+{
+	const struct bench_workload *workload;
+	u_int32_t ops;
+	volatile int32_t next_op;	/* the next operation to run (atomic) */
+	volatile int64_t bytes;		/* payload bytes moved (atomic) */
+	volatile int32_t errors;	/* operations that failed (atomic) */
+	int first_error;
+	uint64_t *usec;				/* each operation's latency */
+
+	/* set up by the workload */
+	opaque_id dir_id;
+	opaque_id obj_id;
+	off_t obj_size;
+};
+
+static struct bench_options gOptions = { 1, 0, 10000, 4, 65536, 8 * 1024 * 1024, FALSE };
+static opaque_id gRootID;
+
+/*****************************************************************************/
+
+static void bench_cred(struct webdav_cred *pcr)
+{
+	pcr->pcr_uid = gProcessUID;
+}
+
+/*****************************************************************************/
+
+static int bench_lookup(
+	opaque_id dir_id,					/* -> the directory to look in */
+	const char *name,					/* -> the name to look up */
+	int force_lookup,					/* -> if TRUE, don't use the node cache */
+	struct webdav_reply_lookup *reply)	/* <- what was found */
+{
+	int error;
+	size_t name_length;
+	struct webdav_request_lookup *request;
+
+	name_length = strlen(name);
+	request = calloc(1, sizeof(struct webdav_request_lookup) + name_length);
+	require_action(request != NULL, calloc, error = ENOMEM);
+
+	bench_cred(&request->pcr);
+	request->dir_id = dir_id;
+	request->force_lookup = force_lookup;
+	request->name_length = (uint32_t)name_length;
+	memcpy(request->name, name, name_length);
+
+	bzero(reply, sizeof(*reply));
+	error = filesystem_lookup(request, reply);
+	free(request);
+
+calloc:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* looks up each component of a '/' separated path relative to the root */
+static int bench_lookup_path(
+	const char *path,					/* -> the path */
+	struct webdav_reply_lookup *reply)	/* <- what was found */
+{
+	int error;
+	char *pathbuf, *component, *next;
+	opaque_id dir_id;
+
+	error = 0;
+	dir_id = gRootID;
+
+	pathbuf = strdup(path);
+	require_action(pathbuf != NULL, strdup, error = ENOMEM);
+
+	next = pathbuf;
+	while ( (error == 0) && ((component = strsep(&next, "/")) != NULL) )
+	{
+		if ( *component != '\0' )
+		{
+			error = bench_lookup(dir_id, component, FALSE, reply);
+			dir_id = reply->obj_id;
+		}
+	}
+	free(pathbuf);
+
+strdup:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static int bench_open(opaque_id obj_id, int flags)
+{
+	struct webdav_request_open request_open;
+	struct webdav_reply_open reply_open;
+
+	bzero(&request_open, sizeof(request_open));
+	bench_cred(&request_open.pcr);
+	request_open.obj_id = obj_id;
+	request_open.flags = flags;
+	request_open.ref = 0;	/* there's no kext vnode to associate the cache file with */
+
+	return ( filesystem_open(&request_open, &reply_open) );
+}
+
+/*****************************************************************************/
+
+static int bench_close(opaque_id obj_id)
+{
+	struct webdav_request_close request_close;
+
+	bench_cred(&request_close.pcr);
+	request_close.obj_id = obj_id;
+
+	return ( filesystem_close(&request_close) );
+}
+
+/*****************************************************************************/
+
+/* waits for a download started by filesystem_open to finish, the way the kext does */
+static int bench_wait_for_download(opaque_id obj_id, off_t *size)
+{
+	int error;
+	struct node_entry *node;
+	struct stat statbuf;
+
+	error = RetrieveDataFromOpaqueID(obj_id, (void **)&node);
+	require_noerr_quiet(error, RetrieveDataFromOpaqueID);
+
+	while ( (node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_IN_PROGRESS )
+	{
+		usleep(1000);	/* 1 millisecond */
+	}
+	require_action((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_FINISHED, aborted, error = EIO);
+
+	require_action(fstat(node->file_fd, &statbuf) == 0, fstat, error = errno);
+	*size = statbuf.st_size;
+
+fstat:
+aborted:
+RetrieveDataFromOpaqueID:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static int setup_list(struct bench_run *run)
+{
+	int error;
+	struct webdav_reply_lookup reply;
+
+	error = bench_lookup_path(BENCH_LIST_PATH, &reply);
+	run->dir_id = reply.obj_id;
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* lookup: look up random names in BENCH_LIST_PATH */
+static int op_lookup(struct bench_run *run, u_int32_t index, u_int64_t *bytes)
+{
+	#pragma unused(index, bytes)
+	char name[32];
+	struct webdav_reply_lookup reply;
+
+	snprintf(name, sizeof(name), BENCH_LIST_NAME_FORMAT, (u_int32_t)arc4random_uniform(gOptions.list_entries));
+
+	return ( bench_lookup(run->dir_id, name, gOptions.force_lookup, &reply) );
+}
+
+/*****************************************************************************/
+
+/* list: open, read and close BENCH_LIST_PATH */
+static int op_list(struct bench_run *run, u_int32_t index, u_int64_t *bytes)
+{
+	#pragma unused(index)
+	int error;
+	struct webdav_request_readdir request_readdir;
+	struct webdav_reply_readdir reply_readdir;
+	off_t size;
+
+	error = bench_open(run->dir_id, O_RDONLY);
+	require_noerr_quiet(error, bench_open);
+
+	bzero(&request_readdir, sizeof(request_readdir));
+	bench_cred(&request_readdir.pcr);
+	request_readdir.obj_id = run->dir_id;
+	request_readdir.cache = TRUE;
+	error = filesystem_readdir(&request_readdir, &reply_readdir);
+	if ( error == 0 )
+	{
+		error = bench_wait_for_download(run->dir_id, &size);
+		*bytes = (u_int64_t)size;
+	}
+
+	(void) bench_close(run->dir_id);
+
+bench_open:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static int setup_blob(struct bench_run *run)
+{
+	int error;
+	struct webdav_reply_lookup reply;
+
+	error = bench_lookup_path(BENCH_DATA_PATH "/" BENCH_BLOB_NAME, &reply);
+	run->obj_id = reply.obj_id;
+	run->obj_size = reply.obj_filesize;
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* seqread: download all of BENCH_BLOB_NAME, starting with no cache file each time */
+static int op_seqread(struct bench_run *run, u_int32_t index, u_int64_t *bytes)
+{
+	#pragma unused(index)
+	int error;
+	struct node_entry *node;
+	off_t size;
+
+	error = bench_open(run->obj_id, O_RDONLY);
+	require_noerr_quiet(error, bench_open);
+
+	error = bench_wait_for_download(run->obj_id, &size);
+	*bytes = (u_int64_t)size;
+
+	(void) bench_close(run->obj_id);
+
+	/* make the next open download it again */
+	if ( RetrieveDataFromOpaqueID(run->obj_id, (void **)&node) == 0 )
+	{
+		nodecache_remove_file_cache(node);
+	}
+
+bench_open:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* randread: read io_size bytes at a random io_size aligned offset of BENCH_BLOB_NAME */
+static int op_randread(struct bench_run *run, u_int32_t index, u_int64_t *bytes)
+{
+	#pragma unused(index)
+	int error;
+	struct webdav_request_read request_read;
+	char *data;
+	size_t size;
+	u_int32_t blocks;
+
+	blocks = (u_int32_t)MAX(run->obj_size / gOptions.io_size, 1);
+
+	bzero(&request_read, sizeof(request_read));
+	bench_cred(&request_read.pcr);
+	request_read.obj_id = run->obj_id;
+	request_read.offset = (off_t)arc4random_uniform(blocks) * gOptions.io_size;
+	request_read.count = gOptions.io_size;
+
+	data = NULL;
+	size = 0;
+	error = filesystem_read(&request_read, &data, &size);
+	if ( data != NULL )
+	{
+		free(data);
+	}
+	*bytes = size;
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static int setup_write(struct bench_run *run)
+{
+	int error;
+	struct webdav_reply_lookup reply;
+
+	error = bench_lookup_path(BENCH_DATA_PATH, &reply);
+	run->dir_id = reply.obj_id;
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* write: create a file in BENCH_DATA_PATH and write write_size bytes to it */
+static int op_write(struct bench_run *run, u_int32_t index, u_int64_t *bytes)
+{
+	int error;
+	char name[64];
+	size_t name_length;
+	struct webdav_request_create *request_create;
+	struct webdav_reply_create reply_create;
+	struct webdav_request_fsync request_fsync;
+	struct node_entry *node;
+	char *buffer;
+	u_int32_t offset;
+	ssize_t written;
+
+	buffer = NULL;
+
+	snprintf(name, sizeof(name), "bench.%d.%u", getpid(), index);
+	name_length = strlen(name);
+	request_create = calloc(1, sizeof(struct webdav_request_create) + name_length);
+	require_action(request_create != NULL, calloc, error = ENOMEM);
+
+	bench_cred(&request_create->pcr);
+	request_create->dir_id = run->dir_id;
+	request_create->mode = S_IFREG | 0644;
+	request_create->name_length = (uint32_t)name_length;
+	memcpy(request_create->name, name, name_length);
+
+	error = filesystem_create(request_create, &reply_create);
+	free(request_create);
+	require_noerr_quiet(error, filesystem_create);
+
+	error = bench_open(reply_create.obj_id, O_RDWR | O_TRUNC);
+	require_noerr_quiet(error, bench_open);
+
+	/* write the cache file the way the kext would */
+	error = RetrieveDataFromOpaqueID(reply_create.obj_id, (void **)&node);
+	require_noerr_quiet(error, RetrieveDataFromOpaqueID);
+
+	buffer = malloc(WEBDAV_MAX_IO_BUFFER_SIZE);
+	require_action(buffer != NULL, malloc_buffer, error = ENOMEM);
+	memset(buffer, (int)index, WEBDAV_MAX_IO_BUFFER_SIZE);
+
+	for ( offset = 0; offset < gOptions.write_size; offset += (u_int32_t)written )
+	{
+		written = pwrite(node->file_fd, buffer, MIN(WEBDAV_MAX_IO_BUFFER_SIZE, gOptions.write_size - offset), offset);
+		require_action(written > 0, pwrite, error = errno);
+	}
+
+	bench_cred(&request_fsync.pcr);
+	request_fsync.obj_id = reply_create.obj_id;
+	error = filesystem_fsync(&request_fsync);
+	if ( error == 0 )
+	{
+		*bytes = gOptions.write_size;
+	}
+
+pwrite:
+malloc_buffer:
+RetrieveDataFromOpaqueID:
+
+	(void) bench_close(reply_create.obj_id);
+	if ( buffer != NULL )
+	{
+		free(buffer);
+	}
+
+bench_open:
+filesystem_create:
+calloc:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static int setup_rename(struct bench_run *run)
+{
+	int error;
+	struct webdav_reply_lookup reply;
+
+	error = bench_lookup_path(BENCH_TREE_PATH, &reply);
+	run->dir_id = reply.obj_id;
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* rename: move one of BENCH_TREE_PATH's trees from "dN" to "rN" or back */
+static int op_rename(struct bench_run *run, u_int32_t index, u_int64_t *bytes)
+{
+	#pragma unused(bytes)
+	int error;
+	u_int32_t tree;
+	char from_name[32];
+	char to_name[32];
+	size_t to_name_length;
+	struct webdav_reply_lookup reply;
+	struct webdav_request_rename *request_rename;
+
+	/* the first pass over the trees moves them to "rN", the next moves them back */
+	tree = index % gOptions.tree_width;
+	snprintf(from_name, sizeof(from_name), "%c%u", ((index / gOptions.tree_width) & 1) ? 'r' : 'd', tree);
+	snprintf(to_name, sizeof(to_name), "%c%u", ((index / gOptions.tree_width) & 1) ? 'd' : 'r', tree);
+
+	error = bench_lookup(run->dir_id, from_name, FALSE, &reply);
+	require_noerr_quiet(error, bench_lookup);
+
+	to_name_length = strlen(to_name);
+	request_rename = calloc(1, sizeof(struct webdav_request_rename) + to_name_length);
+	require_action(request_rename != NULL, calloc, error = ENOMEM);
+
+	bench_cred(&request_rename->pcr);
+	request_rename->from_dir_id = run->dir_id;
+	request_rename->from_obj_id = reply.obj_id;
+	request_rename->to_dir_id = run->dir_id;
+	request_rename->to_obj_id = kInvalidOpaqueID;
+	request_rename->to_name_length = (uint32_t)to_name_length;
+	memcpy(request_rename->to_name, to_name, to_name_length);
+
+	error = filesystem_rename(request_rename);
+	free(request_rename);
+
+calloc:
+bench_lookup:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static const struct bench_workload gWorkloads[] =
+{
+	{ "lookup",		setup_list,		op_lookup,		10000,	FALSE },
+	{ "list",		setup_list,		op_list,		20,		TRUE },
+	{ "seqread",	setup_blob,		op_seqread,		5,		TRUE },
+	{ "randread",	setup_blob,		op_randread,	1000,	FALSE },
+	{ "write",		setup_write,	op_write,		20,		FALSE },
+	{ "rename",		setup_rename,	op_rename,		40,		TRUE },
+	{ NULL,			NULL,			NULL,			0,		FALSE }
+};
+
+/*****************************************************************************/
+
+static void *bench_thread(void *arg)
+{
+	struct bench_run *run;
+	int32_t index;
+	uint64_t start;
+	u_int64_t bytes;
+	int error;
+
+	run = (struct bench_run *)arg;
+	while ( (index = OSAtomicIncrement32(&run->next_op) - 1) < (int32_t)run->ops )
+	{
+		bytes = 0;
+		start = stats_start();
+		error = run->workload->op(run, (u_int32_t)index, &bytes);
+		run->usec[index] = stats_elapsed_usec(start);
+
+		OSAtomicAdd64((int64_t)bytes, &run->bytes);
+		if ( error != 0 )
+		{
+			if ( OSAtomicIncrement32(&run->errors) == 1 )
+			{
+				run->first_error = error;
+			}
+		}
+	}
+
+	return ( NULL );
+}
+
+/*****************************************************************************/
+
+static int compare_usec(const void *a, const void *b)
+{
+	uint64_t usec_a = *(const uint64_t *)a;
+	uint64_t usec_b = *(const uint64_t *)b;
+
+	return ( (usec_a < usec_b) ? -1 : (usec_a > usec_b) );
+}
+
+/*****************************************************************************/
+
+static double percentile_msec(const uint64_t *sorted_usec, u_int32_t count, u_int32_t percent)
+{
+	return ( sorted_usec[((u_int64_t)(count - 1) * percent) / 100] / 1000.0 );
+}
+
+/*****************************************************************************/
+
+static int bench_workload(const struct bench_workload *workload)
+{
+	int error;
+	struct bench_run run;
+	pthread_t *threads;
+	u_int32_t thread_count;
+	u_int32_t index;
+	uint64_t start;
+	double seconds;
+
+	bzero(&run, sizeof(run));
+	run.workload = workload;
+	run.ops = (gOptions.ops != 0) ? gOptions.ops : workload->default_ops;
+	thread_count = workload->single_threaded ? 1 : MIN(gOptions.threads, run.ops);
+
+	threads = NULL;
+	run.usec = calloc(run.ops, sizeof(uint64_t));
+	require_action(run.usec != NULL, calloc_usec, error = ENOMEM);
+	threads = calloc(thread_count, sizeof(pthread_t));
+	require_action(threads != NULL, calloc_threads, error = ENOMEM);
+
+	if ( workload->setup != NULL )
+	{
+		error = workload->setup(&run);
+		if ( error != 0 )
+		{
+			fprintf(stderr, "webdav_bench: %s: setup failed: %s\n", workload->name, strerror(error));
+			goto setup;
+		}
+	}
+
+	start = stats_start();
+	for ( index = 0; index < thread_count; ++index )
+	{
+		error = pthread_create(&threads[index], NULL, bench_thread, &run);
+		if ( error != 0 )
+		{
+			/* let the threads already running finish the operations */
+			thread_count = index;
+			break;
+		}
+	}
+	for ( index = 0; index < thread_count; ++index )
+	{
+		(void) pthread_join(threads[index], NULL);
+	}
+	seconds = stats_elapsed_usec(start) / 1000000.0;
+	require_action(thread_count != 0, pthread_create, error = EAGAIN);
+
+	qsort(run.usec, run.ops, sizeof(uint64_t), compare_usec);
+	printf("%-9s %7u %6d %8.2f %10.1f %9.2f %9.3f %9.3f %9.3f %9.3f\n",
+		workload->name, run.ops, run.errors, seconds,
+		run.ops / seconds, (run.bytes / seconds) / (1024.0 * 1024.0),
+		percentile_msec(run.usec, run.ops, 50), percentile_msec(run.usec, run.ops, 90),
+		percentile_msec(run.usec, run.ops, 99), run.usec[run.ops - 1] / 1000.0);
+	if ( run.errors != 0 )
+	{
+		fprintf(stderr, "webdav_bench: %s: %d operations failed, the first with %s\n",
+			workload->name, run.errors, strerror(run.first_error));
+	}
+	error = 0;
+
+pthread_create:
+setup:
+	free(threads);
+calloc_threads:
+	free(run.usec);
+calloc_usec:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static void usage(void)
+{
+	(void)fprintf(stderr,
+		"usage: webdav_bench [-d] [-f] [-t threads] [-n ops] [-e list_entries] [-w tree_width]\n"
+		"\t[-s io_size] [-S write_size] [-o options] <WebDAV_URL> [workload ...]\n"
+		"workloads: lookup list seqread randread write rename (default all)\n"
+		"options: dirlisttimeout=seconds,lockless,streamedupload\n");
+}
+
+/*****************************************************************************/
+
+static int parse_options(char *options)
+{
+	char *opt;
+
+	while ( (opt = strsep(&options, ",")) != NULL )
+	{
+		if ( strncmp(opt, "dirlisttimeout=", strlen("dirlisttimeout=")) == 0 )
+		{
+			gDirListingTimeout = (unsigned int)strtoul(opt + strlen("dirlisttimeout="), NULL, 10);
+		}
+		else if ( strcmp(opt, "lockless") == 0 )
+		{
+			gLocklessOpens = TRUE;
+		}
+		else if ( strcmp(opt, "streamedupload") == 0 )
+		{
+			gStreamedUploads = TRUE;
+		}
+		else
+		{
+			return ( EINVAL );
+		}
+	}
+	return ( 0 );
+}
+
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+	int error;
+	int ch;
+	int index;
+	int mount_flags;
+	int store_notify_fd;
+	char *uri;
+	size_t uri_length;
+	struct node_entry *root_node;
+	const struct bench_workload *workload;
+
+	error = 0;
+	while ( (error == 0) && ((ch = getopt(argc, argv, "dft:n:e:w:s:S:o:")) != -1) )
+	{
+		switch ( ch )
+		{
+			case 'd':
+				gWebdavfsDebug = TRUE;
+				break;
+			case 'f':
+				gOptions.force_lookup = TRUE;
+				break;
+			case 't':
+				gOptions.threads = (u_int32_t)MAX(strtoul(optarg, NULL, 10), 1);
+				break;
+			case 'n':
+				gOptions.ops = (u_int32_t)strtoul(optarg, NULL, 10);
+				break;
+			case 'e':
+				gOptions.list_entries = (u_int32_t)MAX(strtoul(optarg, NULL, 10), 1);
+				break;
+			case 'w':
+				gOptions.tree_width = (u_int32_t)MAX(strtoul(optarg, NULL, 10), 1);
+				break;
+			case 's':
+				gOptions.io_size = (u_int32_t)MIN(MAX(strtoul(optarg, NULL, 10), 1), WEBDAV_MAX_IO_BUFFER_SIZE);
+				break;
+			case 'S':
+				gOptions.write_size = (u_int32_t)strtoul(optarg, NULL, 10);
+				break;
+			case 'o':
+				error = parse_options(optarg);
+				break;
+			default:
+				error = EINVAL;
+				break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	require_action_quiet((error == 0) && (argc >= 1), usage, usage(); error = EINVAL);
+
+	/* the same set up webdav_agent.c's main does, less the kext and the mount */
+	gProcessUID = getuid();
+	gtimeout_string = WEBDAV_PULSE_TIMEOUT;
+	gtimeout_val = atoi(gtimeout_string);
+	signal(SIGPIPE, SIG_IGN);
+	openlog("webdav_bench", LOG_PERROR | LOG_PID, LOG_DAEMON);
+	CFRunLoopGetCurrent();
+
+	uri_length = strlen(argv[0]);
+	uri = malloc(uri_length + 2);
+	require_action(uri != NULL, malloc_uri, error = ENOMEM);
+	strlcpy(uri, argv[0], uri_length + 2);
+	if ( uri[uri_length - 1] != '/' )
+	{
+		strlcat(uri, "/", uri_length + 2);
+		++uri_length;
+	}
+
+	stats_init();
+
+	error = nodecache_init(uri_length, uri, &root_node);
+	require_noerr(error, init);
+	gRootID = root_node->nodeid;
+
+	error = authcache_init(NULL, NULL, NULL, NULL, NULL);
+	require_noerr(error, init);
+
+	cookies_init();
+
+	error = network_init((const UInt8 *)uri, (CFIndex)uri_length, &store_notify_fd, FALSE);
+	require_noerr(error, init);
+
+	/* no kext: filesystem_open doesn't associate cache files with vnodes */
+	error = filesystem_init(-1);
+	require_noerr(error, init);
+
+	error = requestqueue_init();
+	require_noerr(error, init);
+
+	mount_flags = 0;
+	error = filesystem_mount(&mount_flags);
+	if ( error != 0 )
+	{
+		fprintf(stderr, "webdav_bench: %s: %s\n", uri, strerror(error));
+		goto init;
+	}
+
+	printf("%-9s %7s %6s %8s %10s %9s %9s %9s %9s %9s\n",
+		"workload", "ops", "errors", "seconds", "ops/sec", "MB/sec", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	for ( workload = gWorkloads; workload->name != NULL; ++workload )
+	{
+		if ( argc > 1 )
+		{
+			for ( index = 1; index < argc; ++index )
+			{
+				if ( strcmp(argv[index], workload->name) == 0 )
+				{
+					break;
+				}
+			}
+			if ( index == argc )
+			{
+				continue;
+			}
+		}
+		(void) bench_workload(workload);
+	}
+
+init:
+	free(uri);
+malloc_uri:
+usage:
+
+	return ( (error == 0) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
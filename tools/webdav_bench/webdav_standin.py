@@ -0,0 +1,535 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2013 Apple Inc. All rights reserved.
+#
+# @APPLE_LICENSE_HEADER_START@
+#
+# This file contains Original Code and/or Modifications of Original Code
+# as defined in and that are subject to the Apple Public Source License
+# Version 2.0 (the 'License'). You may not use this file except in
+# compliance with the License. Please obtain a copy of the License at
+# http://www.opensource.apple.com/apsl/ and read it before using this
+# file.
+#
+# The Original Code and all software distributed under the License are
+# distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+# EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+# INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+# Please see the License for the specific language governing rights and
+# limitations under the License.
+#
+# @APPLE_LICENSE_HEADER_END@
+#
+
+"""
+A local, in-memory WebDAV server for benchmarking webdavfs_agent.
+
+The tree it serves is generated at startup (see README for the layout the
+benchmark driver expects):
+
+	/list/f000000 ... 		--list-entries files in one directory
+	/tree/d0/d1/.../f0 ...	--tree-width directories per level, --tree-depth
+							levels, --tree-files files in each directory
+	/data/blob				one --blob-size byte file
+
+Generated files aren't stored: their bytes are a fixed pattern computed on
+the fly, so a tree of 100k files costs only its metadata. Files that are
+PUT are kept in memory.
+
+The network can be made slower and less reliable with --latency,
+--bandwidth, --error-rate/--error-status/--drop-rate and the keep-alive
+options. Only the standard library is used.
+"""
+
+import argparse
+import email.utils
+import random
+import socket
+import sys
+import threading
+import time
+import uuid
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import quote, unquote, urlsplit
+from xml.sax.saxutils import escape
+
+PATTERN = bytes(range(256)) * 256	# 64 KiB; a generated file's byte n is n & 0xff
+IO_CHUNK = 64 * 1024
+
+
+class Node(object):
+	def __init__(self, is_dir, size=0, data=None):
+		self.is_dir = is_dir
+		self.children = {} if is_dir else None
+		self.size = size
+		self.data = data				# None for generated files
+		self.ctime = time.time()
+		self.touch()
+
+	def touch(self):
+		self.mtime = time.time()
+		self.etag = '"%s"' % uuid.uuid4().hex
+
+	def read(self, start, end):
+		"""bytes [start, end) of the file"""
+		if self.data is not None:
+			return self.data[start:end]
+		out = bytearray()
+		while start < end:
+			offset = start % len(PATTERN)
+			take = min(end - start, len(PATTERN) - offset)
+			out += PATTERN[offset:offset + take]
+			start += take
+		return bytes(out)
+
+
+class Tree(object):
+	def __init__(self, options):
+		self.lock = threading.Lock()
+		self.root = Node(True)
+		self.locks = {}					# lock token -> path
+
+		listing = self.mkdirs('/list')
+		for index in range(options.list_entries):
+			listing.children['f%06d' % index] = Node(False, options.file_size)
+
+		self.add_tree(self.mkdirs('/tree'), options.tree_width, options.tree_depth, options.tree_files, options.file_size)
+		self.mkdirs('/data').children['blob'] = Node(False, options.blob_size)
+
+	def add_tree(self, directory, width, depth, files, file_size):
+		for index in range(files):
+			directory.children['f%d' % index] = Node(False, file_size)
+		if depth > 0:
+			for index in range(width):
+				child = Node(True)
+				directory.children['d%d' % index] = child
+				self.add_tree(child, width, depth - 1, files, file_size)
+
+	def mkdirs(self, path):
+		node = self.root
+		for name in split_path(path):
+			node = node.children.setdefault(name, Node(True))
+		return node
+
+	def lookup(self, path):
+		"""(parent, name, node) -- node is None if it doesn't exist, parent too if the parent doesn't"""
+		names = split_path(path)
+		parent, node = None, self.root
+		for name in names:
+			if node is None or not node.is_dir:
+				return (None, None, None)
+			parent, node = node, node.children.get(name)
+		return (parent, names[-1] if names else '', node)
+
+	def count(self, node):
+		"""files and directories in node's tree, node included"""
+		if not node.is_dir:
+			return 1
+		return 1 + sum(self.count(child) for child in node.children.values())
+
+
+def split_path(path):
+	return [name for name in unquote(path).split('/') if name]
+
+
+def http_date(when):
+	return email.utils.formatdate(when, usegmt=True)
+
+
+def iso_date(when):
+	return time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime(when))
+
+
+class Handler(BaseHTTPRequestHandler):
+	protocol_version = 'HTTP/1.1'
+	server_version = 'webdav_standin/1.0'
+
+	# set up by main()
+	options = None
+	tree = None
+
+	def setup(self):
+		BaseHTTPRequestHandler.setup(self)
+		self.requests_on_connection = 0
+		if self.options.keepalive_timeout:
+			self.connection.settimeout(self.options.keepalive_timeout)
+
+	def log_message(self, format, *args):
+		if self.options.verbose:
+			BaseHTTPRequestHandler.log_message(self, format, *args)
+
+	# -- plumbing
+
+	def throttle(self, length, started):
+		"""sleep so that length bytes moved since started take --bandwidth"""
+		if self.options.bandwidth:
+			delay = started + float(length) / self.options.bandwidth - time.time()
+			if delay > 0:
+				time.sleep(delay)
+
+	def read_body(self):
+		started = time.time()
+		if self.headers.get('Transfer-Encoding', '').lower() == 'chunked':
+			body = bytearray()
+			while True:
+				size = int(self.rfile.readline().split(b';')[0].strip() or b'0', 16)
+				if size == 0:
+					# trailers end with an empty line
+					while self.rfile.readline().strip():
+						pass
+					break
+				body += self.rfile.read(size)
+				self.rfile.readline()
+				self.throttle(len(body), started)
+			return bytes(body)
+		length = int(self.headers.get('Content-Length', 0))
+		body = bytearray()
+		while len(body) < length:
+			chunk = self.rfile.read(min(IO_CHUNK, length - len(body)))
+			if not chunk:
+				break
+			body += chunk
+			self.throttle(len(body), started)
+		return bytes(body)
+
+	def reply(self, status, body=b'', headers=None, content_type='text/xml; charset="utf-8"'):
+		self.requests_on_connection += 1
+		keepalive = self.options.keepalive and (
+			not self.options.keepalive_requests or self.requests_on_connection < self.options.keepalive_requests)
+
+		self.send_response(status)
+		for (name, value) in (headers or {}).items():
+			self.send_header(name, value)
+		if body:
+			self.send_header('Content-Type', content_type)
+		self.send_header('Content-Length', str(len(body)))
+		if not keepalive:
+			self.send_header('Connection', 'close')
+			self.close_connection = True
+		self.end_headers()
+
+		if body and self.command != 'HEAD':
+			started = time.time()
+			for offset in range(0, len(body), IO_CHUNK):
+				self.wfile.write(body[offset:offset + IO_CHUNK])
+				self.throttle(offset + IO_CHUNK, started)
+
+	def inject(self):
+		"""the latency every request pays, and the errors some of them get -- TRUE if the request was answered"""
+		if self.options.latency:
+			time.sleep(self.options.latency / 1000.0)
+		if self.options.error_methods and self.command not in self.options.error_methods:
+			return False
+		if self.options.drop_rate and random.random() < self.options.drop_rate:
+			# drop the connection without an answer
+			self.close_connection = True
+			self.connection.shutdown(socket.SHUT_RDWR)
+			return True
+		if self.options.error_rate and random.random() < self.options.error_rate:
+			self.reply(self.options.error_status)
+			return True
+		return False
+
+	def handle_one_request(self):
+		try:
+			BaseHTTPRequestHandler.handle_one_request(self)
+		except (socket.timeout, ConnectionError):
+			self.close_connection = True
+
+	def dispatch(self):
+		self.body = self.read_body() if self.command in ('PUT', 'PROPFIND', 'LOCK', 'REPORT', 'PROPPATCH') else b''
+		if self.inject():
+			return
+		getattr(self, 'dav_' + self.command)()
+
+	do_OPTIONS = do_PROPFIND = do_GET = do_HEAD = do_PUT = do_DELETE = dispatch
+	do_MKCOL = do_MOVE = do_COPY = do_LOCK = do_UNLOCK = do_PROPPATCH = do_REPORT = dispatch
+
+	def path_of(self, url):
+		return urlsplit(url).path
+
+	# -- methods
+
+	def dav_OPTIONS(self):
+		self.reply(200, headers={
+			'DAV': '1, 2',
+			'MS-Author-Via': 'DAV',
+			'Allow': 'OPTIONS, GET, HEAD, PUT, DELETE, PROPFIND, PROPPATCH, MKCOL, COPY, MOVE, LOCK, UNLOCK'})
+
+	def response_xml(self, path, node, quota):
+		href = quote(path if not node.is_dir or path.endswith('/') else path + '/')
+		props = ['<D:creationdate>%s</D:creationdate>' % iso_date(node.ctime),
+			'<D:getlastmodified>%s</D:getlastmodified>' % http_date(node.mtime),
+			'<D:getetag>%s</D:getetag>' % escape(node.etag),
+			'<D:supportedlock><D:lockentry><D:lockscope><D:exclusive/></D:lockscope>'
+			'<D:locktype><D:write/></D:locktype></D:lockentry></D:supportedlock>',
+			'<D:lockdiscovery/>']
+		if node.is_dir:
+			props.append('<D:resourcetype><D:collection/></D:resourcetype>')
+		else:
+			props.append('<D:resourcetype/>')
+			props.append('<D:getcontentlength>%d</D:getcontentlength>' % node.size)
+			props.append('<D:getcontenttype>application/octet-stream</D:getcontenttype>')
+		if quota:
+			props.append('<D:quota-available-bytes>%d</D:quota-available-bytes>' % (1 << 40))
+			props.append('<D:quota-used-bytes>%d</D:quota-used-bytes>' % (1 << 30))
+		return ('<D:response><D:href>%s</D:href><D:propstat><D:prop>%s</D:prop>'
+			'<D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response>\n' % (escape(href), ''.join(props)))
+
+	def dav_PROPFIND(self):
+		path = self.path_of(self.path)
+		depth = self.headers.get('Depth', 'infinity')
+		with self.tree.lock:
+			(parent, name, node) = self.tree.lookup(path)
+			if node is None:
+				self.reply(404)
+				return
+			if depth == 'infinity' and self.options.no_depth_infinity:
+				self.reply(403)
+				return
+			quota = b'quota' in self.body
+			parts = ['<?xml version="1.0" encoding="utf-8"?>\n<D:multistatus xmlns:D="DAV:">\n']
+
+			def walk(path, node, levels):
+				parts.append(self.response_xml(path, node, quota))
+				if node.is_dir and levels != 0:
+					base = path if path.endswith('/') else path + '/'
+					for (child_name, child) in sorted(node.children.items()):
+						walk(base + child_name, child, levels - 1)
+
+			walk(path, node, {'0': 0, '1': 1}.get(depth, -1))
+			parts.append('</D:multistatus>\n')
+		self.reply(207, ''.join(parts).encode('utf-8'))
+
+	def dav_GET(self):
+		path = self.path_of(self.path)
+		with self.tree.lock:
+			(parent, name, node) = self.tree.lookup(path)
+		if node is None:
+			self.reply(404)
+			return
+		if node.is_dir:
+			self.reply(200, b'<html><body>collection</body></html>', content_type='text/html')
+			return
+		headers = {'ETag': node.etag, 'Last-Modified': http_date(node.mtime), 'Accept-Ranges': 'bytes'}
+		if self.headers.get('If-None-Match') == node.etag:
+			self.reply(304, headers=headers)
+			return
+		start, end, status = 0, node.size, 200
+		ranges = self.headers.get('Range', '')
+		if ranges.startswith('bytes=') and ',' not in ranges:
+			(first, last) = ranges[len('bytes='):].split('-')
+			if first:
+				start = int(first)
+				end = min(int(last) + 1, node.size) if last else node.size
+			else:
+				start = max(node.size - int(last), 0)
+			if start >= node.size:
+				self.reply(416, headers={'Content-Range': 'bytes */%d' % node.size})
+				return
+			status = 206
+			headers['Content-Range'] = 'bytes %d-%d/%d' % (start, end - 1, node.size)
+		self.reply(status, node.read(start, end), headers, content_type='application/octet-stream')
+
+	dav_HEAD = dav_GET
+
+	def check_preconditions(self, node):
+		"""412 if the If-Match / If-None-Match headers don't hold for node (None if it doesn't exist)"""
+		if_match = self.headers.get('If-Match')
+		if if_match and (node is None or (if_match != '*' and if_match != node.etag)):
+			return False
+		if_none_match = self.headers.get('If-None-Match')
+		if if_none_match and node is not None and (if_none_match == '*' or if_none_match == node.etag):
+			return False
+		return True
+
+	def dav_PUT(self):
+		path = self.path_of(self.path)
+		with self.tree.lock:
+			(parent, name, node) = self.tree.lookup(path)
+			if parent is None or not parent.is_dir:
+				self.reply(409)
+				return
+			if node is not None and node.is_dir:
+				self.reply(405)
+				return
+			if not self.check_preconditions(node):
+				self.reply(412)
+				return
+			created = node is None
+			if created:
+				node = parent.children[name] = Node(False)
+			node.data = self.body
+			node.size = len(self.body)
+			node.touch()
+			parent.touch()
+			etag = node.etag
+		self.reply(201 if created else 204, headers={'ETag': etag})
+
+	def dav_DELETE(self):
+		path = self.path_of(self.path)
+		with self.tree.lock:
+			(parent, name, node) = self.tree.lookup(path)
+			if node is None or parent is None:
+				self.reply(404)
+				return
+			if node.is_dir and node.children and self.options.no_recursive_delete:
+				self.reply(403)
+				return
+			del parent.children[name]
+			parent.touch()
+		self.reply(204)
+
+	def dav_MKCOL(self):
+		path = self.path_of(self.path)
+		with self.tree.lock:
+			(parent, name, node) = self.tree.lookup(path)
+			if parent is None or not parent.is_dir:
+				self.reply(409)
+				return
+			if node is not None:
+				self.reply(405)
+				return
+			parent.children[name] = Node(True)
+			parent.touch()
+		self.reply(201)
+
+	def dav_MOVE(self):
+		self.move_or_copy(move=True)
+
+	def dav_COPY(self):
+		self.move_or_copy(move=False)
+
+	def move_or_copy(self, move):
+		source = self.path_of(self.path)
+		destination = self.path_of(self.headers.get('Destination', ''))
+		overwrite = self.headers.get('Overwrite', 'T').upper() != 'F'
+		with self.tree.lock:
+			(source_parent, source_name, node) = self.tree.lookup(source)
+			(parent, name, existing) = self.tree.lookup(destination)
+			if node is None or source_parent is None:
+				self.reply(404)
+				return
+			if parent is None or not parent.is_dir:
+				self.reply(409)
+				return
+			if existing is not None and not overwrite:
+				self.reply(412)
+				return
+			if move:
+				del source_parent.children[source_name]
+				source_parent.touch()
+			else:
+				node = clone(node)
+			parent.children[name] = node
+			parent.touch()
+		self.reply(204 if existing is not None else 201)
+
+	def dav_LOCK(self):
+		path = self.path_of(self.path)
+		token = None
+		if_header = self.headers.get('If', '')
+		with self.tree.lock:
+			if not self.body and '<opaquelocktoken:' in if_header:
+				# refresh
+				token = if_header[if_header.index('<') + 1:if_header.index('>')]
+				if token not in self.tree.locks:
+					self.reply(412)
+					return
+			else:
+				(parent, name, node) = self.tree.lookup(path)
+				if parent is None:
+					self.reply(409)
+					return
+				if path in self.tree.locks.values():
+					self.reply(423)
+					return
+				if node is None:
+					# lock-null resource, as servers of the time created
+					parent.children[name] = Node(False)
+				token = 'opaquelocktoken:%s' % uuid.uuid4()
+				self.tree.locks[token] = path
+		body = ('<?xml version="1.0" encoding="utf-8"?>\n<D:prop xmlns:D="DAV:"><D:lockdiscovery><D:activelock>'
+			'<D:locktype><D:write/></D:locktype><D:lockscope><D:exclusive/></D:lockscope><D:depth>0</D:depth>'
+			'<D:timeout>%s</D:timeout><D:locktoken><D:href>%s</D:href></D:locktoken>'
+			'</D:activelock></D:lockdiscovery></D:prop>\n' % (self.headers.get('Timeout', 'Second-600'), token))
+		self.reply(200, body.encode('utf-8'), headers={'Lock-Token': '<%s>' % token})
+
+	def dav_UNLOCK(self):
+		token = self.headers.get('Lock-Token', '').strip('<>')
+		with self.tree.lock:
+			if self.tree.locks.pop(token, None) is None:
+				self.reply(409)
+				return
+		self.reply(204)
+
+	def dav_PROPPATCH(self):
+		path = self.path_of(self.path)
+		body = ('<?xml version="1.0" encoding="utf-8"?>\n<D:multistatus xmlns:D="DAV:"><D:response>'
+			'<D:href>%s</D:href><D:propstat><D:prop/><D:status>HTTP/1.1 200 OK</D:status></D:propstat>'
+			'</D:response></D:multistatus>\n' % escape(quote(path)))
+		self.reply(207, body.encode('utf-8'))
+
+	def dav_REPORT(self):
+		# no sync-collection: the agent falls back to PROPFIND
+		self.reply(501)
+
+
+def clone(node):
+	copy = Node(node.is_dir, node.size, node.data)
+	if node.is_dir:
+		copy.children = dict((name, clone(child)) for (name, child) in node.children.items())
+	return copy
+
+
+def main(argv):
+	parser = argparse.ArgumentParser(description='In-memory WebDAV server for benchmarking webdavfs.')
+	parser.add_argument('--address', default='127.0.0.1')
+	parser.add_argument('--port', type=int, default=8080)
+
+	group = parser.add_argument_group('tree')
+	group.add_argument('--list-entries', type=int, default=10000, help='files in /list (default %(default)s)')
+	group.add_argument('--tree-width', type=int, default=4, help='directories per level in /tree (default %(default)s)')
+	group.add_argument('--tree-depth', type=int, default=3, help='levels of directories in /tree (default %(default)s)')
+	group.add_argument('--tree-files', type=int, default=16, help='files in each /tree directory (default %(default)s)')
+	group.add_argument('--file-size', type=int, default=4096, help='bytes in each generated file (default %(default)s)')
+	group.add_argument('--blob-size', type=int, default=64 << 20, help='bytes in /data/blob (default %(default)s)')
+
+	group = parser.add_argument_group('network')
+	group.add_argument('--latency', type=float, default=0, help='milliseconds added to every request')
+	group.add_argument('--bandwidth', type=int, default=0, help='bytes per second each body is sent or received at (0 for no limit)')
+	group.add_argument('--no-keepalive', dest='keepalive', action='store_false', help='close the connection after every response')
+	group.add_argument('--keepalive-requests', type=int, default=0, help='close a connection after this many responses (0 for no limit)')
+	group.add_argument('--keepalive-timeout', type=float, default=0, help='seconds an idle connection is kept (0 for no limit)')
+
+	group = parser.add_argument_group('errors')
+	group.add_argument('--error-rate', type=float, default=0, help='fraction of requests answered with --error-status')
+	group.add_argument('--error-status', type=int, default=503)
+	group.add_argument('--drop-rate', type=float, default=0, help='fraction of requests whose connection is dropped unanswered')
+	group.add_argument('--error-methods', type=lambda value: value.upper().split(','), default=None,
+		help='comma separated methods the errors apply to (default all)')
+	group.add_argument('--no-recursive-delete', action='store_true', help='refuse (403) to DELETE collections that are not empty')
+	group.add_argument('--no-depth-infinity', action='store_true', help='refuse (403) Depth infinity PROPFINDs')
+
+	parser.add_argument('--seed', type=int, default=None, help='random seed for error injection')
+	parser.add_argument('--verbose', action='store_true', help='log every request')
+	options = parser.parse_args(argv)
+
+	random.seed(options.seed)
+	Handler.options = options
+	Handler.tree = Tree(options)
+
+	server = ThreadingHTTPServer((options.address, options.port), Handler)
+	server.daemon_threads = True
+	sys.stderr.write('webdav_standin: %d objects at http://%s:%d/\n' %
+		(Handler.tree.count(Handler.tree.root), options.address, server.server_address[1]))
+	try:
+		server.serve_forever()
+	except KeyboardInterrupt:
+		pass
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv[1:]))
@@ -81,24 +81,29 @@
 #define WEBDAV_WRITESEQ			28
 #define WEBDAV_DUMP_COOKIES		29
 #define WEBDAV_CLEAR_COOKIES	30
+#define WEBDAV_DUMP_STATS		31
+#define WEBDAV_DUMP_TRACE		32
+#define WEBDAV_CLEAR_STATS		33
+#define WEBDAV_WARMUP			34
+#define WEBDAV_EMPTYDIR			35
+#define WEBDAV_LOOKUP_PATH		36
 
 /* Webdav file type constants */
 #define WEBDAV_FILE_TYPE		1
 #define WEBDAV_DIR_TYPE			2
 
-/* The WEBDAV_MAX_IO_BUFFER_SIZE gates how many bytes we
- * will try to read with a byte range request to the server.
- * Because sockets are only so big we can't transfer 8192 bytes.
- * That many bytes won't fit in a buffer so rather than having
- * webdav_sendmsg wait for all data, it would have to loop.	 Limiting
- * at 8000 works (based on emprical study on Darwin). If you are porting
- * this code to another platform or if the default socket buffer size
- * changes you may need to change this constan to implement the looping.
- * None of this would be necessary if Darwin's soreserve actually did reserve
- * space rather than just enforcing limits
+/* The WEBDAV_MAX_IO_BUFFER_SIZE limits how many bytes one WEBDAV_READ
+ * asks for with a byte range request to the server. A reply that size
+ * doesn't fit in the local socket's buffer (PIPSIZ) and MSG_WAITALL alone
+ * doesn't wait for all of it, so webdav_sendmsg keeps receiving until the
+ * whole reply is in; the limit only bounds the kernel buffer
+ * webdav_read_bytes allocates. Larger reads are split into
+ * several WEBDAV_READs. mount_webdav fetches more than it is asked for
+ * (see READ_AHEAD_WINDOW_MAX) so the WEBDAV_READs that follow usually
+ * don't go to the server.
  */
  
-#define WEBDAV_MAX_IO_BUFFER_SIZE 8000	/* Gates byte read optimization */
+#define WEBDAV_MAX_IO_BUFFER_SIZE (1024 * 1024)	/* Gates byte read optimization */
 
 /* Shared (kernel & processs) WebDAV structures */
 
@@ -209,6 +214,7 @@ struct webdav_args
 /* Defines for webdav_args pa_flags field */
 #define WEBDAV_SUPPRESSALLUI	0x00000001		/* SuppressAllUI flag */
 #define WEBDAV_SECURECONNECTION	0x00000002		/* Secure connection flag (the connection to the server is secure) */
+#define WEBDAV_TREEDELETES		0x00000004		/* rmdir and rename delete what's in a directory that isn't empty (treedelete option) */
 
 /* Defines for webdav_args pa_server_ident field */
 #define WEBDAV_MICROSOFT_IIS_SERVER	0x00000002
@@ -246,6 +252,23 @@ struct webdav_reply_lookup
 	off_t			obj_filesize;		/* filesize of object */
 };	
 
+/* WEBDAV_LOOKUP_PATH */
+#define WEBDAV_LOOKUP_PATH_MAX_COMPONENTS	8	/* the most components resolved by one WEBDAV_LOOKUP_PATH */
+
+struct webdav_request_lookup_path
+{
+	struct webdav_cred pcr;				/* user and groups */
+	opaque_id		dir_id;				/* directory the path starts in */
+	uint32_t		path_length;		/* length of path (no more than NAME_MAX) */
+	char			path[];				/* '/' separated components to find -- no empty, "." or ".." components */
+};
+
+struct webdav_reply_lookup_path
+{
+	uint32_t		count;				/* number of components resolved, starting with the first */
+	struct webdav_reply_lookup components[WEBDAV_LOOKUP_PATH_MAX_COMPONENTS]; /* the objects found */
+};
+
 /* WEBDAV_CREATE */
 struct webdav_request_create
 {
@@ -290,6 +313,7 @@ struct webdav_request_open
 struct webdav_reply_open
 {
 	pid_t			pid;				/* process ID of file system daemon (for matching to ref's pid) */
+	int				writeseq;			/* TRUE if writes may be streamed to the server as they happen (see WEBDAV_WRITESEQ) */
 };
 
 /* WEBDAV_CLOSE */
@@ -332,6 +356,7 @@ struct webdav_request_getattr
 struct webdav_reply_getattr
 {
 	struct webdav_stat	obj_attr;			/* attributes for the object */
+	uint32_t		attr_timeout;		/* seconds the kernel may use obj_attr without asking again, or 0 if it must not cache them */
 };
 
 /* WEBDAV_SETATTR XXX not needed at this time */
@@ -352,7 +377,7 @@ struct webdav_request_read
 	struct webdav_cred pcr;				/* user and groups */
 	opaque_id		obj_id;				/* opaque_id of file object */
 	off_t			offset;				/* position within the file object at which the read is to begin */
-	uint64_t		count;				/* number of bytes of data to be read (limited to WEBDAV_MAX_IO_BUFFER_SIZE (8000-bytes)) */
+	uint64_t		count;				/* number of bytes of data to be read (limited to WEBDAV_MAX_IO_BUFFER_SIZE) */
 };
 
 struct webdav_reply_read
@@ -365,7 +390,7 @@ struct webdav_request_write
 	struct webdav_cred pcr;				/* user and groups */
 	opaque_id		obj_id;				/* opaque_id of file object */
 	off_t			offset;				/* position within the file object at which the write is to begin */
-	uint64_t		count;				/* number of bytes of data to be written (limited to WEBDAV_MAX_IO_BUFFER_SIZE (8000-bytes)) */
+	uint64_t		count;				/* number of bytes of data to be written (limited to WEBDAV_MAX_IO_BUFFER_SIZE) */
 	char			data[];				/* data to be written to the file object */
 };
 
@@ -433,6 +458,23 @@ struct webdav_request_readdir
 
 struct webdav_reply_readdir
 {
+	uint64_t		dirent_size;		/* bytes of directory entries at the start of the cache file, or 0 if it's all entries */
+	uint32_t		dirattr_count;		/* number of webdav_dirattr records following the entries */
+	uid_t			dirattr_uid;		/* the user the webdav_dirattr records were written for */
+};
+
+/*
+ * Readdir-plus record. mount_webdav writes one per directory entry after "."
+ * and "..", in the same order as the entries, after the entries in the
+ * directory's cache file. webdav_vnop_readdir uses them to set up the
+ * entries' vnodes and cached attributes, so a long listing doesn't need a
+ * WEBDAV_LOOKUP and WEBDAV_GETATTR per entry.
+ */
+struct webdav_dirattr
+{
+	struct webdav_reply_lookup lookup;	/* what WEBDAV_LOOKUP would return for the entry */
+	struct webdav_stat	attr;			/* what WEBDAV_GETATTR would return for the entry */
+	uint32_t		attr_timeout;		/* seconds attr may be used without asking again, or 0 to ignore this record */
 };
 
 /* WEBDAV_STATFS */
@@ -494,12 +536,54 @@ struct webdav_reply_cookies {
 	
 };
 
+/* WEBDAV_DUMP_STATS */
+/* WEBDAV_CLEAR_STATS */
+struct webdav_request_stats {
+	struct webdav_cred pcr;				/* user and groups */
+};
+
+struct webdav_reply_stats {
+
+};
+
+/* WEBDAV_DUMP_TRACE */
+struct webdav_request_trace {
+	struct webdav_cred pcr;				/* user and groups */
+};
+
+struct webdav_reply_trace {
+
+};
+
+/* WEBDAV_WARMUP */
+struct webdav_request_warmup
+{
+	struct webdav_cred pcr;				/* user and groups */
+	opaque_id		dir_id;				/* directory whose subtree is to be warmed up */
+	uint32_t		depth;				/* number of levels below dir_id to warm up, or 0 for all of them */
+};
+
+struct webdav_reply_warmup
+{
+};
+
+/* WEBDAV_EMPTYDIR */
+struct webdav_request_emptydir
+{
+	struct webdav_cred pcr;				/* user and groups */
+	opaque_id		dir_id;				/* directory whose contents are to be deleted */
+};
+
+struct webdav_reply_emptydir
+{
+};
+
 struct webdav_request_writeseq
 {
 	struct webdav_cred pcr;				/* user and groups */
 	opaque_id		obj_id;				/* opaque_id of file object */
 	off_t			offset;				/* position within the file object at which the write is to begin */
-	off_t			count;				/* number of bytes of data to be written (limited to WEBDAV_MAX_IO_BUFFER_SIZE (8000-bytes)) */
+	off_t			count;				/* number of bytes of data to be written (limited to WEBDAV_MAX_IO_BUFFER_SIZE) */
 	uint64_t		file_len;			/* length of the file after all sequential writes are done */
 	uint32_t		is_retry;			/* non-zero indicates this request is a retry due to an EPIPE */
 };
@@ -527,6 +611,9 @@ union webdav_request
 	struct webdav_request_statfs	statfs;
 	struct webdav_request_invalcaches invalcaches;
 	struct webdav_request_writeseq  writeseq;
+	struct webdav_request_warmup	warmup;
+	struct webdav_request_emptydir	emptydir;
+	struct webdav_request_lookup_path lookup_path;
 };
 
 union webdav_reply
@@ -547,6 +634,7 @@ union webdav_reply
 	struct webdav_reply_statfs		statfs;
 	struct webdav_reply_invalcaches	invalcaches;
 	struct webdav_reply_writeseq	writeseq;
+	struct webdav_reply_lookup_path	lookup_path;
 };
 
 #define UNKNOWNUID ((uid_t)99)
@@ -573,6 +661,37 @@ union webdav_reply
 #define	WEBDAVIOC_INVALIDATECACHES	_IO('w', 1)
 #define	WEBDAV_INVALIDATECACHES		IOCBASECMD(WEBDAVIOC_INVALIDATECACHES)
 
+/*
+ * The WEBDAVIOC_WARMUP command passed to fsctl(2) on a directory causes
+ * mount_webdav to fetch the attributes of everything below the directory
+ * (depth levels down, or all of them if depth is 0) into its caches, so a tree
+ * walk that follows (find, rsync, a backup) is answered without a round trip
+ * per directory. fsctl returns as soon as the warm-up has started.
+ * example:
+ *	struct WebdavWarmup req;
+ *	req.depth = 0;
+ *	result = fsctl(path, WEBDAVIOC_WARMUP, &req, 0);
+ */
+struct WebdavWarmup {
+	uint32_t depth;
+};
+
+#define	WEBDAVIOC_WARMUP			_IOW('w', 2, struct WebdavWarmup)
+#define	WEBDAV_WARMUP_SUBTREE		IOCBASECMD(WEBDAVIOC_WARMUP)
+
+/*
+ * The WEBDAVIOC_EMPTY_DIRECTORY command passed to fsctl(2) on a directory
+ * causes mount_webdav to delete everything in the directory, leaving it empty
+ * so it can be removed with rmdir(2). Collections are deleted with a single
+ * DELETE when the server allows it and are walked otherwise. fsctl returns
+ * when the directory is empty or an error stopped the delete; on error, some
+ * of the directory's contents may already be gone.
+ * example:
+ * result = fsctl(path, WEBDAVIOC_EMPTY_DIRECTORY, NULL, 0);
+ */
+#define	WEBDAVIOC_EMPTY_DIRECTORY	_IO('w', 3)
+#define	WEBDAV_EMPTY_DIRECTORY		IOCBASECMD(WEBDAVIOC_EMPTY_DIRECTORY)
+
 /*
  * The WEBDAVIOC_WRITE_SEQUENTIAL command passed to fsctl(2) causes WebDAV FS to
  * enable Write Sequential mode on a vnode that is opened for writing.
@@ -608,6 +727,34 @@ struct WebdavWriteSequential {
 #define WEBDAVIOC_RESET_COOKIES		_IOW('x', 28, int)
 #define WEBDAV_RESET_COOKIES		IOCBASECMD(WEBDAVIOC_RESET_COOKIES)
 
+/*
+ * The WEBDAVIOC_SHOW_STATS command passed to fsctl(2) causes webdavfs_agent to
+ * write its per-operation and per-HTTP-method counters and latency histograms
+ * to the system log, one "webdav_stats key=value ..." line per entry.
+ * example:
+ * result = fsctl(path, WEBDAVIOC_SHOW_STATS, &dummy, 0);
+ */
+#define WEBDAVIOC_SHOW_STATS		_IOW('x', 30, int)
+#define WEBDAV_SHOW_STATS			IOCBASECMD(WEBDAVIOC_SHOW_STATS)
+
+/*
+ * The WEBDAVIOC_RESET_STATS command passed to fsctl(2) zeroes the statistics
+ * shown by WEBDAVIOC_SHOW_STATS, so a workload can be measured in isolation:
+ * reset, run the workload, then show.
+ */
+#define WEBDAVIOC_RESET_STATS		_IOW('x', 32, int)
+#define WEBDAV_RESET_STATS			IOCBASECMD(WEBDAVIOC_RESET_STATS)
+
+/*
+ * The WEBDAVIOC_SHOW_TRACE command passed to fsctl(2) causes webdavfs_agent to
+ * decode its recent request and HTTP transaction history into a timeline in
+ * the system log ("webdav_trace ..." lines).
+ * example:
+ * result = fsctl(path, WEBDAVIOC_SHOW_TRACE, &dummy, 0);
+ */
+#define WEBDAVIOC_SHOW_TRACE		_IOW('x', 31, int)
+#define WEBDAV_SHOW_TRACE			IOCBASECMD(WEBDAVIOC_SHOW_TRACE)
+
 /*
  * Sysctl values for WebDAV FS
  */
@@ -638,6 +785,7 @@ struct webdavmount
 	struct sockaddr *pm_socket_name;			/* Socket to server name */
 	struct webdav_statfs pm_statfsbuf;			/* cached statfs data */
 	time_t pm_statfstime;						/* sm_statfsbuf cache time */
+	u_int32_t pm_attr_generation;				/* incremented to invalidate every webdavnode's pt_attr */
 	u_int32_t pm_open_connections;				/* number of connections opened to user-land server */
 	u_int32_t pm_server_ident;					/* identifies some (not all) types of servers we are connected to */
 	off_t pm_dir_size;							/* size of directories */
@@ -674,7 +822,16 @@ struct webdavnode
 	struct webdav_timespec64 pt_mtime_old;				/* previous pt_mtime value (directory nodes only, used for negative name cache) */
 	struct webdav_timespec64 pt_timestamp_refresh;		/* time of last timestamp refresh */
 	
+	/* attribute cache (see webdav_getattr_common) */
+	struct webdav_stat pt_attr;					/* attributes from the last WEBDAV_GETATTR reply */
+	uint64_t pt_attr_expire;					/* uptime in seconds when pt_attr expires, or 0 if pt_attr isn't valid */
+	u_int32_t pt_attr_generation;				/* pm_attr_generation when pt_attr was cached */
+	uid_t pt_attr_uid;							/* uid pt_attr was fetched for (the server may answer each user differently) */
+	
 	off_t pt_filesize;							/* what we think the filesize is */
+	off_t pt_dirent_size;						/* bytes of entries in a directory's cache file, or 0 if it's all entries */
+	u_int32_t pt_dirattr_count;					/* readdir-plus records following the entries in a directory's cache file */
+	uid_t pt_dirattr_uid;						/* uid the readdir-plus records were written for */
 	u_int32_t pt_status;						/* WEBDAV_DIRTY, etc */
 	u_int32_t pt_opencount;						/* reference count of opens */
 	
@@ -683,6 +840,7 @@ struct webdavnode
 	u_int32_t pt_writeseq_enabled;				/* TRUE if node Write Sequential mode is enabled */
 	off_t pt_writeseq_offset;				/* offset we're expecting for the next write */
 	uint64_t pt_writeseq_len;				/* total length in bytes that will be written in Write Sequential mode */
+	u_int32_t pt_writeseq_auto;				/* TRUE if open turned on Write Sequential mode -- it falls back to an fsync at close */
 		
 	/* SMP debug variables */
 	void *pt_lastvop;							/* tracks last operation that locked this webdavnode */
@@ -727,6 +885,7 @@ struct open_associatecachefile
 #define WEBDAV_MOUNT_SUPPRESS_ALL_UI 0x00000020	/* suppress UI when connection is lost */
 #define WEBDAV_MOUNT_CONNECTION_WANTED 0x000000040 /* wakeup is wanted to start another connection with user-land server */
 #define WEBDAV_MOUNT_SECURECONNECTION 0x000000080 /* the connection to the server is secure */
+#define WEBDAV_MOUNT_TREE_DELETES 0x000000100	/* rmdir and rename may delete a directory tree, so they aren't timed out */
 
 /* Webdav sizes for statfs */
 
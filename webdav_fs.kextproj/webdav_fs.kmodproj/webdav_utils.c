@@ -56,6 +56,32 @@ __private_extern__ void webdav_unlock(struct webdavnode *pt)
 	pt->pt_lockState = 0;
 }
 
+/*****************************************************************************/
+/*
+ * Upgrade a shared lock on a webdavnode to an exclusive lock. If it can't be
+ * upgraded in place, the shared lock is dropped before the exclusive lock is
+ * taken, so the webdavnode may have changed in between.
+ */
+__private_extern__ void webdav_lock_upgrade(struct webdavnode *pt)
+{
+	if ( !lck_rw_lock_shared_to_exclusive(&pt->pt_rwlock) )
+	{
+		/* the shared lock is gone */
+		lck_rw_lock_exclusive(&pt->pt_rwlock);
+	}
+	pt->pt_lockState = WEBDAV_EXCLUSIVE_LOCK;
+}
+
+/*****************************************************************************/
+/*
+ * Downgrade an exclusive lock on a webdavnode to a shared lock
+ */
+__private_extern__ void webdav_lock_downgrade(struct webdavnode *pt)
+{
+	lck_rw_lock_exclusive_to_shared(&pt->pt_rwlock);
+	pt->pt_lockState = WEBDAV_SHARED_LOCK;
+}
+
 void timespec_to_webdav_timespec64(struct timespec ts, struct webdav_timespec64 *wts)
 {
 	wts->tv_sec = ts.tv_sec;
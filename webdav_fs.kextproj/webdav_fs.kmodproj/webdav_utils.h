@@ -31,6 +31,8 @@ enum webdavlocktype  {WEBDAV_SHARED_LOCK = 1, WEBDAV_EXCLUSIVE_LOCK = 2};
 /* single */
 int webdav_lock(struct webdavnode *pt, enum webdavlocktype locktype);
 void webdav_unlock(struct webdavnode *pt);
+void webdav_lock_upgrade(struct webdavnode *pt);
+void webdav_lock_downgrade(struct webdavnode *pt);
 
 // convert standard timespec to webdav_timespec_64
 void timespec_to_webdav_timespec64(struct timespec ts, struct webdav_timespec64 *wts);
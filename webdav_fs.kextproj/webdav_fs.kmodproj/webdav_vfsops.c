@@ -316,6 +316,11 @@ static int webdav_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_c
 		/* the connection to the server is secure */
 		fmp->pm_status |= WEBDAV_MOUNT_SECURECONNECTION;
 	}
+	if ( args.pa_flags & WEBDAV_TREEDELETES )
+	{
+		/* rmdir and rename may have to delete a directory tree first */
+		fmp->pm_status |= WEBDAV_MOUNT_TREE_DELETES;
+	}
 	
 	fmp->pm_server_ident = args.pa_server_ident;
 	fmp->pm_uid = args.pa_uid;
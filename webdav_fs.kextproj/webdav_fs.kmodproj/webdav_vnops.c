@@ -186,6 +186,28 @@ void webdav_up(struct webdavmount *fmp)
 	   
 /*****************************************************************************/
 
+/* moves msg's iovecs past the len bytes already received into them */
+static void webdav_msg_advance(struct msghdr *msg, size_t len)
+{
+	while ( (len != 0) && (msg->msg_iovlen != 0) )
+	{
+		if ( len < msg->msg_iov->iov_len )
+		{
+			msg->msg_iov->iov_base = (caddr_t)msg->msg_iov->iov_base + len;
+			msg->msg_iov->iov_len -= len;
+			len = 0;
+		}
+		else
+		{
+			len -= msg->msg_iov->iov_len;
+			++msg->msg_iov;
+			--msg->msg_iovlen;
+		}
+	}
+}
+
+/*****************************************************************************/
+
 /*
  * webdav_sendmsg is used to communicate with the userland half of the file
  * system.
@@ -220,6 +242,7 @@ int webdav_sendmsg(int vnop, struct webdavmount *fmp,
 	struct timeval lasttrytime;
 	struct timeval currenttime;
 	size_t iolen;
+	size_t received;
 	uint32_t num_rcv_timeouts;
 
 	if ( fmp == NULL )
@@ -363,6 +386,14 @@ again:
 		msg.msg_iov = aiov;
 		msg.msg_iovlen = (replysize == 0 ? 1 : 2);
 		
+		/*
+		 * A reply bigger than the socket buffer (PIPSIZ) arrives in pieces, and
+		 * with the receive timeout set, sock_receive can return with only some of
+		 * them even with MSG_WAITALL. Keep receiving until the whole reply is in.
+		 * Only a failed request's reply may be cut short (mount_webdav doesn't
+		 * send the reply struct with some errors).
+		 */
+		received = 0;
 		num_rcv_timeouts = 0;
 		while ( TRUE )
 		{
@@ -373,23 +404,48 @@ again:
 				break;
 			}
 			
+			iolen = 0;
 			error = sock_receive(so, &msg, MSG_WAITALL, &iolen);
 			
+			if ( (error == 0) || ((error == EWOULDBLOCK) && (iolen != 0)) )
+			{
+				received += iolen;
+				if ( received == (sizeof(*result) + replysize) )
+				{
+					/* got all of the reply */
+					error = 0;
+					break;
+				}
+				if ( iolen == 0 )
+				{
+					/* mount_webdav closed the connection */
+					if ( (received < sizeof(*result)) || ((*result & ~WEBDAV_CONNECTION_DOWN_MASK) == 0) )
+					{
+						printf("webdav_sendmsg: sock_receive() short reply %lu of %lu bytes\n",
+							(unsigned long)received, (unsigned long)(sizeof(*result) + replysize));
+						error = EIO;
+					}
+					break;
+				}
+				/* get the rest */
+				webdav_msg_advance(&msg, iolen);
+				continue;
+			}
+			
 			/* did sock_receive timeout? */
 			if (error != EWOULDBLOCK)
 			{
 				/* sock_receive did not time out */
-				if ( error != 0 )
-				{
-					printf("webdav_sendmsg: sock_receive() = %d\n", error);
-				}
+				printf("webdav_sendmsg: sock_receive() = %d\n", error);
 				break;
 			}
 			else {
 				/* sock_receive DID time out */
 				if ( (++num_rcv_timeouts == WEBDAV_MAX_SOCK_RCV_TIMEOUTS ) &&
 				     (vnop != WEBDAV_WRITE) && (vnop != WEBDAV_READ) &&
-					 (vnop != WEBDAV_FSYNC) && (vnop != WEBDAV_WRITESEQ) ) {
+					 (vnop != WEBDAV_FSYNC) && (vnop != WEBDAV_WRITESEQ) &&
+					 (vnop != WEBDAV_EMPTYDIR) &&
+					 !(((vnop == WEBDAV_RMDIR) || (vnop == WEBDAV_RENAME)) && (fmp->pm_status & WEBDAV_MOUNT_TREE_DELETES)) ) {
 						// This vnop has timed out.
 						printf("webdav_sendmsg: sock_receive() timeout. vnop: %d\n", vnop);
 						error = ETIMEDOUT;
@@ -559,6 +615,169 @@ int webdav_lookup(struct vnop_lookup_args *ap, struct webdav_reply_lookup *reply
 
 /*****************************************************************************/
 
+/*
+ * webdav_lookup_path_length
+ *
+ * Returns the length of the part of the path, starting with cnp's component,
+ * that can be resolved with one WEBDAV_LOOKUP_PATH message, or 0 if only cnp's
+ * component can be looked up. The path stops before empty, "." and ".."
+ * components, and before the last component of a create, delete or rename
+ * (which must be looked up on its own).
+ */
+static uint32_t webdav_lookup_path_length(struct componentname *cnp, struct webdavmount *fmp)
+{
+	char *path;
+	char *component;
+	char *end;
+	char *limit;
+	size_t length;
+	uint32_t count;
+	
+	if ( cnp->cn_flags & (ISLASTCN | ISDOTDOT) )
+	{
+		return ( 0 );
+	}
+	
+	path = cnp->cn_nameptr;
+	limit = cnp->cn_pnbuf + cnp->cn_pnlen;
+	end = path + cnp->cn_namelen;
+	count = 1;
+	while ( (count < WEBDAV_LOOKUP_PATH_MAX_COMPONENTS) && ((end + 1) < limit) && (*end == '/') )
+	{
+		component = end + 1;
+		length = 0;
+		while ( ((component + length) < limit) && (component[length] != '\0') && (component[length] != '/') )
+		{
+			++length;
+		}
+		
+		if ( (length == 0) || (length > (size_t)fmp->pm_name_max) ||
+			 ((length == 1) && (component[0] == '.')) ||
+			 ((length == 2) && (component[0] == '.') && (component[1] == '.')) )
+		{
+			break;
+		}
+		if ( (cnp->cn_nameiop != LOOKUP) &&
+			 (((component + length) == limit) || (component[length] != '/')) )
+		{
+			break;
+		}
+		if ( (component + length - path) > NAME_MAX )
+		{
+			break;
+		}
+		
+		end = component + length;
+		++count;
+	}
+	
+	return ( (count > 1) ? (uint32_t)(end - path) : 0 );
+}
+
+/*****************************************************************************/
+
+static
+int webdav_lookup_path(struct vnop_lookup_args *ap, uint32_t path_length, struct webdav_reply_lookup_path *reply_lookup_path)
+{
+	int error;
+	int server_error;
+	struct webdav_request_lookup_path request_lookup_path;
+	
+	/* set up the request */
+	webdav_copy_creds(ap->a_context, &request_lookup_path.pcr);
+	request_lookup_path.dir_id = VTOWEBDAV(ap->a_dvp)->pt_obj_id;
+	request_lookup_path.path_length = path_length;
+
+	server_error = 0;
+	bzero(reply_lookup_path, sizeof(struct webdav_reply_lookup_path));
+	
+	error = webdav_sendmsg(WEBDAV_LOOKUP_PATH, VFSTOWEBDAV(vnode_mount(ap->a_dvp)),
+		&request_lookup_path, offsetof(struct webdav_request_lookup_path, path), 
+		ap->a_cnp->cn_nameptr, path_length,
+		&server_error, reply_lookup_path, sizeof(struct webdav_reply_lookup_path));
+	if ( (error == 0) && (server_error != 0) )
+	{
+		if ( server_error == ESTALE )
+		{
+			/*
+			 * The object id(s) passed to userland are invalid.
+			 * Purge the vnode(s) and restart the request.
+			 */
+			webdav_purge_stale_vnode(ap->a_dvp);
+			error = ERESTART;
+		}
+		else
+		{
+			error = server_error;
+		}
+	}
+	else if ( (error == 0) && (reply_lookup_path->count == 0) )
+	{
+		/* shouldn't happen, but don't use a reply without any components */
+		error = EIO;
+	}
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * The kernel attribute cache. mount_webdav's WEBDAV_GETATTR reply says how
+ * long its answer stays good (attr_timeout), and until then
+ * webdav_getattr_common answers from pt_attr without a round trip to
+ * userland. Operations that change an object or its parent directory on the
+ * server invalidate the cached attributes of both; invalidating the caches of
+ * the whole mount increments pm_attr_generation.
+ *
+ * The server may answer each user differently (or not at all), so pt_attr
+ * only answers the uid it was fetched for. pt_attr is only written with the
+ * webdavnode locked exclusive.
+ */
+static int webdav_attr_cache_valid(struct webdavmount *fmp, struct webdavnode *pt, uid_t uid)
+{
+	struct timeval tv;
+	
+	if ( (pt->pt_attr_expire == 0) || (pt->pt_attr_generation != fmp->pm_attr_generation) || (pt->pt_attr_uid != uid) )
+	{
+		return ( FALSE );
+	}
+	
+	microuptime(&tv);
+	return ( (uint64_t)tv.tv_sec < pt->pt_attr_expire );
+}
+
+/*****************************************************************************/
+
+static void webdav_attr_cache_update(struct webdavmount *fmp, struct webdavnode *pt, uid_t uid, struct webdav_reply_getattr *reply_getattr)
+{
+	struct timeval tv;
+	
+	if ( reply_getattr->attr_timeout == 0 )
+	{
+		pt->pt_attr_expire = 0;
+		return;
+	}
+	
+	microuptime(&tv);
+	pt->pt_attr = reply_getattr->obj_attr;
+	pt->pt_attr_uid = uid;
+	pt->pt_attr_generation = fmp->pm_attr_generation;
+	pt->pt_attr_expire = (uint64_t)tv.tv_sec + reply_getattr->attr_timeout;
+}
+
+/*****************************************************************************/
+
+static void webdav_attr_cache_invalidate(vnode_t vp)
+{
+	if ( vp != NULLVP )
+	{
+		VTOWEBDAV(vp)->pt_attr_expire = 0;
+	}
+}
+
+/*****************************************************************************/
+
 /*
  * webdav_getattr_common
  *
@@ -568,6 +787,8 @@ int webdav_lookup(struct vnop_lookup_args *ap, struct webdav_reply_lookup *reply
  *
  * Note: This routine does not lock the webdavnode associated with vp.
  *       A shared lock MUST be held on the webdavnode 'vp' before calling this routine.
+ *       It is upgraded to exclusive (and possibly dropped and retaken) while
+ *       a WEBDAV_GETATTR reply is stored in pt_attr.
  *
  * results:
  *	0		Success.
@@ -585,6 +806,7 @@ static int webdav_getattr_common(vnode_t vp, struct vnode_attr *vap, vfs_context
 	int server_error;
 	int cache_vap_valid;
 	int need_attr_times, need_attr_size;
+	uid_t uid;
 	struct webdav_request_getattr request_getattr;
 	struct webdav_reply_getattr reply_getattr;
 		
@@ -690,7 +912,13 @@ static int webdav_getattr_common(vnode_t vp, struct vnode_attr *vap, vfs_context
 		}
 	}
 	
-	if ( cache_vap_valid == FALSE )
+	uid = kauth_cred_getuid(vfs_context_ucred(a_context));
+	if ( (cache_vap_valid == FALSE) && webdav_attr_cache_valid(fmp, pt, uid) )
+	{
+		/* the attributes from the last WEBDAV_GETATTR haven't expired yet */
+		reply_getattr.obj_attr = pt->pt_attr;
+	}
+	else if ( cache_vap_valid == FALSE )
 	{
 		/* get the server file's information */
 		webdav_copy_creds(a_context, &request_getattr.pcr);
@@ -720,6 +948,11 @@ static int webdav_getattr_common(vnode_t vp, struct vnode_attr *vap, vfs_context
 		{
 			goto bad;
 		}
+		
+		/* the caller only holds a shared lock */
+		webdav_lock_upgrade(pt);
+		webdav_attr_cache_update(fmp, pt, uid, &reply_getattr);
+		webdav_lock_downgrade(pt);
 	}
 
 	// Timestamp Attributes
@@ -898,6 +1131,7 @@ int webdav_get(
 	nanotime(&ts);
 	timespec_to_webdav_timespec64(ts, &new_pt->pt_timestamp_refresh);
 	new_pt->pt_filesize = obj_filesize;
+	new_pt->pt_attr_expire = 0;
 	new_pt->pt_opencount = 0;
 		
 	/* Create the vnode */
@@ -956,6 +1190,79 @@ int webdav_get(
 
 /*****************************************************************************/
 
+/*
+ * webdav_lookup_ahead
+ *
+ * Creates vnodes for the components after cnp's that a WEBDAV_LOOKUP_PATH
+ * resolved, and enters them in the name cache, so namei finds them there
+ * instead of calling webdav_vnop_lookup (and mount_webdav) for each one.
+ * vp is the vnode for cnp's component. Failures just end the look ahead.
+ */
+static void webdav_lookup_ahead(vnode_t vp, struct componentname *cnp, struct webdav_reply_lookup_path *reply_lookup_path)
+{
+	struct componentname cn;
+	struct webdav_reply_lookup *reply_lookup;
+	vnode_t dvp;
+	vnode_t child;
+	char *name;
+	uint32_t index;
+	int error;
+	
+	dvp = vp;
+	name = cnp->cn_nameptr + cnp->cn_namelen + 1;
+	for ( index = 1; index < reply_lookup_path->count; ++index )
+	{
+		if ( !vnode_isdir(dvp) )
+		{
+			break;
+		}
+		
+		reply_lookup = &reply_lookup_path->components[index];
+		
+		bzero(&cn, sizeof(struct componentname));
+		cn.cn_nameiop = LOOKUP;
+		cn.cn_flags = MAKEENTRY;
+		cn.cn_nameptr = name;
+		cn.cn_namelen = 0;
+		while ( (name[cn.cn_namelen] != '\0') && (name[cn.cn_namelen] != '/') )
+		{
+			++cn.cn_namelen;
+		}
+		
+		webdav_lock(VTOWEBDAV(dvp), WEBDAV_EXCLUSIVE_LOCK);
+		error = webdav_get(vnode_mount(dvp), dvp, 0, &cn, reply_lookup->obj_id, reply_lookup->obj_fileid,
+			(reply_lookup->obj_type == WEBDAV_FILE_TYPE) ? VREG : VDIR,
+			reply_lookup->obj_atime, reply_lookup->obj_mtime, reply_lookup->obj_ctime,
+			reply_lookup->obj_createtime, reply_lookup->obj_filesize, &child);
+		if ( error == 0 )
+		{
+			webdav_unlock(VTOWEBDAV(child));
+		}
+		webdav_unlock(VTOWEBDAV(dvp));
+		
+		/* release the intermediate vnodes -- the name cache has them now */
+		if ( dvp != vp )
+		{
+			vnode_put(dvp);
+		}
+		if ( error != 0 )
+		{
+			dvp = vp;
+			break;
+		}
+		
+		dvp = child;
+		name += cn.cn_namelen + 1;
+	}
+	
+	if ( dvp != vp )
+	{
+		vnode_put(dvp);
+	}
+}
+
+/*****************************************************************************/
+
 /*
  *
  */
@@ -984,9 +1291,13 @@ static int webdav_vnop_lookup(struct vnop_lookup_args *ap)
 	int nameiop;
 	int error;
 	struct webdav_reply_lookup reply_lookup;
+	struct webdav_reply_lookup_path *reply_lookup_path;
+	uint32_t path_length;
 	struct webdavnode *pt;
 
 	START_MARKER("webdav_vnop_lookup");
+	
+	reply_lookup_path = NULL;
 
 	vpp = ap->a_vpp;
 	dvp = ap->a_dvp;
@@ -1103,7 +1414,24 @@ static int webdav_vnop_lookup(struct vnop_lookup_args *ap)
 					webdav_lock(pt_dvp, WEBDAV_EXCLUSIVE_LOCK);
 					pt_dvp->pt_lastvop = webdav_vnop_lookup;
 					
-					error = webdav_lookup(ap, &reply_lookup);
+					/* resolve as much of the rest of the path as we can in the same round trip */
+					path_length = webdav_lookup_path_length(cnp, fmp);
+					if ( path_length != 0 )
+					{
+						MALLOC(reply_lookup_path, struct webdav_reply_lookup_path *, sizeof(struct webdav_reply_lookup_path), M_TEMP, M_WAITOK);
+					}
+					if ( reply_lookup_path != NULL )
+					{
+						error = webdav_lookup_path(ap, path_length, reply_lookup_path);
+						if ( error == 0 )
+						{
+							reply_lookup = reply_lookup_path->components[0];
+						}
+					}
+					else
+					{
+						error = webdav_lookup(ap, &reply_lookup);
+					}
 					
 					if ( error != 0 )
 					{
@@ -1214,6 +1542,11 @@ static int webdav_vnop_lookup(struct vnop_lookup_args *ap)
 						webdav_unlock(VTOWEBDAV(*vpp));
 						
 					webdav_unlock(pt_dvp);
+					
+					if ( (error == 0) && (reply_lookup_path != NULL) )
+					{
+						webdav_lookup_ahead(*vpp, cnp, reply_lookup_path);
+					}
 				}
 				break;
 				
@@ -1224,12 +1557,47 @@ static int webdav_vnop_lookup(struct vnop_lookup_args *ap)
 				printf("webdav_vnop_lookup: unexpected response from cache_lookup: %d\n", error);
 				break;
 		}
-	}		
+	}
+	
+	if ( reply_lookup_path != NULL )
+	{
+		FREE(reply_lookup_path, M_TEMP);
+	}
 	RET_ERR("webdav_vnop_lookup", error);
 }
 
 /*****************************************************************************/
 
+/*
+ * webdav_writeseq_fallback
+ *
+ * Turns off a Write Sequential mode that open turned on by itself, because
+ * the file is no longer being written from start to end (or the server
+ * turned the streamed upload down). Everything written so far is in the
+ * cache file, so marking the node dirty makes close fsync the whole file
+ * with a regular PUT, which replaces the streamed one.
+ *
+ * Returns TRUE if the node fell back; Write Sequential mode turned on with
+ * the WEBDAV_WRITE_SEQUENTIAL fsctl has no fallback.
+ */
+static int webdav_writeseq_fallback(struct webdavnode *pt)
+{
+	if ( !pt->pt_writeseq_enabled || !pt->pt_writeseq_auto )
+	{
+		return ( FALSE );
+	}
+	
+#if DEBUG
+	printf("KWRITESEQ: falling back to fsync at close, offset %llu\n", pt->pt_writeseq_offset);
+#endif
+	pt->pt_writeseq_enabled = 0;
+	pt->pt_writeseq_auto = 0;
+	pt->pt_status |= WEBDAV_DIRTY;
+	return ( TRUE );
+}
+
+/*****************************************************************************/
+
 static int webdav_vnop_open_locked(struct vnop_open_args *ap)
 /*
 	struct vnop_open_args {
@@ -1260,7 +1628,8 @@ static int webdav_vnop_open_locked(struct vnop_open_args *ap)
 	 * Finder opens for read before it opens for write, which means it wouldn't
 	 * be able to perform a sequential write in its current state.
 	 */
-	if (pt->pt_writeseq_enabled && pt->pt_opencount_write && (ap->a_mode & FWRITE)) 
+	if (pt->pt_writeseq_enabled && pt->pt_opencount_write && (ap->a_mode & FWRITE) &&
+		!webdav_writeseq_fallback(pt)) 
 	{
 #if DEBUG
 		printf("KWRITESEQ: Write sequential is enabled and another writer came in.\n");
@@ -1361,6 +1730,19 @@ static int webdav_vnop_open_locked(struct vnop_open_args *ap)
 		if (ap->a_mode & FWRITE)
 			pt->pt_opencount_write = 1;
 		
+		/*
+		 * If mount_webdav says so (the file is empty and the server takes
+		 * streamed uploads), send writes to the server as they happen. The
+		 * length isn't known, so the upload has no expected length.
+		 */
+		if ( (ap->a_mode & FWRITE) && reply_open.writeseq && vnode_isreg(vp) )
+		{
+			pt->pt_writeseq_enabled = 1;
+			pt->pt_writeseq_auto = 1;
+			pt->pt_writeseq_len = 0;
+			pt->pt_writeseq_offset = 0;
+		}
+		
 		/* Set the "dir not loaded" bit if this is a directory, that way
 		 * readdir will know that it needs to force a directory download
 		 * even if the first call turns out not to be in the middle of the
@@ -1572,6 +1954,9 @@ static int webdav_fsync(struct vnop_fsync_args *ap)
 	/* clear the dirty flag before pushing this to the server */
 	pt->pt_status &= ~WEBDAV_DIRTY;
 	
+	/* the PUT changes the file's attributes on the server */
+	webdav_attr_cache_invalidate(vp);
+	
 	webdav_copy_creds(ap->a_context, &request_fsync.pcr);
 	request_fsync.obj_id = pt->pt_obj_id;
 
@@ -1807,6 +2192,7 @@ static int webdav_vnop_close_locked(struct vnop_close_args *ap)
 		/* decrement open for writing count */
 		--pt->pt_opencount_write;
 		pt->pt_writeseq_enabled = 0;
+		pt->pt_writeseq_auto = 0;
 	}
 	
 	RET_ERR("webdav_vnop_close_locked", error);
@@ -1858,6 +2244,8 @@ static int webdav_vnop_mmap(struct vnop_mmap_args *ap)
 	webdav_lock(pt, WEBDAV_EXCLUSIVE_LOCK);
 	pt->pt_lastvop = webdav_vnop_mmap;
 	pt->pt_status |= (WEBDAV_ISMAPPED | WEBDAV_WASMAPPED);
+	/* pages written through the mapping can't be streamed */
+	(void) webdav_writeseq_fallback(pt);
 	webdav_unlock(pt);
 	
 	RET_ERR("webdav_vnop_mmap", 0);
@@ -1904,6 +2292,10 @@ static int webdav_vnop_mnomap(struct vnop_mnomap_args *ap)
  * error, then the caller will just spin wait for the part of the file needed
  * to be downloaded.
  *
+ * Ranges larger than WEBDAV_MAX_IO_BUFFER_SIZE are read with several
+ * WEBDAV_READ requests. If one of them fails, a_uio has been advanced past
+ * the bytes already read, so the caller's wait picks up from there.
+ *
  * results:
  * 0	no error - bytes were read
  * !0	the bytes were not read and the caller must wait for the download
@@ -1920,6 +2312,7 @@ static int webdav_read_bytes(vnode_t vp, uio_t a_uio, vfs_context_t context)
 	void *buffer;
 	struct webdavmount *fmp;
 	struct webdav_request_read request_read;
+	uint64_t buffer_size;
 
 	pt = VTOWEBDAV(vp);
 	error = server_error = 0;
@@ -1936,9 +2329,9 @@ static int webdav_read_bytes(vnode_t vp, uio_t a_uio, vfs_context_t context)
 	/* Now allocate the buffer that we are going to use to hold the data that
 	 * comes back
 	 */
-	request_read.count = uio_resid(a_uio); /* this won't overflow because we've already checked uio_resid's size */
+	buffer_size = MIN((uint64_t)uio_resid(a_uio), WEBDAV_MAX_IO_BUFFER_SIZE);
 
-	MALLOC(buffer, void *, (uint32_t) request_read.count, M_TEMP, M_WAITOK);
+	MALLOC(buffer, void *, (uint32_t) buffer_size, M_TEMP, M_WAITOK);
 	if (buffer == NULL)
 	{
 #if DEBUG
@@ -1950,37 +2343,44 @@ static int webdav_read_bytes(vnode_t vp, uio_t a_uio, vfs_context_t context)
 	
 	webdav_copy_creds(context, &request_read.pcr);
 	request_read.obj_id = pt->pt_obj_id;
-	request_read.offset = uio_offset(a_uio);
 
-	error = webdav_sendmsg(WEBDAV_READ, fmp,
-		&request_read, sizeof(struct webdav_request_read), 
-		NULL, 0, 
-		&server_error, buffer, (size_t)request_read.count);
-	if ( (error == 0) && (server_error != 0) )
+	while ( uio_resid(a_uio) > 0 )
 	{
-		if ( server_error == ESTALE )
+		request_read.offset = uio_offset(a_uio);
+		request_read.count = MIN((uint64_t)uio_resid(a_uio), buffer_size);
+
+		error = webdav_sendmsg(WEBDAV_READ, fmp,
+			&request_read, sizeof(struct webdav_request_read), 
+			NULL, 0, 
+			&server_error, buffer, (size_t)request_read.count);
+		if ( (error == 0) && (server_error != 0) )
 		{
-			/*
-			 * The object id(s) passed to userland are invalid.
-			 * Purge the vnode(s) and restart the request.
-			 */
-			webdav_purge_stale_vnode(vp);
-			error = ERESTART;
+			if ( server_error == ESTALE )
+			{
+				/*
+				 * The object id(s) passed to userland are invalid.
+				 * Purge the vnode(s) and restart the request.
+				 */
+				webdav_purge_stale_vnode(vp);
+				error = ERESTART;
+			}
+			else
+			{
+				error = server_error;
+			}
 		}
-		else
+		if (error)
 		{
-			error = server_error;
+			/* return an error so the caller will wait */
+			break;
 		}
-	}
-	if (error)
-	{
-		/* return an error so the caller will wait */
-		goto dealloc_done;
-	}
-
-	error = uiomove((caddr_t)buffer, (int)request_read.count, a_uio);
 
-dealloc_done:
+		error = uiomove((caddr_t)buffer, (int)request_read.count, a_uio);
+		if (error)
+		{
+			break;
+		}
+	}
 
 	FREE((void *)buffer, M_TEMP);
 
@@ -2556,6 +2956,15 @@ static int webdav_vnop_write(struct vnop_write_args *ap)
 	/******************************************************/
 
 	/* make sure this is the offset we're expecting */
+	if ( (pt->pt_writeseq_offset != uio_offset(in_uio)) && webdav_writeseq_fallback(pt) )
+	{
+		/* not sequential after all -- write the cache file and PUT it at close */
+		FREE((caddr_t)req, M_TEMP);
+		pt->pt_lastvop = webdav_vnop_write;
+		error = webdav_rdwr((struct vnop_read_args *)ap);
+		webdav_unlock(pt);
+		goto out2;
+	}
 	if (pt->pt_writeseq_offset != uio_offset(in_uio))
 	{
 		printf("KWRITESEQ: vnop_write: wrong offset. uio_offset: %llu, expected: %llu\n",
@@ -2610,6 +3019,10 @@ static int webdav_vnop_write(struct vnop_write_args *ap)
 		printf("KWRITESEQ: Success for offset:%llu len: %lu\n", req->offset, req->count); 
 #endif
 		goto out1;
+	} else if ( (error == 0) && (server_error != EAGAIN) && webdav_writeseq_fallback(pt) ) {
+		/* the data is in the cache file, so the fsync at close will PUT it */
+		pt->pt_writeseq_offset += req->count;
+		goto out1;
 	} else {
 		/* Otherwise, no error will be returned if server_error != EAGAIN even
 		 * though we have an error at this point
@@ -2639,6 +3052,9 @@ static int webdav_vnop_write(struct vnop_write_args *ap)
 #if DEBUG
 			printf("KWRITESEQ: Retry was successfull, count:%lu\n", req->count);
 #endif
+		} else if ( (error == 0) && webdav_writeseq_fallback(pt) ) {
+			/* the data is in the cache file, so the fsync at close will PUT it */
+			pt->pt_writeseq_offset = req->offset + req->count;
 		} else {
 			printf("KWRITESEQ: Retry failed, server_error %d, error %d\n", server_error, error);
 			error = EIO;
@@ -2799,6 +3215,8 @@ static int webdav_vnop_remove(struct vnop_remove_args *ap)
 		cache_purge_negatives(dvp);
 	}
 
+	webdav_attr_cache_invalidate(dvp);
+
 	/* Get the node off of the cache so that other lookups
 	 * won't find it and think the file still exists
 	 */
@@ -2910,6 +3328,8 @@ static int webdav_vnop_rmdir(struct vnop_rmdir_args *ap)
 		cache_purge_negatives(dvp);
 	}
 
+	webdav_attr_cache_invalidate(dvp);
+
 	/* Get the node off of the cache so that other lookups
 	 * won't find it and think the file still exists
 	 */
@@ -3010,6 +3430,7 @@ static int webdav_vnop_create(struct vnop_create_args *ap)
 	
 	/* parent directory changed so force readdir to reload */
 	VTOWEBDAV(dvp)->pt_status |= WEBDAV_DIR_NOT_LOADED;
+	webdav_attr_cache_invalidate(dvp);
 	
 	/* parent directory just changed, flush negative name cache entries */
 	if (VTOWEBDAV(dvp)->pt_status & WEBDAV_NEGNCENTRIES)
@@ -3210,6 +3631,11 @@ static int webdav_vnop_rename(struct vnop_rename_args *ap)
 	/* parent directories may have changed (even if error) so force readdir to reload */
 	VTOWEBDAV(fdvp)->pt_status |= WEBDAV_DIR_NOT_LOADED;
 	VTOWEBDAV(tdvp)->pt_status |= WEBDAV_DIR_NOT_LOADED;
+	
+	/* and don't answer getattr from attributes cached before the rename */
+	webdav_attr_cache_invalidate(fdvp);
+	webdav_attr_cache_invalidate(tdvp);
+	webdav_attr_cache_invalidate(fvp);
 
 	/* if success, blow away statfs cache */
 	if (!error)
@@ -3313,6 +3739,7 @@ static int webdav_vnop_mkdir(struct vnop_mkdir_args *ap)
 
 	/* parent directory changed so force readdir to reload */
 	VTOWEBDAV(dvp)->pt_status |= WEBDAV_DIR_NOT_LOADED;
+	webdav_attr_cache_invalidate(dvp);
 	
 	/* parent directory changed so flush negative name cache */
 	if (pt_dvp->pt_status & WEBDAV_NEGNCENTRIES)
@@ -3393,6 +3820,7 @@ static int webdav_vnop_setattr(struct vnop_setattr_args *ap)
 	
 	webdav_lock(pt, WEBDAV_EXCLUSIVE_LOCK);
 	pt->pt_lastvop = webdav_vnop_setattr;
+	webdav_attr_cache_invalidate(vp);
 	
 	/* Can't mess with the root vnode */
 	if (vnode_isvroot(vp))
@@ -3511,6 +3939,12 @@ static int webdav_vnop_setattr(struct vnop_setattr_args *ap)
 				pt->pt_status |= WEBDAV_DIRTY;
 			}
 			
+			/* a streamed upload can't follow the file being truncated or extended */
+			if ( (off_t)ap->a_vap->va_data_size != pt->pt_writeseq_offset )
+			{
+				(void) webdav_writeseq_fallback(pt);
+			}
+			
 			/* set the size and other attributes of the cache file */
 			error = vnode_setattr(cachevp, ap->a_vap, ap->a_context);
 			
@@ -3540,6 +3974,157 @@ exit:
 
 /*****************************************************************************/
 
+#define WEBDAV_READDIR_PLUS_BATCH 32	/* entries handled per pass in webdav_readdir_plus */
+
+/* reads length bytes at offset from a cache file into a kernel buffer */
+static int webdav_read_cache_file(vnode_t cachevp, off_t offset, void *buffer, size_t length, vfs_context_t context)
+{
+	int error;
+	uio_t auio;
+	
+	auio = uio_create(1, offset, UIO_SYSSPACE, UIO_READ);
+	if ( auio == NULL )
+	{
+		return ( ENOMEM );
+	}
+	
+	error = uio_addiov(auio, CAST_USER_ADDR_T(buffer), length);
+	if ( error == 0 )
+	{
+		error = VNOP_READ(cachevp, auio, 0, context);
+		if ( (error == 0) && (uio_resid(auio) != 0) )
+		{
+			/* short read -- the cache file isn't what we expected */
+			error = EIO;
+		}
+	}
+	
+	uio_free(auio);
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_readdir_plus
+ *
+ * For the entries webdav_vnop_readdir just returned (the bytes from start to
+ * end of the cache file), uses the readdir-plus records mount_webdav wrote
+ * after the entries to set up each entry's vnode, name cache entry and
+ * cached attributes. A long listing's lookups and getattrs are then answered
+ * in the kernel instead of with a WEBDAV_LOOKUP and WEBDAV_GETATTR per entry.
+ * This is only an optimization, so any failure just ends it. The records are
+ * only used by the user they were written for: another user's READDIR may
+ * have rewritten them since this reader's READDIR at offset 0.
+ *
+ * The webdavnode for vp must be locked exclusive.
+ */
+static void webdav_readdir_plus(vnode_t vp, vnode_t cachevp, off_t start, off_t end, vfs_context_t context)
+{
+	struct webdavnode *pt;
+	struct dirent *dirents;
+	struct webdav_dirattr *dirattrs;
+	struct webdav_dirattr *dirattr;
+	struct webdav_reply_getattr reply_getattr;
+	struct componentname cn;
+	vnode_t child;
+	uint32_t first, last, record, count, index;
+	uid_t uid;
+	int error;
+	
+	pt = VTOWEBDAV(vp);
+	uid = kauth_cred_getuid(vfs_context_ucred(context));
+	if ( uid != pt->pt_dirattr_uid )
+	{
+		return;
+	}
+	
+	MALLOC(dirents, struct dirent *, WEBDAV_READDIR_PLUS_BATCH * sizeof(struct dirent), M_TEMP, M_WAITOK);
+	MALLOC(dirattrs, struct webdav_dirattr *, WEBDAV_READDIR_PLUS_BATCH * sizeof(struct webdav_dirattr), M_TEMP, M_WAITOK);
+	if ( (dirents == NULL) || (dirattrs == NULL) )
+	{
+		goto done;
+	}
+	
+	/* "." and ".." don't have records */
+	first = (uint32_t)(start / sizeof(struct dirent));
+	last = (uint32_t)(end / sizeof(struct dirent));
+	if ( first < 2 )
+	{
+		first = 2;
+	}
+	
+	while ( first < last )
+	{
+		record = first - 2;
+		if ( record >= pt->pt_dirattr_count )
+		{
+			break;
+		}
+		count = MIN(last - first, WEBDAV_READDIR_PLUS_BATCH);
+		count = MIN(count, pt->pt_dirattr_count - record);
+		
+		if ( webdav_read_cache_file(cachevp, (off_t)first * sizeof(struct dirent),
+				dirents, count * sizeof(struct dirent), context) != 0 ||
+			 webdav_read_cache_file(cachevp, pt->pt_dirent_size + (off_t)record * sizeof(struct webdav_dirattr),
+				dirattrs, count * sizeof(struct webdav_dirattr), context) != 0 )
+		{
+			break;
+		}
+		
+		for ( index = 0; index < count; ++index )
+		{
+			dirattr = &dirattrs[index];
+			
+			/* skip entries without attributes, and anything that doesn't match its entry */
+			if ( (dirattr->attr_timeout == 0) ||
+				 ((ino_t)dirattr->lookup.obj_fileid != dirents[index].d_ino) ||
+				 (dirents[index].d_namlen == 0) )
+			{
+				continue;
+			}
+			
+			bzero(&cn, sizeof(struct componentname));
+			cn.cn_nameiop = LOOKUP;
+			cn.cn_flags = MAKEENTRY;
+			cn.cn_nameptr = dirents[index].d_name;
+			cn.cn_namelen = dirents[index].d_namlen;
+			
+			error = webdav_get(vnode_mount(vp), vp, 0, &cn, dirattr->lookup.obj_id, dirattr->lookup.obj_fileid,
+				(dirattr->lookup.obj_type == WEBDAV_FILE_TYPE) ? VREG : VDIR,
+				dirattr->lookup.obj_atime, dirattr->lookup.obj_mtime, dirattr->lookup.obj_ctime,
+				dirattr->lookup.obj_createtime, dirattr->lookup.obj_filesize, &child);
+			if ( error != 0 )
+			{
+				continue;
+			}
+			
+			reply_getattr.obj_attr = dirattr->attr;
+			reply_getattr.attr_timeout = dirattr->attr_timeout;
+			/* webdav_get returned child locked exclusive */
+			webdav_attr_cache_update(VFSTOWEBDAV(vnode_mount(vp)), VTOWEBDAV(child), uid, &reply_getattr);
+			
+			webdav_unlock(VTOWEBDAV(child));
+			vnode_put(child);
+		}
+		
+		first += count;
+	}
+
+done:
+	if ( dirattrs != NULL )
+	{
+		FREE(dirattrs, M_TEMP);
+	}
+	if ( dirents != NULL )
+	{
+		FREE(dirents, M_TEMP);
+	}
+}
+
+/*****************************************************************************/
+
 /*
  * webdav_vnop_readdir
  *
@@ -3574,6 +4159,7 @@ static int webdav_vnop_readdir(struct vnop_readdir_args *ap)
 	uio_t uio;
 	int error;
 	user_ssize_t count, lost;
+	off_t start;
 	struct vnode_attr vattr;
 
 	START_MARKER("webdav_vnop_readdir");
@@ -3616,15 +4202,17 @@ static int webdav_vnop_readdir(struct vnop_readdir_args *ap)
 	if ( (uio_offset(uio) == 0) || (pt->pt_status & WEBDAV_DIR_NOT_LOADED) )
 	{
 		struct webdav_request_readdir request_readdir;
+		struct webdav_reply_readdir reply_readdir;
 		
 		webdav_copy_creds(ap->a_context, &request_readdir.pcr);
 		request_readdir.obj_id = pt->pt_obj_id;
 		request_readdir.cache = !vnode_isnocache(vp);
+		bzero(&reply_readdir, sizeof(struct webdav_reply_readdir));
 
 		error = webdav_sendmsg(WEBDAV_READDIR, fmp,
 			&request_readdir, sizeof(struct webdav_request_readdir), 
 			NULL, 0, 
-			&server_error, NULL, 0);
+			&server_error, &reply_readdir, sizeof(struct webdav_reply_readdir));
 		if ( (error == 0) && (server_error != 0) )
 		{
 			if ( server_error == ESTALE )
@@ -3650,6 +4238,11 @@ static int webdav_vnop_readdir(struct vnop_readdir_args *ap)
 
 		/* We didn't get an error so clear the WEBDAV_DIR_NOT_LOADED flag */
 		pt->pt_status &= ~WEBDAV_DIR_NOT_LOADED;
+		
+		/* remember where the entries end and the readdir-plus records start */
+		pt->pt_dirent_size = (off_t)reply_readdir.dirent_size;
+		pt->pt_dirattr_count = reply_readdir.dirattr_count;
+		pt->pt_dirattr_uid = reply_readdir.dirattr_uid;
 	}
 
 	if ( ap->a_flags & VNODE_READDIR_EXTENDED )
@@ -3675,14 +4268,40 @@ static int webdav_vnop_readdir(struct vnop_readdir_args *ap)
 			goto done;
 		}
 
+		/* don't return the readdir-plus records as entries */
+		if ( pt->pt_dirent_size != 0 )
+		{
+			if ( uio_offset(uio) >= pt->pt_dirent_size )
+			{
+				count = 0;
+			}
+			else if ( (uio_offset(uio) + count) > pt->pt_dirent_size )
+			{
+				count = pt->pt_dirent_size - uio_offset(uio);
+			}
+		}
+
 		lost = uio_resid(uio) - count;
 		uio_setresid(uio, count);
 
-		error = VNOP_READ(cachevp, uio, 0, ap->a_context);
+		start = uio_offset(uio);
+		if ( count != 0 )
+		{
+			error = VNOP_READ(cachevp, uio, 0, ap->a_context);
+		}
 		
 		uio_setresid(uio, uio_resid(uio) + lost);
 		
-		if (ap->a_eofflag)
+		if ( (error == 0) && (pt->pt_dirattr_count != 0) && (uio_offset(uio) > start) )
+		{
+			webdav_readdir_plus(vp, cachevp, start, uio_offset(uio), ap->a_context);
+		}
+		
+		if (ap->a_eofflag && (pt->pt_dirent_size != 0))
+		{
+			*ap->a_eofflag = pt->pt_dirent_size <= uio_offset(uio);
+		}
+		else if (ap->a_eofflag)
 		{
 			VATTR_INIT(&vattr);
 			VATTR_WANTED(&vattr, va_data_size);
@@ -4363,6 +4982,9 @@ static int webdav_vnop_ioctl(struct vnop_ioctl_args *ap)
 			
 			webdav_copy_creds(ap->a_context, &request_invalcaches.pcr);
 
+			/* the kernel's cached attributes go too */
+			OSIncrementAtomic((SInt32 *)&fmp->pm_attr_generation);
+
 			error = webdav_sendmsg(WEBDAV_INVALCACHES, fmp,
 				&request_invalcaches, sizeof(struct webdav_request_invalcaches), 
 				NULL, 0, 
@@ -4373,6 +4995,80 @@ static int webdav_vnop_ioctl(struct vnop_ioctl_args *ap)
 			}
 		}
 		break;
+		
+		case WEBDAV_WARMUP_SUBTREE:	/* fetch a directory tree's attributes into the mount_webdav caches */
+		{
+			struct webdavmount *fmp;
+			struct webdav_request_warmup request_warmup;
+			int server_error;
+			
+			if ( !vnode_isdir(vp) )
+			{
+				error = ENOTDIR;
+				break;
+			}
+			
+			/* Note: Since this command is coming through fsctl(), vnode_get has been called on the vnode */
+			
+			/* set up the rest of the parameters needed to send a message */ 
+			fmp = VFSTOWEBDAV(vnode_mount(vp));
+			server_error = 0;
+			
+			webdav_copy_creds(ap->a_context, &request_warmup.pcr);
+			request_warmup.dir_id = VTOWEBDAV(vp)->pt_obj_id;
+			request_warmup.depth = ((struct WebdavWarmup *)ap->a_data)->depth;
+
+			error = webdav_sendmsg(WEBDAV_WARMUP, fmp,
+				&request_warmup, sizeof(struct webdav_request_warmup), 
+				NULL, 0, 
+				&server_error, NULL, 0);
+			if ( (error == 0) && (server_error != 0) )
+			{
+				error = server_error;
+			}
+		}
+		break;
+		
+		case WEBDAV_EMPTY_DIRECTORY:	/* delete everything in a directory */
+		{
+			struct webdavmount *fmp;
+			struct webdav_request_emptydir request_emptydir;
+			int server_error;
+			
+			if ( !vnode_isdir(vp) )
+			{
+				error = ENOTDIR;
+				break;
+			}
+			
+			/* Note: Since this command is coming through fsctl(), vnode_get has been called on the vnode */
+			
+			/* set up the rest of the parameters needed to send a message */ 
+			fmp = VFSTOWEBDAV(vnode_mount(vp));
+			server_error = 0;
+			
+			webdav_copy_creds(ap->a_context, &request_emptydir.pcr);
+			request_emptydir.dir_id = VTOWEBDAV(vp)->pt_obj_id;
+
+			error = webdav_sendmsg(WEBDAV_EMPTYDIR, fmp,
+				&request_emptydir, sizeof(struct webdav_request_emptydir), 
+				NULL, 0, 
+				&server_error, NULL, 0);
+			if ( (error == 0) && (server_error != 0) )
+			{
+				error = server_error;
+			}
+			
+			/*
+			 * Even a failed delete may have removed some of the directory's
+			 * contents, so forget the names cached under it either way.
+			 */
+			cache_purge(vp);
+			OSIncrementAtomic((SInt32 *)&fmp->pm_attr_generation);
+			fmp->pm_statfstime = 0;
+		}
+		break;
+		
 		case WEBDAV_WRITE_SEQUENTIAL:
 			wrseq_ptr = (struct WebdavWriteSequential *)ap->a_data;
 			pt = VTOWEBDAV(vp);
@@ -4397,6 +5093,10 @@ static int webdav_vnop_ioctl(struct vnop_ioctl_args *ap)
 				pt->pt_writeseq_offset = 0; 
 				error = 0;
 			}
+			if ( pt->pt_writeseq_auto && (pt->pt_writeseq_offset == 0) ) {
+				/* open already turned it on; nothing's been written, so take the length hint */
+				pt->pt_writeseq_len = wrseq_ptr->file_len;
+			}
 			webdav_unlock(pt);
 		break;
 			
@@ -4449,6 +5149,81 @@ static int webdav_vnop_ioctl(struct vnop_ioctl_args *ap)
 			}
 		}
 		break;
+			
+		case WEBDAV_SHOW_STATS:	/* dump statistics */
+		{
+			struct webdavmount *fmp;
+			struct webdav_request_stats request_stats;
+			int server_error;
+			
+			/* Note: Since this command is coming through fsctl(), vnode_get has been called on the vnode */
+			
+			/* set up the rest of the parameters needed to send a message */ 
+			fmp = VFSTOWEBDAV(vnode_mount(vp));
+			server_error = 0;
+			
+			webdav_copy_creds(ap->a_context, &request_stats.pcr);
+			
+			error = webdav_sendmsg(WEBDAV_DUMP_STATS, fmp,
+								   &request_stats, sizeof(struct webdav_request_stats), 
+								   NULL, 0, 
+								   &server_error, NULL, 0);
+			if ( (error == 0) && (server_error != 0) )
+			{
+				error = server_error;
+			}
+		}
+		break;
+			
+		case WEBDAV_SHOW_TRACE:	/* dump event trace */
+		{
+			struct webdavmount *fmp;
+			struct webdav_request_trace request_trace;
+			int server_error;
+			
+			/* Note: Since this command is coming through fsctl(), vnode_get has been called on the vnode */
+			
+			/* set up the rest of the parameters needed to send a message */ 
+			fmp = VFSTOWEBDAV(vnode_mount(vp));
+			server_error = 0;
+			
+			webdav_copy_creds(ap->a_context, &request_trace.pcr);
+			
+			error = webdav_sendmsg(WEBDAV_DUMP_TRACE, fmp,
+								   &request_trace, sizeof(struct webdav_request_trace), 
+								   NULL, 0, 
+								   &server_error, NULL, 0);
+			if ( (error == 0) && (server_error != 0) )
+			{
+				error = server_error;
+			}
+		}
+		break;
+			
+		case WEBDAV_RESET_STATS:	/* reset statistics */
+		{
+			struct webdavmount *fmp;
+			struct webdav_request_stats request_stats;
+			int server_error;
+			
+			/* Note: Since this command is coming through fsctl(), vnode_get has been called on the vnode */
+			
+			/* set up the rest of the parameters needed to send a message */ 
+			fmp = VFSTOWEBDAV(vnode_mount(vp));
+			server_error = 0;
+			
+			webdav_copy_creds(ap->a_context, &request_stats.pcr);
+			
+			error = webdav_sendmsg(WEBDAV_CLEAR_STATS, fmp,
+								   &request_stats, sizeof(struct webdav_request_stats), 
+								   NULL, 0, 
+								   &server_error, NULL, 0);
+			if ( (error == 0) && (server_error != 0) )
+			{
+				error = server_error;
+			}
+		}
+		break;
 	
 		default:
 